@@ -0,0 +1,61 @@
+#!/bin/bash
+set -e
+
+# Benchmarks every stage of the pipeline on a synthetic Zipf corpus and appends the results to a report, one JSON line
+# per phase (the tools' -metrics output). Run with 'make bench', or 'make bench BENCH_SCALE=1B' for a larger dataset.
+# Scales: 10M, 1B or 10B tokens. Datasets are generated with a fixed seed into $BENCH_DIR and kept for later runs, so
+# two runs (e.g. before and after a change) measure the same input; each run starts with a "config" line.
+
+SCALE=${1:-10M}
+BUILDDIR=${BUILDDIR:-build}
+BENCH_DIR=${BENCH_DIR:-bench_data}
+REPORT=${REPORT:-bench_report.jsonl}
+NUM_THREADS=${NUM_THREADS:-$(nproc)}
+MEMORY=${MEMORY:-4.0}
+SEED=1
+VOCAB_MIN_COUNT=5
+VECTOR_SIZE=50
+WINDOW_SIZE=15
+X_MAX=10
+VERBOSE=0
+MICRO_TOKENS=10000000     # prefix of the corpus the microbenchmarks read, the same at every scale
+
+case $SCALE in
+  10M) TOKENS=10M; VOCAB=100000;  MAX_ITER=3 ;;
+  1B)  TOKENS=1G;  VOCAB=1000000; MAX_ITER=3 ;;
+  10B) TOKENS=10G; VOCAB=2000000; MAX_ITER=1 ;;
+  *) echo "Unknown scale $SCALE; expected 10M, 1B or 10B." >&2; exit 1 ;;
+esac
+
+DATA=$BENCH_DIR/$SCALE
+CORPUS=$DATA/corpus.txt
+mkdir -p $DATA
+if [ ! -e $CORPUS ]; then
+  echo "$ $BUILDDIR/zipf_corpus -tokens $TOKENS -vocab-size $VOCAB -seed $SEED > $CORPUS"
+  $BUILDDIR/zipf_corpus -tokens $TOKENS -vocab-size $VOCAB -seed $SEED -verbose $VERBOSE > $CORPUS.tmp
+  mv $CORPUS.tmp $CORPUS
+fi
+
+printf '{"tool":"bench","phase":"config","scale":"%s","tokens":"%s","vocab_size":%d,"threads":%d,"memory":%s,"commit":"%s","host":"%s","date":"%s"}\n' \
+  $SCALE $TOKENS $VOCAB $NUM_THREADS $MEMORY "$(git rev-parse --short HEAD 2>/dev/null)" "$(hostname)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" >> $REPORT
+
+run() {
+  echo "$ $*" >&2
+  "$@"
+}
+
+run $BUILDDIR/vocab_count -min-count $VOCAB_MIN_COUNT -threads $NUM_THREADS -verbose $VERBOSE -metrics $REPORT < $CORPUS > $DATA/vocab.txt
+run $BUILDDIR/cooccur -memory $MEMORY -vocab-file $DATA/vocab.txt -threads $NUM_THREADS -window-size $WINDOW_SIZE -overflow-file $DATA/overflow \
+    -verbose $VERBOSE -metrics $REPORT < $CORPUS > $DATA/cooccurrence.bin
+run $BUILDDIR/shuffle -memory $MEMORY -threads $NUM_THREADS -temp-file $DATA/temp_shuffle -verbose $VERBOSE -metrics $REPORT \
+    < $DATA/cooccurrence.bin > $DATA/cooccurrence.shuf.bin
+run $BUILDDIR/glove -save-file $DATA/vectors -threads $NUM_THREADS -input-file $DATA/cooccurrence.shuf.bin -x-max $X_MAX -iter $MAX_ITER \
+    -vector-size $VECTOR_SIZE -binary 1 -vocab-file $DATA/vocab.txt -verbose $VERBOSE -metrics $REPORT
+
+# Microbenchmarks: tokenizer, vocab hash, record sort and compact format, then the glove update kernels. The merge
+# inside cooccur and the shuffle passes are measured by their phases above. microbench maps the corpus and stops
+# after the first $MICRO_TOKENS tokens, so its memory and running time do not grow with the scale
+run $BUILDDIR/microbench -corpus $CORPUS -max-tokens $MICRO_TOKENS -seed $SEED -verbose $VERBOSE -metrics $REPORT
+run $BUILDDIR/glove -bench-kernels 2000000 -vector-size $VECTOR_SIZE -vocab-file $DATA/vocab.txt -metrics $REPORT > /dev/null
+
+echo "Results appended to $REPORT"
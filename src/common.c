@@ -0,0 +1,991 @@
+//  Code shared by the GloVe tools
+//
+//  GloVe: Global Vectors for Word Representation
+//  Copyright (c) 2014 The Board of Trustees of
+//  The Leland Stanford Junior University. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+//  For more information, bug reports, fixes, contact:
+//    Jeffrey Pennington (jpennin@stanford.edu)
+//    GlobalVectors@googlegroups.com
+//    http://nlp.stanford.edu/projects/glove/
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include "common.h"
+
+#define CLASS_WORD 0
+#define CLASS_SEPARATOR 1
+#define CLASS_NEWLINE 2
+
+static void init_classes(TOKEN_READER *r, const char *separators, int newline_token) {
+    memset(r->cls, CLASS_WORD, sizeof(r->cls));
+    for (; *separators; separators++) r->cls[(unsigned char)*separators] = CLASS_SEPARATOR;
+    r->cls['\n'] = newline_token ? CLASS_NEWLINE : CLASS_SEPARATOR;
+}
+
+int reader_init_file(TOKEN_READER *r, FILE *fin, const char *separators, int newline_token) {
+    r->fin = fin;
+    r->buf = malloc(READER_BUFFER_SIZE);
+    if (r->buf == NULL) return 1;
+    r->pos = r->end = r->buf;
+    r->eof = 0;
+    r->bytes = 0;
+    init_classes(r, separators, newline_token);
+    return 0;
+}
+
+void reader_init_range(TOKEN_READER *r, const char *start, const char *end, const char *separators, int newline_token) {
+    r->fin = NULL;
+    r->buf = NULL;
+    r->pos = start;
+    r->end = end;
+    r->eof = 1;
+    r->bytes = end - start;
+    init_classes(r, separators, newline_token);
+}
+
+void reader_free(TOKEN_READER *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+long long range_start(const char *text, long long size, int a, int n, const char *after) {
+    long long off = size * a / n;
+    // off == 0 for the first range, and for later ones too when size < n; text[-1] does not exist
+    while (off > 0 && off < size && (text[off - 1] == 0 || strchr(after, text[off - 1]) == NULL)) off++;
+    return off;
+}
+
+/* Keep the unread bytes from keep on (the start of a partial word) at the front of the buffer and fill the rest.
+ * Afterwards r->pos points at the kept bytes. Returns the number of new bytes */
+// 把还没读完的半个词挪到缓冲区开头，剩下的空间用fread填满
+static size_t refill(TOKEN_READER *r, const char *keep) {
+    size_t kept = r->end - keep, got;
+    r->pos = keep;
+    if (r->eof) return 0;
+    memmove(r->buf, keep, kept);
+    got = fread(r->buf + kept, 1, READER_BUFFER_SIZE - kept, r->fin);
+    if (got < READER_BUFFER_SIZE - kept) r->eof = 1;
+    r->bytes += got;
+    r->pos = r->buf;
+    r->end = r->buf + kept + got;
+    return got;
+}
+
+int next_token(TOKEN_READER *r, const char **token, long long *length) {
+    const unsigned char *cls = r->cls;
+    const char *p = r->pos, *start;
+    long long scanned;
+
+    while (1) {
+        while (p < r->end && cls[(unsigned char)*p] == CLASS_SEPARATOR) p++;
+        if (p < r->end) break;
+        if (refill(r, p) == 0) return TOKEN_END;
+        p = r->pos;
+    }
+    if (cls[(unsigned char)*p] == CLASS_NEWLINE) {
+        r->pos = p + 1;
+        return TOKEN_NEWLINE;
+    }
+    start = p;
+    while (1) {
+        while (p < r->end && cls[(unsigned char)*p] == CLASS_WORD) p++;
+        if (p < r->end) break;
+        // 词一直延伸到缓冲区末尾：读入更多数据；缓冲区已被这个词占满时直接把它切开
+        if (r->fin != NULL && start == r->buf && r->end - r->buf == READER_BUFFER_SIZE) break;
+        scanned = p - start;
+        if (refill(r, start) == 0) {
+            *token = r->pos;
+            *length = r->end - r->pos;
+            r->pos = r->end;
+            return TOKEN_WORD_AT_END;
+        }
+        start = r->pos;
+        p = start + scanned;
+    }
+    r->pos = p;
+    *token = start;
+    *length = p - start;
+    return TOKEN_WORD;
+}
+
+/* Same bit mixing as the original bitwisehash, over a length-delimited word, followed by a finalizer: its low bits
+ * cluster badly under linear probing on their own */
+// 哈希函数，和原来的bitwisehash相同的位运算，只是按长度而不是按'\0'结束；
+// 最后再做一次混合，否则低位分布不均匀，线性探测时会形成很长的聚集
+static unsigned int bitwisehash(const char *word, long long length) {
+    unsigned int h = HASH_SEED;
+    const char *end = word + length;
+    for (; word < end; word++) h ^= ((h << 5) + *word + (h >> 2));
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int entry_matches(const HASH_ENTRY *e, unsigned int hash, const char *word, long long length) {
+    return e->hash == hash && strncmp(e->word, word, length) == 0 && e->word[length] == '\0';
+}
+
+/* Copy word into the arena, starting a new block when the current one is full */
+// 在arena中分配空间存放词，当前块满了就新开一块
+static char *arena_copy(VOCAB_HASH *h, const char *word, long long length) {
+    ARENA_BLOCK *b = h->arena;
+    char *s;
+    if (b == NULL || b->used + length + 1 > b->size) {
+        size_t size = (length + 1 > ARENA_BLOCK_SIZE) ? length + 1 : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(ARENA_BLOCK) + size);
+        if (b == NULL) return NULL;
+        b->next = h->arena;
+        b->used = 0;
+        b->size = size;
+        h->arena = b;
+    }
+    s = b->data + b->used;
+    memcpy(s, word, length);
+    s[length] = '\0';
+    b->used += length + 1;
+    return s;
+}
+
+VOCAB_HASH *vocab_hash_create(long long capacity) {
+    VOCAB_HASH *h = malloc(sizeof(VOCAB_HASH));
+    long long slots = 16;
+    if (h == NULL) return NULL;
+    while (slots * 3 < capacity * 4) slots *= 2;
+    h->slots = calloc(slots, sizeof(HASH_ENTRY));
+    if (h->slots == NULL) {free(h); return NULL;}
+    h->capacity = slots;
+    h->size = 0;
+    h->arena = NULL;
+    return h;
+}
+
+void vocab_hash_free(VOCAB_HASH *h) {
+    ARENA_BLOCK *b, *next;
+    if (h == NULL) return;
+    for (b = h->arena; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    free(h->slots);
+    free(h);
+}
+
+/* Double the table; cached hashes mean no word has to be rehashed */
+static int grow(VOCAB_HASH *h) {
+    long long a, i, capacity = h->capacity * 2;
+    HASH_ENTRY *slots = calloc(capacity, sizeof(HASH_ENTRY));
+    if (slots == NULL) return 1;
+    for (a = 0; a < h->capacity; a++) {
+        if (h->slots[a].word == NULL) continue;
+        for (i = h->slots[a].hash & (capacity - 1); slots[i].word != NULL; i = (i + 1) & (capacity - 1));
+        slots[i] = h->slots[a];
+    }
+    free(h->slots);
+    h->slots = slots;
+    h->capacity = capacity;
+    return 0;
+}
+
+HASH_ENTRY *vocab_hash_find(const VOCAB_HASH *h, const char *word, long long length) {
+    unsigned int hash = bitwisehash(word, length);
+    long long i, mask = h->capacity - 1;
+    for (i = hash & mask; h->slots[i].word != NULL; i = (i + 1) & mask) {
+        if (entry_matches(&h->slots[i], hash, word, length)) return &h->slots[i];
+    }
+    return NULL;
+}
+
+HASH_ENTRY *vocab_hash_insert(VOCAB_HASH *h, const char *word, long long length) {
+    unsigned int hash = bitwisehash(word, length);
+    long long i, mask = h->capacity - 1;
+    for (i = hash & mask; h->slots[i].word != NULL; i = (i + 1) & mask) {
+        if (entry_matches(&h->slots[i], hash, word, length)) return &h->slots[i];
+    }
+    if ((h->size + 1) * 4 > h->capacity * 3) { // Keep the load factor at most 3/4
+        if (grow(h) != 0) return NULL;
+        mask = h->capacity - 1;
+        for (i = hash & mask; h->slots[i].word != NULL; i = (i + 1) & mask);
+    }
+    if ((h->slots[i].word = arena_copy(h, word, length)) == NULL) return NULL;
+    h->slots[i].hash = hash;
+    h->slots[i].value = 0;
+    h->size++;
+    return &h->slots[i];
+}
+
+/***
+ *  索引文件的格式（就是VOCAB_MAP的image，按8字节对齐，可以直接mmap）：
+ *   - 80字节的文件头VOCAB_INDEX_HEADER，包括建索引时vocab.txt的大小、inode、纳秒级的修改时间和内容指纹
+ *   - counts[size]和offsets[size + 1]，都是long long
+ *   - capacity个VOCAB_SLOT
+ *   - words_bytes字节的词，按词频排名，每个词以'\0'结尾
+ */
+
+typedef struct vocab_index_header {
+    char magic[8];
+    long long text_size;    // bytes of the vocab file the index was built from
+    long long size, capacity, words_bytes, total;
+    long long text_inode, text_mtime_ns; // of the vocab file; 0 while the index is not stamped
+    unsigned long long text_fingerprint; // see text_fingerprint
+    long long reserved[1];
+} VOCAB_INDEX_HEADER;
+
+static const char index_magic[8] = "GLVVOC2\n";
+
+#define FINGERPRINT_CHUNKS 16
+#define FINGERPRINT_CHUNK 4096
+
+// 内容指纹：均匀分布在文件中的16块、每块4KB的FNV-1a哈希，不管文件多大只读64KB；大小、inode和修改时间都相同
+// 而内容不同的文件（cp -p、rsync -t、tar解包，或者同一秒内重写）几乎不可能在这些块上也完全相同
+/* FNV-1a hash of FINGERPRINT_CHUNKS chunks spread evenly over the size bytes of fd (all of it if it is small), so
+ * checking an index reads at most 64KB of its vocab file. Returns 0 if fd cannot be read */
+static unsigned long long text_fingerprint(int fd, long long size) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    char buf[FINGERPRINT_CHUNK];
+    long long a, offset, n = size <= FINGERPRINT_CHUNKS * FINGERPRINT_CHUNK ? (size + FINGERPRINT_CHUNK - 1) / FINGERPRINT_CHUNK : FINGERPRINT_CHUNKS;
+    ssize_t got, b;
+    for (a = 0; a < n; a++) {
+        offset = n == 1 ? 0 : a * (size - FINGERPRINT_CHUNK) / (n - 1);
+        if (offset < 0) offset = 0;
+        if ((got = pread(fd, buf, FINGERPRINT_CHUNK, offset)) < 0) return 0;
+        for (b = 0; b < got; b++) h = (h ^ (unsigned char)buf[b]) * 0x100000001b3ULL;
+    }
+    return h == 0 ? 1 : h;
+}
+
+static size_t index_image_size(long long size, long long capacity, long long words_bytes) {
+    return sizeof(VOCAB_INDEX_HEADER) + sizeof(long long) * (2 * size + 1) + sizeof(VOCAB_SLOT) * capacity + words_bytes;
+}
+
+/* Point the arrays of v into its image, checking the header against image_size. Returns 0 on success */
+static int vocab_map_attach(VOCAB_MAP *v) {
+    const VOCAB_INDEX_HEADER *hd = (const VOCAB_INDEX_HEADER *)v->image;
+    if (v->image_size < sizeof(VOCAB_INDEX_HEADER) || memcmp(hd->magic, index_magic, sizeof(index_magic)) != 0) return 1;
+    if (hd->size < 0 || hd->words_bytes < hd->size || hd->capacity <= hd->size || (hd->capacity & (hd->capacity - 1)) != 0
+        || index_image_size(hd->size, hd->capacity, hd->words_bytes) != v->image_size) return 1;
+    v->size = hd->size;
+    v->capacity = hd->capacity;
+    v->total = hd->total;
+    v->counts = (const long long *)(hd + 1);
+    v->offsets = v->counts + v->size;
+    v->slots = (const VOCAB_SLOT *)(v->offsets + v->size + 1);
+    v->words = (const char *)(v->slots + v->capacity);
+    return v->offsets[v->size] == hd->words_bytes ? 0 : 1;
+}
+
+int vocab_map_build(VOCAB_MAP *v, char *const *words, const long long *counts, long long size) {
+    long long a, i, length, capacity = 16, words_bytes = 0, mask;
+    unsigned int hash;
+    VOCAB_INDEX_HEADER *hd;
+    long long *cnt, *off;
+    VOCAB_SLOT *slots;
+    char *w;
+
+    memset(v, 0, sizeof(VOCAB_MAP));
+    for (a = 0; a < size; a++) words_bytes += (length = strlen(words[a])) > VOCAB_MAX_WORD ? VOCAB_MAX_WORD + 1 : length + 1;
+    while (capacity * 3 < size * 4) capacity *= 2; // load factor at most 3/4, as in VOCAB_HASH
+    v->image_size = index_image_size(size, capacity, words_bytes);
+    if ((v->image = calloc(1, v->image_size)) == NULL) return 1;
+    hd = (VOCAB_INDEX_HEADER *)v->image;
+    memcpy(hd->magic, index_magic, sizeof(index_magic));
+    hd->size = size;
+    hd->capacity = capacity;
+    hd->words_bytes = words_bytes;
+    cnt = (long long *)(hd + 1);
+    off = cnt + size;
+    slots = (VOCAB_SLOT *)(off + size + 1);
+    w = (char *)(slots + capacity);
+    mask = capacity - 1;
+    for (a = 0, off[0] = 0; a < size; a++) {
+        length = strlen(words[a]);
+        if (length > VOCAB_MAX_WORD) length = VOCAB_MAX_WORD;
+        memcpy(w + off[a], words[a], length);
+        off[a + 1] = off[a] + length + 1;
+        cnt[a] = counts[a];
+        hd->total += counts[a];
+        hash = bitwisehash(words[a], length);
+        for (i = hash & mask; slots[i].rank != 0; i = (i + 1) & mask) {
+            if (slots[i].hash == hash && strcmp(w + slots[i].offset, w + off[a]) == 0) break;
+        }
+        if (slots[i].rank != 0) {v->duplicates++; continue;}
+        slots[i].hash = hash;
+        slots[i].rank = a + 1;
+        slots[i].offset = off[a];
+    }
+    return vocab_map_attach(v);
+}
+
+// 整个文件读进内存后在缓冲区里切分，和fscanf("%1000s %lld")读到的结果相同（除了过长的词截断而不是拆成两个）
+int vocab_map_read_text(VOCAB_MAP *v, const char *text_path) {
+    long long size = 0, capacity = 1 << 16, n = 0, *counts = malloc(sizeof(long long) * capacity);
+    char **words = malloc(sizeof(char *) * capacity), *text = NULL, *p, *end, *q;
+    FILE *fin = fopen(text_path, "rb");
+    int result = 1;
+
+    memset(v, 0, sizeof(VOCAB_MAP));
+    if (fin == NULL || counts == NULL || words == NULL) goto done;
+    fseeko(fin, 0, SEEK_END);
+    size = ftello(fin);
+    fseeko(fin, 0, SEEK_SET);
+    if (size < 0 || (text = malloc(size + 1)) == NULL || (size > 0 && fread(text, size, 1, fin) != 1)) goto done;
+    text[size] = '\0';
+    for (p = text, end = text + size; ; n++) {
+        while (p < end && isspace((unsigned char)*p)) p++;
+        if (p == end) break;
+        if (n == capacity) {
+            capacity *= 2;
+            if ((q = realloc(words, sizeof(char *) * capacity)) == NULL) goto done;
+            words = (char **)q;
+            if ((q = realloc(counts, sizeof(long long) * capacity)) == NULL) goto done;
+            counts = (long long *)q;
+        }
+        words[n] = p;
+        while (p < end && !isspace((unsigned char)*p)) p++;
+        if (p == end) break; // a word without a count
+        *p++ = '\0';
+        counts[n] = strtoll(p, &q, 10);
+        if (q == p) break;
+        p = q;
+    }
+    result = vocab_map_build(v, words, counts, n) != 0 || vocab_map_stamp(v, fileno(fin)) != 0;
+done:
+    if (fin != NULL) fclose(fin);
+    free(text);
+    free(words);
+    free(counts);
+    return result;
+}
+
+int vocab_map_stamp(VOCAB_MAP *v, int fd) {
+    VOCAB_INDEX_HEADER *hd = (VOCAB_INDEX_HEADER *)v->image;
+    struct stat st;
+    if (v->mapped || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return 1;
+    hd->text_size = st.st_size;
+    hd->text_inode = st.st_ino;
+    hd->text_mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return (hd->text_fingerprint = text_fingerprint(fd, st.st_size)) == 0;
+}
+
+int vocab_map_save(const VOCAB_MAP *v, const char *path) {
+    char *tmp = malloc(strlen(path) + 5);
+    FILE *fout;
+    int failed = 1;
+    if (tmp == NULL) return 1;
+    sprintf(tmp, "%s.tmp", path);
+    if ((fout = fopen(tmp, "wb")) != NULL) {
+        failed = fwrite(v->image, v->image_size, 1, fout) != 1;
+        if (fclose(fout) != 0) failed = 1;
+        if (failed || rename(tmp, path) != 0) {remove(tmp); failed = 1;}
+    }
+    free(tmp);
+    return failed;
+}
+
+/* 1 unless the vocab file at text_path is the one hd was stamped from */
+static int index_stale(const VOCAB_INDEX_HEADER *hd, const char *text_path) {
+    struct stat st;
+    int fd = open(text_path, O_RDONLY), stale;
+    if (fd < 0) return 1;
+    stale = fstat(fd, &st) != 0 || hd->text_mtime_ns == 0 || st.st_size != hd->text_size || (long long)st.st_ino != hd->text_inode
+        || st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec != hd->text_mtime_ns || text_fingerprint(fd, st.st_size) != hd->text_fingerprint;
+    close(fd);
+    return stale;
+}
+
+int vocab_map_open(VOCAB_MAP *v, const char *path, const char *text_path) {
+    struct stat st;
+    int fd;
+
+    memset(v, 0, sizeof(VOCAB_MAP));
+    if ((fd = open(path, O_RDONLY)) < 0) return 1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(VOCAB_INDEX_HEADER)) {close(fd); return 1;}
+    v->image_size = st.st_size;
+    v->image = mmap(NULL, v->image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (v->image == MAP_FAILED) {v->image = NULL; return 1;}
+    v->mapped = 1;
+    // vocab.txt的大小、inode、修改时间和内容指纹必须和建索引时完全一样，否则认为索引过期
+    if (vocab_map_attach(v) != 0 || (text_path != NULL && index_stale((const VOCAB_INDEX_HEADER *)v->image, text_path))) {
+        vocab_map_free(v);
+        return 1;
+    }
+    return 0;
+}
+
+int vocab_map_load(VOCAB_MAP *v, const char *text_path, const char *index_path) {
+    char *path = NULL;
+    int result;
+    if (index_path == NULL || index_path[0] == 0) {
+        if ((path = malloc(strlen(text_path) + strlen(VOCAB_INDEX_SUFFIX) + 1)) == NULL) return 1;
+        sprintf(path, "%s%s", text_path, VOCAB_INDEX_SUFFIX);
+        index_path = path;
+    }
+    result = vocab_map_open(v, index_path, text_path) == 0 ? 0 : vocab_map_read_text(v, text_path);
+    free(path);
+    return result;
+}
+
+void vocab_map_free(VOCAB_MAP *v) {
+    if (v->image != NULL) {
+        if (v->mapped) munmap(v->image, v->image_size);
+        else free(v->image);
+    }
+    memset(v, 0, sizeof(VOCAB_MAP));
+}
+
+long long vocab_map_find(const VOCAB_MAP *v, const char *word, long long length) {
+    unsigned int hash = bitwisehash(word, length);
+    long long i, mask = v->capacity - 1;
+    const char *w;
+    for (i = hash & mask; v->slots[i].rank != 0; i = (i + 1) & mask) {
+        if (v->slots[i].hash != hash) continue;
+        w = v->words + v->slots[i].offset;
+        if (strncmp(w, word, length) == 0 && w[length] == '\0') return v->slots[i].rank;
+    }
+    return 0;
+}
+
+/***
+ *  紧凑的共现记录格式的编码和解码
+ */
+
+#define CREC_MAX_PAYLOAD (CREC_BLOCK_RECORDS * (sizeof(double) + 2 * 5)) // values plus two varints of at most 5 bytes
+static const char crec_magic[6] = {'G', 'L', 'V', 'C', 'R', 'C'};
+static const unsigned short crec_version = 1;
+
+int crec_parse_format(const char *name) {
+    if (strcmp(name, "raw") == 0) return CREC_FORMAT_RAW;
+    if (strcmp(name, "compact") == 0) return CREC_FORMAT_COMPACT;
+    if (strcmp(name, "compact32") == 0) return CREC_FORMAT_COMPACT32;
+    return -1;
+}
+
+static unsigned char *put_varint(unsigned char *p, unsigned int x) {
+    while (x >= 0x80) {
+        *p++ = (unsigned char)(x | 0x80);
+        x >>= 7;
+    }
+    *p++ = (unsigned char)x;
+    return p;
+}
+
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, unsigned int *x) {
+    unsigned int v = 0;
+    int shift;
+    for (shift = 0; p < end && shift < 35; shift += 7) {
+        v |= (unsigned int)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            *x = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// zigzag编码：把有符号的差值映射成非负数，0, -1, 1, -2 ... 映射成 0, 1, 2, 3 ...
+static unsigned int zigzag(int x) { return ((unsigned int)x << 1) ^ (unsigned int)(x >> 31); }
+static int unzigzag(unsigned int x) { return (int)(x >> 1) ^ -(int)(x & 1); }
+
+/* Encode n records into buf; returns the payload size */
+static size_t encode_block(const CREC *cr, long long n, int format, unsigned char *buf) {
+    long long a;
+    int prev1 = 0, prev2 = 0;
+    unsigned char *p = buf;
+    float f;
+    for (a = 0; a < n; a++) {
+        if (format == CREC_FORMAT_COMPACT32) {
+            f = (float)cr[a].val;
+            memcpy(p, &f, sizeof(float));
+            p += sizeof(float);
+        }
+        else {
+            memcpy(p, &cr[a].val, sizeof(double));
+            p += sizeof(double);
+        }
+    }
+    for (a = 0; a < n; a++) {
+        p = put_varint(p, zigzag(cr[a].word1 - prev1));
+        p = put_varint(p, zigzag(cr[a].word2 - (cr[a].word1 == prev1 ? prev2 : 0)));
+        prev1 = cr[a].word1;
+        prev2 = cr[a].word2;
+    }
+    return p - buf;
+}
+
+/* Decode n records from a payload of size bytes; returns 0 on success */
+static int decode_block(const unsigned char *buf, size_t size, long long n, int format, CREC *cr) {
+    long long a;
+    int prev1 = 0, prev2 = 0;
+    size_t value_size = (format == CREC_FORMAT_COMPACT32) ? sizeof(float) : sizeof(double);
+    const unsigned char *p = buf, *end = buf + size;
+    unsigned int x, y;
+    float f;
+    if ((size_t)n * value_size > size) return 1;
+    for (a = 0; a < n; a++) {
+        if (format == CREC_FORMAT_COMPACT32) {
+            memcpy(&f, p, sizeof(float));
+            cr[a].val = f;
+        }
+        else memcpy(&cr[a].val, p, sizeof(double));
+        p += value_size;
+    }
+    for (a = 0; a < n; a++) {
+        if ((p = get_varint(p, end, &x)) == NULL || (p = get_varint(p, end, &y)) == NULL) return 1;
+        cr[a].word1 = prev1 + unzigzag(x);
+        cr[a].word2 = unzigzag(y) + (cr[a].word1 == prev1 ? prev2 : 0);
+        prev1 = cr[a].word1;
+        prev2 = cr[a].word2;
+    }
+    return 0;
+}
+
+int crec_alloc_buffers(unsigned char **buf, unsigned char **cbuf) {
+    *buf = malloc(CREC_MAX_PAYLOAD);
+    *cbuf = malloc(CREC_MAX_PAYLOAD);
+    if (*buf == NULL || *cbuf == NULL) {
+        free(*buf);
+        free(*cbuf);
+        *buf = *cbuf = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+int crec_writer_open(CREC_WRITER *w, FILE *fout, int format, int level) {
+    unsigned char header[CREC_HEADER_SIZE] = {0};
+    unsigned int f = format, block_records = CREC_BLOCK_RECORDS;
+    w->fout = fout;
+    w->format = format;
+    w->level = level;
+    w->block = NULL;
+    w->buf = w->cbuf = NULL;
+    w->n = w->records = w->bytes = 0;
+    if (format == CREC_FORMAT_RAW) return 0;
+#ifndef USE_ZSTD
+    if (level > 0) {
+        fprintf(stderr, "Compression needs a build with zstd (make COMPRESS_FLAGS=\"-DUSE_ZSTD -lzstd\").\n");
+        return 1;
+    }
+#endif
+    if ((w->block = malloc(sizeof(CREC) * CREC_BLOCK_RECORDS)) == NULL) return 1;
+    if (crec_alloc_buffers(&w->buf, &w->cbuf) != 0) return 1;
+    memcpy(header, crec_magic, sizeof(crec_magic));
+    memcpy(header + 6, &crec_version, sizeof(unsigned short));
+    memcpy(header + 8, &f, sizeof(unsigned int));
+    memcpy(header + 12, &block_records, sizeof(unsigned int));
+    w->bytes = CREC_HEADER_SIZE;
+    return fwrite(header, CREC_HEADER_SIZE, 1, fout) == 1 ? 0 : 1;
+}
+
+static int flush_block(CREC_WRITER *w) {
+    unsigned int head[3];
+    size_t raw = encode_block(w->block, w->n, w->format, w->buf), stored = raw;
+    unsigned char *data = w->buf;
+    if (w->n == 0) return 0;
+#ifdef USE_ZSTD
+    if (w->level > 0) {
+        size_t c = ZSTD_compress(w->cbuf, raw, w->buf, raw, w->level);
+        if (!ZSTD_isError(c) && c < raw) { // Blocks that would not shrink are stored as they are
+            stored = c;
+            data = w->cbuf;
+        }
+    }
+#endif
+    head[0] = w->n;
+    head[1] = stored;
+    head[2] = raw;
+    w->n = 0;
+    w->bytes += sizeof(head) + stored;
+    if (fwrite(head, sizeof(head), 1, w->fout) != 1 || fwrite(data, stored, 1, w->fout) != 1) return 1;
+    return 0;
+}
+
+int crec_write(CREC_WRITER *w, const CREC *cr) {
+    w->records++;
+    if (w->format == CREC_FORMAT_RAW) {
+        w->bytes += sizeof(CREC);
+        return fwrite(cr, sizeof(CREC), 1, w->fout) == 1 ? 0 : 1;
+    }
+    w->block[w->n++] = *cr;
+    if (w->n == CREC_BLOCK_RECORDS) return flush_block(w);
+    return 0;
+}
+
+int crec_write_many(CREC_WRITER *w, const CREC *cr, long long n) {
+    long long a;
+    if (w->format == CREC_FORMAT_RAW) {
+        w->records += n;
+        w->bytes += n * sizeof(CREC);
+        return (n == 0 || fwrite(cr, sizeof(CREC), n, w->fout) == (size_t)n) ? 0 : 1;
+    }
+    for (a = 0; a < n; a++) if (crec_write(w, &cr[a]) != 0) return 1;
+    return 0;
+}
+
+int crec_writer_close(CREC_WRITER *w) {
+    int result = 0;
+    if (w->format != CREC_FORMAT_RAW) result = flush_block(w);
+    free(w->block);
+    free(w->buf);
+    free(w->cbuf);
+    w->block = NULL;
+    w->buf = w->cbuf = NULL;
+    return result;
+}
+
+/* Check a 16 byte file header; returns the format, or -1 if it is not a compact header */
+static int parse_header(const unsigned char *header) {
+    unsigned short version;
+    unsigned int format;
+    if (memcmp(header, crec_magic, sizeof(crec_magic)) != 0) return -1;
+    memcpy(&version, header + 6, sizeof(unsigned short));
+    memcpy(&format, header + 8, sizeof(unsigned int));
+    if (version != crec_version || (format != CREC_FORMAT_COMPACT && format != CREC_FORMAT_COMPACT32)) return -1;
+    return format;
+}
+
+int crec_reader_open(CREC_READER *r, FILE *fin) {
+    r->fin = fin;
+    r->block = NULL;
+    r->buf = r->cbuf = NULL;
+    r->n = r->pos = 0;
+    r->bytes = 0;
+    // 先读入文件头大小的数据：是紧凑格式的文件头就按块读取，否则这些字节就是raw格式的开头
+    r->peeked = fread(r->peek, 1, CREC_HEADER_SIZE, fin);
+    if (r->peeked == CREC_HEADER_SIZE && (r->format = parse_header(r->peek)) >= 0) {
+        r->peeked = 0;
+        r->bytes = CREC_HEADER_SIZE;
+        if ((r->block = malloc(sizeof(CREC) * CREC_BLOCK_RECORDS)) == NULL) return 1;
+        return crec_alloc_buffers(&r->buf, &r->cbuf);
+    }
+    r->format = CREC_FORMAT_RAW;
+    return 0;
+}
+
+/* crec_read_block, also adding the size of the block in the file to *bytes */
+static long long read_block(FILE *fin, int format, CREC *out, unsigned char *buf, unsigned char *cbuf, long long *bytes) {
+    unsigned int head[3];
+    if (fread(head, sizeof(head), 1, fin) != 1) return 0;
+    if (head[0] > CREC_BLOCK_RECORDS || head[2] > CREC_MAX_PAYLOAD || head[1] > head[2]) return -1;
+    *bytes += sizeof(head) + head[1];
+    if (out == NULL) return fseeko(fin, head[1], SEEK_CUR) == 0 ? (long long)head[0] : -1;
+    if (head[1] == head[2]) {
+        if (fread(buf, head[1], 1, fin) != 1 && head[1] > 0) return -1;
+    }
+    else {
+#ifdef USE_ZSTD
+        if (fread(cbuf, head[1], 1, fin) != 1) return -1;
+        if (ZSTD_decompress(buf, head[2], cbuf, head[1]) != head[2]) return -1;
+#else
+        (void)cbuf;
+        fprintf(stderr, "Compressed cooccurrence block; rebuild with zstd (make COMPRESS_FLAGS=\"-DUSE_ZSTD -lzstd\").\n");
+        return -1;
+#endif
+    }
+    if (decode_block(buf, head[2], head[0], format, out) != 0) return -1;
+    return head[0];
+}
+
+long long crec_read_block(FILE *fin, int format, CREC *out, unsigned char *buf, unsigned char *cbuf) {
+    long long bytes = 0;
+    return read_block(fin, format, out, buf, cbuf, &bytes);
+}
+
+long long crec_read(CREC_READER *r, CREC *out, long long n) {
+    long long got = 0, m;
+    if (r->format == CREC_FORMAT_RAW) {
+        // 先交出打开时为检查文件头而读入的字节
+        if (r->peeked > 0) {
+            unsigned char *dst = (unsigned char *)out;
+            size_t want = n * sizeof(CREC), take = (size_t)r->peeked < want ? (size_t)r->peeked : want;
+            memcpy(dst, r->peek, take);
+            memmove(r->peek, r->peek + take, r->peeked - take);
+            r->peeked -= take;
+            got = take + fread(dst + take, 1, want - take, r->fin);
+            if (got % sizeof(CREC) != 0) got -= got % sizeof(CREC); // Drop a trailing partial record, as fread of whole records would
+            r->bytes += got;
+            return got / sizeof(CREC);
+        }
+        got = fread(out, sizeof(CREC), n, r->fin);
+        r->bytes += got * sizeof(CREC);
+        return got;
+    }
+    while (got < n) {
+        if (r->pos == r->n) {
+            if ((m = read_block(r->fin, r->format, r->block, r->buf, r->cbuf, &r->bytes)) <= 0) {
+                if (m < 0) return -1;
+                break;
+            }
+            r->n = m;
+            r->pos = 0;
+        }
+        m = (n - got < r->n - r->pos) ? n - got : r->n - r->pos;
+        memcpy(out + got, r->block + r->pos, m * sizeof(CREC));
+        r->pos += m;
+        got += m;
+    }
+    return got;
+}
+
+void crec_reader_close(CREC_READER *r) {
+    free(r->block);
+    free(r->buf);
+    free(r->cbuf);
+    r->block = NULL;
+    r->buf = r->cbuf = NULL;
+}
+
+int crec_file_format(FILE *fin) {
+    unsigned char header[CREC_HEADER_SIZE];
+    int format;
+    if (fread(header, CREC_HEADER_SIZE, 1, fin) == 1 && (format = parse_header(header)) >= 0) return format;
+    fseeko(fin, 0, SEEK_SET);
+    return CREC_FORMAT_RAW;
+}
+
+/***
+ *  共现记录的排序：按(word1, word2)打包成的64位键做原地的MSD基数排序（American flag sort）
+ *  每一趟按键的一个字节把记录分到256个桶中，然后对每个桶递归排下一个字节，小的桶用插入排序
+ *  不需要额外的缓冲区，所以不会增加overflow缓冲区的内存开销
+ */
+
+#define CREC_SORT_INSERTION 32
+
+static void crec_insertion_sort(CREC *cr, long long n) {
+    long long a, b;
+    unsigned long long k;
+    CREC x;
+    for (a = 1; a < n; a++) {
+        x = cr[a];
+        k = crec_key(&x);
+        for (b = a; b > 0 && crec_key(&cr[b - 1]) > k; b--) cr[b] = cr[b - 1];
+        cr[b] = x;
+    }
+}
+
+static void crec_radix_sort(CREC *cr, long long n, int shift) {
+    long long count[256] = {0}, next[256], end[256], a, pos;
+    int b, d;
+    CREC x, tmp;
+    if (n <= CREC_SORT_INSERTION) {crec_insertion_sort(cr, n); return;}
+    for (a = 0; a < n; a++) count[(crec_key(&cr[a]) >> shift) & 255]++;
+    for (pos = 0, b = 0; b < 256; b++) {
+        next[b] = pos;
+        pos += count[b];
+        end[b] = pos;
+    }
+    // 所有记录的这个字节都相同时（比如word2的高位字节）直接排下一个字节
+    if (count[(crec_key(&cr[0]) >> shift) & 255] < n) {
+        /* Permute in place: carry each displaced record along its cycle until it reaches its own bucket */
+        for (b = 0; b < 256; b++) {
+            while (next[b] < end[b]) {
+                x = cr[next[b]];
+                while ((d = (crec_key(&x) >> shift) & 255) != b) {
+                    tmp = cr[next[d]];
+                    cr[next[d]++] = x;
+                    x = tmp;
+                }
+                cr[next[b]++] = x;
+            }
+        }
+    }
+    if (shift == 0) return;
+    for (pos = 0, b = 0; b < 256; b++) {
+        if (count[b] > 1) crec_radix_sort(cr + pos, count[b], shift - 8);
+        pos += count[b];
+    }
+}
+
+void crec_sort(CREC *cr, long long n) {
+    long long a;
+    unsigned long long bits = 0;
+    int shift = 0;
+    if (n < 2) return;
+    // 只排键中实际用到的字节：词的序号不超过vocab_size，word1和word2的高位字节通常都是0
+    for (a = 0; a < n; a++) bits |= crec_key(&cr[a]);
+    while (shift < 56 && (bits >> (shift + 8)) != 0) shift += 8;
+    crec_radix_sort(cr, n, shift);
+}
+
+static FILE *metrics_file = NULL;
+static const char *metrics_tool = "";
+static double metrics_start;
+
+int metrics_open(const char *tool, const char *path) {
+    if (path == NULL) return 0;
+    metrics_file = strcmp(path, "-") == 0 ? stderr : fopen(path, "a");
+    if (metrics_file == NULL) return 1;
+    metrics_tool = tool;
+    metrics_start = metrics_now();
+    return 0;
+}
+
+void metrics_close(void) {
+    if (metrics_file != NULL && metrics_file != stderr) fclose(metrics_file);
+    metrics_file = NULL;
+}
+
+int metrics_enabled(void) {
+    return metrics_file != NULL;
+}
+
+double metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int metrics_due(double *last) {
+    double now;
+    if (metrics_file == NULL) return 0;
+    now = metrics_now();
+    if (now - *last < METRICS_INTERVAL) return 0;
+    *last = now;
+    return 1;
+}
+
+void metrics_emit(const char *phase, double seconds, const char *fields, ...) {
+    struct rusage usage;
+    va_list ap;
+    if (metrics_file == NULL) return;
+    getrusage(RUSAGE_SELF, &usage); // ru_maxrss is in kilobytes on Linux
+    flockfile(metrics_file);
+    fprintf(metrics_file, "{\"tool\":\"%s\",\"phase\":\"%s\",\"elapsed\":%.3f,\"seconds\":%.3f,\"peak_rss_mb\":%.1f",
+        metrics_tool, phase, metrics_now() - metrics_start, seconds, usage.ru_maxrss / 1024.0);
+    if (fields != NULL) {
+        fputc(',', metrics_file);
+        va_start(ap, fields);
+        vfprintf(metrics_file, fields, ap);
+        va_end(ap);
+    }
+    fputs("}\n", metrics_file);
+    fflush(metrics_file);
+    funlockfile(metrics_file);
+}
+
+/* First number in a file such as memory.max, or -1 if it is missing or says "max" */
+static long long read_number_file(const char *path) {
+    long long v = -1;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    if (fscanf(f, "%lld", &v) != 1) v = -1;
+    fclose(f);
+    return v;
+}
+
+/* Value of "key value" in a file like /proc/meminfo or memory.stat, or -1 */
+static long long read_keyed_value(const char *path, const char *key) {
+    char line[256];
+    size_t len = strlen(key);
+    long long v = -1;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, key, len) == 0 && (line[len] == ' ' || line[len] == ':')) {
+            v = atoll(line + len + 1 + strspn(line + len + 1, " \t"));
+            break;
+        }
+    }
+    fclose(f);
+    return v;
+}
+
+/* Least memory left under the limits of the cgroup at rel (e.g. "/system.slice/job.scope") in the hierarchy mounted at
+ * mount and of all its ancestors, each being its limit minus its usage plus its reclaimable page cache; -1 if none
+ * of them has a limit. v2 selects the file names of cgroup v2 over those of v1 */
+static long long cgroup_memory_left(const char *mount, char *rel, int v2) {
+    char path[4200], *slash;
+    long long limit, usage, cache, left, least = -1;
+    size_t len = strlen(rel);
+    while (len > 0 && rel[len - 1] == '/') rel[--len] = '\0';
+    while (1) {
+        snprintf(path, sizeof(path), "%s%s/%s", mount, rel, v2 ? "memory.max" : "memory.limit_in_bytes");
+        // an unlimited v1 group reports a limit near 2^63, an unlimited v2 group "max"
+        if ((limit = read_number_file(path)) > 0 && limit < (1LL << 60)) {
+            snprintf(path, sizeof(path), "%s%s/%s", mount, rel, v2 ? "memory.current" : "memory.usage_in_bytes");
+            usage = read_number_file(path);
+            snprintf(path, sizeof(path), "%s%s/memory.stat", mount, rel);
+            cache = read_keyed_value(path, v2 ? "inactive_file" : "total_inactive_file");
+            left = limit - (usage > 0 ? usage : 0) + (cache > 0 ? cache : 0);
+            if (left > limit) left = limit;
+            if (least < 0 || left < least) least = left;
+        }
+        if ((slash = strrchr(rel, '/')) == NULL) break;
+        *slash = '\0'; // parent; "" is the root of the mount
+    }
+    return least;
+}
+
+/* Whether the comma separated list of controllers names name */
+static int lists_controller(const char *list, const char *name) {
+    size_t n = strlen(name);
+    const char *p;
+    for (p = list; (p = strstr(p, name)) != NULL; p += n) {
+        if ((p == list || p[-1] == ',') && (p[n] == '\0' || p[n] == ',')) return 1;
+    }
+    return 0;
+}
+
+// 进程所在的cgroup由/proc/self/cgroup给出：systemd的slice、Slurm的作业等通常没有cgroup namespace，限制设在进程自己的
+// cgroup或它的某个祖先上，而不是/sys/fs/cgroup根目录，所以从进程的cgroup一直向上查到根，取最小的剩余量
+long long available_memory(void) {
+    char line[4096], *controllers, *rel;
+    long long avail = read_keyed_value("/proc/meminfo", "MemAvailable"), left;
+    FILE *f;
+    if (avail >= 0) avail *= 1024; // kB
+    else if (sysconf(_SC_AVPHYS_PAGES) > 0) avail = (long long)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if ((f = fopen("/proc/self/cgroup", "r")) != NULL) {
+        /* Lines are "id:controllers:path"; cgroup v2 is "0::path", v1 lists memory among the controllers */
+        while (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if ((controllers = strchr(line, ':')) == NULL || (rel = strchr(++controllers, ':')) == NULL) continue;
+            *rel++ = '\0';
+            if (*controllers == '\0') left = cgroup_memory_left("/sys/fs/cgroup", rel, 1);
+            else if (lists_controller(controllers, "memory")) left = cgroup_memory_left("/sys/fs/cgroup/memory", rel, 0);
+            else continue;
+            if (left >= 0 && (avail < 0 || left < avail)) avail = left;
+        }
+        fclose(f);
+    }
+    else { // no /proc: the limits of the root groups, as seen from a cgroup namespace
+        line[0] = '\0';
+        if ((left = cgroup_memory_left("/sys/fs/cgroup", line, 1)) < 0) left = cgroup_memory_left("/sys/fs/cgroup/memory", line, 0);
+        if (left >= 0 && (avail < 0 || left < avail)) avail = left;
+    }
+    return avail;
+}
+
+double auto_memory_gb(double fallback) {
+    long long avail = available_memory();
+    if (avail <= 0) return fallback;
+    return AUTO_MEMORY_FRACTION * avail / 1073741824.0;
+}
@@ -0,0 +1,295 @@
+//  Code shared by the GloVe tools
+//
+//  GloVe: Global Vectors for Word Representation
+//  Copyright (c) 2014 The Board of Trustees of
+//  The Leland Stanford Junior University. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+//  For more information, bug reports, fixes, contact:
+//    Jeffrey Pennington (jpennin@stanford.edu)
+//    GlobalVectors@googlegroups.com
+//    http://nlp.stanford.edu/projects/glove/
+
+#ifndef GLOVE_COMMON_H
+#define GLOVE_COMMON_H
+
+#include <math.h>
+#include <stdio.h>
+
+/***
+ *  按块读取语料的分词器，vocab_count和cooccur共用
+ *  每次用fread读入一大块，在块内用查表的方式找分隔符，返回指向缓冲区内部的词（不拷贝）
+ *  词在下一次调用next_token之前有效，并且不以'\0'结尾，要用返回的长度
+ */
+
+// 读入缓冲区的大小，比这更长的词会被切开
+#define READER_BUFFER_SIZE 4194304
+
+// next_token的返回值
+#define TOKEN_WORD 0          // a word followed by a delimiter
+#define TOKEN_NEWLINE 1       // a newline (only when newline_token is set)
+#define TOKEN_END 2           // end of input
+#define TOKEN_WORD_AT_END 3   // a word cut off by the end of input, with no delimiter after it
+
+typedef struct token_reader {
+    FILE *fin;                  // NULL when reading a fixed memory range
+    char *buf;                  // block buffer, owned by the reader when fin != NULL
+    const char *pos, *end;      // unread part of the buffer
+    int eof;                    // no more data after end
+    unsigned char cls[256];     // byte classes: word byte, separator or newline
+    long long bytes;            // bytes of input taken in so far
+} TOKEN_READER;
+
+/* Read tokens from a stream in large blocks. Bytes in separators split words; if newline_token is set, '\n' also splits
+ * words and is returned as TOKEN_NEWLINE, otherwise it is a plain separator. Returns 0 on success */
+int reader_init_file(TOKEN_READER *r, FILE *fin, const char *separators, int newline_token);
+/* Read tokens from the bytes [start, end), e.g. one slice of a memory-mapped corpus */
+void reader_init_range(TOKEN_READER *r, const char *start, const char *end, const char *separators, int newline_token);
+void reader_free(TOKEN_READER *r);
+// 多线程切分语料：第a段（共n段）的起点，从size * a / n往后移到after中某个字节之后，这样不会把一行或一个词切开
+/* Start of range a of n when splitting the size bytes at text between threads: size * a / n moved forward to just past
+ * a byte in after (never NUL), or to size. Starts never decrease in a, so a range may be empty but never negative */
+long long range_start(const char *text, long long size, int a, int n, const char *after);
+/* Return the next token as a slice of the reader's buffer; *token and *length are set for TOKEN_WORD and
+ * TOKEN_WORD_AT_END. Separators are skipped; a newline right after a word is left for the next call */
+int next_token(TOKEN_READER *r, const char **token, long long *length);
+
+/***
+ *  基于计数器的随机数：第i个随机数就是(seed, stream, i)的哈希值
+ *  不需要保存和推进任何状态，所以各个线程可以各自取数，结果也不依赖于线程数
+ */
+
+/* Counter-based random numbers (a splitmix64 finalizer over seed, stream and counter) */
+static inline unsigned long long counter_rand(unsigned long long seed, unsigned long long stream, unsigned long long i) {
+    unsigned long long z = seed * 0x9E3779B97F4A7C15ULL + stream * 0xD1B54A32D192ED03ULL + i * 0x8CB92BA72F3D8DD7ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform integer in [0, n), by multiply-shift; the bias is negligible for n far below 2^64 */
+static inline unsigned long long counter_rand_below(unsigned long long seed, unsigned long long stream, unsigned long long i, unsigned long long n) {
+    return (unsigned long long)(((unsigned __int128)counter_rand(seed, stream, i) * n) >> 64);
+}
+
+/* Zipf distributed rank in [1, n]: the floored inverse CDF of the density r^-s on [1, n), so rank r is drawn about
+ * r^-s times as often as rank 1 (n itself only by rounding). For s = 1 this is n^u for uniform u */
+static inline long long counter_zipf(unsigned long long seed, unsigned long long stream, unsigned long long i, long long n, double s) {
+    double u = (counter_rand(seed, stream, i) >> 11) * 0x1.0p-53;
+    if (s == 1.0) return (long long)exp(log((double)n) * u);
+    return (long long)pow(1.0 + u * (pow((double)n, 1.0 - s) - 1.0), 1.0 / (1.0 - s));
+}
+
+/***
+ *  开放寻址（线性探测）的词表哈希表，vocab_count和cooccur共用
+ *  表项里缓存了完整的哈希值，词本身存放在按块分配的arena中，插入一个新词不需要malloc
+ *  表的大小是2的幂，装载率超过3/4时翻倍
+ */
+
+#define HASH_SEED 1159241
+#define ARENA_BLOCK_SIZE 16777216
+
+typedef struct hash_entry {
+    char *word;             // NUL-terminated, stored in the arena; NULL for an empty slot
+    unsigned int hash;      // full hash of word, so probing and resizing rarely touch the word itself
+    long long value;        // count in vocab_count, frequency rank in cooccur
+} HASH_ENTRY;
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used, size;
+    char data[];
+} ARENA_BLOCK;
+
+typedef struct vocab_hash {
+    HASH_ENTRY *slots;
+    long long capacity;     // power of 2
+    long long size;         // number of words
+    ARENA_BLOCK *arena;     // newest block first
+} VOCAB_HASH;
+
+/* Create an empty table with room for about capacity words before the first resize. Returns NULL if out of memory */
+VOCAB_HASH *vocab_hash_create(long long capacity);
+void vocab_hash_free(VOCAB_HASH *h);
+/* Find word[0..length), adding it with value 0 if it is new. The entry stays valid until the next insert. Returns
+ * NULL if out of memory */
+HASH_ENTRY *vocab_hash_insert(VOCAB_HASH *h, const char *word, long long length);
+/* Read-only lookup; safe to call from several threads while nobody inserts. Returns NULL if word is absent */
+HASH_ENTRY *vocab_hash_find(const VOCAB_HASH *h, const char *word, long long length);
+
+/***
+ *  词表的二进制索引文件（vocab.txt.idx），由vocab_count -vocab-index写出，其他工具直接mmap，不用再解析和哈希vocab.txt
+ *  按词频排名依次存放每个词的词频、词在词串中的偏移和建好的哈希表（与VOCAB_HASH同样的哈希函数和线性探测）
+ *  索引记录了vocab.txt的字节数、inode、纳秒级的修改时间和内容指纹；任何一项不同时，索引视为过期，改为读取文本
+ */
+
+#define VOCAB_INDEX_SUFFIX ".idx" // default index of a vocab file: its name plus this
+#define VOCAB_MAX_WORD 1000 // longer words are cut, as by the "%1000s" the tools used to read vocab files with
+
+typedef struct vocab_slot {
+    unsigned int hash;      // as in VOCAB_HASH
+    unsigned int rank;      // frequency rank of the word, from 1; 0 for an empty slot
+    long long offset;       // of the word in words
+} VOCAB_SLOT;
+
+typedef struct vocab_map {
+    long long size;             // number of words
+    long long capacity;         // slots, a power of 2
+    long long total;            // sum of the counts
+    const long long *counts;    // counts[r - 1] is the count of the word of rank r
+    const long long *offsets;   // the word of rank r is at words + offsets[r - 1]; offsets[size] is the end of words
+    const VOCAB_SLOT *slots;
+    const char *words;          // NUL-terminated words in rank order
+    long long duplicates;       // words seen again when the map was built; they keep their first rank
+    void *image;                // the index file image, mapped or allocated
+    size_t image_size;
+    int mapped;                 // 1 if image is a mapping of an index file
+} VOCAB_MAP;
+
+/* Build a map of size words in rank order with their counts. Returns 0 on success, 1 if out of memory */
+int vocab_map_build(VOCAB_MAP *v, char *const *words, const long long *counts, long long size);
+/* Parse a text vocab file ("word count" per line), stamping the map with it. Returns 0 on success, 1 if it cannot be
+ * read or memory runs out */
+int vocab_map_read_text(VOCAB_MAP *v, const char *text_path);
+/* Record the vocab file open at fd (size, inode, mtime and a fingerprint of its contents) in a built map, so that
+ * vocab_map_open can tell whether a saved index still belongs to it. Returns 0 on success, 1 if fd is not a regular
+ * file or cannot be read */
+int vocab_map_stamp(VOCAB_MAP *v, int fd);
+/* Write the map as an index file, through path.tmp. Returns 0 on success */
+int vocab_map_save(const VOCAB_MAP *v, const char *path);
+/* Map an index file, checking it against text_path unless that is NULL. Returns 0 on success, 1 if the index is
+ * missing, stale or invalid */
+int vocab_map_open(VOCAB_MAP *v, const char *path, const char *text_path);
+/* Map the index of text_path (index_path, or text_path + VOCAB_INDEX_SUFFIX if index_path is NULL or empty) if it is
+ * up to date, else parse text_path. Returns 0 on success */
+int vocab_map_load(VOCAB_MAP *v, const char *text_path, const char *index_path);
+void vocab_map_free(VOCAB_MAP *v);
+/* Rank of word[0..length), or 0 if it is absent; safe to call from several threads */
+long long vocab_map_find(const VOCAB_MAP *v, const char *word, long long length);
+
+static inline const char *vocab_map_word(const VOCAB_MAP *v, long long rank) {
+    return v->words + v->offsets[rank - 1];
+}
+
+/***
+ *  共现记录，以及它的紧凑存储格式
+ *  原来的格式（raw）就是CREC数组，没有文件头，每条记录16字节
+ *  紧凑格式（compact）：16字节的文件头，后面是一个个可以独立解码的块，每块最多CREC_BLOCK_RECORDS条记录
+ *   - 块头：records、bytes（存储的字节数）、raw_bytes（未压缩的字节数），都是unsigned int；bytes != raw_bytes表示块经过了zstd压缩
+ *   - 块内先是records个val（double，或者compact32格式下的float），然后是word1和word2的varint编码：
+ *     word1存与上一条记录的差，word2在word1相同时存与上一条记录的差，否则存word2本身，差值用zigzag变成非负数
+ *     有序的cooccur输出中差值很小，大部分id只占1个字节
+ */
+
+typedef struct cooccur_rec {
+    int word1;
+    int word2;
+    double val;
+} CREC;
+
+/* Sort key of a record: (word1, word2) in one integer; word ids are positive, so keys order like the pairs */
+static inline unsigned long long crec_key(const CREC *cr) {
+    return ((unsigned long long)(unsigned int)cr->word1 << 32) | (unsigned int)cr->word2;
+}
+
+/* Sort records by (word1, word2) in place, with an MSD radix sort over the bytes of crec_key that are in use */
+void crec_sort(CREC *cr, long long n);
+
+#define CREC_FORMAT_RAW 0           // headerless array of CREC
+#define CREC_FORMAT_COMPACT 1       // blocks of varint coded ids and double values
+#define CREC_FORMAT_COMPACT32 2     // as compact, with values stored as float
+#define CREC_BLOCK_RECORDS 65536
+#define CREC_HEADER_SIZE 16
+
+typedef struct crec_writer {
+    FILE *fout;
+    int format, level;          // level > 0: zstd compression level (builds with USE_ZSTD only)
+    CREC *block;                // records of the block being filled
+    long long n;
+    unsigned char *buf, *cbuf;  // encoded and compressed block
+    long long records;          // total records written
+    long long bytes;            // bytes written to fout, header included
+} CREC_WRITER;
+
+typedef struct crec_reader {
+    FILE *fin;
+    int format;
+    CREC *block;                // decoded block, for compact formats
+    long long n, pos;
+    unsigned char *buf, *cbuf;
+    unsigned char peek[CREC_HEADER_SIZE]; // raw input read while looking for a header
+    int peeked;
+    long long bytes;            // bytes of input consumed, header included
+} CREC_READER;
+
+/* Parse a -format argument: raw, compact or compact32. Returns -1 if unknown */
+int crec_parse_format(const char *name);
+/* Start writing records to fout; compact formats write their header here. Return 0 on success */
+int crec_writer_open(CREC_WRITER *w, FILE *fout, int format, int level);
+int crec_write(CREC_WRITER *w, const CREC *cr);
+int crec_write_many(CREC_WRITER *w, const CREC *cr, long long n);
+/* Flush the last block and free buffers; does not close fout */
+int crec_writer_close(CREC_WRITER *w);
+/* Start reading records from fin, detecting the format from the first bytes, so stdin works too. Return 0 on success */
+int crec_reader_open(CREC_READER *r, FILE *fin);
+/* Read up to n records; returns the number read, 0 at end of input or -1 on a corrupt or unsupported block */
+long long crec_read(CREC_READER *r, CREC *out, long long n);
+void crec_reader_close(CREC_READER *r);
+/* Seekable access for glove: read the format of a file positioned at its start (raw files are left at 0) */
+int crec_file_format(FILE *fin);
+/* Read the block at the current position of a compact file into out (room for CREC_BLOCK_RECORDS); with out == NULL
+ * skip over it. buf and cbuf may be NULL, otherwise scratch buffers from crec_alloc_buffers. Returns the number of
+ * records, 0 at end of file, -1 on error */
+long long crec_read_block(FILE *fin, int format, CREC *out, unsigned char *buf, unsigned char *cbuf);
+/* Allocate the scratch buffers crec_read_block needs for one block */
+int crec_alloc_buffers(unsigned char **buf, unsigned char **cbuf);
+
+/***
+ *  运行指标（-metrics <file>）：每个阶段结束时写一行JSON，glove每轮迭代后也写一行，耗时长的阶段每隔METRICS_INTERVAL秒写一行进度
+ *  每行都有tool、phase、从程序启动算起的elapsed、阶段耗时seconds和峰值内存peak_rss_mb，其余字段由各个工具给出
+ *  用来估算作业的规模，以及在整条流水线变慢时找出是哪个阶段变慢了
+ */
+
+#define METRICS_INTERVAL 10.0   // seconds between progress lines within a phase
+
+/* Start writing metrics lines of tool to path, "-" for stderr. Until then, or if path is NULL, the other metrics
+ * calls do nothing. Returns 0 on success */
+int metrics_open(const char *tool, const char *path);
+void metrics_close(void);
+int metrics_enabled(void);
+/* Wall-clock seconds from a fixed point, for timing phases */
+double metrics_now(void);
+/* Whether a progress line is due, METRICS_INTERVAL seconds after *last; if so *last is moved to now */
+int metrics_due(double *last);
+/* Write {"tool":..,"phase":..,"elapsed":..,"seconds":..,"peak_rss_mb":..,<fields>} as one line. fields, if not NULL, is
+ * a printf format for the remaining members, e.g. "\"tokens\":%lld,\"tokens_per_sec\":%.0f" */
+void metrics_emit(const char *phase, double seconds, const char *fields, ...);
+
+/***
+ *  -memory auto：按这台机器上实际还能用的内存来定内存预算，而不是用固定的默认值
+ *  可用内存取/proc/meminfo的MemAvailable和cgroup限额剩下的部分（v2的memory.max，或v1的memory.limit_in_bytes，
+ *  减去已用的量，可回收的page cache不算已用）中较小的一个，预算是其中的AUTO_MEMORY_FRACTION
+ *  cgroup从/proc/self/cgroup给出的进程自己的cgroup开始，逐级向上查到根，取剩余最少的一级
+ */
+
+#define AUTO_MEMORY_FRACTION 0.8
+
+/* Bytes this process can still allocate without swapping or hitting the limit of its cgroup or any ancestor of it,
+ * or -1 if unknown */
+long long available_memory(void);
+/* Memory budget for -memory auto, in GB: AUTO_MEMORY_FRACTION of available_memory(), or fallback if that is unknown */
+double auto_memory_gb(double fallback);
+
+#endif /* GLOVE_COMMON_H */
@@ -33,7 +33,7 @@
  *  2. 程序使用lookup数组和bigram_table，来实现w1*w2<max_product的词对的记录直接存入bigram_table中，再次遇到的时候直接加
  *  3. 而w1*w2>max_product的词对的记录，存入一个缓冲区overflow，缓冲区每次满的时候，排序，合并同类项，写入文件
  *  4. 读完整个语料后，把最后一个overflow缓冲区写入文件，把bigram_table也写入文件
- *  5. 最后，读取全部文件的记录，合并同类项并输出。由于每个文件都是排序后的，所以维持了一个文件数目为长度的优先队列，每次出队一个记录，合并同类项，然后再从对应文件中再入队一个记录
+ *  5. 最后，读取全部文件的记录，合并同类项并输出。由于每个文件都是排序后的，所以用一棵以文件为叶子的败者树做多路归并，每次选出最小的一个记录，合并同类项，然后再从对应文件中读入下一个记录
  *  
  *  
  */
@@ -42,36 +42,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-
-#define TSIZE 1048576
-#define SEED 1159241
-#define HASHFN bitwisehash
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
 
 static const int MAX_STRING_LENGTH = 1000;
+// 分隔词的字符，换行符另外处理（会重置窗口）
+#define WORD_SEPARATORS " \t"
 typedef double real;
 
-// Cooccurence Record, 两个词共现的值
-typedef struct cooccur_rec {
-    int word1;
-    int word2;
-    real val;
-} CREC;
-
-// Cooccurence Record ID, 两个词共现的值以及id
-typedef struct cooccur_rec_id {
-    int word1;
-    int word2;
-    real val;
-    // i用来记录是文件数组中哪一个文件里读入的当前记录
-    int id;
-} CRECID;
-
-// 词频表的哈希表项
-typedef struct hashrec {
-    char	*word;
-    long long id;
-    struct hashrec *next;
-} HASHREC;
+// 共现记录CREC定义在common.h中
 
 // 控制是否输出debug信息，有0、1、2共三个级别
 int verbose = 2; // 0, 1, or 2
@@ -91,9 +73,30 @@ int window_size = 15; // default context window size
 int symmetric = 1; // 0: asymmetric, 1: symmetric
 // 内存消耗的软限制，单位GB，默认值3，简单的启发式限制所以并不是极端准确的
 real memory_limit = 3; // soft limit, in gigabytes, used to estimate optimal array sizes
+int memory_auto = 0; // -memory auto: memory_limit from the free memory, max_product and overflow_length from the vocab counts
 // vocab_file: 词表文件，默认为vocab.txt
 // file_head: overflow文件的前缀名，默认为"overflow"，文件全名为"overflow_0000.bin"，多个文件数值递增
 char *vocab_file, *file_head;
+// 词表的二进制索引文件（见common.h），为空时用<vocab_file>.idx（如果存在并且没有过期）
+char *vocab_index_file; // empty: map <vocab_file>.idx if it is up to date, without writing it
+// 增量更新时之前输出的共现矩阵，以及它当时用的词表；为空时不使用
+char *previous_file, *previous_vocab_file; // -previous: earlier cooccur output to add to this run's counts; -previous-vocab: its vocab, for remapping ids
+// 线程数，大于1时把语料按行切分成num_threads段并行统计，此时标准输入必须重定向自一个普通文件
+int num_threads = 1; // pthreads; more than 1 requires stdin to be redirected from a regular file
+// 为1时有两个overflow缓冲区，一个写满后由后台线程排序并写入临时文件，同时继续统计并填写另一个
+// 默认-1：有空闲的CPU核（核数多于统计线程数）时才打开，否则后台线程只会和统计线程抢同一个核
+int async_spill = -1; // 1: sort and write full overflow buffers in a background thread while counting continues; 0: stop to write them; -1: 1 if there are more cores than counting threads
+// 为1时词频低的词的那些行不用稠密数组，而是存到哈希表里，见choose_dense_rows
+int sparse_table = 0; // 0: dense array for the whole w1*w2 < max_product region; 1: hash the rows estimated to be mostly zero
+long long dense_rows, sparse_estimate; // rows 1..dense_rows are in bigram_table; expected number of hashed cells per table
+// 输出格式，见common.h；compress_level > 0时紧凑格式的块用zstd压缩
+int output_format = CREC_FORMAT_RAW, compress_level = 0;
+// 运行指标（-metrics）：当前阶段的开始时间和上一行进度的时间，以及overflow缓冲区的排序、写出和bigram_table写出的累计量
+// 后台写出和多线程时这些工作与统计同时进行，各自计时后相加，所以它们的seconds可能超过墙上时间
+char *metrics_path = NULL;
+double metrics_phase, metrics_last, sort_seconds, spill_seconds, dump_seconds;
+long long spill_runs, spill_records, spill_bytes, dump_bytes;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 
@@ -104,102 +107,20 @@ int scmp( char *s1, char *s2 ) {
     return(*s1 - *s2);
 }
 
-// 哈希函数、数据结构、哈希表的初始化、插入、查找，都是从这个网址的源代码中稍加修改而来
-// 修改的部分就是数据结构，和哈希表的默认长度
-// 很不错的源代码，可以仔细学习一些原理
-/* Move-to-front hashing and hash function from Hugh Williams, http://www.seg.rmit.edu.au/code/zwh-ipl/ */
-
-/* Simple bitwise hash function */
-// 哈希函数，使用了位运算
-unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
-    char c;
-    unsigned int h;
-    h = seed;
-    for (; (c =* word) != '\0'; word++) h ^= ((h << 5) + c + (h >> 2));
-    return((unsigned int)((h&0x7fffffff) % tsize));
-}
-
-/* Create hash table, initialise pointers to NULL */
-// 创建一个大小为TSIZE的空哈希表
-HASHREC ** inithashtable() {
-    int	i;
-    HASHREC **ht;
-    ht = (HASHREC **) malloc( sizeof(HASHREC *) * TSIZE );
-    for (i = 0; i < TSIZE; i++) ht[i] = (HASHREC *) NULL;
-    return(ht);
-}
-
-/* Search hash table for given string, return record if found, else NULL */
-// 从哈希表中查找某个词 如果没有的话返回NULL
-HASHREC *hashsearch(HASHREC **ht, char *w) {
-    HASHREC	*htmp, *hprv;
-    // 首先计算哈希值
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    // 循环遍历哈希值位置的链表，找到对应词或者得到NULL
-    for (hprv = NULL, htmp=ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    // 类似LRU的策略，找到词以后放到链表头部，方便下次查询
-    if ( htmp != NULL && hprv!=NULL ) { // move to front on access
-        hprv->next = htmp->next;
-        htmp->next = ht[hval];
-        ht[hval] = htmp;
-    }
-    return(htmp);
-}
-
-/* Insert string in hash table, check for duplicates which should be absent */
-// 把一个词和其词频插入哈希表，同时还有其id。与count_vocab.c一样，使用链表解决哈希冲突
-void hashinsert(HASHREC **ht, char *w, long long id) {
-    HASHREC	*htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    // 查找哈希值对应的位置，如果已经存在则遍历使指针指到链表的末尾节点
-    for (hprv = NULL, htmp = ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if (htmp == NULL) {
-        htmp = (HASHREC *) malloc(sizeof(HASHREC));
-        htmp->word = (char *) malloc(strlen(w) + 1);
-        strcpy(htmp->word, w);
-        htmp->id = id;
-        htmp->next = NULL;
-        // 哈希值对应位置为空，直接插入该位置
-        if (hprv == NULL) ht[hval] = htmp;
-        // 已经存在节点，则插到链表末尾
-        else hprv->next = htmp;
-    }
-    // 不应该存在同一个词插两次的情况
-    else fprintf(stderr, "Error, duplicate entry located: %s.\n",htmp->word);
-    return;
-}
-
-/* Read word from input stream */
-// 从输入流中读入一个词
-int get_word(char *word, FILE *fin) {
-    int i = 0, ch;
-    while (!feof(fin)) {
-        ch = fgetc(fin);
-        // 忽略回车符，这是因为考虑到windows文件的缘故吗
-        if (ch == 13) continue;
-        // 遇到空格Tab换行
-        if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
-            // 如果i>0，说明已经读取了一个词了
-            if (i > 0) {
-                // 如果是回车，要把回车放回去
-                if (ch == '\n') ungetc(ch, fin);
-                // 跳出循环，到程序末尾，返回值
-                break;
-            }
-            // 此处是i==0的情况，即还没有读到词就读到了空格Tab换行
-            // 如果是换行，直接返回1
-            if (ch == '\n') return 1;
-            // 空格或者Tab，则跳过继续查找词
-            else continue;
-        }
-        // 正常字符，存入word中
-        word[i++] = ch;
-        // 如果一个词的长度超过了MAX_STRING_LENGTH，超出部分会被忽略
-        if (i >= MAX_STRING_LENGTH - 1) i--;   // truncate words that exceed max length
+/* Copy a token from the tokenizer into word, with the rules the old fgetc-based get_word used: carriage returns are
+ * dropped and words are truncated to MAX_STRING_LENGTH - 2 characters. Returns the length of the copied word */
+// 把分词器返回的词拷贝到word中：忽略回车符（考虑windows文件），超出长度的部分被忽略
+int copy_word(char *word, const char *token, long long length) {
+    long long a;
+    int i = 0;
+    if (length <= MAX_STRING_LENGTH - 2 && memchr(token, 13, length) == NULL) { // Common case
+        memcpy(word, token, length);
+        word[length] = 0;
+        return length;
     }
-    // 结束字符串并返回
+    for (a = 0; a < length && i < MAX_STRING_LENGTH - 2; a++) if (token[a] != 13) word[i++] = token[a];
     word[i] = 0;
-    return 0;
+    return i;
 }
 
 /* Write sorted chunk of cooccurrence records to file, accumulating duplicate entries */
@@ -224,190 +145,886 @@ int write_chunk(CREC *cr, long long length, FILE *fout) {
     return 0;
 }
 
-/* Check if two cooccurrence records are for the same two words, used for qsort */
-// 比较两条共现记录是不是同样的两个词，并且顺序相同。用于qsort排序
-int compare_crec(const void *a, const void *b) {
-    int c;
-    if ( (c = ((CREC *) a)->word1 - ((CREC *) b)->word1) != 0) return c;
-    else return (((CREC *) a)->word2 - ((CREC *) b)->word2);
-    
-}
-
-/* Check if two cooccurrence records are for the same two words */
-// 比较两条记录是不是同一对词
-int compare_crecid(CRECID a, CRECID b) {
-    int c;
-    if ( (c = a.word1 - b.word1) != 0) return c;
-    else return a.word2 - b.word2;
-}
-
-/* Swap two entries of priority queue */
-// 交换优先队列中的两个两条记录
-void swap_entry(CRECID *pq, int i, int j) {
-    CRECID temp = pq[i];
-    pq[i] = pq[j];
-    pq[j] = temp;
-}
-
-/* Insert entry into priority queue */
-// 插入一条记录到优先队列
-// 优先队列是一个小顶堆
-void insert(CRECID *pq, CRECID new, int size) {
-    int j = size - 1, p;
-    // 插入记录
-    pq[j] = new;
-    // 调整优先队列，当前节点与二叉树中的父节点相比，如果父节点小就交换，递归直到不满足或者到达根部
-    while ( (p=(j-1)/2) >= 0 ) {
-        if (compare_crecid(pq[p],pq[j]) > 0) {swap_entry(pq,p,j); j = p;}
-        else break;
-    }
-}
-
-/* Delete entry from priority queue */
-// 从优先队列中删除队首记录，删除前优先队列的长度是size
-// 优先队列是一个小顶堆
-void delete(CRECID *pq, int size) {
-    int j, p = 0;
-    // 把数组中最后一记录移到队首
-    pq[p] = pq[size - 1];
-    // 从队首开始，二叉树的父节点跟左右子节点比较，直到比两个子节点都大于父节点，或者到队尾
-    // j是p的左子节点
-    while ( (j = 2*p+1) < size - 1 ) {
-        // 如果j是当前的最后一个词了，只需要p和j比较，没有右子节点
-        if (j == size - 2) {
-            // 如果节点p>j，交换二者
-            if (compare_crecid(pq[p],pq[j]) > 0) swap_entry(pq,p,j);
-            // 否则直接返回，删除完成
-            return;
-        }
+/***
+ *  多路归并：每个临时文件都是按(word1, word2)排好序的，用败者树（loser tree）每次选出最小的记录
+ *  败者树每出一条记录只需要沿着叶子到根的一条路径比较log2(num)次，每次比较只是一个64位整数的比较
+ *  每个文件有一个较大的读缓冲区，输出也先攒到缓冲区里成批写出
+ *  num_threads > 1时按(word1, word2)把键空间切成num_threads段，各线程同时归并自己的一段
+ */
+
+#define MERGE_OUT_RECORDS 65536
+#define MERGE_SAMPLES_PER_THREAD 256
+#define KEY_END 0xFFFFFFFFFFFFFFFFULL // key of an exhausted run; above every real key
+
+// 一个临时文件中正在归并的一段：[next, end)是还没有读入缓冲区的记录
+typedef struct merge_run {
+    FILE *fid;
+    CREC *buf;
+    long long n, pos, next, end;
+} MERGE_RUN;
+
+// 一个归并线程负责的键空间的一段，start[i]和end[i]是这一段在第i个文件里的记录位置
+typedef struct merge_job {
+    int id, num;
+    long long *start, *end;
+    long long buffer_records;   // read buffer per file
+    CREC_WRITER *fout;          // the output for range 0; other ranges go to a raw temporary file
+    long long lines;
+    int result;
+} MERGE_JOB;
+
+// 败者树中a是否排在b前面，键相同时文件号小的在前，这样重复记录的累加顺序是确定的，与线程数无关
+static inline int run_before(const unsigned long long *key, int a, int b) {
+    return key[a] < key[b] || (key[a] == key[b] && a < b);
+}
+
+/* Replay the path from leaf s to the root after its key changed: each node keeps the loser, tree[0] the winner */
+static inline void loser_tree_adjust(int *tree, const unsigned long long *key, int num, int s) {
+    int t, tmp;
+    for (t = (s + num) / 2; t > 0; t /= 2) {
+        if (run_before(key, tree[t], s)) {tmp = s; s = tree[t]; tree[t] = tmp;}
+    }
+    tree[0] = s;
+}
+
+/* Refill the read buffer of a run and return the key of its next record */
+unsigned long long run_refill(MERGE_RUN *run) {
+    long long want = run->end - run->next;
+    if (want > run->n) want = run->n;
+    run->pos = 0;
+    if (want <= 0) return KEY_END;
+    run->n = fread(run->buf, sizeof(CREC), want, run->fid);
+    run->next += run->n;
+    if (run->n == 0) {run->end = run->next; return KEY_END;}
+    return crec_key(&run->buf[0]);
+}
+
+/* Merge this job's key range of all runs, accumulating duplicates. Range 0 writes to the final output, the others
+ * to a raw temporary file that merge_files appends in order */
+void *merge_thread(void *arg) {
+    MERGE_JOB *job = (MERGE_JOB *)arg;
+    int i, w, num = job->num;
+    char filename[200];
+    MERGE_RUN *runs = calloc(num, sizeof(MERGE_RUN));
+    unsigned long long *key = malloc(sizeof(unsigned long long) * (num + 1)), k, old_key = KEY_END;
+    int *tree = calloc(num + 1, sizeof(int));
+    CREC *out = malloc(sizeof(CREC) * MERGE_OUT_RECORDS), old;
+    CREC_WRITER part, *fout = job->fout;
+    FILE *fpart = NULL;
+    long long n = 0;
+    
+    job->lines = 0;
+    job->result = 1;
+    if (runs == NULL || key == NULL || tree == NULL || out == NULL) goto done;
+    if (fout == NULL) {
+        sprintf(filename,"%s_merge_%04d.bin",file_head,job->id);
+        if ((fpart = fopen(filename,"wb")) == NULL) goto done;
+        crec_writer_open(&part, fpart, CREC_FORMAT_RAW, 0);
+        fout = &part;
+    }
+    for (i = 0; i < num; i++) {
+        sprintf(filename,"%s_%04d.bin",file_head,i);
+        if ((runs[i].fid = fopen(filename,"rb")) == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); goto done;}
+        if ((runs[i].buf = malloc(sizeof(CREC) * job->buffer_records)) == NULL) goto done;
+        fseeko(runs[i].fid, job->start[i] * sizeof(CREC), SEEK_SET);
+        runs[i].n = job->buffer_records;
+        runs[i].next = job->start[i];
+        runs[i].end = job->end[i];
+        key[i] = run_refill(&runs[i]);
+    }
+    
+    /* Build the tree by replaying every leaf against a virtual leaf num that precedes all real keys */
+    key[num] = 0;
+    for (i = 0; i <= num; i++) tree[i] = num;
+    for (i = num - 1; i >= 0; i--) loser_tree_adjust(tree, key, num, i);
+    key[num] = KEY_END; // only left in the tree if there are no runs at all
+    
+    /* Take the winner, merge it into old or emit old, advance its run and replay its path */
+    while ((k = key[w = tree[0]]) != KEY_END) {
+        if (k == old_key) old.val += runs[w].buf[runs[w].pos].val;
         else {
-            // 如果j不是最后一个词，需要跟左右子节点都比较
-            // 如果j<j+1，左边的节点比较小
-            if (compare_crecid(pq[j], pq[j+1]) < 0) {
-                // 如果p>j，交换
-                if (compare_crecid(pq[p],pq[j]) > 0) {swap_entry(pq,p,j); p = j;}
-                // 否则p<j,j+1，那么满足小顶堆条件，直接返回
-                else return;
-            }
-            else {
-                // 如果j>j+1，右边的节点比较小
-                // 如果p>j+1，交换
-                if (compare_crecid(pq[p],pq[j+1]) > 0) {swap_entry(pq,p,j+1); p = j + 1;}
-                // 否则p<j,j+1，那么满足小顶堆条件，直接返回
-                else return;
+            if (old_key != KEY_END) {
+                out[n++] = old;
+                if (n == MERGE_OUT_RECORDS) {
+                    if (crec_write_many(fout, out, n) != 0) goto done;
+                    job->lines += n;
+                    n = 0;
+                    if (job->id == 0 && verbose > 1) fprintf(stderr,"\033[39G%lld lines.",job->lines);
+                    if (job->id == 0 && metrics_due(&metrics_last)) metrics_emit("merge", metrics_last - metrics_phase, "\"progress\":1,\"records\":%lld", job->lines);
+                }
             }
+            old = runs[w].buf[runs[w].pos];
+            old_key = k;
         }
+        if (++runs[w].pos < runs[w].n) key[w] = crec_key(&runs[w].buf[runs[w].pos]);
+        else key[w] = run_refill(&runs[w]);
+        loser_tree_adjust(tree, key, num, w);
+    }
+    if (old_key != KEY_END) out[n++] = old;
+    if (crec_write_many(fout, out, n) != 0) goto done;
+    job->lines += n;
+    job->result = 0;
+    
+done:
+    if (fpart != NULL && (crec_writer_close(&part) != 0 || fclose(fpart) != 0)) job->result = 1;
+    if (runs != NULL) for (i = 0; i < num; i++) {
+        if (runs[i].fid != NULL) fclose(runs[i].fid);
+        free(runs[i].buf);
     }
+    free(runs);
+    free(key);
+    free(tree);
+    free(out);
+    return NULL;
 }
 
-/* Write top node of priority queue to file, accumulating duplicate entries */
-// merge或者write，判断new和old是不是同一个词对的记录，如果是的话相加，不是就把old写入文件
-int merge_write(CRECID new, CRECID *old, FILE *fout) {
-    // 如果new和old是同一个词对
-    if (new.word1 == old->word1 && new.word2 == old->word2) {
-        // 把new的词频加入old
-        old->val += new.val;
-        // 返回0，用于统计实际写入的词对数
-        return 0; // Indicates duplicate entry
+/* Index of the first record of a sorted raw run with key >= k, by binary search over the file */
+long long run_lower_bound(FILE *fid, long long length, unsigned long long k) {
+    long long lo = 0, hi = length, mid;
+    CREC cr;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        fseeko(fid, mid * sizeof(CREC), SEEK_SET);
+        if (fread(&cr, sizeof(CREC), 1, fid) != 1) return mid;
+        if (crec_key(&cr) < k) lo = mid + 1;
+        else hi = mid;
     }
-    // 如果old和new不同，实际写入文件
-    fwrite(old, sizeof(CREC), 1, fout);
-    // 用new顶替已经写入的old
-    *old = new;
-    return 1; // Actually wrote to file
+    return lo;
+}
+
+int compare_key(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
 }
 
 /* Merge [num] sorted files of cooccurrence records */
 // 把num个文件合并，每个文件都按照w1 w2的方式排序
+// 多线程时先从各文件中按记录数等间隔地抽样，用样本的分位数作为各线程键空间的分界，再二分查找每个分界在各文件中的位置
 int merge_files(int num) {
-    int i, size;
-    long long counter = 0;
-    CRECID *pq, new, old;
+    int i, t, num_jobs = (num_threads > 1 && num > 0) ? num_threads : 1, result = 0;
+    long long counter = 0, total = 0, step, j, s, *length, *bounds, num_samples = 0;
+    unsigned long long *samples = NULL, *split;
     char filename[200];
-    FILE **fid, *fout;
-    // 用于打开num个文件
-    fid = malloc(sizeof(FILE) * num);
-    // 维持一个大小为num的优先队列
-    pq = malloc(sizeof(CRECID) * num);
+    FILE **fid;
+    CREC_WRITER writer, *fout = &writer;
+    CREC cr, *copy;
+    MERGE_JOB *jobs;
+    pthread_t *pt;
+    
+    fid = calloc(num + 1, sizeof(FILE *));
+    length = malloc(sizeof(long long) * (num + 1));
+    bounds = malloc(sizeof(long long) * (num + 1) * (num_jobs + 1)); // bounds[t * num + i]: start of range t in file i
+    split = malloc(sizeof(unsigned long long) * (num_jobs + 1));
+    jobs = calloc(num_jobs, sizeof(MERGE_JOB));
+    pt = malloc(sizeof(pthread_t) * num_jobs);
+    metrics_phase = metrics_last = metrics_now();
     // 输出到标准输出
-    fout = stdout;
+    if (crec_writer_open(fout, stdout, output_format, compress_level) != 0) {fprintf(stderr, "Unable to write output.\n"); return 1;}
     if (verbose > 1) fprintf(stderr, "Merging cooccurrence files: processed 0 lines.");
     
-    /* Open all files and add first entry of each to priority queue */
-    // 打开num个文件，每个文件读取第一条记录并存入对应的优先队列中
     for (i = 0; i < num; i++) {
-        // 打开文件
         sprintf(filename,"%s_%04d.bin",file_head,i);
-        fid[i] = fopen(filename,"rb");
-        if (fid[i] == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
-        // 读取第一条记录
-        fread(&new, sizeof(CREC), 1, fid[i]);
-        new.id = i;
-        // 把记录插入优先队列的i+1位置
-        insert(pq,new,i+1);
-    }
-    
-    /* Pop top node, save it in old to see if the next entry is a duplicate */
-    // 取出优先队列的头部节点存到old，然后删除这个节点并插入新节点
-    // size用来记录当前打开的文件的数目
-    size = num;
-    old = pq[0];
-    i = pq[0].id;
-    // 删除节点
-    delete(pq, size);
-    // 读取下一个词
-    fread(&new, sizeof(CREC), 1, fid[i]);
-    // 如果文件读取完毕，就把size减1
-    if (feof(fid[i])) size--;
+        if ((fid[i] = fopen(filename,"rb")) == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
+        fseeko(fid[i], 0, SEEK_END);
+        length[i] = ftello(fid[i]) / sizeof(CREC);
+        total += length[i];
+    }
+    
+    /* Split the key space at quantiles of an evenly spaced sample of all runs */
+    split[0] = 0;
+    split[num_jobs] = KEY_END;
+    if (num_jobs > 1) {
+        step = total / (MERGE_SAMPLES_PER_THREAD * num_jobs) + 1;
+        samples = malloc(sizeof(unsigned long long) * (total / step + num + 1));
+        for (i = 0; i < num; i++) for (j = 0; j < length[i]; j += step) {
+            fseeko(fid[i], j * sizeof(CREC), SEEK_SET);
+            if (fread(&cr, sizeof(CREC), 1, fid[i]) == 1) samples[num_samples++] = crec_key(&cr);
+        }
+        qsort(samples, num_samples, sizeof(unsigned long long), compare_key);
+        for (t = 1; t < num_jobs; t++) split[t] = num_samples > 0 ? samples[num_samples * t / num_jobs] : KEY_END;
+        free(samples);
+    }
+    for (i = 0; i < num; i++) {
+        bounds[i] = 0;
+        bounds[num_jobs * num + i] = length[i];
+        for (t = 1; t < num_jobs; t++) bounds[t * num + i] = run_lower_bound(fid[i], length[i], split[t]);
+        fclose(fid[i]);
+    }
+    
+    /* Read buffers share the memory the overflow buffers used */
+    s = overflow_length / ((long long)num_jobs * (num > 0 ? num : 1));
+    if (s > 65536) s = 65536;
+    if (s < 256) s = 256;
+    for (t = 0; t < num_jobs; t++) {
+        jobs[t].id = t;
+        jobs[t].num = num;
+        jobs[t].start = &bounds[t * num];
+        jobs[t].end = &bounds[(t + 1) * num];
+        jobs[t].buffer_records = s;
+        jobs[t].fout = (t == 0) ? fout : NULL;
+    }
+    if (num_jobs == 1) merge_thread(&jobs[0]);
     else {
-        // 否则插入新读入的词
-        new.id = i;
-        insert(pq, new, size);
-    }
-    
-    /* Repeatedly pop top node and fill priority queue until files have reached EOF */
-    // 反复地从优先队列中读取一个词，写入文件或跟前一条记录合并，并新读取一个词插入优先队列，直到所有文件到底
-    while (size > 0) {
-        // 把两条相同记录合并，或向文件中写入一条记录
-        // counter记录所有写入文件的记录的数目
-        counter += merge_write(pq[0], &old, fout); // Only count the lines written to file, not duplicates
-        if ((counter%100000) == 0) if (verbose > 1) fprintf(stderr,"\033[39G%lld lines.",counter);
-        // i是队首词的文件的下标
-        i = pq[0].id;
-        // 删除队首词
-        delete(pq, size);
-        // 从第i个文件中读取下一个词
-        fread(&new, sizeof(CREC), 1, fid[i]);
-        // 如果文件读取完毕，就把size减1
-        if (feof(fid[i])) size--;
-        else {
-            // 否则插入新读入的词
-            new.id = i;
-            insert(pq, new, size);
+        for (t = 0; t < num_jobs; t++) pthread_create(&pt[t], NULL, merge_thread, (void *)&jobs[t]);
+        for (t = 0; t < num_jobs; t++) pthread_join(pt[t], NULL);
+    }
+    
+    /* Append the other ranges to the output in key order */
+    copy = malloc(sizeof(CREC) * MERGE_OUT_RECORDS);
+    for (t = 0; t < num_jobs; t++) {
+        if (jobs[t].result != 0) result = 1;
+        counter += jobs[t].lines;
+        if (t == 0) continue;
+        sprintf(filename,"%s_merge_%04d.bin",file_head,t);
+        if (result == 0) {
+            FILE *fpart = fopen(filename,"rb");
+            if (fpart == NULL) result = 1;
+            else {
+                while ((j = fread(copy, sizeof(CREC), MERGE_OUT_RECORDS, fpart)) > 0) if (crec_write_many(fout, copy, j) != 0) {result = 1; break;}
+                fclose(fpart);
+            }
         }
+        remove(filename);
     }
-    // 把最后一个old写入文件
-    fwrite(&old, sizeof(CREC), 1, fout);
-    fprintf(stderr,"\033[0GMerging cooccurrence files: processed %lld lines.\n",++counter);
+    free(copy);
+    if (crec_writer_close(fout) != 0 || fflush(stdout) != 0) result = 1;
+    if (result != 0) {fprintf(stderr, "\nUnable to write output.\n"); return 1;}
+    fprintf(stderr,"\033[0GMerging cooccurrence files: processed %lld lines.\n",counter);
+    metrics_emit("merge", metrics_now() - metrics_phase, "\"runs\":%d,\"threads\":%d,\"records_read\":%lld,\"bytes_read\":%lld,\"records\":%lld,\"bytes_written\":%lld,\"records_per_sec\":%.0f",
+        num, num_jobs, total, total * (long long)sizeof(CREC), counter, fout->bytes, counter / (metrics_now() - metrics_phase + 1e-9));
     // 删除所有的overflow文件
     for (i=0;i<num;i++) {
         sprintf(filename,"%s_%04d.bin",file_head,i);
         remove(filename);
     }
     fprintf(stderr,"\n");
+    free(fid);
+    free(length);
+    free(bounds);
+    free(split);
+    free(jobs);
+    free(pt);
+    return 0;
+}
+
+/***
+ *  -sparse-table：w1*w2 < max_product的区域里，排名靠后的词的那些行大部分是0，稠密数组在这些行上浪费内存，写出时也要白白扫描
+ *  根据词表中的词频估计每一行非零的比例，从第一个比例低于SPARSE_DENSITY的行开始，改用开放寻址的哈希表存储
+ *  哈希表的表项就是CREC（word1 == 0表示空位），写出时把非空表项移到前面、排序后直接写入文件
+ */
+
+#define SPARSE_DENSITY 0.25     // a hashed cell costs about 4 dense cells (16 bytes at up to 3/4 load)
+#define SPARSE_ROW_SAMPLES 1024
+
+typedef struct cell_hash {
+    CREC *slots;
+    long long capacity, size;   // capacity is a power of 2
+} CELL_HASH;
+
+static inline long long cell_slot(const CELL_HASH *h, unsigned long long key) {
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    return key & (h->capacity - 1);
+}
+
+CELL_HASH *cell_hash_create(long long capacity) {
+    CELL_HASH *h = malloc(sizeof(CELL_HASH));
+    long long c = 1024;
+    while (c < capacity + capacity / 3) c *= 2;
+    if (h == NULL || (h->slots = calloc(c, sizeof(CREC))) == NULL) {free(h); return NULL;}
+    h->capacity = c;
+    h->size = 0;
+    return h;
+}
+
+int cell_hash_grow(CELL_HASH *h) {
+    CREC *old = h->slots;
+    long long a, i, capacity = h->capacity;
+    if ((h->slots = calloc(capacity * 2, sizeof(CREC))) == NULL) {h->slots = old; return 1;}
+    h->capacity = capacity * 2;
+    for (a = 0; a < capacity; a++) {
+        if (old[a].word1 == 0) continue;
+        for (i = cell_slot(h, crec_key(&old[a])); h->slots[i].word1 != 0; i = (i + 1) & (h->capacity - 1));
+        h->slots[i] = old[a];
+    }
+    free(old);
+    return 0;
+}
+
+/* Add val to cell (w1, w2); returns nonzero if the table could not grow */
+static inline int cell_hash_add(CELL_HASH *h, int w1, int w2, real val) {
+    CREC cr = {w1, w2, val};
+    unsigned long long key = crec_key(&cr);
+    long long i;
+    for (i = cell_slot(h, key); h->slots[i].word1 != 0; i = (i + 1) & (h->capacity - 1)) {
+        if (crec_key(&h->slots[i]) == key) {h->slots[i].val += val; return 0;}
+    }
+    h->slots[i] = cr;
+    if (++h->size * 4 >= h->capacity * 3) return cell_hash_grow(h);
+    return 0;
+}
+
+void cell_hash_free(CELL_HASH *h) {
+    if (h == NULL) return;
+    free(h->slots);
+    free(h);
+}
+
+/* Write the hashed cells to fout in (word1, word2) order; this compacts the slots, so the table can only be freed after */
+int write_cell_hash(CELL_HASH *h, FILE *fout) {
+    long long a, n = 0;
+    for (a = 0; a < h->capacity; a++) if (h->slots[a].word1 != 0) h->slots[n++] = h->slots[a];
+    crec_sort(h->slots, n);
+    return (n == 0 || fwrite(h->slots, sizeof(CREC), n, fout) == (size_t)n) ? 0 : 1;
+}
+
+/* Add val to cell (w1, w2) of the w1*w2 < max_product region: in bigram_table for the first dense_rows rows, else in
+ * the hash of the sparse rows */
+static inline int add_bigram(real *bigram_table, long long *lookup, CELL_HASH *sparse, long long w1, long long w2, real val) {
+    if (w1 <= dense_rows) {bigram_table[lookup[w1-1] + w2 - 2] += val; return 0;}
+    return cell_hash_add(sparse, w1, w2, val);
+}
+
+/* Estimated fraction of nonzero cells in row x, assuming words cooccur independently so that cell (x, y) is hit
+ * Poisson(count[x] * count[y] * scale) times. Real text is burstier, so this overestimates the density */
+double row_density(const long long *count, long long x, long long row_length, double scale) {
+    long long a, y, samples = row_length < SPARSE_ROW_SAMPLES ? row_length : SPARSE_ROW_SAMPLES;
+    double sum = 0;
+    for (a = 0; a < samples; a++) {
+        y = 1 + a * row_length / samples;
+        sum += 1 - exp(-(double)count[x] * count[y] * scale);
+    }
+    return samples > 0 ? sum / samples : 0;
+}
+
+/* Read the counts of the vocab file: count[r] for rank r in 1..vocab_size, with *total their sum; ranks past the end
+ * of the file count 0. A vocab_size of 0 takes every line, and sets vocab_size to their number. Returns NULL on error */
+long long *read_vocab_counts(long long *vocab_size, long long *total) {
+    long long x, *count;
+    VOCAB_MAP vocab;
+    
+    if (vocab_map_load(&vocab, vocab_file, vocab_index_file) != 0) {fprintf(stderr, "Unable to read counts from vocab file %s.\n", vocab_file); return NULL;}
+    if (*vocab_size == 0) *vocab_size = vocab.size;
+    if ((count = malloc(sizeof(long long) * (*vocab_size + 1))) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); vocab_map_free(&vocab); return NULL;}
+    *total = 0;
+    for (x = 1; x <= *vocab_size; x++) *total += (count[x] = x <= vocab.size ? vocab.counts[x - 1] : 0);
+    vocab_map_free(&vocab);
+    return count;
+}
+
+/* Set dense_rows and sparse_estimate (expected hashed cells per table) from the counts in the vocab file */
+int choose_dense_rows(long long vocab_size, long long *lookup) {
+    long long x, lo, hi, step, total, *count = read_vocab_counts(&vocab_size, &total);
+    double scale, cells = 0;
+    
+    if (count == NULL) return 1;
+    // 每个词的左边（对称时还有右边）有window_size个上下文词；多线程时每个线程只看到1/num_threads的语料
+    scale = (double)window_size * (symmetric > 0 ? 2 : 1) / ((double)(total > 0 ? total : 1) * num_threads);
+    
+    /* Binary search for the first row below SPARSE_DENSITY; density falls as the row word gets rarer */
+    lo = 1;
+    hi = vocab_size + 1;
+    while (lo < hi) {
+        x = lo + (hi - lo) / 2;
+        if (row_density(count, x, lookup[x] - lookup[x-1], scale) < SPARSE_DENSITY) hi = x;
+        else lo = x + 1;
+    }
+    dense_rows = lo - 1;
+    step = (vocab_size - dense_rows) / SPARSE_ROW_SAMPLES + 1;
+    for (x = dense_rows + 1; x <= vocab_size; x += step) cells += row_density(count, x, lookup[x] - lookup[x-1], scale) * (lookup[x] - lookup[x-1]) * step;
+    sparse_estimate = (long long)cells;
+    if (verbose > 1) fprintf(stderr, "dense rows: %lld of %lld (%lld of %lld elements), about %lld hashed elements.\n",
+                             dense_rows, vocab_size, lookup[dense_rows] - 1, lookup[vocab_size] - 1, sparse_estimate);
+    free(count);
+    return 0;
+}
+
+/***
+ *  -memory auto：max_product和overflow_length不再由固定的公式算出，而是按词表里的词频来估计
+ *  假设两个词独立地共现，一次共现落在w1*w2 >= max_product区域（要进overflow缓冲区）的概率是
+ *  sum_w1 p(w1) * sum_{w2 > max_product/w1} p(w2)；稠密数组占lookup[vocab_size]个元素，剩下的内存都给overflow缓冲区
+ *  在一串几何增长的max_product中选估计的代价最小的：稠密数组每个元素（清零、写出时扫描）算1，
+ *  每条溢出的记录（排序、写临时文件、归并）算AUTO_SPILL_COST * (1 + log2(临时文件数))，临时文件越多归并越慢
+ *  所以内存大时临时文件少，稠密数组也不会大到扫描它比排序溢出的记录还慢
+ */
+
+#define AUTO_PRODUCT_STEP 1.2       // ratio of successive max_product candidates
+#define AUTO_MIN_OVERFLOW 0.05      // share of the budget always left to the overflow buffer
+#define AUTO_SPILL_COST 4.0         // cost of an overflow record relative to a dense cell
+
+/* Choose max_product and overflow_length for memory_limit from the frequency curve in the vocab file */
+int auto_tune_memory() {
+    long long vocab_size = 0, total, a, len, cells, best_product = 0, *count = read_vocab_counts(&vocab_size, &total);
+    double p, spill_share, dense_bytes, records, spilled, files, cost, best_cost = -1, best_files = 0, best_length = 0, *tail;
+    double budget = (double)memory_limit / num_threads * 1073741824; // each thread has its own arrays
+    // 每个线程看到的共现次数：每个词和左边（对称时还有右边）window_size个词各共现一次
+    double events = (double)total / num_threads * window_size * (symmetric > 0 ? 2 : 1);
+    
+    if (count == NULL) return 1;
+    if (vocab_size == 0 || total == 0) {fprintf(stderr, "Vocab file %s has no counts.\n", vocab_file); free(count); return 1;}
+    tail = malloc(sizeof(double) * (vocab_size + 2)); // tail[r]: share of the tokens with rank r or rarer
+    tail[vocab_size + 1] = 0;
+    for (a = vocab_size; a >= 1; a--) tail[a] = tail[a + 1] + (double)count[a] / total;
+    for (p = vocab_size; p <= (double)vocab_size * vocab_size * AUTO_PRODUCT_STEP; p *= AUTO_PRODUCT_STEP) {
+        for (a = 1, cells = 0, spill_share = 0; a <= vocab_size; a++) {
+            len = (long long)p / a < vocab_size ? (long long)p / a : vocab_size; // row a of the dense array, as in the lookup table
+            cells += len;
+            spill_share += (double)count[a] / total * tail[len + 1];
+        }
+        dense_bytes = cells * sizeof(real) + (vocab_size + 1) * sizeof(long long);
+        if (dense_bytes > (1 - AUTO_MIN_OVERFLOW) * budget) break; // larger products only leave less for the overflow buffer
+        records = (budget - dense_bytes) / sizeof(CREC) - 2 * window_size;
+        spilled = events * spill_share;
+        files = ceil(spilled / records);
+        cost = cells + AUTO_SPILL_COST * spilled * (1 + log2(files > 1 ? files : 1));
+        if (best_cost < 0 || cost < best_cost) {
+            best_cost = cost;
+            best_files = files;
+            best_product = (long long)p;
+            best_length = records;
+        }
+    }
+    free(tail);
+    free(count);
+    if (best_cost < 0) {
+        fprintf(stderr, "-memory %.3f GB is too little for a dense array over %lld words; give more memory or -max-product.\n", (double)memory_limit, vocab_size);
+        return 1;
+    }
+    max_product = best_product;
+    overflow_length = (long long)best_length;
+    if (verbose > 1) fprintf(stderr, "auto memory: %.2f GB for %d thread(s), about %.0f overflow file(s) per thread expected\n", (double)memory_limit, num_threads, best_files);
+    return 0;
+}
+
+/* Write out full bigram_table, skipping zeros, followed by the hashed sparse rows */
+// 把bigram_table中的全部的非0数据写入文件，按(word1, word2)排好序；稀疏的行在哈希表中，排序后接在后面
+// 记录先攒在缓冲区里成批写出
+int write_bigram_table(real *bigram_table, long long *lookup, CELL_HASH *sparse, long long vocab_size, FILE *fid, int show_progress) {
+    int x, y;
+    long long j = 1e6, n = 0;
+    real r;
+    CREC *out = malloc(sizeof(CREC) * MERGE_OUT_RECORDS);
+    if (out == NULL) return 1;
+    // 对1到dense_rows这些稠密的行进行遍历，x即word1
+    for (x = 1; x <= dense_rows; x++) {
+        if ( (long long) (0.75*log(vocab_size / x)) < j) {j = (long long) (0.75*log(vocab_size / x)); if (show_progress) fprintf(stderr,".");} // log's to make it look (sort of) pretty
+        // 对word1对应的全部的word2进行遍历
+        // 当x < max_product / vocab_size时，这个差值就是vocab_size
+        // 否则是 max_product / x
+        for (y = 1; y <= (lookup[x] - lookup[x-1]); y++) {
+            // 如果记录不为0，写入文件，这个写入格式跟之前的格式一样
+            if ((r = bigram_table[lookup[x-1] - 2 + y]) != 0) {
+                out[n].word1 = x;
+                out[n].word2 = y;
+                out[n].val = r;
+                if (++n == MERGE_OUT_RECORDS) {
+                    if (fwrite(out, sizeof(CREC), n, fid) != (size_t)n) {free(out); return 1;}
+                    n = 0;
+                }
+            }
+        }
+    }
+    if (n > 0 && fwrite(out, sizeof(CREC), n, fid) != (size_t)n) {free(out); return 1;}
+    free(out);
+    return sparse != NULL ? write_cell_hash(sparse, fid) : 0;
+}
+
+// 多线程模式下各个线程共享的只读数据，以及分配临时文件编号用的计数器
+/* State shared by the cooccur threads: read-only vocab and lookup, plus the counter handing out temp file numbers */
+typedef struct cooccur_thread {
+    int id;
+    const char *start, *end; // Line aligned byte range of the corpus handled by this thread
+    long long tokens;
+    double seconds;          // time spent counting, for the per-thread rates in the metrics
+    int result;
+} CTHREAD;
+
+VOCAB_MAP *shared_vocab;
+long long shared_vocab_size, *shared_lookup;
+int next_file_id = 0;
+pthread_mutex_t file_id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 新建一个临时文件，文件编号在所有线程间递增，merge_files会把它们全部合并
+/* Open the next temporary file; numbers are unique across threads so merge_files can pick them all up */
+FILE *open_temp_file() {
+    char filename[200];
+    int id;
+    pthread_mutex_lock(&file_id_lock);
+    id = next_file_id++;
+    pthread_mutex_unlock(&file_id_lock);
+    sprintf(filename,"%s_%04d.bin",file_head,id);
+    return fopen(filename,"w");
+}
+
+// 排序并写出一个overflow缓冲区，作为一个有序的临时文件
+/* Sort an overflow buffer and write it out as one sorted run */
+int write_overflow_run(CREC *cr, long long length) {
+    FILE *fout;
+    double start = metrics_now(), sorted;
+    long long bytes;
+    if (length == 0) return 0;
+    if ((fout = open_temp_file()) == NULL) return 1;
+    crec_sort(cr, length);
+    sorted = metrics_now();
+    write_chunk(cr, length, fout);
+    bytes = ftello(fout);
+    fclose(fout);
+    pthread_mutex_lock(&metrics_lock);
+    sort_seconds += sorted - start;
+    spill_seconds += metrics_now() - sorted;
+    spill_runs++;
+    spill_records += length;
+    spill_bytes += bytes;
+    pthread_mutex_unlock(&metrics_lock);
+    return 0;
+}
+
+/* Add the time since start and the size of fid to the dump totals, after a dense table was written to fid */
+void count_dump(double start, FILE *fid) {
+    long long bytes = ftello(fid);
+    pthread_mutex_lock(&metrics_lock);
+    dump_seconds += metrics_now() - start;
+    dump_bytes += bytes;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/* Write the sort, spill and dump totals as one metrics line each, just before the merge */
+void report_spills() {
+    metrics_emit("sort", sort_seconds, "\"runs\":%lld,\"records\":%lld,\"background\":%d", spill_runs, spill_records, async_spill);
+    metrics_emit("spill", spill_seconds, "\"runs\":%lld,\"bytes_written\":%lld,\"mb_per_sec\":%.1f", spill_runs, spill_bytes, spill_bytes / 1048576.0 / (spill_seconds + 1e-9));
+    metrics_emit("dump", dump_seconds, "\"bytes_written\":%lld,\"mb_per_sec\":%.1f", dump_bytes, dump_bytes / 1048576.0 / (dump_seconds + 1e-9));
+}
+
+/***
+ *  overflow缓冲区的后台写出：统计线程填满一个缓冲区后交给写出线程去排序和写临时文件，自己接着填另一个缓冲区
+ *  这样读语料、统计和写磁盘可以同时进行。写出线程还没写完上一个缓冲区时，统计线程在spill_run中等待
+ *  async_spill == 0时只有一个缓冲区，在统计线程中直接写出
+ */
+
+typedef struct spill_writer {
+    CREC *buf[2];
+    int cur;                    // buffer being filled by the counting loop
+    CREC *pending;              // buffer handed to the writer thread, with pending_length records
+    long long pending_length;
+    int busy, stop, result;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} SPILL_WRITER;
+
+void *spill_thread(void *arg) {
+    SPILL_WRITER *s = (SPILL_WRITER *)arg;
+    int result;
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (!s->busy && !s->stop) pthread_cond_wait(&s->cond, &s->lock);
+        if (!s->busy) break;
+        pthread_mutex_unlock(&s->lock);
+        result = write_overflow_run(s->pending, s->pending_length);
+        pthread_mutex_lock(&s->lock);
+        if (result != 0) s->result = 1;
+        s->busy = 0;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* Allocate the overflow buffer(s) and start the writer thread; returns the first buffer to fill, NULL if out of memory */
+CREC *spill_open(SPILL_WRITER *s) {
+    int a, n = async_spill ? 2 : 1;
+    memset(s, 0, sizeof(SPILL_WRITER));
+    for (a = 0; a < n; a++) {
+        s->buf[a] = malloc(sizeof(CREC) * (overflow_length + 2 * window_size)); // Room for one full symmetric window past the flush threshold
+        if (s->buf[a] == NULL) {free(s->buf[0]); return NULL;}
+    }
+    if (async_spill) {
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        pthread_create(&s->thread, NULL, spill_thread, (void *)s);
+    }
+    return s->buf[0];
+}
+
+/* Hand a full buffer of length records to the writer and return the buffer to fill next (the same one when writing
+ * synchronously); returns NULL if writing a run failed */
+CREC *spill_run(SPILL_WRITER *s, CREC *cr, long long length) {
+    if (!async_spill) return write_overflow_run(cr, length) == 0 ? cr : NULL;
+    pthread_mutex_lock(&s->lock);
+    while (s->busy) pthread_cond_wait(&s->cond, &s->lock); // the other buffer is still being written
+    if (s->result == 0) {
+        s->pending = cr;
+        s->pending_length = length;
+        s->busy = 1;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (s->result != 0) return NULL;
+    s->cur ^= 1;
+    return s->buf[s->cur];
+}
+
+/* Write the last buffer, wait for the writer and free the buffers. Returns 0 if every run was written; with cr == NULL
+ * nothing more is written, which is how the error paths stop the writer */
+int spill_close(SPILL_WRITER *s, CREC *cr, long long length) {
+    int result = cr == NULL || spill_run(s, cr, length) == NULL;
+    if (async_spill) {
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+        if (s->result != 0) result = 1;
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->cond);
+    }
+    free(s->buf[0]);
+    free(s->buf[1]);
+    return result;
+}
+
+// 一个线程统计语料中[start, end)这一段，逻辑与get_cooccurrence中的单线程版本相同
+// 每个线程有自己的bigram_table和overflow缓冲区，最后都作为有序的临时文件写出
+/* Count cooccurrences in one line aligned byte range; same logic as the serial loop in get_cooccurrence, but each
+ * thread has its own bigram_table and overflow buffer, both written out as sorted runs for merge_files */
+void *cooccur_thread(void *arg) {
+    CTHREAD *t = (CTHREAD *)arg;
+    const char *token;
+    char str[MAX_STRING_LENGTH + 1];
+    int flag, spilling;
+    TOKEN_READER reader;
+    long long j = 0, k, ind = 0, w1, w2, length, *lookup = shared_lookup, vocab_size = shared_vocab_size;
+    long long *history = malloc(sizeof(long long) * window_size);
+    SPILL_WRITER spill;
+    CREC *cr = spill_open(&spill);
+    real *bigram_table = (real *)calloc( lookup[dense_rows] , sizeof(real) );
+    CELL_HASH *sparse = dense_rows < vocab_size ? cell_hash_create(sparse_estimate) : NULL;
+    FILE *fout = NULL;
+    double start;
+    
+    t->tokens = 0;
+    t->seconds = 0;
+    t->result = 1;
+    spilling = cr != NULL; // spill_open frees what it allocated when it fails, and starts no writer
+    if (history == NULL || cr == NULL || bigram_table == NULL || (dense_rows < vocab_size && sparse == NULL)) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        goto done;
+    }
+    reader_init_range(&reader, t->start, t->end, WORD_SEPARATORS, 1);
+    t->seconds = metrics_now();
+    while (1) {
+        if (ind >= overflow_length - window_size) { // If overflow buffer is (almost) full, sort it and write it to temporary file
+            if ((cr = spill_run(&spill, cr, ind)) == NULL) goto done;
+            ind = 0;
+        }
+        flag = next_token(&reader, &token, &length);
+        if (flag == TOKEN_END || flag == TOKEN_WORD_AT_END) break; // As in the serial loop, a word running into the end of the corpus is dropped
+        if (flag == TOKEN_NEWLINE) {j = 0; continue;} // Newline, reset line index (j)
+        if ((length = copy_word(str, token, length)) == 0) continue; // Token made only of carriage returns
+        t->tokens++;
+        if ((w2 = vocab_map_find(shared_vocab, str, length)) == 0) continue; // Skip out-of-vocabulary words; w2 is the target word (frequency rank)
+        for (k = j - 1; k >= ( (j > window_size) ? j - window_size : 0 ); k--) { // Iterate over all words to the left of target word, but not past beginning of line
+            w1 = history[k % window_size]; // Context word (frequency rank)
+            if ( w1 < max_product/w2 ) { // Product is small enough to store in a full array
+                if (add_bigram(bigram_table, lookup, sparse, w1, w2, 1.0/((real)(j-k))) != 0 // Weight by inverse of distance between words
+                    || (symmetric > 0 && add_bigram(bigram_table, lookup, sparse, w2, w1, 1.0/((real)(j-k))) != 0)) { // If symmetric context is used, exchange roles of w2 and w1 (ie look at right context too)
+                    fprintf(stderr, "Couldn't allocate memory!");
+                    goto done;
+                }
+            }
+            else { // Product is too big, data is likely to be sparse. Store these entries in a temporary buffer to be sorted, merged (accumulated), and written to file when it gets full.
+                cr[ind].word1 = w1;
+                cr[ind].word2 = w2;
+                cr[ind].val = 1.0/((real)(j-k));
+                ind++; // Keep track of how full temporary buffer is
+                if (symmetric > 0) { // Symmetric context
+                    cr[ind].word1 = w2;
+                    cr[ind].word2 = w1;
+                    cr[ind].val = 1.0/((real)(j-k));
+                    ind++;
+                }
+            }
+        }
+        history[j % window_size] = w2; // Target word is stored in circular buffer to become context word in the future
+        j++;
+    }
+    
+    t->seconds = metrics_now() - t->seconds;
+    
+    /* Write out the last overflow buffer and this thread's part of the dense table */
+    spilling = 0;
+    if (spill_close(&spill, cr, ind) != 0) goto done;
+    if ((fout = open_temp_file()) == NULL) goto done;
+    start = metrics_now();
+    if (write_bigram_table(bigram_table, lookup, sparse, vocab_size, fout, 0) != 0) goto done;
+    count_dump(start, fout);
+    t->result = 0;
+    
+    // 所有出口都经过这里：停掉写出线程，释放这个线程的全部缓冲区
+done:
+    if (spilling) spill_close(&spill, NULL, 0);
+    if (fout != NULL) fclose(fout);
+    free(history);
+    free(bigram_table);
+    cell_hash_free(sparse);
+    return NULL;
+}
+
+/***
+ *  增量更新：把之前输出的共现矩阵切成overflow缓冲区大小的片段，作为有序的临时文件和这次统计的结果一起合并
+ *  之前的矩阵可以是任何一种输出格式。-previous-vocab给出它当时的词表时，按词把旧的序号换成当前词表中的序号，
+ *  当前词表里没有的词的记录被丢掉；不给时认为两次的词表相同
+ */
+
+/* Read the words of the vocab file the previous matrix was built with and map each old rank to its rank in the
+ * current vocab, 0 for words that were dropped. Returns the map (indexed from 1) and sets *old_size */
+long long *load_previous_map(VOCAB_MAP *vocab, long long *old_size) {
+    long long n, dropped = 0, moved = 0, *map;
+    const char *word;
+    VOCAB_MAP old;
+    if (vocab_map_load(&old, previous_vocab_file, NULL) != 0 || (map = malloc(sizeof(long long) * (old.size + 1))) == NULL) {
+        fprintf(stderr, "Unable to open vocab file %s.\n", previous_vocab_file);
+        vocab_map_free(&old);
+        return NULL;
+    }
+    map[0] = 0;
+    for (n = 1; n <= old.size; n++) {
+        word = vocab_map_word(&old, n);
+        map[n] = vocab_map_find(vocab, word, strlen(word));
+        if (map[n] == 0) dropped++;
+        else if (map[n] != n) moved++;
+    }
+    *old_size = n = old.size;
+    vocab_map_free(&old);
+    if (verbose > 1) fprintf(stderr, "Previous vocab: %lld words, %lld with a new rank, %lld not in the current vocab.\n", n, moved, dropped);
+    return map;
+}
+
+/* Spill the previous cooccurrence matrix (-previous) as sorted runs, remapping its word ids. Returns 0 on success */
+int spill_previous(VOCAB_MAP *vocab) {
+    long long a, n, m, old_size = 0, records = 0, kept = 0, *map = NULL;
+    FILE *fin = fopen(previous_file, "rb");
+    CREC_READER reader;
+    CREC *cr = malloc(sizeof(CREC) * overflow_length);
+    
+    if (fin == NULL || cr == NULL || crec_reader_open(&reader, fin) != 0) {fprintf(stderr, "Unable to read previous cooccurrences %s.\n", previous_file); return 1;}
+    if (previous_vocab_file[0] != 0 && (map = load_previous_map(vocab, &old_size)) == NULL) return 1;
+    while ((n = crec_read(&reader, cr, overflow_length)) > 0) {
+        records += n;
+        if (map != NULL) {
+            for (a = m = 0; a < n; a++) {
+                if (cr[a].word1 > old_size || cr[a].word2 > old_size || map[cr[a].word1] == 0 || map[cr[a].word2] == 0) continue;
+                cr[m].word1 = map[cr[a].word1];
+                cr[m].word2 = map[cr[a].word2];
+                cr[m++].val = cr[a].val;
+            }
+            n = m;
+        }
+        kept += n;
+        if (write_overflow_run(cr, n) != 0) {fprintf(stderr, "Unable to write temporary files.\n"); return 1;}
+    }
+    crec_reader_close(&reader);
+    fclose(fin);
+    free(cr);
+    free(map);
+    if (n < 0) {fprintf(stderr, "Corrupt previous cooccurrences %s.\n", previous_file); return 1;}
+    if (verbose > 1) fprintf(stderr, "Added %lld of %lld previous records from \"%s\".\n", kept, records, previous_file);
+    return 0;
+}
+
+// 多线程统计共现：把标准输入的语料文件映射到内存，按行切分成num_threads段
+/* Multi-threaded counting: map the corpus on stdin and split it into num_threads line aligned ranges */
+int get_cooccurrence_parallel(VOCAB_MAP *vocab, long long vocab_size, long long *lookup) {
+    struct stat st;
+    const char *corpus;
+    long long a, counter = 0;
+    int result = 0;
+    double rate, min_rate = 0, max_rate = 0, max_seconds = 0, sum_seconds = 0;
+    pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    CTHREAD *threads = (CTHREAD *)malloc(num_threads * sizeof(CTHREAD));
+    
+    if (fstat(fileno(stdin), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "-threads > 1 needs the corpus on stdin to be a regular file (cooccur ... < corpus.txt).\n");
+        return 1;
+    }
+    corpus = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(stdin), 0) : NULL;
+    if (corpus == MAP_FAILED) {fprintf(stderr, "Unable to map corpus.\n"); return 1;}
+    if (corpus != NULL) madvise((void *)corpus, st.st_size, MADV_SEQUENTIAL);
+    shared_vocab = vocab;
+    shared_vocab_size = vocab_size;
+    shared_lookup = lookup;
+    
+    if (verbose > 1) fprintf(stderr, "Processing corpus with %d threads...", num_threads);
+    for (a = 0; a < num_threads; a++) {
+        // 每一段都从一行的开头开始
+        threads[a].id = a;
+        threads[a].start = corpus + range_start(corpus, st.st_size, a, num_threads, "\n"); // Start each range at the beginning of a line
+        if (a > 0) threads[a - 1].end = threads[a].start;
+    }
+    threads[num_threads - 1].end = corpus + st.st_size;
+    metrics_phase = metrics_now();
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, cooccur_thread, (void *)&threads[a]);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    for (a = 0; a < num_threads; a++) {
+        counter += threads[a].tokens;
+        if (threads[a].result != 0) result = 1;
+        // 各线程的速度，以及最慢的线程比平均多用的时间（负载不均衡）
+        rate = threads[a].tokens / (threads[a].seconds + 1e-9);
+        if (a == 0 || rate < min_rate) min_rate = rate;
+        if (a == 0 || rate > max_rate) max_rate = rate;
+        if (threads[a].seconds > max_seconds) max_seconds = threads[a].seconds;
+        sum_seconds += threads[a].seconds;
+    }
+    metrics_emit("tokenize", metrics_now() - metrics_phase, "\"tokens\":%lld,\"bytes_read\":%lld,\"threads\":%d,\"tokens_per_sec\":%.0f,\"mb_per_sec\":%.1f,\"thread_tokens_per_sec_min\":%.0f,\"thread_tokens_per_sec_max\":%.0f,\"imbalance\":%.3f",
+        counter, (long long)st.st_size, num_threads, counter / (metrics_now() - metrics_phase + 1e-9), st.st_size / 1048576.0 / (metrics_now() - metrics_phase + 1e-9),
+        min_rate, max_rate, sum_seconds > 0 ? max_seconds * num_threads / sum_seconds : 1.0);
+    if (verbose > 1) fprintf(stderr,"\033[0GProcessed %lld tokens.\n",counter);
+    if (verbose > 1) fprintf(stderr,"%d files in total.\n",next_file_id);
+    if (corpus != NULL) munmap((void *)corpus, st.st_size);
+    free(pt);
+    free(threads);
+    free(lookup);
+    if (result != 0) {fprintf(stderr, "Unable to write temporary files.\n"); return 1;}
+    if (previous_file[0] != 0 && spill_previous(vocab) != 0) return 1;
+    vocab_map_free(vocab);
+    free(vocab);
+    report_spills();
+    return merge_files(next_file_id); // Merge the sorted temporary files
+}
+
+/* Load the vocab, mapping each word to its frequency rank (its line number): map its index when that is up to date,
+ * else parse the vocab file and, with -vocab-index, save the index there for the next run. Returns 0 on success */
+// 读取词表，得到词到词频排名的哈希表；索引文件存在并且没有过期时直接mmap，否则解析词表文件，指定了-vocab-index时顺便写出索引
+int load_vocab(VOCAB_MAP *vocab) {
+    if (vocab_map_load(vocab, vocab_file, vocab_index_file) != 0) {fprintf(stderr,"Unable to open vocab file %s.\n",vocab_file); return 1;}
+    // 不应该存在同一个词出现两次的情况
+    if (vocab->duplicates > 0) fprintf(stderr, "Error, %lld duplicate entries located in %s.\n", vocab->duplicates, vocab_file);
+    if (verbose > 1) {
+        if (vocab->mapped) fprintf(stderr, "Mapped vocab index of \"%s\": %lld words.\n", vocab_file, vocab->size);
+        else fprintf(stderr, "Read vocab from file \"%s\": %lld words.\n", vocab_file, vocab->size);
+    }
+    if (!vocab->mapped && vocab_index_file[0] != 0) {
+        if (vocab_map_save(vocab, vocab_index_file) != 0) fprintf(stderr, "Unable to write vocab index %s.\n", vocab_index_file);
+        else if (verbose > 1) fprintf(stderr, "Saved vocab index to \"%s\".\n", vocab_index_file);
+    }
     return 0;
 }
 
 /* Collect word-word cooccurrence counts from input stream */
 // 从标准输入中构造词-词共现矩阵
 int get_cooccurrence() {
-    int flag, x, y, fidcounter = 1;
-    long long a, j = 0, k, id, counter = 0, ind = 0, vocab_size, w1, w2, *lookup, *history;
-    char format[20], filename[200], str[MAX_STRING_LENGTH + 1];
-    FILE *fid, *foverflow;
-    real *bigram_table, r;
-    HASHREC *htmp, **vocab_hash = inithashtable();
-    CREC *cr = malloc(sizeof(CREC) * (overflow_length + 1));
+    int flag;
+    long long a, j = 0, k, counter = 0, ind = 0, vocab_size, w1, w2, length, *lookup, *history;
+    char filename[200], str[MAX_STRING_LENGTH + 1];
+    const char *token;
+    FILE *fid;
+    TOKEN_READER reader;
+    real *bigram_table;
+    CELL_HASH *sparse;
+    VOCAB_MAP *vocab = malloc(sizeof(VOCAB_MAP));
+    SPILL_WRITER spill;
+    CREC *cr;
     history = malloc(sizeof(long long) * window_size);
     
     // 输出参数信息
@@ -418,20 +1035,11 @@ int get_cooccurrence() {
         else fprintf(stderr, "context: symmetric\n");
     }
     if (verbose > 1) fprintf(stderr, "max product: %lld\n", max_product);
-    if (verbose > 1) fprintf(stderr, "overflow length: %lld\n", overflow_length);
-    // 读取词表文件用的格式，设定了最长词的限制
-    sprintf(format,"%%%ds %%lld", MAX_STRING_LENGTH); // Format to read from vocab file, which has (irrelevant) frequency data
-    if (verbose > 1) fprintf(stderr, "Reading vocab from file \"%s\"...", vocab_file);
-    // 打开词表文件，失败就退出程序
-    fid = fopen(vocab_file,"r");
-    if (fid == NULL) {fprintf(stderr,"Unable to open vocab file %s.\n",vocab_file); return 1;}
-    // 读取每一个词和其词频，插入哈希表
-    while (fscanf(fid, format, str, &id) != EOF) hashinsert(vocab_hash, str, ++j); // Here id is not used: inserting vocab words into hash table with their frequency rank, j
-    fclose(fid);
+    if (verbose > 1) fprintf(stderr, "overflow length: %lld%s\n", overflow_length, async_spill ? " (x2, written in the background)" : "");
+    if (vocab == NULL || load_vocab(vocab) != 0) return 1;
     // 获得词表大小
-    vocab_size = j;
-    j = 0;
-    if (verbose > 1) fprintf(stderr, "loaded %lld words.\nBuilding lookup table...", vocab_size);
+    vocab_size = vocab->size;
+    if (verbose > 1) fprintf(stderr, "Building lookup table...");
     
     /* Build auxiliary lookup table used to index into bigram_table */
     // lookup数组用来做bigram_table的下标索引
@@ -451,60 +1059,63 @@ int get_cooccurrence() {
         else lookup[a] = lookup[a-1] + vocab_size;
     }
     if (verbose > 1) fprintf(stderr, "table contains %lld elements.\n",lookup[a-1]);
+    dense_rows = vocab_size;
+    if (sparse_table && choose_dense_rows(vocab_size, lookup) != 0) return 1;
+    // 多线程模式下每个线程有自己的bigram_table和overflow缓冲区
+    if (num_threads > 1) {
+        free(history);
+        return get_cooccurrence_parallel(vocab, vocab_size, lookup);
+    }
     
     /* Allocate memory for full array which will store all cooccurrence counts for words whose product of frequency ranks is less than max_product */
     // 开辟bigram_table的存储空间，用来存储所有w1*w2<max_product的部分的共现矩阵
-    bigram_table = (real *)calloc( lookup[a-1] , sizeof(real) );
-    if (bigram_table == NULL) {
+    bigram_table = (real *)calloc( lookup[dense_rows] , sizeof(real) );
+    sparse = dense_rows < vocab_size ? cell_hash_create(sparse_estimate) : NULL;
+    if (bigram_table == NULL || (dense_rows < vocab_size && sparse == NULL)) {
         fprintf(stderr, "Couldn't allocate memory!");
         return 1;
     }
     
-    fid = stdin;
-    sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-    // file_head是overflow-file参数输入的，默认为overflow
-    // fidcounter初始化为1
-    sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
-    // 打开文件
-    foverflow = fopen(filename,"w");
+    if (reader_init_file(&reader, stdin, WORD_SEPARATORS, 1) != 0 || (cr = spill_open(&spill)) == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    // overflow临时文件从1开始编号，0号文件留给bigram_table
+    next_file_id = 1;
     if (verbose > 1) fprintf(stderr,"Processing token: 0");
+    metrics_phase = metrics_last = metrics_now();
     
     /* For each token in input stream, calculate a weighted cooccurrence sum within window_size */
     // 对标准输入里的每一个token，计算窗口内的加权的共现和
     while (1) {
         // ind初始化为0，如果overflow记录数的buffer快满了，就先写入临时文件
         if (ind >= overflow_length - window_size) { // If overflow buffer is (almost) full, sort it and write it to temporary file
-            // cr是长度为overflow_length的CREC共现记录的数组
-            qsort(cr, ind, sizeof(CREC), compare_crec);
-            // 把这一组cr数组里的记录写入临时文件
-            write_chunk(cr,ind,foverflow);
-            // 关闭文件，每个文件都只写一次
-            fclose(foverflow);
-            // 文件数目计数器加1，打开下一个文件的句柄
-            fidcounter++;
-            sprintf(filename,"%s_%04d.bin",file_head,fidcounter);
-            foverflow = fopen(filename,"w");
+            // cr是长度为overflow_length的CREC共现记录的数组，排序后写入一个新的临时文件，每个文件都只写一次
+            // 后台写出时换到另一个缓冲区继续统计
+            if ((cr = spill_run(&spill, cr, ind)) == NULL) {fprintf(stderr, "Unable to write temporary files.\n"); return 1;}
             // 数组内偏移量归零
             ind = 0;
         }
         // 取一个词，正常取词
-        flag = get_word(str, fid);
-        // 如果读完了就退出循环
-        if (feof(fid)) break;
+        flag = next_token(&reader, &token, &length);
+        // 如果读完了就退出循环；和以前一样，文件末尾没有分隔符的最后一个词会被丢掉
+        if (flag == TOKEN_END || flag == TOKEN_WORD_AT_END) break;
         // 如果是新的一行，重置j，进入下一次循环
         // 此处读取的换行符是上一行的末尾的换行符，所以下一次循环会从新一行的首字母读起
         // j表示一个词在一行中的位置是第j个词，不包括不在词表中的词
-        if (flag == 1) {j = 0; continue;} // Newline, reset line index (j)
+        if (flag == TOKEN_NEWLINE) {j = 0; continue;} // Newline, reset line index (j)
+        // 只由回车符组成的词不算
+        if ((length = copy_word(str, token, length)) == 0) continue;
         // 统计输入的token的总数
         counter++;
         // 输出信息
-        if ((counter%100000) == 0) if (verbose > 1) fprintf(stderr,"\033[19G%lld",counter);
-        // 从哈希表中查找到这个词对应的哈希记录
-        htmp = hashsearch(vocab_hash, str);
-        // 如果不在哈希表中，进入下一轮循环
-        if (htmp == NULL) continue; // Skip out-of-vocabulary words
-        // 目标词的词频排名
-        w2 = htmp->id; // Target word (frequency rank)
+        if ((counter%100000) == 0) {
+            if (verbose > 1) fprintf(stderr,"\033[19G%lld",counter);
+            if (metrics_due(&metrics_last)) metrics_emit("tokenize", metrics_last - metrics_phase, "\"progress\":1,\"tokens\":%lld,\"bytes_read\":%lld,\"tokens_per_sec\":%.0f",
+                counter, reader.bytes, counter / (metrics_last - metrics_phase));
+        }
+        // 从哈希表中查找到这个词的词频排名，即目标词；如果不在词表中，进入下一轮循环
+        if ((w2 = vocab_map_find(vocab, str, length)) == 0) continue; // Skip out-of-vocabulary words; w2 is the target word (frequency rank)
         // 倒序从当前词j的左侧第一个词j-1开始，向左一个个遍历，直到遍历了window_size或者到达了句首
         for (k = j - 1; k >= ( (j > window_size) ? j - window_size : 0 ); k--) { // Iterate over all words to the left of target word, but not past beginning of line
             // history记录了各个之前读到的词的词频排名
@@ -516,9 +1127,13 @@ int get_cooccurrence() {
                 // lookup[w1-1] + w2 - 2相当于是一个矩阵下标(w1, w2)
                 // 具体lookup函数的使用方法可以写篇短文介绍一下
                 // 增量是加权的，权值是上下文词和当前词距离的反比
-                bigram_table[lookup[w1-1] + w2 - 2] += 1.0/((real)(j-k)); // Weight by inverse of distance between words
                 // 如果开启了对称性，则把w1和w2换过来也计算一下，相当于w1做当前词，w2做上下文词
-                if (symmetric > 0) bigram_table[lookup[w2-1] + w1 - 2] += 1.0/((real)(j-k)); // If symmetric context is used, exchange roles of w2 and w1 (ie look at right context too)
+                // -sparse-table时稀疏的行存在哈希表sparse中
+                if (add_bigram(bigram_table, lookup, sparse, w1, w2, 1.0/((real)(j-k))) != 0 // Weight by inverse of distance between words
+                    || (symmetric > 0 && add_bigram(bigram_table, lookup, sparse, w2, w1, 1.0/((real)(j-k))) != 0)) { // If symmetric context is used, exchange roles of w2 and w1 (ie look at right context too)
+                    fprintf(stderr, "Couldn't allocate memory!");
+                    return 1;
+                }
             }
             else { // Product is too big, data is likely to be sparse. Store these entries in a temporary buffer to be sorted, merged (accumulated), and written to file when it gets full.
                 // 如果w1 * w2太大，超过了max_product，概率上来说两个词共同出现的概率较小，很可能是非常稀疏的数据
@@ -549,8 +1164,9 @@ int get_cooccurrence() {
     /* Write out temp buffer for the final time (it may not be full) */
     // 最后一次存储cr数组中的记录，可能此时数组并不满
     if (verbose > 1) fprintf(stderr,"\033[0GProcessed %lld tokens.\n",counter);
-    qsort(cr, ind, sizeof(CREC), compare_crec);
-    write_chunk(cr,ind,foverflow);
+    metrics_emit("tokenize", metrics_now() - metrics_phase, "\"tokens\":%lld,\"bytes_read\":%lld,\"threads\":1,\"tokens_per_sec\":%.0f,\"mb_per_sec\":%.1f",
+        counter, reader.bytes, counter / (metrics_now() - metrics_phase + 1e-9), reader.bytes / 1048576.0 / (metrics_now() - metrics_phase + 1e-9));
+    if (spill_close(&spill, cr, ind) != 0) {fprintf(stderr, "Unable to write temporary files.\n"); return 1;}
     // bigram_table中的数据存入尾号0000的文件中
     sprintf(filename,"%s_0000.bin",file_head);
     
@@ -558,36 +1174,24 @@ int get_cooccurrence() {
     // 这一段代码是把bigram_table中的全部的非0数据存入文件中
     if (verbose > 1) fprintf(stderr, "Writing cooccurrences to disk");
     fid = fopen(filename,"w");
-    j = 1e6;
-    // 对1到vocab_size这全部的词进行遍历，x即word1
-    for (x = 1; x <= vocab_size; x++) {
-        if ( (long long) (0.75*log(vocab_size / x)) < j) {j = (long long) (0.75*log(vocab_size / x)); if (verbose > 1) fprintf(stderr,".");} // log's to make it look (sort of) pretty
-        // 对word1对应的全部的word2进行遍历
-        // 当x < max_product / vocab_size时，这个差值就是vocab_size
-        // 否则是 max_product / x
-        for (y = 1; y <= (lookup[x] - lookup[x-1]); y++) {
-            // 如果记录不为0，写入文件，这个写入格式跟之前的格式一样
-            if ((r = bigram_table[lookup[x-1] - 2 + y]) != 0) {
-                // word1
-                fwrite(&x, sizeof(int), 1, fid);
-                // word2
-                fwrite(&y, sizeof(int), 1, fid);
-                // val
-                fwrite(&r, sizeof(real), 1, fid);
-            }
-        }
-    }
+    metrics_phase = metrics_now();
+    if (write_bigram_table(bigram_table, lookup, sparse, vocab_size, fid, verbose > 1) != 0) {fprintf(stderr, "Unable to write temporary files.\n"); return 1;}
+    count_dump(metrics_phase, fid);
     
     // 关闭文件，释放各个存储空间
-    if (verbose > 1) fprintf(stderr,"%d files in total.\n",fidcounter + 1);
+    if (verbose > 1) fprintf(stderr,"%d files in total.\n",next_file_id);
     fclose(fid);
-    fclose(foverflow);
-    free(cr);
+    reader_free(&reader);
     free(lookup);
     free(bigram_table);
-    free(vocab_hash);
+    cell_hash_free(sparse);
+    // 增量更新时把之前的共现矩阵也加进来
+    if (previous_file[0] != 0 && spill_previous(vocab) != 0) return 1;
+    vocab_map_free(vocab);
+    free(vocab);
+    report_spills();
     // 把全部的临时文件合并
-    return merge_files(fidcounter + 1); // Merge the sorted temporary files
+    return merge_files(next_file_id); // Merge the sorted temporary files
 }
 
 // 查找某个命令行参数
@@ -611,6 +1215,9 @@ int main(int argc, char **argv) {
     real rlimit, n = 1e5;
     vocab_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
     file_head = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    vocab_index_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    previous_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    previous_vocab_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
     
     if (argc == 1) {
         printf("Tool to calculate word-word cooccurrence statistics\n");
@@ -624,14 +1231,44 @@ int main(int argc, char **argv) {
         printf("\t\tNumber of context words to the left (and to the right, if symmetric = 1); default 15\n");
         printf("\t-vocab-file <file>\n");
         printf("\t\tFile containing vocabulary (truncated unigram counts, produced by 'vocab_count'); default vocab.txt\n");
+        printf("\t-vocab-index <file>\n");
+        printf("\t\tBinary index of the vocabulary (as written by vocab_count -vocab-index), mapped instead of parsing the vocab file\n");
+        printf("\t\twhen it is up to date (same size, not older than the vocab file); otherwise rebuilt and written. Default:\n");
+        printf("\t\t<vocab file>%s if it is up to date, which is never written\n", VOCAB_INDEX_SUFFIX);
+        printf("\t-previous <file>\n");
+        printf("\t\tIncremental update: cooccurrence output of an earlier run (any -format) to add to the counts of the corpus on stdin,\n");
+        printf("\t\te.g. to fold in newly appended text without recounting the old text. Default: none\n");
+        printf("\t-previous-vocab <file>\n");
+        printf("\t\tVocab file the -previous matrix was built with. Its word ids are remapped to the ranks in -vocab-file, which should\n");
+        printf("\t\thold the counts of old and new text together; pairs with a word no longer in the vocab are dropped. Default: same vocab\n");
         printf("\t-memory <float>\n");
         printf("\t\tSoft limit for memory consumption, in GB -- based on simple heuristic, so not extremely accurate; default 4.0\n");
+        printf("\t\tauto: use %.0f%% of the memory available to this process (free RAM, within any cgroup limit), and pick -max-product\n", 100 * AUTO_MEMORY_FRACTION);
+        printf("\t\tand -overflow-length from the word counts in the vocab file so that few overflow files are written\n");
         printf("\t-max-product <int>\n");
         printf("\t\tLimit the size of dense cooccurrence array by specifying the max product <int> of the frequency counts of the two cooccurring words.\n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n");
         printf("\t-overflow-length <int>\n");
         printf("\t\tLimit to length <int> the sparse overflow array, which buffers cooccurrence data that does not fit in the dense array, before writing to disk. \n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n");
+        printf("\t-sparse-table <int>\n");
+        printf("\t\tIf <int> = 1, estimate from the counts in the vocab file which rows of the dense array are mostly zero, and store\n");
+        printf("\t\tthose rows in a hash table instead; saves memory on corpora where the dense region is sparse. Default 0 (off)\n");
+        printf("\t-async-spill <int>\n");
+        printf("\t\tIf <int> = 1, split the overflow length between two buffers: while a full one is sorted and written by a background\n");
+        printf("\t\tthread, counting continues in the other. If <int> = 0, use one buffer and stop counting to write it. Default: 1 if there\n");
+        printf("\t\tare more CPU cores than -threads, else 0\n");
         printf("\t-overflow-file <file>\n");
         printf("\t\tFilename, excluding extension, for temporary files; default overflow\n");
+        printf("\t-format <string>\n");
+        printf("\t\tOutput format: raw (default; 16-byte records), compact (blocks of delta/varint coded word ids with double values)\n");
+        printf("\t\tor compact32 (as compact, values stored as float). shuffle and glove read all three.\n");
+        printf("\t-compress <int>\n");
+        printf("\t\tzstd level for compact blocks; default 0 (off). Needs a build with 'make COMPRESS_FLAGS=\"-DUSE_ZSTD -lzstd\"'\n");
+        printf("\t-threads <int>\n");
+        printf("\t\tNumber of threads; default 1. With more than 1 the corpus on stdin must be a regular file; it is split into line aligned ranges\n");
+        printf("\t\tand each thread gets its own dense array and overflow buffer, sized from -memory divided by <int>.\n");
+        printf("\t-metrics <file>\n");
+        printf("\t\tAppend one JSON line per phase (tokenize, sort, spill, dump, merge) to <file>, or to stderr for -: time, tokens/sec, bytes read\n");
+        printf("\t\tand written, peak RSS, and with -threads the per-thread rates and load imbalance. Long phases also report progress every %.0f seconds.\n", METRICS_INTERVAL);
 
         printf("\nExample usage:\n");
         printf("./cooccur -verbose 2 -symmetric 0 -window-size 10 -vocab-file vocab.txt -memory 8.0 -overflow-file tempoverflow < corpus.txt > cooccurrences.bin\n\n");
@@ -647,11 +1284,27 @@ int main(int argc, char **argv) {
     // 词表文件，默认为vocab.txt
     if ((i = find_arg((char *)"-vocab-file", argc, argv)) > 0) strcpy(vocab_file, argv[i + 1]);
     else strcpy(vocab_file, (char *)"vocab.txt");
+    if ((i = find_arg((char *)"-vocab-index", argc, argv)) > 0) strcpy(vocab_index_file, argv[i + 1]);
+    else vocab_index_file[0] = 0;
+    if ((i = find_arg((char *)"-previous", argc, argv)) > 0) strcpy(previous_file, argv[i + 1]);
+    else previous_file[0] = 0;
+    if ((i = find_arg((char *)"-previous-vocab", argc, argv)) > 0) strcpy(previous_vocab_file, argv[i + 1]);
+    else previous_vocab_file[0] = 0;
     // file_head: overflow文件的前缀名，默认为"overflow"，文件全名为"overflow_0000.bin"，多个文件数值递增
     if ((i = find_arg((char *)"-overflow-file", argc, argv)) > 0) strcpy(file_head, argv[i + 1]);
     else strcpy(file_head, (char *)"overflow");
-    // 内存消耗的软限制，单位GB，默认值3，简单的启发式限制所以并不是极端准确的
-    if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
+    // 内存消耗的软限制，单位GB，默认值3，简单的启发式限制所以并不是极端准确的；auto表示按可用内存和词频自动确定
+    if ((i = find_arg((char *)"-memory", argc, argv)) > 0) {
+        if (strcmp(argv[i + 1], "auto") == 0) memory_auto = 1;
+        else memory_limit = atof(argv[i + 1]);
+    }
+    if ((i = find_arg((char *)"-format", argc, argv)) > 0 && (output_format = crec_parse_format(argv[i + 1])) < 0) {
+        fprintf(stderr, "Unknown format %s; expected raw, compact or compact32.\n", argv[i + 1]);
+        return 1;
+    }
+    if ((i = find_arg((char *)"-compress", argc, argv)) > 0) compress_level = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+    if (num_threads < 1) num_threads = 1;
     
     /* The memory_limit determines a limit on the number of elements in bigram_table and the overflow buffer */
     /* Estimate the maximum value that max_product can take so that this limit is still satisfied */
@@ -659,23 +1312,43 @@ int main(int argc, char **argv) {
     // 所以rlimit是record limit，是memory_limit指定的内存使用数目的85%所能存储的CREC共现记录的数目
     // 剩下的15%就是留给overflow用
     // memory_limit是一个粗略的估计，因为哈希表什么的数据结构也是用内存的
-    rlimit = 0.85 * (real)memory_limit * 1073741824/(sizeof(CREC));
-    // n的初始值为1e5
-    // 0.1544313298这个数，搜了一下，在这里提到了：
-    // http://numbers.computation.free.fr/Constants/Gamma/gammaFormulas.html
-    // TODO 没搞懂具体的数学原理，但总之是迭代计算出一个合适的n，满足nlogn + 0.15n ~= rlimit
-    while (fabs(rlimit - n * (log(n) + 0.1544313298)) > 1e-3) n = rlimit / (log(n) + 0.1544313298);
-    // 计算得到预估的max_product
-    max_product = (long long) n;
-    overflow_length = (long long) rlimit/6; // 0.85 + 1/6 ~= 1
+    // 多线程时每个线程各有一份数组，所以内存按线程数平分
+    if (memory_auto) {
+        memory_limit = auto_memory_gb(memory_limit);
+        if (auto_tune_memory() != 0) return 1;
+    }
+    else {
+        rlimit = 0.85 * (real)memory_limit / num_threads * 1073741824/(sizeof(CREC));
+        // n的初始值为1e5
+        // 0.1544313298这个数，搜了一下，在这里提到了：
+        // http://numbers.computation.free.fr/Constants/Gamma/gammaFormulas.html
+        // TODO 没搞懂具体的数学原理，但总之是迭代计算出一个合适的n，满足nlogn + 0.15n ~= rlimit
+        while (fabs(rlimit - n * (log(n) + 0.1544313298)) > 1e-3) n = rlimit / (log(n) + 0.1544313298);
+        // 计算得到预估的max_product
+        max_product = (long long) n;
+        overflow_length = (long long) rlimit/6; // 0.85 + 1/6 ~= 1
+    }
     
     /* Override estimates by specifying limits explicitly on the command line */
     // 用来控制稀疏性，w1*w2<max_product的记录(w1,w2)存入bigram_table数组，其他的存入overflow的cr缓冲区
     if ((i = find_arg((char *)"-max-product", argc, argv)) > 0) max_product = atoll(argv[i + 1]);
     // overflow数组的大小，用来存储w1*w2>max_product时的共现记录
     if ((i = find_arg((char *)"-overflow-length", argc, argv)) > 0) overflow_length = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-async-spill", argc, argv)) > 0) async_spill = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-sparse-table", argc, argv)) > 0) sparse_table = atoi(argv[i + 1]);
+    if (async_spill < 0) async_spill = sysconf(_SC_NPROCESSORS_ONLN) > num_threads;
+    // 后台写出时两个缓冲区平分原来一个缓冲区的内存
+    if (async_spill) overflow_length /= 2;
+    
+    if ((i = find_arg((char *)"-metrics", argc, argv)) > 0) metrics_path = argv[i + 1];
+    if (metrics_open("cooccur", metrics_path) != 0) {
+        fprintf(stderr, "Unable to open metrics file %s.\n", metrics_path);
+        return 1;
+    }
     
     // 构造共现矩阵
-    return get_cooccurrence();
+    i = get_cooccurrence();
+    metrics_close();
+    return i;
 }
 
@@ -25,6 +25,8 @@
  *  
  *  glove.c 是4个核心文件中的第四个文件，在demo.sh中给出的使用样例是：
  *  $ build/glove -save-file vectors -threads 8 -input-file cooccurrence.shuf.bin -x-max 10 -iter 15 -vector-size 50 -binary 2 -vocab-file vocab.txt -verbose 2
+ *  也可以直接接在cooccur后面，不写中间文件：
+ *  $ build/cooccur -vocab-file vocab.txt -window-size 15 < text8 | build/glove -input-file - -save-file vectors -threads 8 -x-max 10 -iter 15 -vocab-file vocab.txt
  *  
  *  本程序读取打乱后的共现矩阵，对每一条记录，用随机梯度下降的方式更新参数
  *  参数的更新采用多线程的方式
@@ -33,27 +35,52 @@
  */
 
 
+#define _GNU_SOURCE // pthread_setaffinity_np and the CPU_* macros
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define _FILE_OFFSET_BITS 64
 #define MAX_STRING_LENGTH 1000
+// 二进制输出文件头的长度，只在float/half精度下写入
+#define BIN_HEADER_SIZE 64
 
 typedef double real;
+// 半精度浮点数的存储类型，计算时转换成float
+typedef uint16_t half;
 
-// 共现矩阵里的记录
-typedef struct cooccur_rec {
-    // 数值类型，用词频排序后的序号来代表词
-    int word1;
-    int word2;
-    // 加权后计算出来的共现率
-    real val;
-} CREC;
+// W和gradsq的存储精度
+enum { PRECISION_DOUBLE = 0, PRECISION_FLOAT = 1, PRECISION_HALF = 2 };
+// W和gradsq在内存中的排列方式，见initialize_parameters
+enum { LAYOUT_SPLIT = 0, LAYOUT_PADDED = 1, LAYOUT_INTERLEAVED = 2 };
+#define ROW_ALIGN 64 // bytes; padded rows start on a cache line
+#define HUGE_PAGE_SIZE 2097152
+#define MAX_NUMA_NODES 64
+#define SYNC_CHUNK 1048576 // doubles per allreduce when syncing parameters
+#define SAMPLE_STREAM (1ULL << 62) // counter_rand streams of the record sampling, past those of -block-shuffle (2 * epoch + 0/1)
+#define ROUND_STREAM (3ULL << 62) // counter_rand stream of the stochastic rounding of half gradsq
+#define ADAPTIVE_MIN_KEEP 0.1 // -adaptive still visits every record with at least this probability, so stale losses get refreshed
+
+// 共现矩阵里的记录CREC定义在common.h中，val是加权后计算出来的共现率
 
 // 参数区
 
@@ -67,11 +94,78 @@ int save_gradsq = 0; // By default don't save squared gradient values
 int use_binary = 0; // 0: save as text files; 1: save as binary; 2: both. For binary, save both word and context word vectors.
 int model = 2; // For text file output only. 0: concatenate word and context vectors (and biases) i.e. save everything; 1: Just save word vectors (no bias); 2: Save (word + context word) vectors (no biases)
 int checkpoint_every = 0; // checkpoint the model for every checkpoint_every iterations. Do nothing if checkpoint_every <= 0
+int checkpoint_async = 1; // 0: training waits while checkpoints are written; 1: snapshot W and gradsq and write checkpoints from a background thread
+int start_iter = 0; // Number of iterations already done by the -init-W model; -1: resume from the latest checkpoint of save_W_file
+int use_mmap = 0; // 0: each thread reads its slice of input_file through stdio; 1: map input_file and read records in place; 2: as 1, and lock the mapping in RAM so it is read from disk only once
+int precision = PRECISION_DOUBLE; // Storage type of W and gradsq. 0: double; 1: float; 2: half (updates are computed in float)
+int param_layout = LAYOUT_SPLIT; // 0: W and gradsq in two arrays of vector_size + 1 element rows; 1: as 0, rows padded to ROW_ALIGN bytes; 2: padded rows, each W row followed by its gradsq row in one array
+int use_huge_pages = 0; // 0: off; 1: transparent huge pages (madvise); 2: reserved huge pages (MAP_HUGETLB), falling back to 1
+long long hot_rows = 0; // Words (ranks 1..hot_rows) whose rows each thread trains on private copies of, merged every hot_merge_every records; 0: plain Hogwild for all rows
+long long hot_merge_every = 1024;
+int sync_every = 1; // Epochs between parameter syncs in distributed training; checkpoints and the last epoch always sync
+long long sync_records = 0; // Records per rank between syncs within an epoch in distributed training; 0: sync only between epochs
+int numa_mode = 0; // 0: off; 1: pin training threads to CPUs, round-robin over NUMA nodes; 2: as 1, and spread the pages of W and gradsq over the nodes
+long long shuffle_block = 0; // 0: read input_file in order; > 0: shuffle unshuffled input in glove, visiting blocks of this many records in a new random order each epoch
+unsigned long long seed = 1; // Seed for -block-shuffle
 real eta = 0.05; // Initial learning rate
 real alpha = 0.75, x_max = 100.0; // Weighting function parameters, not extremely sensitive to corpus, though may need adjustment for very small or very large corpora
-real *W, *gradsq, *cost;
+real min_weight = 0; // Records with f(X) below this are dropped
+real subsample = 0; // Records with f(X) below this are kept with probability f(X) / subsample and trained with weight subsample
+real adaptive = 0; // After the first epoch, records whose last loss is below adaptive * the mean loss are kept with probability loss / (adaptive * mean)
+// W和gradsq按precision指定的类型存储，param_size是每个元素的字节数
+void *W, *gradsq;
+size_t param_size = sizeof(double);
+// 第r行（0 <= r < 2 * vocab_size）的第b个元素在W + r * row_stride + b，gradsq也一样
+long long row_stride; // elements from one parameter row to the next, in W and in gradsq
+size_t param_alloc_size; // bytes of the W allocation, and of gradsq's unless it is interleaved with W
+void *hugetlb_maps[2]; // allocations that came from MAP_HUGETLB and need munmap
+real *cost;
+// 运行指标（-metrics）：每轮各线程训练的记录数和用时，用来算每个线程的更新速度和负载不均衡；saved_bytes是保存的文件的总字节数
+char *metrics_path = NULL;
+long long *thread_records, *thread_skipped, saved_bytes = 0;
+double *thread_seconds;
+// use_mmap > 0时，整个共现文件映射到内存，各线程直接遍历自己那一段CREC数组
+CREC *cooccur_map = NULL;
+size_t cooccur_map_size = 0;
 long long num_lines, *lines_per_thread, vocab_size;
-char *vocab_file, *input_file, *save_W_file, *save_gradsq_file;
+// -block-shuffle时，每轮迭代开始前主线程重新排列block_order，线程t处理其中第t段的块
+long long num_blocks = 0, *block_order = NULL;
+int current_epoch = 0;
+// 输入是紧凑格式（见common.h）时，按文件里的块来训练：block_offset是每个块在文件中的位置，不支持-mmap
+int input_format = CREC_FORMAT_RAW;
+off_t *block_offset = NULL;
+long long *block_first = NULL; // index of each block's first record among this rank's records
+// -weight-cache：第一轮迭代时把每条记录的log(val)和权重f(val)按float存下来，之后的迭代直接查表，不再调用log和pow
+// 表按记录在（本rank的）输入中的位置排列，每轮每条记录正好被访问一次，所以第一轮结束后就填满了
+float *weight_cache = NULL; // 2 floats per record: log(val), f(val)
+int use_weight_cache = 0, weight_cache_ready = 0;
+// -min-weight、-subsample和-adaptive：每轮跳过一部分对误差贡献很小的记录，保留下来的记录的权重除以被保留的概率，所以梯度和误差的期望不变
+// 是否保留由(seed, 迭代轮数, 记录的位置)决定，与线程数无关；-adaptive按记录在输入中的位置在record_loss里记下每条记录上次的误差
+int sampling = 0; // any of the three is on
+float *record_loss = NULL; // -adaptive: unweighted loss of each record when it was last trained on, -1 before that
+double mean_record_cost = 0; // mean cost per record of the last epoch, 0 before the first
+// -input-file -：共现数据从标准输入读入，例如 cooccur ... | glove -input-file - ...，不需要cooccurrence.bin和shuffle的中间文件
+// 主线程按shuffle_block条记录一块读入内存（cooccur_map），第一轮迭代的工作线程同时从已经读入的块中随机取块训练，
+// 所以训练在cooccur还在归并输出时就开始了；之后的迭代和-block-shuffle一样。超过memory_limit以后的块写到stream_file
+typedef struct pipe_input {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long long loaded;           // records read so far
+    long long *pending, n_pending, capacity, taken; // blocks read and not yet trained on in the first epoch
+    int done;                   // end of input (or an error) reached
+    long long mem_blocks;       // blocks that fit in memory_limit: block b is in cooccur_map if b < mem_blocks, else in fd
+    int fd;                     // stream_file, -1 until the input goes over memory_limit
+    long long bytes;            // bytes read from stdin
+} PIPE_INPUT;
+PIPE_INPUT pipe_in = {.fd = -1};
+int pipe_epoch = 0; // set during the first epoch of pipe input, while the workers train on blocks as they are read
+real memory_limit = 4.0; // soft limit, in gigabytes, on the pipe input kept in memory
+char *vocab_file, *input_file, *save_W_file, *save_gradsq_file, *stream_file;
+// 词表的二进制索引（见common.h）：启动时能mmap就直接得到vocab_size和所有的词，否则只数一下vocab_file的行数，保存文本时再解析
+char *vocab_index_file;
+VOCAB_MAP vocab;
+// 从之前的训练结果开始时的W和gradsq文件，以及它们对应的词表；为空时不使用
+char *init_W_file, *init_gradsq_file, *init_vocab_file;
 
 // 快速比较两个词是否相同
 /* Efficient string comparison */
@@ -80,29 +174,489 @@ int scmp( char *s1, char *s2 ) {
     return(*s1 - *s2);
 }
 
+// 半精度和单精度之间的转换，有F16C指令时直接用硬件指令
+/* Conversion between IEEE half and single precision */
+#if defined(__F16C__)
+static inline float half_to_float(half h) { return _cvtsh_ss(h); }
+static inline half float_to_half(float f) { return _cvtss_sh(f, 0); }
+#else
+static inline float half_to_float(half h) {
+    union { uint32_t u; float f; } o;
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+    if (exp == 0x1f) o.u = sign | 0x7f800000 | (mant << 13); // inf or NaN
+    else if (exp != 0) o.u = sign | ((exp + 112) << 23) | (mant << 13);
+    else if (mant == 0) o.u = sign;
+    else { // subnormal half, renormalize
+        exp = 113;
+        while (!(mant & 0x400)) {mant <<= 1; exp--;}
+        o.u = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    return o.f;
+}
+static inline half float_to_half(float f) {
+    union { uint32_t u; float f; } i;
+    i.f = f;
+    uint32_t sign = (i.u >> 16) & 0x8000, mant = i.u & 0x7fffff;
+    int exp = (int)((i.u >> 23) & 0xff) - 112;
+    if (((i.u >> 23) & 0xff) == 0xff) return (half)(sign | 0x7c00 | (mant ? 0x200 : 0)); // inf or NaN
+    if (exp >= 0x1f) return (half)(sign | 0x7c00); // overflow to inf
+    if (exp <= 0) { // subnormal half or zero
+        if (exp < -10) return (half)sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp, r = mant >> shift;
+        if ((mant >> (shift - 1)) & 1 && ((mant & ((1u << (shift - 1)) - 1)) || (r & 1))) r++; // round to nearest even
+        return (half)(sign | r);
+    }
+    uint32_t r = sign | (exp << 10) | (mant >> 13);
+    if ((mant & 0x1000) && ((mant & 0x1fff) != 0x1000 || (r & 1))) r++; // round to nearest even, may carry into exponent
+    return (half)r;
+}
+#endif
+
+// 半精度gradsq的随机舍入：gradsq从1开始，每次只加一个很小的平方梯度，就近舍入会把小于半个ulp（1附近约4.9e-4）的增量
+// 全部丢掉，gradsq永远停在1，AdaGrad退化成固定步长的SGD。按落在两个相邻半精度数之间的位置随机地向上或向下舍入，期望值就是
+// 精确的和。随机数是每个线程自己的计数器和未舍入的值的哈希，各线程互不干扰
+/* Stochastic rounding for half gradsq: round f up or down to one of its two neighbouring halves with probability given
+ * by its position between them, so increments far below the ulp still add up in expectation. The random bits hash a
+ * per-thread counter together with the unrounded value, so threads never share state */
+static __thread unsigned long long round_counter = 0;
+static inline half float_to_half_stochastic(float f) {
+    half h = float_to_half(f), other;
+    float near = half_to_float(h), far;
+    if (near == f || (h & 0x7c00) == 0x7c00) return h; // exact, or inf/NaN (also for a non-finite f)
+    other = fabsf(near) < fabsf(f) ? h + 1 : h - 1; // neighbour on the other side of f (the same sign, one ulp away)
+    far = half_to_float(other);
+    union { uint32_t u; float f; } bits;
+    bits.f = f;
+    if ((counter_rand(seed, ROUND_STREAM + bits.u, round_counter++) >> 40) * 0x1.0p-24f < (f - near) / (far - near)) return other;
+    return h;
+}
+
+// 按当前精度读写W和gradsq中的第idx个元素，只用于初始化和保存，训练的内循环不走这里
+/* Read or write element idx of a parameter array stored in the current precision */
+static inline real get_param(void *base, long long idx) {
+    if (precision == PRECISION_FLOAT) return ((float *)base)[idx];
+    if (precision == PRECISION_HALF) return half_to_float(((half *)base)[idx]);
+    return ((double *)base)[idx];
+}
+static inline void set_param(void *base, long long idx, real val) {
+    if (precision == PRECISION_FLOAT) ((float *)base)[idx] = (float)val;
+    else if (precision == PRECISION_HALF) ((half *)base)[idx] = float_to_half((float)val);
+    else ((double *)base)[idx] = val;
+}
+
+const char *precision_name(int p) {
+    return p == PRECISION_FLOAT ? "float" : (p == PRECISION_HALF ? "half" : "double");
+}
+
+/***
+ *  NUMA：不依赖libnuma，从/sys/devices/system/node读出每个节点上的CPU
+ *  训练线程t绑定到节点t % num_numa_nodes上的一个CPU，线程自己分配的缓冲区和读入的数据因此都在本地节点上
+ *  -numa 2时，W和gradsq的页按块轮流由各个节点上的线程第一次写入，Linux默认的first-touch策略就把它们交错分布到各个节点
+ */
+
+int num_numa_nodes = 0;
+cpu_set_t numa_cpus[MAX_NUMA_NODES]; // usable CPUs of each node that has any
+
+/* Parse a sysfs cpulist such as "0-3,8-11" into set */
+void parse_cpulist(const char *list, cpu_set_t *set) {
+    char *end;
+    long a, b;
+    CPU_ZERO(set);
+    while (*list >= '0' && *list <= '9') {
+        a = b = strtol(list, &end, 10);
+        if (*end == '-') b = strtol(end + 1, &end, 10);
+        for (; a <= b && a < CPU_SETSIZE; a++) CPU_SET(a, set);
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* Find the NUMA nodes and their CPUs, limited to the CPUs this process may run on. Without sysfs, all CPUs form one node */
+void numa_discover() {
+    char path[64], line[4096];
+    cpu_set_t allowed, set;
+    FILE *f;
+    int n;
+    
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        for (n = 0; n < sysconf(_SC_NPROCESSORS_ONLN) && n < CPU_SETSIZE; n++) CPU_SET(n, &allowed);
+    }
+    for (n = 0; n < MAX_NUMA_NODES; n++) { // node numbers may have gaps
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+        if ((f = fopen(path, "r")) == NULL) continue;
+        if (fgets(line, sizeof(line), f) != NULL) {
+            parse_cpulist(line, &set);
+            CPU_AND(&set, &set, &allowed);
+            if (CPU_COUNT(&set) > 0) numa_cpus[num_numa_nodes++] = set;
+        }
+        fclose(f);
+    }
+    if (num_numa_nodes == 0) numa_cpus[num_numa_nodes++] = allowed;
+    if (verbose > 0) {
+        fprintf(stderr, "NUMA: %d node%s with", num_numa_nodes, num_numa_nodes > 1 ? "s" : "");
+        for (n = 0; n < num_numa_nodes; n++) fprintf(stderr, " %d", CPU_COUNT(&numa_cpus[n]));
+        fprintf(stderr, " usable CPUs\n");
+    }
+}
+
+/* Pin the calling training thread: thread id goes to node id % num_numa_nodes, on the next CPU of that node */
+void pin_thread(long long id) {
+    cpu_set_t *node = &numa_cpus[id % num_numa_nodes], one;
+    int cpu, k = (id / num_numa_nodes) % CPU_COUNT(node);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, node) && k-- == 0) break;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+}
+
+typedef struct touch_job {
+    char *base;
+    size_t bytes, chunk;
+    int node;
+} TOUCH_JOB;
+
+void *touch_pages(void *arg) {
+    TOUCH_JOB *job = (TOUCH_JOB *)arg;
+    size_t off, page, page_size = sysconf(_SC_PAGESIZE);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa_cpus[job->node]);
+    for (off = job->node * job->chunk; off < job->bytes; off += num_numa_nodes * job->chunk)
+        for (page = off; page < off + job->chunk && page < job->bytes; page += page_size) job->base[page] = 0;
+    return NULL;
+}
+
+/* Fault in the pages of a fresh allocation from every node in turn, a page (or a huge page) at a time, so first-touch
+ * placement interleaves it over the nodes */
+void spread_pages(void *p, size_t bytes) {
+    TOUCH_JOB jobs[MAX_NUMA_NODES];
+    pthread_t pt[MAX_NUMA_NODES];
+    int n;
+    if (num_numa_nodes < 2) return;
+    for (n = 0; n < num_numa_nodes; n++) {
+        jobs[n].base = (char *)p;
+        jobs[n].bytes = bytes;
+        jobs[n].chunk = use_huge_pages > 0 ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+        jobs[n].node = n;
+        if (pthread_create(&pt[n], NULL, touch_pages, &jobs[n]) != 0) touch_pages(&jobs[n]), pt[n] = pthread_self();
+    }
+    for (n = 0; n < num_numa_nodes; n++) if (!pthread_equal(pt[n], pthread_self())) pthread_join(pt[n], NULL);
+}
+
+// 给W和gradsq分配内存，可以用大页减少随机访问词向量时的TLB缺失
+/* Allocate parameter memory, on huge pages if -huge-pages asks for them. Returns NULL if out of memory */
+void *alloc_params(size_t bytes) {
+    void *p = NULL;
+    int i;
+#ifdef MAP_HUGETLB
+    if (use_huge_pages > 1) {
+        p = mmap(NULL, (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            for (i = 0; i < 2 && hugetlb_maps[i] != NULL; i++);
+            if (i < 2) {hugetlb_maps[i] = p; return p;}
+            munmap(p, (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+        }
+        if (verbose > 0) fprintf(stderr, "No reserved huge pages for %zu bytes; using transparent huge pages.\n", bytes);
+        use_huge_pages = 1;
+    }
+#endif
+    if (use_huge_pages > 0) {
+        if (posix_memalign(&p, HUGE_PAGE_SIZE, bytes) != 0) return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+        return p;
+    }
+    if (posix_memalign(&p, 128, bytes) != 0) return NULL; // Might perform better than malloc
+    return p;
+}
+
+void free_params(void *p) {
+    int i;
+    for (i = 0; i < 2; i++) if (p != NULL && hugetlb_maps[i] == p) {
+        munmap(p, (param_alloc_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+        hugetlb_maps[i] = NULL;
+        return;
+    }
+    free(p);
+}
+
 // 初始化词向量和梯度向量，采用随机初始化
+// 每个词的词向量和上下文向量各占一行，前vocab_size行是词向量，后vocab_size行是上下文向量，每行vector_size + 1个元素（最后一个是偏置）
+// -layout padded把每行补齐到64字节；-layout interleaved再把每行W和它的gradsq放在一起，一次更新只碰到两块连续的内存
+// 随机数的使用顺序和排列方式无关，所以不同的排列方式训练出同样的结果
+/* Allocate W and gradsq in the chosen layout and initialize them. The random values do not depend on the layout */
 void initialize_parameters() {
     long long a, b;
-    vector_size++; // Temporarily increment to allocate space for bias
+    size_t row_bytes = (vector_size + 1) * param_size;
 
+    row_stride = vector_size + 1;
+    if (param_layout != LAYOUT_SPLIT) row_stride = (row_bytes + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN / param_size;
+    param_alloc_size = 2 * vocab_size * row_stride * param_size * (param_layout == LAYOUT_INTERLEAVED ? 2 : 1);
     /* Allocate space for word vectors and context word vectors, and correspodning gradsq */
-    a = posix_memalign((void **)&W, 128, 2 * vocab_size * (vector_size + 1) * sizeof(real)); // Might perform better than malloc
+    W = alloc_params(param_alloc_size);
     if (W == NULL) {
         fprintf(stderr, "Error allocating memory for W\n");
         exit(1);
     }
-    a = posix_memalign((void **)&gradsq, 128, 2 * vocab_size * (vector_size + 1) * sizeof(real)); // Might perform better than malloc
+    if (param_layout == LAYOUT_INTERLEAVED) {
+        gradsq = (char *)W + row_stride * param_size;
+        row_stride *= 2;
+    }
+    else gradsq = alloc_params(param_alloc_size);
 	if (gradsq == NULL) {
         fprintf(stderr, "Error allocating memory for gradsq\n");
         exit(1);
     }
-    for (b = 0; b < vector_size; b++) for (a = 0; a < 2 * vocab_size; a++) W[a * vector_size + b] = (rand() / (real)RAND_MAX - 0.5) / vector_size;
-    for (b = 0; b < vector_size; b++) for (a = 0; a < 2 * vocab_size; a++) gradsq[a * vector_size + b] = 1.0; // So initial value of eta is equal to initial learning rate
-    vector_size--;
+    if (numa_mode > 1) {
+        spread_pages(W, param_alloc_size);
+        if (param_layout != LAYOUT_INTERLEAVED) spread_pages(gradsq, param_alloc_size);
+    }
+    for (b = 0; b < vector_size + 1; b++) for (a = 0; a < 2 * vocab_size; a++) set_param(W, a * row_stride + b, (rand() / (real)RAND_MAX - 0.5) / (vector_size + 1));
+    for (b = 0; b < vector_size + 1; b++) for (a = 0; a < 2 * vocab_size; a++) set_param(gradsq, a * row_stride + b, 1.0); // So initial value of eta is equal to initial learning rate
+}
+
+void free_parameters() {
+    free_params(W);
+    if (param_layout != LAYOUT_INTERLEAVED) free_params(gradsq);
+}
+
+/***
+ *  多机训练（用make CC=mpicc DIST_FLAGS=-DUSE_MPI编译，用mpirun启动）
+ *  每个进程（rank）训练自己那一份共现数据：input_file中有%d时各自读文件名中%d换成rank的文件，否则平分同一个文件
+ *  每sync_every轮，在各线程都停在屏障时，合并每个rank对参数的改变量，所有rank得到相同的参数：
+ *  W的改变量对改过这一行的rank取平均（只有一个rank改过的行就用它的改变量），gradsq的改变量加起来
+ *  -sync-records N时每一轮再分成sync_rounds段（每个rank约N条记录一段，各rank段数相同），每段结束时各线程停在sync_reached屏障，
+ *  同步之后从sync_done屏障继续。各rank在两次同步之间看不到彼此的更新，所以前几轮比单机收敛得慢，训练越久差距越小；
+ *  同步得越勤，每轮的cost越接近单机，代价是每次同步都要过一次屏障、交换一次被改过的行
+ *  先对“哪些行被改过”做一次allreduce，之后只交换被至少一个rank改过的行
+ *  只有rank 0输出日志、写检查点和最终结果
+ */
+
+int dist_rank = 0, dist_size = 1;
+long long shard_start = 0; // first record of this rank's shard when the ranks split one raw input_file
+long long global_lines = 0; // records over all ranks
+void *sync_W = NULL, *sync_gradsq = NULL; // parameters after the last sync, in the current precision and layout
+double sync_seconds = 0; // time spent syncing in the current epoch
+int syncs = 0; // syncs in the current epoch
+int sync_rounds = 1; // parts of each epoch, the same on every rank; the ranks sync after each part (see -sync-records)
+double epoch_started; // wall clock at the start of the current epoch
+
+double wall_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+#ifdef USE_MPI
+void dist_finalize() {
+    MPI_Finalize();
+}
+
+void dist_init(int *argc, char ***argv) {
+    int provided;
+    MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided); // only the main thread calls MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &dist_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &dist_size);
+    atexit(dist_finalize);
+}
+
+double dist_sum(double x) {
+    MPI_Allreduce(MPI_IN_PLACE, &x, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    return x;
+}
+
+long long dist_sum_ll(long long x) {
+    MPI_Allreduce(MPI_IN_PLACE, &x, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    return x;
+}
+
+/* Nonzero on every rank if status is nonzero on any */
+int dist_any(int status) {
+    MPI_Allreduce(MPI_IN_PLACE, &status, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    return status;
+}
+
+static void bcast_bytes(void *p, size_t bytes) {
+    size_t off, len;
+    for (off = 0; off < bytes; off += len) {
+        len = bytes - off < 1073741824 ? bytes - off : 1073741824;
+        MPI_Bcast((char *)p + off, (int)len, MPI_BYTE, 0, MPI_COMM_WORLD);
+    }
+}
+
+/* Start every rank from rank 0's parameters (which may come from -init-W or a checkpoint only rank 0 can read) and
+ * keep a copy as the base of the first sync. status is rank 0's setup result; returns it on every rank */
+int dist_share_params(int status) {
+    if (dist_size < 2) return status;
+    MPI_Bcast(&status, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (status != 0) return status;
+    MPI_Bcast(&start_iter, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    bcast_bytes(W, param_alloc_size);
+    if (param_layout != LAYOUT_INTERLEAVED) bcast_bytes(gradsq, param_alloc_size);
+    if (posix_memalign(&sync_W, 128, param_alloc_size) != 0) {fprintf(stderr, "Error allocating memory for sync copy\n"); return 1;}
+    memcpy(sync_W, W, param_alloc_size);
+    if (param_layout == LAYOUT_INTERLEAVED) sync_gradsq = (char *)sync_W + ((char *)gradsq - (char *)W);
+    else {
+        if (posix_memalign(&sync_gradsq, 128, param_alloc_size) != 0) {fprintf(stderr, "Error allocating memory for sync copy\n"); return 1;}
+        memcpy(sync_gradsq, gradsq, param_alloc_size);
+    }
+    return 0;
+}
+
+/* Combine the changes every rank made to W and gradsq since the last sync, row by row for the rows any rank touched.
+ * A row only one rank touched takes that rank's change, so rare words, often seen by one rank only, keep their full
+ * step size. A row k ranks touched takes the mean of their changes to W: each rank took its own full AdaGrad steps
+ * from the same start, so the sum would be about k times one step on the most frequent words (the model averaging
+ * of one node per shard). gradsq changes are always summed, so gradsq counts the squared gradients of all shards */
+void dist_sync_params() {
+    long long r, b, first, n = 2 * vocab_size, row_len = vector_size + 1, chunk_rows = SYNC_CHUNK / (2 * row_len);
+    size_t row_bytes = row_len * param_size;
+    unsigned short *touched = (unsigned short *)calloc(n, sizeof(unsigned short)); // ranks that changed each row
+    double *buf = (double *)malloc(sizeof(double) * 2 * row_len * (chunk_rows > 0 ? chunk_rows : 1)), *d;
+    long long packed, sent = 0, shared = 0;
+    
+    if (chunk_rows < 1) chunk_rows = 1;
+    for (r = 0; r < n; r++) {
+        long long o = r * row_stride * param_size;
+        touched[r] = memcmp((char *)W + o, (char *)sync_W + o, row_bytes) != 0 || memcmp((char *)gradsq + o, (char *)sync_gradsq + o, row_bytes) != 0;
+    }
+    for (first = 0; first < n; first += 1 << 30) // counts are ints
+        MPI_Allreduce(MPI_IN_PLACE, touched + first, (int)(n - first < 1 << 30 ? n - first : 1 << 30), MPI_UNSIGNED_SHORT, MPI_SUM, MPI_COMM_WORLD);
+    for (first = 0; first < n; first = r) {
+        for (r = first, packed = 0, d = buf; r < n && packed < chunk_rows; r++) {
+            if (!touched[r]) continue;
+            for (b = 0; b < row_len; b++) *d++ = get_param(W, r * row_stride + b) - get_param(sync_W, r * row_stride + b);
+            for (b = 0; b < row_len; b++) *d++ = get_param(gradsq, r * row_stride + b) - get_param(sync_gradsq, r * row_stride + b);
+            packed++;
+        }
+        if (packed == 0) continue;
+        MPI_Allreduce(MPI_IN_PLACE, buf, (int)(d - buf), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        sent += packed;
+        for (b = first, d = buf; b < r; b++) {
+            long long c, o = b * row_stride;
+            double scale;
+            if (!touched[b]) continue;
+            scale = 1.0 / touched[b];
+            if (touched[b] > 1) shared++;
+            for (c = 0; c < row_len; c++) set_param(W, o + c, get_param(sync_W, o + c) + *d++ * scale);
+            for (c = 0; c < row_len; c++) set_param(gradsq, o + c, get_param(sync_gradsq, o + c) + *d++);
+            memcpy((char *)sync_W + o * param_size, (char *)W + o * param_size, row_bytes);
+            memcpy((char *)sync_gradsq + o * param_size, (char *)gradsq + o * param_size, row_bytes);
+        }
+    }
+    if (verbose > 1 && dist_rank == 0) fprintf(stderr, "    synced %lld of %lld rows across %d ranks, %lld of them changed by more than one\n", sent, n, dist_size, shared);
+    free(touched);
+    free(buf);
+}
+#else
+void dist_init(int *argc, char ***argv) {(void)argc; (void)argv;}
+double dist_sum(double x) {return x;}
+long long dist_sum_ll(long long x) {return x;}
+int dist_any(int status) {return status;}
+int dist_share_params(int status) {return status;}
+void dist_sync_params() {}
+#endif
+
+/* With a %d in input_file, each rank reads its own shard file, named by replacing %d with the rank */
+int shard_file_name() {
+    char name[MAX_STRING_LENGTH], *pct = strchr(input_file, '%');
+    if (pct == NULL) return 0;
+    if (pct[1] != 'd' || strchr(pct + 1, '%') != NULL) {fprintf(stderr, "input-file may contain one %%d (the rank) and no other %%.\n"); return 1;}
+    snprintf(name, sizeof(name), input_file, dist_rank);
+    strcpy(input_file, name);
+    return 0;
+}
+
+/***
+ *  从之前训练的结果开始（-init-W、-init-gradsq）：读入save_params写出的二进制文件，按词对应到当前词表的行
+ *  当前词表里的新词保持随机初始化的值（gradsq为1），旧词表里已经没有的词被丢掉
+ *  文件可以是任意精度：float/half文件有64字节的文件头，double文件没有文件头，大小由文件长度算出
+ */
+
+/* Map the words of the old vocab (-init-vocab) to their 0-based rows in the current vocab, -1 for words that are
+ * gone. Returns NULL with *old_size = vocab_size when there is no old vocab, i.e. rows map to themselves */
+long long *load_init_map(long long *old_size) {
+    long long n, *map;
+    const char *word;
+    VOCAB_MAP old;
+    *old_size = vocab_size;
+    if (init_vocab_file[0] == 0) return NULL;
+    if (vocab.image == NULL && vocab_map_read_text(&vocab, vocab_file) != 0) {fprintf(stderr, "Unable to open vocab file %s.\n", vocab_file); return NULL;}
+    if (vocab_map_load(&old, init_vocab_file, NULL) != 0 || (map = (long long *)malloc(sizeof(long long) * (old.size + 1))) == NULL) {
+        fprintf(stderr, "Unable to open vocab file %s.\n", init_vocab_file);
+        vocab_map_free(&old);
+        return NULL;
+    }
+    for (n = 0; n < old.size; n++) {
+        word = vocab_map_word(&old, n + 1);
+        map[n] = vocab_map_find(&vocab, word, strlen(word)) - 1;
+    }
+    *old_size = old.size;
+    vocab_map_free(&old);
+    return map;
+}
+
+/* Load a binary W or gradsq file from an earlier run into dest (stored in the current precision), row by row through
+ * map (see load_init_map). The file is memory-mapped and converted in place, without copying it through stdio.
+ * Returns 0 on success */
+int load_init_params(void *dest, const char *file, const long long *map, long long old_size) {
+    char header[BIN_HEADER_SIZE + 1], name[16];
+    long long a, b, row, file_vocab, loaded = 0, offset = 0;
+    int fd, file_vector_size = vector_size, file_precision = PRECISION_DOUBLE;
+    size_t elem = sizeof(double);
+    struct stat st;
+    const char *data, *p;
+    
+    if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {fprintf(stderr, "Unable to open file %s.\n", file); return 1;}
+    data = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {fprintf(stderr, "Unable to map file %s.\n", file); return 1;}
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    if (st.st_size >= BIN_HEADER_SIZE && strncmp(data, "GloVe ", 6) == 0) {
+        memcpy(header, data, BIN_HEADER_SIZE);
+        header[BIN_HEADER_SIZE] = 0;
+        if (sscanf(header, "GloVe %15s %lld %d", name, &file_vocab, &file_vector_size) != 3) {
+            fprintf(stderr, "Bad header in %s.\n", file);
+            munmap((void *)data, st.st_size);
+            return 1;
+        }
+        file_precision = strcmp(name, "half") == 0 ? PRECISION_HALF : (strcmp(name, "float") == 0 ? PRECISION_FLOAT : PRECISION_DOUBLE);
+        elem = file_precision == PRECISION_HALF ? sizeof(half) : (file_precision == PRECISION_FLOAT ? sizeof(float) : sizeof(double));
+        offset = BIN_HEADER_SIZE;
+    }
+    else file_vocab = st.st_size / (2 * (vector_size + 1) * (long long)sizeof(double)); // headerless double
+    if (file_vector_size != vector_size || file_vocab != old_size) {
+        fprintf(stderr, "%s holds %lld words of size %d; expected %lld words of size %d%s.\n", file, file_vocab, file_vector_size,
+                old_size, vector_size, map == NULL ? " (use -init-vocab if the vocab has changed)" : "");
+        munmap((void *)data, st.st_size);
+        return 1;
+    }
+    if (offset + 2 * file_vocab * (vector_size + 1) * (long long)elem > (long long)st.st_size) {
+        fprintf(stderr, "%s is truncated.\n", file);
+        munmap((void *)data, st.st_size);
+        return 1;
+    }
+    /* Word rows come first, then context rows, each (vector_size + 1) long including the bias */
+    for (a = 0; a < 2 * file_vocab; a++) {
+        row = map != NULL ? map[a % file_vocab] : a % file_vocab;
+        if (row < 0) continue;
+        if (a >= file_vocab) row += vocab_size;
+        else loaded++;
+        p = data + offset + a * (vector_size + 1) * elem;
+        for (b = 0; b <= vector_size; b++) {
+            real val = file_precision == PRECISION_HALF ? half_to_float(((const half *)p)[b])
+                     : (file_precision == PRECISION_FLOAT ? ((const float *)p)[b] : ((const double *)p)[b]);
+            set_param(dest, row * row_stride + b, val);
+        }
+    }
+    munmap((void *)data, st.st_size);
+    if (verbose > 0) fprintf(stderr, "initialized %lld of %lld words from %s\n", loaded, vocab_size, file);
+    return 0;
 }
 
 // 检查是否是超出范围的数了
-inline real check_nan(real update) {
+static inline real check_nan(real update) {
     if (isnan(update) || isinf(update)) {
         fprintf(stderr,"\ncaught NaN in update");
         return 0.;
@@ -111,84 +665,1277 @@ inline real check_nan(real update) {
     }
 }
 
-// 用多线程来训练模型
-/* Train the GloVe model */
-void *glove_thread(void *vid) {
-    long long a, b ,l1, l2;
-    long long id = *(long long*)vid;
-    CREC cr;
-    real diff, fdiff, temp1, temp2;
-    FILE *fin;
-    fin = fopen(input_file, "rb");
-    fseeko(fin, (num_lines / num_threads * id) * (sizeof(CREC)), SEEK_SET); //Threads spaced roughly equally throughout file
-    cost[id] = 0;
-    
-    real* W_updates1 = (real*)malloc(vector_size * sizeof(real));
-    real* W_updates2 = (real*)malloc(vector_size * sizeof(real));
-    for (a = 0; a < lines_per_thread[id]; a++) {
-        fread(&cr, sizeof(CREC), 1, fin);
-        if (feof(fin)) break;
-        if (cr.word1 < 1 || cr.word2 < 1) { continue; }
+// 对一条共现记录做一次AdaGrad更新，w1/w2是词向量和上下文向量所在的行，g1/g2是对应的gradsq行
+// 每一种存储精度用同一份代码生成一个函数：TYPE是存储类型，ACC是计算用的类型，STORE/GSTORE是写回W/gradsq时的转换，DIM是向量维度
+// DIM可以是vector_size，也可以是一个常数，这样编译器能完全展开循环，不需要处理剩余的维度
+// 返回这条记录的加权平方误差，如果diff出现NaN则不做更新并返回-1
+/* Per-record AdaGrad update, generated once per storage precision. TYPE is the storage type and ACC the type updates
+ * are accumulated in; STORE and GSTORE convert back to TYPE for W and gradsq. DIM is either vector_size or a
+ * compile-time constant for the fixed-width kernels below.
+ * Returns the weighted squared error of the record, or -1 if the update was skipped. */
+#define DEFINE_UPDATE_KERNEL(NAME, TYPE, ACC, LOAD, STORE, GSTORE, SQRT, DIM) \
+static real NAME(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) { \
+    TYPE *w1 = (TYPE *)pw1, *w2 = (TYPE *)pw2, *g1 = (TYPE *)pg1, *g2 = (TYPE *)pg2; \
+    ACC *W_updates1 = (ACC *)scratch, *W_updates2 = W_updates1 + DIM; \
+    ACC diff = 0, fdiff, temp1, temp2, W_updates1_sum = 0, W_updates2_sum = 0, cost_rec; \
+    long long b; \
+    for (b = 0; b < DIM; b++) diff += LOAD(w1[b]) * LOAD(w2[b]); /* dot product of word and context word vector */ \
+    diff += LOAD(w1[DIM]) + LOAD(w2[DIM]) - (ACC)logval; /* add separate bias for each word */ \
+    fdiff = (ACC)weight * diff; /* multiply weighting function (f) with diff */ \
+    if (isnan(diff) || isnan(fdiff) || isinf(diff) || isinf(fdiff)) return -1; \
+    cost_rec = 0.5 * fdiff * diff; /* weighted squared error */ \
+    fdiff *= (ACC)eta; /* for ease in calculating gradient */ \
+    for (b = 0; b < DIM; b++) { \
+        /* learning rate times gradient for word vectors */ \
+        temp1 = fdiff * LOAD(w2[b]); \
+        temp2 = fdiff * LOAD(w1[b]); \
+        /* adaptive updates */ \
+        W_updates1[b] = temp1 / SQRT(LOAD(g1[b])); \
+        W_updates2[b] = temp2 / SQRT(LOAD(g2[b])); \
+        W_updates1_sum += W_updates1[b]; \
+        W_updates2_sum += W_updates2[b]; \
+        g1[b] = GSTORE(LOAD(g1[b]) + temp1 * temp1); \
+        g2[b] = GSTORE(LOAD(g2[b]) + temp2 * temp2); \
+    } \
+    if (!isnan(W_updates1_sum) && !isinf(W_updates1_sum) && !isnan(W_updates2_sum) && !isinf(W_updates2_sum)) { \
+        for (b = 0; b < DIM; b++) { \
+            w1[b] = STORE(LOAD(w1[b]) - W_updates1[b]); \
+            w2[b] = STORE(LOAD(w2[b]) - W_updates2[b]); \
+        } \
+    } \
+    /* updates for bias terms */ \
+    w1[DIM] = STORE(LOAD(w1[DIM]) - check_nan(fdiff / SQRT(LOAD(g1[DIM])))); \
+    w2[DIM] = STORE(LOAD(w2[DIM]) - check_nan(fdiff / SQRT(LOAD(g2[DIM])))); \
+    fdiff *= fdiff; \
+    g1[DIM] = GSTORE(LOAD(g1[DIM]) + fdiff); \
+    g2[DIM] = GSTORE(LOAD(g2[DIM]) + fdiff); \
+    return cost_rec; \
+}
+
+#define LOAD_NATIVE(x) (x)
+#define STORE_NATIVE(x) (x)
+DEFINE_UPDATE_KERNEL(update_double, double, double, LOAD_NATIVE, STORE_NATIVE, STORE_NATIVE, sqrt, vector_size)
+DEFINE_UPDATE_KERNEL(update_float, float, float, LOAD_NATIVE, STORE_NATIVE, STORE_NATIVE, sqrtf, vector_size)
+DEFINE_UPDATE_KERNEL(update_half, half, float, half_to_float, float_to_half, float_to_half_stochastic, sqrtf, vector_size)
+
+// 常用维度的定长版本，vector_size等于其中之一时自动使用
+/* Fixed-width instances for the common vector sizes; used automatically when vector_size matches */
+#define FOR_EACH_FIXED_WIDTH(X) X(50) X(100) X(200) X(300)
+#define DEFINE_FIXED_WIDTH_SCALAR(DIM) \
+    DEFINE_UPDATE_KERNEL(update_double_##DIM, double, double, LOAD_NATIVE, STORE_NATIVE, STORE_NATIVE, sqrt, DIM) \
+    DEFINE_UPDATE_KERNEL(update_float_##DIM, float, float, LOAD_NATIVE, STORE_NATIVE, STORE_NATIVE, sqrtf, DIM) \
+    DEFINE_UPDATE_KERNEL(update_half_##DIM, half, float, half_to_float, float_to_half, float_to_half_stochastic, sqrtf, DIM)
+FOR_EACH_FIXED_WIDTH(DEFINE_FIXED_WIDTH_SCALAR)
+
+typedef real (*update_fn)(void *, void *, void *, void *, real, real, void *);
+update_fn update_record = update_double;
+const char *update_kernel_name = "scalar";
+int update_kernel_width = 0; // Nonzero if the selected kernel is specialized for this vector size
+
+// 手写的SIMD更新函数：点积一遍，然后在同一遍里完成AdaGrad更新、gradsq累加和NaN/inf检查
+// 更新直接写回W，同时把旧值存在scratch里，万一发现NaN/inf再整行恢复，所以正常情况下只需要两遍
+// float用rsqrt近似加一步牛顿迭代，double用sqrt和除法
+// 指令集在运行时检测，所以同一个二进制文件可以在不同的机器上使用
+/* Hand-vectorized update kernels. After the dot product a single fused pass computes the AdaGrad step, accumulates
+ * gradsq, writes W in place and checks every update for NaN/inf; old rows are kept in scratch and restored if a
+ * non-finite update is found. float kernels use rsqrt plus one Newton step, double kernels use sqrt and divide.
+ * The instruction set is chosen at startup, so one binary serves machines with and without AVX2/AVX-512. */
+
+// 不依赖isnan/isinf判断是否为NaN/inf，因为-Ofast会把它们优化掉
+/* Test exponent bits directly: isnan/isinf are folded away under -ffast-math */
+static inline int float_nonfinite(float x) {
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    return (u & 0x7f800000u) == 0x7f800000u;
+}
+static inline int double_nonfinite(double x) {
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return (u & 0x7ff0000000000000ull) == 0x7ff0000000000000ull;
+}
+
+// 向量部分之后的标量收尾：剩余维度的更新，必要时回滚，以及偏置项的更新
+/* Scalar tail shared by the SIMD kernels: remaining dimensions, rollback on non-finite updates, and the bias terms */
+static inline __attribute__((always_inline)) real finish_float(float *w1, float *w2, float *g1, float *g2, float *old,
+                                                                int b, int dim, float fdiff, int bad, real cost_rec) {
+    float x1, x2, t1, t2, u1, u2;
+    for (; b < dim; b++) {
+        x1 = w1[b]; x2 = w2[b];
+        t1 = fdiff * x2; t2 = fdiff * x1;
+        u1 = t1 / sqrtf(g1[b]); u2 = t2 / sqrtf(g2[b]);
+        g1[b] += t1 * t1; g2[b] += t2 * t2;
+        old[b] = x1; old[dim + b] = x2;
+        w1[b] = x1 - u1; w2[b] = x2 - u2;
+        bad |= float_nonfinite(u1) | float_nonfinite(u2);
+    }
+    if (bad) {
+        memcpy(w1, old, dim * sizeof(float));
+        memcpy(w2, old + dim, dim * sizeof(float));
+    }
+    w1[dim] -= check_nan(fdiff / sqrtf(g1[dim]));
+    w2[dim] -= check_nan(fdiff / sqrtf(g2[dim]));
+    fdiff *= fdiff;
+    g1[dim] += fdiff;
+    g2[dim] += fdiff;
+    return cost_rec;
+}
+static inline __attribute__((always_inline)) real finish_double(double *w1, double *w2, double *g1, double *g2, double *old,
+                                                                 int b, int dim, double fdiff, int bad, real cost_rec) {
+    double x1, x2, t1, t2, u1, u2;
+    for (; b < dim; b++) {
+        x1 = w1[b]; x2 = w2[b];
+        t1 = fdiff * x2; t2 = fdiff * x1;
+        u1 = t1 / sqrt(g1[b]); u2 = t2 / sqrt(g2[b]);
+        g1[b] += t1 * t1; g2[b] += t2 * t2;
+        old[b] = x1; old[dim + b] = x2;
+        w1[b] = x1 - u1; w2[b] = x2 - u2;
+        bad |= double_nonfinite(u1) | double_nonfinite(u2);
+    }
+    if (bad) {
+        memcpy(w1, old, dim * sizeof(double));
+        memcpy(w2, old + dim, dim * sizeof(double));
+    }
+    w1[dim] -= check_nan(fdiff / sqrt(g1[dim]));
+    w2[dim] -= check_nan(fdiff / sqrt(g2[dim]));
+    fdiff *= fdiff;
+    g1[dim] += fdiff;
+    g2[dim] += fdiff;
+    return cost_rec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+TARGET_AVX2 KERNEL_INLINE float hsum_ps_avx2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 0x55));
+    return _mm_cvtss_f32(s);
+}
+TARGET_AVX2 KERNEL_INLINE double hsum_pd_avx2(__m256d v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    s = _mm_add_sd(s, _mm_unpackhi_pd(s, s));
+    return _mm_cvtsd_f64(s);
+}
+
+TARGET_AVX2 KERNEL_INLINE real update_float_avx2_body(float *w1, float *w2, float *g1, float *g2, real logval, real weight,
+                                                       float *old, int dim) {
+    int b, bad;
+    float diff, fdiff;
+    real cost_rec;
+    __m256 acc = _mm256_setzero_ps();
+    for (b = 0; b + 8 <= dim; b += 8) acc = _mm256_fmadd_ps(_mm256_loadu_ps(w1 + b), _mm256_loadu_ps(w2 + b), acc);
+    diff = hsum_ps_avx2(acc);
+    for (; b < dim; b++) diff += w1[b] * w2[b];
+    diff += w1[dim] + w2[dim] - (float)logval;
+    fdiff = (float)weight * diff;
+    if (float_nonfinite(diff) || float_nonfinite(fdiff)) return -1;
+    cost_rec = 0.5 * fdiff * diff;
+    fdiff *= (float)eta;
+
+    const __m256 vf = _mm256_set1_ps(fdiff), three_halves = _mm256_set1_ps(1.5f), one_half = _mm256_set1_ps(0.5f);
+    const __m256i expmask = _mm256_set1_epi32(0x7f800000);
+    __m256i nonfinite = _mm256_setzero_si256();
+    for (b = 0; b + 8 <= dim; b += 8) {
+        __m256 x1 = _mm256_loadu_ps(w1 + b), x2 = _mm256_loadu_ps(w2 + b);
+        __m256 q1 = _mm256_loadu_ps(g1 + b), q2 = _mm256_loadu_ps(g2 + b);
+        __m256 t1 = _mm256_mul_ps(vf, x2), t2 = _mm256_mul_ps(vf, x1);
+        __m256 r1 = _mm256_rsqrt_ps(q1), r2 = _mm256_rsqrt_ps(q2);
+        // one Newton step: r = r * (1.5 - 0.5 * q * r * r)
+        r1 = _mm256_mul_ps(r1, _mm256_fnmadd_ps(_mm256_mul_ps(one_half, q1), _mm256_mul_ps(r1, r1), three_halves));
+        r2 = _mm256_mul_ps(r2, _mm256_fnmadd_ps(_mm256_mul_ps(one_half, q2), _mm256_mul_ps(r2, r2), three_halves));
+        __m256 u1 = _mm256_mul_ps(t1, r1), u2 = _mm256_mul_ps(t2, r2);
+        _mm256_storeu_ps(g1 + b, _mm256_fmadd_ps(t1, t1, q1));
+        _mm256_storeu_ps(g2 + b, _mm256_fmadd_ps(t2, t2, q2));
+        _mm256_storeu_ps(old + b, x1);
+        _mm256_storeu_ps(old + dim + b, x2);
+        _mm256_storeu_ps(w1 + b, _mm256_sub_ps(x1, u1));
+        _mm256_storeu_ps(w2 + b, _mm256_sub_ps(x2, u2));
+        nonfinite = _mm256_or_si256(nonfinite, _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_castps_si256(u1), expmask), expmask));
+        nonfinite = _mm256_or_si256(nonfinite, _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_castps_si256(u2), expmask), expmask));
+    }
+    bad = !_mm256_testz_si256(nonfinite, nonfinite);
+    return finish_float(w1, w2, g1, g2, old, b, dim, fdiff, bad, cost_rec);
+}
+
+TARGET_AVX2 KERNEL_INLINE real update_double_avx2_body(double *w1, double *w2, double *g1, double *g2, real logval, real weight,
+                                                        double *old, int dim) {
+    int b, bad;
+    double diff, fdiff;
+    real cost_rec;
+    __m256d acc = _mm256_setzero_pd();
+    for (b = 0; b + 4 <= dim; b += 4) acc = _mm256_fmadd_pd(_mm256_loadu_pd(w1 + b), _mm256_loadu_pd(w2 + b), acc);
+    diff = hsum_pd_avx2(acc);
+    for (; b < dim; b++) diff += w1[b] * w2[b];
+    diff += w1[dim] + w2[dim] - logval;
+    fdiff = weight * diff;
+    if (double_nonfinite(diff) || double_nonfinite(fdiff)) return -1;
+    cost_rec = 0.5 * fdiff * diff;
+    fdiff *= eta;
+
+    const __m256d vf = _mm256_set1_pd(fdiff);
+    const __m256i expmask = _mm256_set1_epi64x(0x7ff0000000000000ll);
+    __m256i nonfinite = _mm256_setzero_si256();
+    for (b = 0; b + 4 <= dim; b += 4) {
+        __m256d x1 = _mm256_loadu_pd(w1 + b), x2 = _mm256_loadu_pd(w2 + b);
+        __m256d q1 = _mm256_loadu_pd(g1 + b), q2 = _mm256_loadu_pd(g2 + b);
+        __m256d t1 = _mm256_mul_pd(vf, x2), t2 = _mm256_mul_pd(vf, x1);
+        __m256d u1 = _mm256_div_pd(t1, _mm256_sqrt_pd(q1)), u2 = _mm256_div_pd(t2, _mm256_sqrt_pd(q2));
+        _mm256_storeu_pd(g1 + b, _mm256_fmadd_pd(t1, t1, q1));
+        _mm256_storeu_pd(g2 + b, _mm256_fmadd_pd(t2, t2, q2));
+        _mm256_storeu_pd(old + b, x1);
+        _mm256_storeu_pd(old + dim + b, x2);
+        _mm256_storeu_pd(w1 + b, _mm256_sub_pd(x1, u1));
+        _mm256_storeu_pd(w2 + b, _mm256_sub_pd(x2, u2));
+        nonfinite = _mm256_or_si256(nonfinite, _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_castpd_si256(u1), expmask), expmask));
+        nonfinite = _mm256_or_si256(nonfinite, _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_castpd_si256(u2), expmask), expmask));
+    }
+    bad = !_mm256_testz_si256(nonfinite, nonfinite);
+    return finish_double(w1, w2, g1, g2, old, b, dim, fdiff, bad, cost_rec);
+}
+
+// AVX-512用掩码处理剩余的维度，不需要标量收尾
+/* AVX-512 handles the remainder with masked loads and stores, so the scalar tail only updates the bias */
+TARGET_AVX512 KERNEL_INLINE real update_float_avx512_body(float *w1, float *w2, float *g1, float *g2, real logval, real weight,
+                                                          float *old, int dim) {
+    int b;
+    __mmask16 m, nonfinite = 0;
+    float diff, fdiff;
+    real cost_rec;
+    __m512 acc = _mm512_setzero_ps();
+    for (b = 0; b < dim; b += 16) {
+        m = (dim - b >= 16) ? (__mmask16)0xffff : (__mmask16)((1u << (dim - b)) - 1);
+        acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, w1 + b), _mm512_maskz_loadu_ps(m, w2 + b), acc);
+    }
+    diff = _mm512_reduce_add_ps(acc);
+    diff += w1[dim] + w2[dim] - (float)logval;
+    fdiff = (float)weight * diff;
+    if (float_nonfinite(diff) || float_nonfinite(fdiff)) return -1;
+    cost_rec = 0.5 * fdiff * diff;
+    fdiff *= (float)eta;
+
+    const __m512 vf = _mm512_set1_ps(fdiff), three_halves = _mm512_set1_ps(1.5f), one_half = _mm512_set1_ps(0.5f);
+    const __m512i expmask = _mm512_set1_epi32(0x7f800000);
+    for (b = 0; b < dim; b += 16) {
+        m = (dim - b >= 16) ? (__mmask16)0xffff : (__mmask16)((1u << (dim - b)) - 1);
+        __m512 x1 = _mm512_maskz_loadu_ps(m, w1 + b), x2 = _mm512_maskz_loadu_ps(m, w2 + b);
+        __m512 q1 = _mm512_mask_loadu_ps(_mm512_set1_ps(1.0f), m, g1 + b), q2 = _mm512_mask_loadu_ps(_mm512_set1_ps(1.0f), m, g2 + b);
+        __m512 t1 = _mm512_mul_ps(vf, x2), t2 = _mm512_mul_ps(vf, x1);
+        __m512 r1 = _mm512_rsqrt14_ps(q1), r2 = _mm512_rsqrt14_ps(q2);
+        r1 = _mm512_mul_ps(r1, _mm512_fnmadd_ps(_mm512_mul_ps(one_half, q1), _mm512_mul_ps(r1, r1), three_halves));
+        r2 = _mm512_mul_ps(r2, _mm512_fnmadd_ps(_mm512_mul_ps(one_half, q2), _mm512_mul_ps(r2, r2), three_halves));
+        __m512 u1 = _mm512_mul_ps(t1, r1), u2 = _mm512_mul_ps(t2, r2);
+        _mm512_mask_storeu_ps(g1 + b, m, _mm512_fmadd_ps(t1, t1, q1));
+        _mm512_mask_storeu_ps(g2 + b, m, _mm512_fmadd_ps(t2, t2, q2));
+        _mm512_mask_storeu_ps(old + b, m, x1);
+        _mm512_mask_storeu_ps(old + dim + b, m, x2);
+        _mm512_mask_storeu_ps(w1 + b, m, _mm512_sub_ps(x1, u1));
+        _mm512_mask_storeu_ps(w2 + b, m, _mm512_sub_ps(x2, u2));
+        nonfinite |= _mm512_mask_cmpeq_epi32_mask(m, _mm512_and_si512(_mm512_castps_si512(u1), expmask), expmask);
+        nonfinite |= _mm512_mask_cmpeq_epi32_mask(m, _mm512_and_si512(_mm512_castps_si512(u2), expmask), expmask);
+    }
+    return finish_float(w1, w2, g1, g2, old, dim, dim, fdiff, nonfinite != 0, cost_rec);
+}
+
+TARGET_AVX512 KERNEL_INLINE real update_double_avx512_body(double *w1, double *w2, double *g1, double *g2, real logval, real weight,
+                                                           double *old, int dim) {
+    int b;
+    __mmask8 m, nonfinite = 0;
+    double diff, fdiff;
+    real cost_rec;
+    __m512d acc = _mm512_setzero_pd();
+    for (b = 0; b < dim; b += 8) {
+        m = (dim - b >= 8) ? (__mmask8)0xff : (__mmask8)((1u << (dim - b)) - 1);
+        acc = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, w1 + b), _mm512_maskz_loadu_pd(m, w2 + b), acc);
+    }
+    diff = _mm512_reduce_add_pd(acc);
+    diff += w1[dim] + w2[dim] - logval;
+    fdiff = weight * diff;
+    if (double_nonfinite(diff) || double_nonfinite(fdiff)) return -1;
+    cost_rec = 0.5 * fdiff * diff;
+    fdiff *= eta;
+
+    const __m512d vf = _mm512_set1_pd(fdiff);
+    const __m512i expmask = _mm512_set1_epi64(0x7ff0000000000000ll);
+    for (b = 0; b < dim; b += 8) {
+        m = (dim - b >= 8) ? (__mmask8)0xff : (__mmask8)((1u << (dim - b)) - 1);
+        __m512d x1 = _mm512_maskz_loadu_pd(m, w1 + b), x2 = _mm512_maskz_loadu_pd(m, w2 + b);
+        __m512d q1 = _mm512_mask_loadu_pd(_mm512_set1_pd(1.0), m, g1 + b), q2 = _mm512_mask_loadu_pd(_mm512_set1_pd(1.0), m, g2 + b);
+        __m512d t1 = _mm512_mul_pd(vf, x2), t2 = _mm512_mul_pd(vf, x1);
+        __m512d u1 = _mm512_div_pd(t1, _mm512_sqrt_pd(q1)), u2 = _mm512_div_pd(t2, _mm512_sqrt_pd(q2));
+        _mm512_mask_storeu_pd(g1 + b, m, _mm512_fmadd_pd(t1, t1, q1));
+        _mm512_mask_storeu_pd(g2 + b, m, _mm512_fmadd_pd(t2, t2, q2));
+        _mm512_mask_storeu_pd(old + b, m, x1);
+        _mm512_mask_storeu_pd(old + dim + b, m, x2);
+        _mm512_mask_storeu_pd(w1 + b, m, _mm512_sub_pd(x1, u1));
+        _mm512_mask_storeu_pd(w2 + b, m, _mm512_sub_pd(x2, u2));
+        nonfinite |= _mm512_mask_cmpeq_epi64_mask(m, _mm512_and_si512(_mm512_castpd_si512(u1), expmask), expmask);
+        nonfinite |= _mm512_mask_cmpeq_epi64_mask(m, _mm512_and_si512(_mm512_castpd_si512(u2), expmask), expmask);
+    }
+    return finish_double(w1, w2, g1, g2, old, dim, dim, fdiff, nonfinite != 0, cost_rec);
+}
+
+TARGET_AVX2 static real update_float_avx2(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) {
+    return update_float_avx2_body(pw1, pw2, pg1, pg2, logval, weight, scratch, vector_size);
+}
+TARGET_AVX2 static real update_double_avx2(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) {
+    return update_double_avx2_body(pw1, pw2, pg1, pg2, logval, weight, scratch, vector_size);
+}
+TARGET_AVX512 static real update_float_avx512(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) {
+    return update_float_avx512_body(pw1, pw2, pg1, pg2, logval, weight, scratch, vector_size);
+}
+TARGET_AVX512 static real update_double_avx512(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) {
+    return update_double_avx512_body(pw1, pw2, pg1, pg2, logval, weight, scratch, vector_size);
+}
+
+#define DEFINE_FIXED_WIDTH_X86(DIM) \
+TARGET_AVX2 static real update_float_avx2_##DIM(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) { \
+    return update_float_avx2_body(pw1, pw2, pg1, pg2, logval, weight, scratch, DIM); \
+} \
+TARGET_AVX2 static real update_double_avx2_##DIM(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) { \
+    return update_double_avx2_body(pw1, pw2, pg1, pg2, logval, weight, scratch, DIM); \
+} \
+TARGET_AVX512 static real update_float_avx512_##DIM(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) { \
+    return update_float_avx512_body(pw1, pw2, pg1, pg2, logval, weight, scratch, DIM); \
+} \
+TARGET_AVX512 static real update_double_avx512_##DIM(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) { \
+    return update_double_avx512_body(pw1, pw2, pg1, pg2, logval, weight, scratch, DIM); \
+}
+FOR_EACH_FIXED_WIDTH(DEFINE_FIXED_WIDTH_X86)
+
+static int cpu_has_avx2(void) { __builtin_cpu_init(); return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"); }
+static int cpu_has_avx512(void) { __builtin_cpu_init(); return __builtin_cpu_supports("avx512f"); }
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+// NEON是aarch64的基本指令集，不需要运行时检测
+/* NEON is mandatory on aarch64, so these kernels need no runtime check */
+KERNEL_INLINE real update_float_neon_body(float *w1, float *w2, float *g1, float *g2, real logval, real weight,
+                                          float *old, int dim) {
+    int b, bad;
+    float diff, fdiff;
+    real cost_rec;
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (b = 0; b + 4 <= dim; b += 4) acc = vfmaq_f32(acc, vld1q_f32(w1 + b), vld1q_f32(w2 + b));
+    diff = vaddvq_f32(acc);
+    for (; b < dim; b++) diff += w1[b] * w2[b];
+    diff += w1[dim] + w2[dim] - (float)logval;
+    fdiff = (float)weight * diff;
+    if (float_nonfinite(diff) || float_nonfinite(fdiff)) return -1;
+    cost_rec = 0.5 * fdiff * diff;
+    fdiff *= (float)eta;
+
+    const float32x4_t vf = vdupq_n_f32(fdiff);
+    const uint32x4_t expmask = vdupq_n_u32(0x7f800000u);
+    uint32x4_t nonfinite = vdupq_n_u32(0);
+    for (b = 0; b + 4 <= dim; b += 4) {
+        float32x4_t x1 = vld1q_f32(w1 + b), x2 = vld1q_f32(w2 + b);
+        float32x4_t q1 = vld1q_f32(g1 + b), q2 = vld1q_f32(g2 + b);
+        float32x4_t t1 = vmulq_f32(vf, x2), t2 = vmulq_f32(vf, x1);
+        float32x4_t r1 = vrsqrteq_f32(q1), r2 = vrsqrteq_f32(q2);
+        // two Newton steps on the 8-bit estimate
+        r1 = vmulq_f32(r1, vrsqrtsq_f32(vmulq_f32(q1, r1), r1));
+        r2 = vmulq_f32(r2, vrsqrtsq_f32(vmulq_f32(q2, r2), r2));
+        r1 = vmulq_f32(r1, vrsqrtsq_f32(vmulq_f32(q1, r1), r1));
+        r2 = vmulq_f32(r2, vrsqrtsq_f32(vmulq_f32(q2, r2), r2));
+        float32x4_t u1 = vmulq_f32(t1, r1), u2 = vmulq_f32(t2, r2);
+        vst1q_f32(g1 + b, vfmaq_f32(q1, t1, t1));
+        vst1q_f32(g2 + b, vfmaq_f32(q2, t2, t2));
+        vst1q_f32(old + b, x1);
+        vst1q_f32(old + dim + b, x2);
+        vst1q_f32(w1 + b, vsubq_f32(x1, u1));
+        vst1q_f32(w2 + b, vsubq_f32(x2, u2));
+        nonfinite = vorrq_u32(nonfinite, vceqq_u32(vandq_u32(vreinterpretq_u32_f32(u1), expmask), expmask));
+        nonfinite = vorrq_u32(nonfinite, vceqq_u32(vandq_u32(vreinterpretq_u32_f32(u2), expmask), expmask));
+    }
+    bad = vmaxvq_u32(nonfinite) != 0;
+    return finish_float(w1, w2, g1, g2, old, b, dim, fdiff, bad, cost_rec);
+}
+
+KERNEL_INLINE real update_double_neon_body(double *w1, double *w2, double *g1, double *g2, real logval, real weight,
+                                           double *old, int dim) {
+    int b, bad;
+    double diff, fdiff;
+    real cost_rec;
+    float64x2_t acc = vdupq_n_f64(0.0);
+    for (b = 0; b + 2 <= dim; b += 2) acc = vfmaq_f64(acc, vld1q_f64(w1 + b), vld1q_f64(w2 + b));
+    diff = vaddvq_f64(acc);
+    for (; b < dim; b++) diff += w1[b] * w2[b];
+    diff += w1[dim] + w2[dim] - logval;
+    fdiff = weight * diff;
+    if (double_nonfinite(diff) || double_nonfinite(fdiff)) return -1;
+    cost_rec = 0.5 * fdiff * diff;
+    fdiff *= eta;
+
+    const float64x2_t vf = vdupq_n_f64(fdiff);
+    const uint64x2_t expmask = vdupq_n_u64(0x7ff0000000000000ull);
+    uint64x2_t nonfinite = vdupq_n_u64(0);
+    for (b = 0; b + 2 <= dim; b += 2) {
+        float64x2_t x1 = vld1q_f64(w1 + b), x2 = vld1q_f64(w2 + b);
+        float64x2_t q1 = vld1q_f64(g1 + b), q2 = vld1q_f64(g2 + b);
+        float64x2_t t1 = vmulq_f64(vf, x2), t2 = vmulq_f64(vf, x1);
+        float64x2_t u1 = vdivq_f64(t1, vsqrtq_f64(q1)), u2 = vdivq_f64(t2, vsqrtq_f64(q2));
+        vst1q_f64(g1 + b, vfmaq_f64(q1, t1, t1));
+        vst1q_f64(g2 + b, vfmaq_f64(q2, t2, t2));
+        vst1q_f64(old + b, x1);
+        vst1q_f64(old + dim + b, x2);
+        vst1q_f64(w1 + b, vsubq_f64(x1, u1));
+        vst1q_f64(w2 + b, vsubq_f64(x2, u2));
+        nonfinite = vorrq_u64(nonfinite, vceqq_u64(vandq_u64(vreinterpretq_u64_f64(u1), expmask), expmask));
+        nonfinite = vorrq_u64(nonfinite, vceqq_u64(vandq_u64(vreinterpretq_u64_f64(u2), expmask), expmask));
+    }
+    bad = (vgetq_lane_u64(nonfinite, 0) | vgetq_lane_u64(nonfinite, 1)) != 0;
+    return finish_double(w1, w2, g1, g2, old, b, dim, fdiff, bad, cost_rec);
+}
+
+static real update_float_neon(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) {
+    return update_float_neon_body(pw1, pw2, pg1, pg2, logval, weight, scratch, vector_size);
+}
+static real update_double_neon(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) {
+    return update_double_neon_body(pw1, pw2, pg1, pg2, logval, weight, scratch, vector_size);
+}
+
+#define DEFINE_FIXED_WIDTH_NEON(DIM) \
+static real update_float_neon_##DIM(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) { \
+    return update_float_neon_body(pw1, pw2, pg1, pg2, logval, weight, scratch, DIM); \
+} \
+static real update_double_neon_##DIM(void *pw1, void *pw2, void *pg1, void *pg2, real logval, real weight, void *scratch) { \
+    return update_double_neon_body(pw1, pw2, pg1, pg2, logval, weight, scratch, DIM); \
+}
+FOR_EACH_FIXED_WIDTH(DEFINE_FIXED_WIDTH_NEON)
+#endif
+
+static int cpu_any(void) { return 1; }
+
+// 所有可用的更新函数，同一精度下越靠后的越优先；width不为0的只在vector_size等于width时使用
+/* All update kernels. For a given precision, later supported entries are preferred by -kernel auto; entries with a
+ * nonzero width only apply when vector_size equals it, and then win over the generic kernel of the same name. */
+typedef struct update_kernel {
+    const char *name;
+    int precision;
+    update_fn fn;
+    int (*supported)(void);
+    int width;
+} KERNEL;
+
+#define SCALAR_ENTRIES(DIM) \
+    {"scalar", PRECISION_DOUBLE, update_double_##DIM, cpu_any, DIM}, \
+    {"scalar", PRECISION_FLOAT, update_float_##DIM, cpu_any, DIM}, \
+    {"scalar", PRECISION_HALF, update_half_##DIM, cpu_any, DIM},
+#define AVX2_ENTRIES(DIM) \
+    {"avx2", PRECISION_DOUBLE, update_double_avx2_##DIM, cpu_has_avx2, DIM}, \
+    {"avx2", PRECISION_FLOAT, update_float_avx2_##DIM, cpu_has_avx2, DIM},
+#define AVX512_ENTRIES(DIM) \
+    {"avx512", PRECISION_DOUBLE, update_double_avx512_##DIM, cpu_has_avx512, DIM}, \
+    {"avx512", PRECISION_FLOAT, update_float_avx512_##DIM, cpu_has_avx512, DIM},
+#define NEON_ENTRIES(DIM) \
+    {"neon", PRECISION_DOUBLE, update_double_neon_##DIM, cpu_any, DIM}, \
+    {"neon", PRECISION_FLOAT, update_float_neon_##DIM, cpu_any, DIM},
+
+KERNEL kernels[] = {
+    {"scalar", PRECISION_DOUBLE, update_double, cpu_any, 0},
+    {"scalar", PRECISION_FLOAT, update_float, cpu_any, 0},
+    {"scalar", PRECISION_HALF, update_half, cpu_any, 0},
+    FOR_EACH_FIXED_WIDTH(SCALAR_ENTRIES)
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", PRECISION_DOUBLE, update_double_avx2, cpu_has_avx2, 0},
+    {"avx2", PRECISION_FLOAT, update_float_avx2, cpu_has_avx2, 0},
+    FOR_EACH_FIXED_WIDTH(AVX2_ENTRIES)
+    {"avx512", PRECISION_DOUBLE, update_double_avx512, cpu_has_avx512, 0},
+    {"avx512", PRECISION_FLOAT, update_float_avx512, cpu_has_avx512, 0},
+    FOR_EACH_FIXED_WIDTH(AVX512_ENTRIES)
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    {"neon", PRECISION_DOUBLE, update_double_neon, cpu_any, 0},
+    {"neon", PRECISION_FLOAT, update_float_neon, cpu_any, 0},
+    FOR_EACH_FIXED_WIDTH(NEON_ENTRIES)
+#endif
+};
+#define NUM_KERNELS ((int)(sizeof(kernels) / sizeof(KERNEL)))
+
+// 这个更新函数能否用于当前的精度和维度
+/* Whether kernel k can run with the current precision and vector size on this CPU */
+int kernel_usable(int k) {
+    return kernels[k].precision == precision && (kernels[k].width == 0 || kernels[k].width == vector_size) && kernels[k].supported();
+}
+
+// 按名字选择更新函数，"auto"选择当前CPU支持的最快的一个，有定长版本时优先用定长版本
+// fixed_width为0时不使用定长版本；返回kernels中的下标，找不到返回-1
+/* Pick the update kernel by name for the current precision; "auto" takes the best instruction set this CPU supports.
+ * A fixed-width instance is preferred over the generic kernel unless fixed_width is 0. Returns -1 if none matches. */
+int select_kernel(const char *name, int fixed_width) {
+    int k, found = -1;
+    for (k = 0; k < NUM_KERNELS; k++) {
+        if (!kernel_usable(k) || (kernels[k].width != 0 && !fixed_width)) continue;
+        if (strcmp(name, "auto") != 0 && strcmp(name, kernels[k].name) != 0) continue;
+        found = k; // entries of one instruction set are grouped generic first, so a matching fixed width comes last
+    }
+    return found;
+}
+
+// 把共现文件映射到内存。use_mmap == 2时再尝试锁定在物理内存中，这样之后的每一轮迭代都不用再读磁盘
+/* Map the cooccurrence file read-only; with use_mmap == 2 also try to pin it in RAM so later epochs never touch disk */
+int map_cooccur_file(long long file_size) {
+    int fd, flags = MAP_SHARED;
+    long pages = sysconf(_SC_AVPHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+    fd = open(input_file, O_RDONLY);
+    if (fd < 0) {fprintf(stderr,"Unable to open cooccurrence file %s.\n",input_file); return 1;}
+    cooccur_map_size = (size_t)file_size;
+    if (use_mmap == 2 && pages > 0 && (long long)pages * page_size < file_size) {
+        fprintf(stderr, "Cooccurrence file is larger than free memory; streaming it from disk instead of pinning.\n");
+        use_mmap = 1;
+    }
+#ifdef MAP_POPULATE
+    if (use_mmap == 2) flags |= MAP_POPULATE;
+#endif
+    cooccur_map = (CREC *)mmap(NULL, cooccur_map_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (cooccur_map == MAP_FAILED) {
+        cooccur_map = NULL;
+        fprintf(stderr,"Unable to map cooccurrence file %s.\n",input_file);
+        return 1;
+    }
+    if (use_mmap == 2 && mlock(cooccur_map, cooccur_map_size) != 0) {
+        if (verbose > 0) fprintf(stderr, "Could not lock cooccurrence file in memory (check ulimit -l); pages may be evicted.\n");
+    }
+    return 0;
+}
+
+// 提示内核某个线程会顺序读取这一段，并马上开始预读
+/* Hint sequential access for a thread's slice and start readahead */
+void madvise_slice(CREC *slice, long long length) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    char *start = (char *)((uintptr_t)slice & ~(uintptr_t)(page_size - 1)); // madvise needs a page aligned address
+    size_t len = (char *)(slice + length) - start;
+    madvise(start, len, MADV_SEQUENTIAL);
+    madvise(start, len, MADV_WILLNEED);
+}
+
+// 工作线程和主线程在每一轮迭代的开始和结束时同步用的屏障
+// 没有用pthread_barrier_t，因为不是所有平台都有
+/* Reusable barrier; pthread_barrier_t is optional in POSIX and missing on some platforms */
+typedef struct epoch_barrier {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count, waiting, generation;
+} BARRIER;
+
+BARRIER epoch_start, epoch_end;
+BARRIER sync_reached, sync_done; // around the syncs within an epoch, with sync_rounds > 1
+int stop_training = 0; // Set by the main thread before the final epoch_start to make workers exit
+
+void barrier_init(BARRIER *bar, int count) {
+    pthread_mutex_init(&bar->lock, NULL);
+    pthread_cond_init(&bar->cond, NULL);
+    bar->count = count;
+    bar->waiting = 0;
+    bar->generation = 0;
+}
+
+void barrier_wait(BARRIER *bar) {
+    pthread_mutex_lock(&bar->lock);
+    int gen = bar->generation;
+    if (++bar->waiting == bar->count) {
+        bar->waiting = 0;
+        bar->generation++;
+        pthread_cond_broadcast(&bar->cond);
+    } else {
+        while (gen == bar->generation) pthread_cond_wait(&bar->cond, &bar->lock);
+    }
+    pthread_mutex_unlock(&bar->lock);
+}
+
+/***
+ *  高频词的行（-hot-rows K）：词的id就是频率排名，前K个词的行几乎被每个线程一直写，多线程时互相踩缓存行，还会丢失更新
+ *  每个线程对这2K行（K个词向量和K个上下文向量）用自己的私有副本训练：一行在两次合并之间第一次用到时从全局读入，
+ *  每hot_merge_every条记录加锁合并一次，把用到过的行的改变量（副本 - 读入时的值）加到全局的行上。其余的行仍然是Hogwild
+ *  全局的高频行只在合并时加锁写入，所以不会丢失更新；每轮迭代结束前合并，所以检查点和多机同步看到的都是合并后的值
+ */
+
+typedef struct hot_rows {
+    void *w, *g;                // private rows: word rows 0..hot_rows-1, then the context rows of the same words
+    void *w0, *g0;              // their values when loaded
+    unsigned char *loaded;      // whether private row i is in use since the last merge
+    long long *dirty, n_dirty;  // the rows in use
+    long long since_merge;      // records trained since the last merge
+} HOT_ROWS;
+
+pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void hot_rows_free(HOT_ROWS *hr) {
+    if (hr == NULL) return;
+    free(hr->w);
+    free(hr->w0);
+    if (param_layout != LAYOUT_INTERLEAVED) {free(hr->g); free(hr->g0);}
+    free(hr->loaded);
+    free(hr->dirty);
+    free(hr);
+}
+
+/* Allocate one thread's copies, laid out like W and gradsq (row_stride apart, gradsq interleaved if W is). Returns
+ * NULL if out of memory */
+HOT_ROWS *hot_rows_create() {
+    size_t bytes = 2 * hot_rows * row_stride * param_size;
+    HOT_ROWS *hr = (HOT_ROWS *)calloc(1, sizeof(HOT_ROWS));
+    if (hr == NULL) return NULL;
+    hr->loaded = (unsigned char *)calloc(2 * hot_rows, 1);
+    hr->dirty = (long long *)malloc(2 * hot_rows * sizeof(long long));
+    if (hr->loaded == NULL || hr->dirty == NULL || posix_memalign(&hr->w, 128, bytes) != 0 || posix_memalign(&hr->w0, 128, bytes) != 0) {
+        hot_rows_free(hr);
+        return NULL;
+    }
+    if (param_layout == LAYOUT_INTERLEAVED) {
+        hr->g = (char *)hr->w + ((char *)gradsq - (char *)W);
+        hr->g0 = (char *)hr->w0 + ((char *)gradsq - (char *)W);
+    }
+    else if (posix_memalign(&hr->g, 128, bytes) != 0 || posix_memalign(&hr->g0, 128, bytes) != 0) {hot_rows_free(hr); return NULL;}
+    return hr;
+}
+
+/* Global row of private row i */
+static inline long long hot_global_row(long long i) {
+    return i < hot_rows ? i : vocab_size + i - hot_rows;
+}
+
+/* Byte offset of private row i, the first time since the last merge it is used: copy it from the global row. Reading
+ * the global row needs no lock; the base is taken from the private copy, so the merged delta is exact even if the
+ * read raced with another thread's merge */
+static inline long long hot_row(HOT_ROWS *hr, long long i) {
+    long long o = i * row_stride * param_size;
+    if (!hr->loaded[i]) {
+        size_t row_bytes = (vector_size + 1) * param_size;
+        long long go = hot_global_row(i) * row_stride * param_size;
+        memcpy((char *)hr->w + o, (char *)W + go, row_bytes);
+        memcpy((char *)hr->g + o, (char *)gradsq + go, row_bytes);
+        memcpy((char *)hr->w0 + o, (char *)hr->w + o, row_bytes);
+        memcpy((char *)hr->g0 + o, (char *)hr->g + o, row_bytes);
+        hr->loaded[i] = 1;
+        hr->dirty[hr->n_dirty++] = i;
+    }
+    return o;
+}
+
+/* Add this thread's changes to the rows it used since the last merge to the global rows */
+void hot_rows_merge(HOT_ROWS *hr) {
+    long long d, i, b, li, gi;
+    pthread_mutex_lock(&hot_lock);
+    for (d = 0; d < hr->n_dirty; d++) {
+        i = hr->dirty[d];
+        for (b = 0; b <= vector_size; b++) {
+            li = i * row_stride + b;
+            gi = hot_global_row(i) * row_stride + b;
+            set_param(W, gi, get_param(W, gi) + get_param(hr->w, li) - get_param(hr->w0, li));
+            set_param(gradsq, gi, get_param(gradsq, gi) + get_param(hr->g, li) - get_param(hr->g0, li));
+        }
+        hr->loaded[i] = 0;
+    }
+    pthread_mutex_unlock(&hot_lock);
+    hr->n_dirty = 0;
+    hr->since_merge = 0;
+}
+
+// 一轮迭代中间的同步点：先合并高频行，等主线程把各rank的参数同步好再继续
+/* A worker's sync point within an epoch: merge its hot rows, then wait while the main thread syncs the ranks */
+void sync_point(HOT_ROWS *hr) {
+    if (hr != NULL) hot_rows_merge(hr);
+    barrier_wait(&sync_reached);
+    barrier_wait(&sync_done);
+}
+
+/* Record weights for the weighting function, as stored by -weight-cache */
+static inline void weigh_record(const CREC *cr, float *lw) {
+    lw[0] = log(cr->val);
+    lw[1] = (cr->val > x_max) ? 1.0 : pow(cr->val / x_max, alpha);
+}
+
+void weigh_records(const CREC *cr, long long n, float *lw) {
+    long long a;
+    for (a = 0; a < n; a++) weigh_record(&cr[a], lw + 2 * a);
+}
+
+/* Decide whether record i of this epoch is trained on; returns 0 to skip it, else divides *weight by the probability
+ * it was kept with. loss is the record's entry of record_loss, or NULL */
+static inline int sample_record(long long i, real *weight, const float *loss) {
+    double keep = 1, p;
+    if (*weight < min_weight) return 0;
+    if (*weight < subsample) keep = *weight / subsample;
+    if (loss != NULL && *loss >= 0 && mean_record_cost > 0) {
+        p = *loss / (adaptive * mean_record_cost);
+        keep *= p < ADAPTIVE_MIN_KEEP ? ADAPTIVE_MIN_KEEP : (p > 1 ? 1 : p);
+    }
+    if (keep >= 1) return 1;
+    if ((counter_rand(seed, SAMPLE_STREAM + current_epoch, i) >> 11) * 0x1.0p-53 >= keep) return 0;
+    *weight /= keep;
+    return 1;
+}
+
+// 一个线程在一轮迭代里处理自己负责的那一段记录，返回这一段的总误差
+// lw不为NULL时是这段记录的log(val)和f(val)（fill为1时先算出来填进去）
+/* Run one pass over length cooccurrence records, from slice or else read from fin; returns the summed cost. With lw,
+ * the log and weight of record a are lw[2a] and lw[2a+1], computed here first if fill is set. first is the position
+ * of the first record in this epoch's order (in the input, for -adaptive); records left out by sample_record are
+ * counted in *skipped, and with skipped NULL every record is trained on */
+real train_slice(CREC *slice, long long length, FILE *fin, void *scratch, float *lw, int fill, HOT_ROWS *hr, long long first, long long *skipped) {
+    long long a, l1, l2;
+    CREC cr, *crp = &cr;
+    real rec_cost, total = 0, logval, weight, train_weight;
+    char *w1, *w2, *g1, *g2;
+    float *loss = record_loss != NULL && skipped != NULL ? record_loss + first : NULL;
+    for (a = 0; a < length; a++) {
+        if (slice != NULL) crp = &slice[a]; // slices never run past num_lines
+        else {
+            fread(&cr, sizeof(CREC), 1, fin);
+            if (feof(fin)) break;
+        }
+        if (crp->word1 < 1 || crp->word2 < 1) { continue; }
         
         /* Get location of words in W & gradsq */
-        l1 = (cr.word1 - 1LL) * (vector_size + 1); // cr word indices start at 1
-        l2 = ((cr.word2 - 1LL) + vocab_size) * (vector_size + 1); // shift by vocab_size to get separate vectors for context words
+        l1 = (crp->word1 - 1LL) * row_stride; // cr word indices start at 1
+        l2 = ((crp->word2 - 1LL) + vocab_size) * row_stride; // shift by vocab_size to get separate vectors for context words
         
-        /* Calculate cost, save diff for gradients */
-        diff = 0;
-        for (b = 0; b < vector_size; b++) diff += W[b + l1] * W[b + l2]; // dot product of word and context word vector
-        diff += W[vector_size + l1] + W[vector_size + l2] - log(cr.val); // add separate bias for each word
-        fdiff = (cr.val > x_max) ? diff : pow(cr.val / x_max, alpha) * diff; // multiply weighting function (f) with diff
+        /* Calculate cost and apply adaptive gradient updates; weighting function is 1 above x_max */
+        if (lw != NULL) {
+            if (fill) weigh_record(crp, lw + 2 * a);
+            logval = lw[2 * a];
+            weight = lw[2 * a + 1];
+        }
+        else {
+            logval = log(crp->val);
+            weight = (crp->val > x_max) ? 1.0 : pow(crp->val / x_max, alpha);
+        }
+        train_weight = weight;
+        if (sampling && skipped != NULL && !sample_record(first + a, &train_weight, loss != NULL ? loss + a : NULL)) {
+            (*skipped)++;
+            continue;
+        }
+        w1 = (char *)W + l1 * param_size; g1 = (char *)gradsq + l1 * param_size;
+        w2 = (char *)W + l2 * param_size; g2 = (char *)gradsq + l2 * param_size;
+        if (hr != NULL) { // frequent words use this thread's private rows
+            if (crp->word1 <= hot_rows) {
+                l1 = hot_row(hr, crp->word1 - 1LL);
+                w1 = (char *)hr->w + l1; g1 = (char *)hr->g + l1;
+            }
+            if (crp->word2 <= hot_rows) {
+                l2 = hot_row(hr, crp->word2 - 1LL + hot_rows);
+                w2 = (char *)hr->w + l2; g2 = (char *)hr->g + l2;
+            }
+        }
+        rec_cost = update_record(w1, w2, g1, g2, logval, train_weight, scratch);
+        if (hr != NULL && ++hr->since_merge >= hot_merge_every) hot_rows_merge(hr);
 
         // Check for NaN and inf() in the diffs.
-        if (isnan(diff) || isnan(fdiff) || isinf(diff) || isinf(fdiff)) {
+        if (rec_cost < 0) {
             fprintf(stderr,"Caught NaN in diff for kdiff for thread. Skipping update");
             continue;
         }
+        if (loss != NULL) loss[a] = rec_cost * weight / train_weight;
 
-        cost[id] += 0.5 * fdiff * diff; // weighted squared error
-        
-        /* Adaptive gradient updates */
-        fdiff *= eta; // for ease in calculating gradient
-        real W_updates1_sum = 0;
-        real W_updates2_sum = 0;
-        for (b = 0; b < vector_size; b++) {
-            // learning rate times gradient for word vectors
-            temp1 = fdiff * W[b + l2];
-            temp2 = fdiff * W[b + l1];
-            // adaptive updates
-            W_updates1[b] = temp1 / sqrt(gradsq[b + l1]);
-            W_updates2[b] = temp2 / sqrt(gradsq[b + l2]);
-            W_updates1_sum += W_updates1[b];
-            W_updates2_sum += W_updates2[b];
-            gradsq[b + l1] += temp1 * temp1;
-            gradsq[b + l2] += temp2 * temp2;
-        }
-        if (!isnan(W_updates1_sum) && !isinf(W_updates1_sum) && !isnan(W_updates2_sum) && !isinf(W_updates2_sum)) {
-            for (b = 0; b < vector_size; b++) {
-                W[b + l1] -= W_updates1[b];
-                W[b + l2] -= W_updates2[b];
+        total += rec_cost; // weighted squared error
+    }
+    return total;
+}
+
+/* Fisher-Yates over the records of block b (and their weights, with lw), the same for every thread count */
+void permute_block(CREC *buffer, long long length, long long b, float *lw) {
+    long long i, j;
+    float ftmp;
+    CREC tmp;
+    for (i = length - 1; i > 0; i--) {
+        j = counter_rand_below(seed, 2 * current_epoch + 1, b * shuffle_block + i, i + 1);
+        tmp = buffer[j];
+        buffer[j] = buffer[i];
+        buffer[i] = tmp;
+        if (lw != NULL) {
+            ftmp = lw[2 * j]; lw[2 * j] = lw[2 * i]; lw[2 * i] = ftmp;
+            ftmp = lw[2 * j + 1]; lw[2 * j + 1] = lw[2 * i + 1]; lw[2 * i + 1] = ftmp;
+        }
+    }
+}
+
+// -block-shuffle：共现文件没有经过shuffle打乱时，由glove自己打乱
+// 每轮迭代块的顺序重新随机排列，线程t处理block_order中的第t段；每个块读入缓冲区后，块内的记录也随机打乱
+// 随机数都由(seed, 迭代轮数, 块号)决定，与线程数无关
+// 紧凑格式的输入也走这里：块就是文件里的块，解码到buffer中；没有-block-shuffle时block_order保持原来的顺序，块内也不打乱
+/* Shuffle in glove instead of with the shuffle tool: visit this thread's share of the epoch's block order, reading
+ * each block into buffer and permuting its records before training on them. Compact input is always read this way,
+ * decoding its file blocks with buf and cbuf as scratch, and is only permuted with -block-shuffle */
+real train_blocks(long long id, CREC *buffer, FILE *fin, void *scratch, unsigned char *buf, unsigned char *cbuf, float *lwbuf, HOT_ROWS *hr) {
+    long long a, b, length, part, first = num_blocks * id / num_threads, last = num_blocks * (id + 1) / num_threads;
+    real total = 0;
+    float *lw = NULL;
+    for (part = 0; part < sync_rounds; part++) { // the ranks sync between parts, each a share of this thread's blocks
+        for (a = first + (last - first) * part / sync_rounds; a < first + (last - first) * (part + 1) / sync_rounds; a++) {
+            b = block_order[a];
+            length = (b == num_blocks - 1) ? num_lines - b * shuffle_block : shuffle_block;
+            if (input_format != CREC_FORMAT_RAW) {
+                fseeko(fin, block_offset[b], SEEK_SET);
+                if ((length = crec_read_block(fin, input_format, buffer, buf, cbuf)) < 0) {
+                    fprintf(stderr,"Unable to decode block %lld of %s; skipping it.\n", b, input_file);
+                    continue;
+                }
+                thread_records[id] += length;
+                if (weight_cache != NULL) lw = weight_cache + 2 * block_first[b];
+                if (shuffle_block == 0) {
+                    total += train_slice(buffer, length, NULL, scratch, lw, !weight_cache_ready, hr, block_first[b], &thread_skipped[id]);
+                    continue;
+                }
+            }
+            else if (cooccur_map != NULL) memcpy(buffer, cooccur_map + shard_start + b * shuffle_block, length * sizeof(CREC));
+            else {
+                fseeko(fin, (shard_start + b * shuffle_block) * sizeof(CREC), SEEK_SET);
+                length = fread(buffer, sizeof(CREC), length, fin);
+            }
+            if (input_format == CREC_FORMAT_RAW) thread_records[id] += length;
+            if (weight_cache != NULL) { // weights of the block in file order, permuted along with the records below
+                if (input_format == CREC_FORMAT_RAW) lw = weight_cache + 2 * b * shuffle_block;
+                if (!weight_cache_ready) weigh_records(buffer, length, lw);
+                memcpy(lwbuf, lw, 2 * length * sizeof(float));
             }
+            permute_block(buffer, length, b, weight_cache != NULL ? lwbuf : NULL);
+            total += train_slice(buffer, length, NULL, scratch, weight_cache != NULL ? lwbuf : NULL, 0, hr, b * shuffle_block, &thread_skipped[id]);
         }
+        if (part + 1 < sync_rounds) sync_point(hr);
+    }
+    return total;
+}
 
-        // updates for bias terms
-        W[vector_size + l1] -= check_nan(fdiff / sqrt(gradsq[vector_size + l1]));
-        W[vector_size + l2] -= check_nan(fdiff / sqrt(gradsq[vector_size + l2]));
-        fdiff *= fdiff;
-        gradsq[vector_size + l1] += fdiff;
-        gradsq[vector_size + l2] += fdiff;
-        
+/* Draw the block order for an epoch; called by the main thread while the workers wait at epoch_start */
+void shuffle_blocks(int epoch) {
+    long long i, j, tmp;
+    for (i = 0; i < num_blocks; i++) block_order[i] = i;
+    for (i = num_blocks - 1; i > 0; i--) {
+        j = counter_rand_below(seed, 2 * epoch, i, i + 1);
+        tmp = block_order[j];
+        block_order[j] = block_order[i];
+        block_order[i] = tmp;
+    }
+}
+
+/* Set up pipe input: reserve address space for memory_limit worth of records (pages are only allocated as they are
+ * filled) and read in blocks of shuffle_block records. Returns 0 on success */
+int open_pipe_input() {
+    long long capacity;
+    if (shuffle_block <= 0) shuffle_block = CREC_BLOCK_RECORDS;
+    pipe_in.mem_blocks = (long long)(memory_limit * 1073741824.0 / sizeof(CREC)) / shuffle_block;
+    capacity = (pipe_in.mem_blocks > 0 ? pipe_in.mem_blocks : 1) * shuffle_block;
+    cooccur_map_size = capacity * sizeof(CREC);
+    cooccur_map = mmap(NULL, cooccur_map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cooccur_map == MAP_FAILED) {
+        cooccur_map = NULL;
+        fprintf(stderr, "Unable to reserve %lld MB for the cooccurrence data; lower -memory.\n", (long long)(cooccur_map_size >> 20));
+        return 1;
+    }
+    pthread_mutex_init(&pipe_in.lock, NULL);
+    pthread_cond_init(&pipe_in.cond, NULL);
+    pipe_in.capacity = 1024;
+    pipe_in.pending = (long long *)malloc(sizeof(long long) * pipe_in.capacity);
+    pipe_in.fd = -1;
+    pipe_epoch = 1;
+    if (verbose > 0) fprintf(stderr, "reading cooccurrence data from stdin in blocks of %lld records, up to %lld MB in memory\n",
+                             shuffle_block, (long long)(pipe_in.mem_blocks * shuffle_block * sizeof(CREC)) >> 20);
+    return 0;
+}
+
+static int write_all(int fd, const void *p, size_t bytes) {
+    ssize_t n;
+    while (bytes > 0) {
+        if ((n = write(fd, p, bytes)) <= 0) return 1;
+        p = (const char *)p + n;
+        bytes -= n;
     }
-    free(W_updates1);
-    free(W_updates2);
+    return 0;
+}
+
+/* Make block b, of length records, available to the workers; length < shuffle_block (the last block) or error ends
+ * the input */
+void publish_block(long long b, long long length, int error) {
+    pthread_mutex_lock(&pipe_in.lock);
+    if (length > 0) {
+        if (pipe_in.n_pending == pipe_in.capacity) {
+            pipe_in.capacity *= 2;
+            pipe_in.pending = (long long *)realloc(pipe_in.pending, sizeof(long long) * pipe_in.capacity);
+        }
+        pipe_in.pending[pipe_in.n_pending++] = b;
+        pipe_in.loaded += length;
+    }
+    if (length < shuffle_block || error) pipe_in.done = 1;
+    pthread_cond_broadcast(&pipe_in.cond);
+    pthread_mutex_unlock(&pipe_in.lock);
+}
+
+// 主线程在第一轮迭代中读入标准输入，每读满一块就交给工作线程
+/* Read the pipe input to its end during the first epoch; blocks past memory_limit go to stream_file, together with a
+ * copy of the blocks in memory so that later epochs can read the whole input from there. Returns 0 on success */
+int read_pipe_input() {
+    CREC_READER reader;
+    CREC *spill = NULL, *dest;
+    long long b, got, n = 0, report = 0;
+    if (crec_reader_open(&reader, stdin) != 0) {fprintf(stderr, "Unable to read cooccurrence data from stdin.\n"); publish_block(0, 0, 1); return 1;}
+    for (b = 0; ; b++) {
+        if (b == pipe_in.mem_blocks) {
+            if (verbose > 0) fprintf(stderr, "\ncooccurrence data is over -memory; continuing in %s\n", stream_file);
+            spill = (CREC *)malloc(shuffle_block * sizeof(CREC));
+            if (spill == NULL || (pipe_in.fd = open(stream_file, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+                fprintf(stderr, "Unable to open %s.\n", stream_file);
+                break;
+            }
+            if (write_all(pipe_in.fd, cooccur_map, b * shuffle_block * sizeof(CREC)) != 0) {fprintf(stderr, "Unable to write %s.\n", stream_file); break;}
+        }
+        dest = spill != NULL ? spill : cooccur_map + b * shuffle_block;
+        for (got = 0; got < shuffle_block && (n = crec_read(&reader, dest + got, shuffle_block - got)) > 0; got += n);
+        if (n < 0) {fprintf(stderr, "Corrupt cooccurrence data on stdin after %lld records.\n", b * shuffle_block + got); break;}
+        if (spill != NULL && write_all(pipe_in.fd, spill, got * sizeof(CREC)) != 0) {fprintf(stderr, "Unable to write %s.\n", stream_file); break;}
+        publish_block(b, got, 0);
+        if (got < shuffle_block) break;
+        if (verbose > 1 && (b + 1) * shuffle_block - report >= 10000000) {
+            report = (b + 1) * shuffle_block;
+            fprintf(stderr, "\033[0G%lld lines read.", report);
+        }
+    }
+    pipe_in.bytes = reader.bytes;
+    crec_reader_close(&reader);
+    free(spill);
+    if (!pipe_in.done) {publish_block(b, 0, 1); return 1;}
+    if (verbose > 1 && report > 0) fprintf(stderr, "\n");
+    return 0;
+}
+
+/* Next block of the first epoch of pipe input: a random one of the blocks read and not yet trained on, waiting for
+ * the reader if there is none. Returns -1 at the end of the input */
+long long take_pipe_block(long long *length) {
+    long long b = -1, j;
+    pthread_mutex_lock(&pipe_in.lock);
+    while (pipe_in.n_pending == 0 && !pipe_in.done) pthread_cond_wait(&pipe_in.cond, &pipe_in.lock);
+    if (pipe_in.n_pending > 0) {
+        j = counter_rand_below(seed, 2 * current_epoch, pipe_in.taken++, pipe_in.n_pending);
+        b = pipe_in.pending[j];
+        pipe_in.pending[j] = pipe_in.pending[--pipe_in.n_pending];
+        *length = pipe_in.loaded - b * shuffle_block < shuffle_block ? pipe_in.loaded - b * shuffle_block : shuffle_block;
+    }
+    pthread_mutex_unlock(&pipe_in.lock);
+    return b;
+}
+
+// 第一轮迭代（管道输入）：块的顺序由读入的快慢决定，块内仍按(seed, 迭代轮数, 块号)打乱
+/* First epoch of pipe input: train on blocks as the main thread reads them, each permuted as in train_blocks */
+real train_pipe(long long id, CREC *buffer, void *scratch, HOT_ROWS *hr) {
+    long long b, length;
+    size_t bytes;
+    real total = 0;
+    while ((b = take_pipe_block(&length)) >= 0) {
+        bytes = length * sizeof(CREC);
+        if (b < pipe_in.mem_blocks) memcpy(buffer, cooccur_map + b * shuffle_block, bytes);
+        else if (pread(pipe_in.fd, buffer, bytes, (off_t)(b * shuffle_block * sizeof(CREC))) != (ssize_t)bytes) {
+            fprintf(stderr, "Unable to read block %lld back from %s; skipping it.\n", b, stream_file);
+            continue;
+        }
+        thread_records[id] += length;
+        permute_block(buffer, length, b, NULL);
+        total += train_slice(buffer, length, NULL, scratch, NULL, 0, hr, b * shuffle_block, &thread_skipped[id]);
+    }
+    return total;
+}
+
+/* Allocate -weight-cache for num_lines records, if requested; it is filled during the next epoch */
+void alloc_weight_cache() {
+    if (use_weight_cache <= 0) return;
+    weight_cache = (float *)malloc(2 * num_lines * sizeof(float));
+    if (weight_cache == NULL) fprintf(stderr, "Unable to allocate %lld bytes for -weight-cache; computing weights every iteration.\n", 8 * num_lines);
+    else if (verbose > 1) fprintf(stderr,"caching record weights in %lld MB\n", (8 * num_lines) >> 20);
+}
+
+/* After the first epoch of pipe input: the number of records is known now, so set up the blocks of the later epochs,
+ * which read from stream_file instead of memory if the input went over memory_limit */
+int finish_pipe_input(int result, double started) {
+    pipe_epoch = 0;
+    if (result != 0) return result;
+    num_lines = global_lines = pipe_in.loaded;
+    fprintf(stderr,"Read %lld lines.\n", num_lines);
+    if (num_lines == 0) {fprintf(stderr, "No cooccurrence data on stdin.\n"); return 1;}
+    num_blocks = (num_lines + shuffle_block - 1) / shuffle_block;
+    block_order = (long long *)malloc(sizeof(long long) * (num_blocks + 1));
+    metrics_emit("pipe", wall_seconds() - started, "\"records\":%lld,\"bytes\":%lld,\"blocks\":%lld,\"spilled_blocks\":%lld",
+                 num_lines, pipe_in.bytes, num_blocks, pipe_in.fd < 0 ? 0 : num_blocks - pipe_in.mem_blocks);
+    if (pipe_in.fd >= 0) {
+        munmap(cooccur_map, cooccur_map_size);
+        cooccur_map = NULL;
+        strcpy(input_file, stream_file); // the workers open it at the next epoch
+    }
+    alloc_weight_cache();
+    return 0;
+}
+
+// 用多线程来训练模型
+// 工作线程在整个训练过程中只创建一次，文件句柄、映射和临时空间在各轮迭代间复用，每轮迭代在屏障处同步
+/* Long-lived training worker: keeps its file handle, mapping and scratch buffers across epochs and syncs with the
+ * main thread at the epoch barriers */
+void *glove_thread(void *vid) {
+    long long id = *(long long*)vid;
+    long long start = shard_start + num_lines / num_threads * id; //Threads spaced roughly equally throughout file (or this rank's shard)
+    long long part, from, to;
+    CREC *slice = NULL, *block = NULL;
+    unsigned char *buf = NULL, *cbuf = NULL;
+    float *lwbuf = NULL;
+    HOT_ROWS *hr = NULL;
+    FILE *fin = NULL;
+    if (numa_mode > 0) pin_thread(id); // before allocating, so the buffers below are on this thread's node
+    if (hot_rows > 0 && (hr = hot_rows_create()) == NULL) fprintf(stderr, "Unable to allocate hot rows for thread %lld; using shared rows.\n", id);
+    // W_updates1/2的临时空间，按最宽的计算类型分配
+    void *scratch = malloc(2 * vector_size * sizeof(real));
+    if (cooccur_map != NULL) slice = cooccur_map + start;
+    if (input_format != CREC_FORMAT_RAW) {
+        block = malloc(CREC_BLOCK_RECORDS * sizeof(CREC));
+        crec_alloc_buffers(&buf, &cbuf);
+    }
+    else if (shuffle_block > 0) block = malloc(shuffle_block * sizeof(CREC));
     
-    fclose(fin);
+    while (1) {
+        barrier_wait(&epoch_start);
+        if (stop_training) break;
+        // 管道输入在第一轮迭代之后才有stream_file和weight_cache，所以在这里按需打开和分配
+        if (cooccur_map == NULL && fin == NULL) fin = fopen(input_file, "rb");
+        if (weight_cache != NULL && shuffle_block > 0 && lwbuf == NULL) lwbuf = malloc(2 * shuffle_block * sizeof(float));
+        thread_seconds[id] = wall_seconds();
+        thread_records[id] = block != NULL ? 0 : lines_per_thread[id];
+        thread_skipped[id] = 0;
+        if (pipe_epoch) cost[id] = train_pipe(id, block, scratch, hr);
+        else if (block != NULL) cost[id] = train_blocks(id, block, fin, scratch, buf, cbuf, lwbuf, hr);
+        else {
+            if (slice != NULL) {
+                // 直接在映射的内存上遍历，不用拷贝；流式模式下提示内核顺序读取并提前预读
+                if (use_mmap == 1) madvise_slice(slice, lines_per_thread[id]);
+            }
+            else fseeko(fin, start * (sizeof(CREC)), SEEK_SET); // also clears EOF left by the previous epoch
+            cost[id] = 0;
+            for (part = 0; part < sync_rounds; part++) { // the ranks sync between parts, each a share of this thread's records
+                from = lines_per_thread[id] * part / sync_rounds;
+                to = lines_per_thread[id] * (part + 1) / sync_rounds;
+                cost[id] += train_slice(slice != NULL ? slice + from : NULL, to - from, fin, scratch,
+                                        weight_cache != NULL ? weight_cache + 2 * (start - shard_start + from) : NULL, !weight_cache_ready, hr,
+                                        start - shard_start + from, &thread_skipped[id]);
+                if (part + 1 < sync_rounds) sync_point(hr);
+            }
+        }
+        if (hr != NULL) hot_rows_merge(hr);
+        thread_seconds[id] = wall_seconds() - thread_seconds[id];
+        barrier_wait(&epoch_end);
+    }
+    free(scratch);
+    free(block);
+    free(buf);
+    free(cbuf);
+    free(lwbuf);
+    hot_rows_free(hr);
+    
+    if (fin != NULL) fclose(fin);
     pthread_exit(NULL);
 }
 
+// float/half精度的二进制文件开头写一个64字节的文本头，记录精度和大小，double精度保持原来的无文件头格式
+/* Write readable fixed-size header for reduced precision binary output; double output stays headerless for compatibility */
+void write_bin_header(FILE *fout) {
+    char header[BIN_HEADER_SIZE + 1];
+    int len;
+    if (precision == PRECISION_DOUBLE) return;
+    len = snprintf(header, sizeof(header), "GloVe %s %lld %d", precision_name(precision), vocab_size, vector_size);
+    memset(header + len, ' ', BIN_HEADER_SIZE - len);
+    header[BIN_HEADER_SIZE - 1] = '\n';
+    fwrite(header, 1, BIN_HEADER_SIZE, fout);
+}
+
+// 输出文件先写到同名的.tmp文件，写完后再改名，这样中途被杀掉也不会留下不完整的检查点
+/* Open path.tmp for writing; close_atomic renames it over path once it is complete, so an interrupted save never
+ * leaves a partial file under the final name */
+FILE *open_atomic(const char *path, char *tmp) {
+    sprintf(tmp, "%s.tmp", path);
+    return fopen(tmp, "wb");
+}
+
+int close_atomic(FILE *f, const char *tmp, const char *path) {
+    int failed = fflush(f) != 0 || ferror(f);
+    saved_bytes += ftello(f);
+    if (fclose(f) != 0) failed = 1;
+    if (failed || rename(tmp, path) != 0) {remove(tmp); return 1;}
+    return 0;
+}
+
+// 文本输出：词表只在第一次保存时读一遍；各个线程分别把一段行格式化到自己的缓冲区，再按顺序写出
+// 浮点数用下面的put_real格式化，结果和printf的"%lf"逐字节相同
+#define TEXT_BATCH_ROWS 4096 // rows formatted by each thread per batch
+
+const char **vocab_words = NULL; // words of vocab_file, looked up on the first text save
+
+/* Get the words of vocab_file once, for every later text save: from its index if that was mapped at startup, else
+ * by parsing the file. Returns 0 on success */
+int load_vocab_words() {
+    long long a;
+    
+    if (vocab_words != NULL) return 0;
+    if (vocab.image == NULL && vocab_map_read_text(&vocab, vocab_file) != 0) {fprintf(stderr, "Unable to open file %s.\n",vocab_file); return 1;}
+    vocab_words = (const char **)malloc(vocab_size * sizeof(char *));
+    for (a = 0; a < vocab_size && a < vocab.size; a++) {
+        vocab_words[a] = vocab_map_word(&vocab, a + 1);
+        if (strcmp(vocab_words[a], "<unk>") == 0) break; // input vocab cannot contain special <unk> keyword
+    }
+    if (a < vocab_size) {
+        fprintf(stderr, "Bad vocab file %s at word %lld.\n", vocab_file, a + 1);
+        free(vocab_words);
+        vocab_words = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/* Append " %lf" of x to p and return the new end. Values below 1e6 in magnitude are rounded to 6 decimals by integer
+ * arithmetic; NaN, infinities, large values and values within 1e-3 of a halfway case go through snprintf, so the
+ * output always matches printf */
+static inline char *put_real(char *p, real x) {
+    char digits[24];
+    double ax = fabs(x), scaled, r;
+    unsigned long long v, ip;
+    int n = 0, k;
+    
+    *p++ = ' ';
+    if (!(ax < 1e6)) return p + sprintf(p, "%lf", x);
+    scaled = ax * 1e6;
+    r = floor(scaled);
+    if (fabs(scaled - r - 0.5) < 1e-3) return p + sprintf(p, "%lf", x);
+    v = (unsigned long long)r + (scaled - r > 0.5);
+    if (signbit(x)) *p++ = '-';
+    ip = v / 1000000;
+    v %= 1000000;
+    do {digits[n++] = '0' + ip % 10; ip /= 10;} while (ip > 0);
+    while (n > 0) *p++ = digits[--n];
+    *p++ = '.';
+    for (k = 5; k >= 0; k--) {p[k] = '0' + v % 10; v /= 10;}
+    return p + 6;
+}
+
+/* The longest line put_vector_row or put_gradsq_row can produce */
+size_t text_row_bound() {
+    return MAX_STRING_LENGTH + 2 * (vector_size + 1) * 330 + 2;
+}
+
+/* Format one line of the vectors file from word vector vec and context vector ctx (each with a trailing bias),
+ * following -model */
+char *put_vector_row(char *p, const char *word, const real *vec, const real *ctx) {
+    long long b;
+    size_t len = strlen(word);
+    memcpy(p, word, len);
+    p += len;
+    if (model == 0) { // Save all parameters (including bias)
+        for (b = 0; b < (vector_size + 1); b++) p = put_real(p, vec[b]);
+        for (b = 0; b < (vector_size + 1); b++) p = put_real(p, ctx[b]);
+    }
+    if (model == 1) // Save only "word" vectors (without bias)
+        for (b = 0; b < vector_size; b++) p = put_real(p, vec[b]);
+    if (model == 2) // Save "word + context word" vectors (without bias)
+        for (b = 0; b < vector_size; b++) p = put_real(p, vec[b] + ctx[b]);
+    *p++ = '\n';
+    return p;
+}
+
+typedef struct text_job {
+    void *w, *g;                // parameters to format; g == NULL when gradsq is not saved
+    long long start, end;       // rows [start, end)
+    char *buf, *gbuf;           // formatted lines of the vectors and gradsq files
+    size_t len, glen, cap, gcap;
+} TEXT_JOB;
+
+/* Make room for one more line in a job buffer */
+static int reserve_row(char **buf, size_t len, size_t *cap) {
+    char *grown;
+    if (len + text_row_bound() <= *cap) return 0;
+    *cap = 2 * *cap + text_row_bound();
+    if ((grown = realloc(*buf, *cap)) == NULL) return 1;
+    *buf = grown;
+    return 0;
+}
+
+void *format_text_rows(void *arg) {
+    TEXT_JOB *job = (TEXT_JOB *)arg;
+    real *vec = (real *)malloc(2 * (vector_size + 1) * sizeof(real)), *ctx = vec + vector_size + 1;
+    long long a, b;
+    
+    job->len = job->glen = 0;
+    for (a = job->start; a < job->end; a++) {
+        if (reserve_row(&job->buf, job->len, &job->cap) != 0) {job->len = (size_t)-1; break;}
+        for (b = 0; b < (vector_size + 1); b++) {
+            vec[b] = get_param(job->w, a * row_stride + b);
+            ctx[b] = get_param(job->w, (vocab_size + a) * row_stride + b);
+        }
+        job->len = put_vector_row(job->buf + job->len, vocab_words[a], vec, ctx) - job->buf;
+        if (job->g != NULL) { // Save gradsq
+            char *p;
+            if (reserve_row(&job->gbuf, job->glen, &job->gcap) != 0) {job->len = (size_t)-1; break;}
+            p = job->gbuf + job->glen;
+            b = strlen(vocab_words[a]);
+            memcpy(p, vocab_words[a], b);
+            p += b;
+            for (b = 0; b < (vector_size + 1); b++) p = put_real(p, get_param(job->g, a * row_stride + b));
+            for (b = 0; b < (vector_size + 1); b++) p = put_real(p, get_param(job->g, (vocab_size + a) * row_stride + b));
+            *p++ = '\n';
+            job->glen = p - job->gbuf;
+        }
+    }
+    free(vec);
+    return NULL;
+}
+
+/* Write the text lines of all vocab words to fout (and fgs, if not NULL), formatting TEXT_BATCH_ROWS rows per thread
+ * at a time on num_threads threads and writing the results in order. Returns 0 on success */
+int write_text_rows(void *w, void *g, FILE *fout, FILE *fgs) {
+    int t, failed = 0, nthreads = num_threads > 0 ? num_threads : 1;
+    long long a;
+    TEXT_JOB *jobs = (TEXT_JOB *)calloc(nthreads, sizeof(TEXT_JOB));
+    pthread_t *pt = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    char *started = (char *)calloc(nthreads, 1);
+    
+    for (a = 0; a < vocab_size && !failed; a += (long long)nthreads * TEXT_BATCH_ROWS) {
+        for (t = 0; t < nthreads; t++) {
+            jobs[t].w = w;
+            jobs[t].g = fgs != NULL ? g : NULL;
+            jobs[t].start = a + (long long)t * TEXT_BATCH_ROWS;
+            if (jobs[t].start > vocab_size) jobs[t].start = vocab_size;
+            jobs[t].end = jobs[t].start + TEXT_BATCH_ROWS;
+            if (jobs[t].end > vocab_size) jobs[t].end = vocab_size;
+            started[t] = t > 0 && pthread_create(&pt[t], NULL, format_text_rows, &jobs[t]) == 0;
+        }
+        format_text_rows(&jobs[0]);
+        for (t = 1; t < nthreads; t++) {
+            if (started[t]) pthread_join(pt[t], NULL);
+            else format_text_rows(&jobs[t]);
+        }
+        for (t = 0; t < nthreads && !failed; t++) {
+            if (jobs[t].len == (size_t)-1) {failed = 1; break;}
+            if (fwrite(jobs[t].buf, 1, jobs[t].len, fout) != jobs[t].len) failed = 1;
+            if (fgs != NULL && fwrite(jobs[t].gbuf, 1, jobs[t].glen, fgs) != jobs[t].glen) failed = 1;
+        }
+    }
+    for (t = 0; t < nthreads; t++) {free(jobs[t].buf); free(jobs[t].gbuf);}
+    free(jobs);
+    free(pt);
+    free(started);
+    return failed;
+}
+
+/* Write the 2 * vocab_size rows of a parameter array without padding: one fwrite if the rows are contiguous, else one
+ * per row. Returns 0 on success */
+int write_param_rows(const void *p, FILE *fout) {
+    long long a, n = 2 * vocab_size;
+    if (row_stride == vector_size + 1) return fwrite(p, param_size * row_stride, n, fout) != (size_t)n;
+    for (a = 0; a < n; a++)
+        if (fwrite((const char *)p + a * row_stride * param_size, param_size, vector_size + 1, fout) != (size_t)(vector_size + 1)) return 1;
+    return 0;
+}
+
 // 把得到的结果保存到文件中
-/* Save params to file */
-int save_params(int nb_iter) {
+/* Save params w and g (W and gradsq, or a snapshot of them) to file */
+int save_params(int nb_iter, void *w, void *g) {
     /*
      * nb_iter is the number of iteration (= a full pass through the cooccurrence matrix).
      *   nb_iter > 0 => checkpointing the intermediate parameters, so nb_iter is in the filename of output file.
@@ -196,10 +1943,9 @@ int save_params(int nb_iter) {
      */
 
     long long a, b;
-    char format[20];
     char output_file[MAX_STRING_LENGTH], output_file_gsq[MAX_STRING_LENGTH];
-    char *word = malloc(sizeof(char) * MAX_STRING_LENGTH + 1);
-    FILE *fid, *fout, *fgs;
+    char tmp_file[MAX_STRING_LENGTH + 4], tmp_file_gsq[MAX_STRING_LENGTH + 4];
+    FILE *fout, *fgs = NULL;
     
     if (use_binary > 0) { // Save parameters in binary file
         if (nb_iter <= 0)
@@ -207,20 +1953,22 @@ int save_params(int nb_iter) {
         else
             sprintf(output_file,"%s.%03d.bin",save_W_file,nb_iter);
 
-        fout = fopen(output_file,"wb");
+        fout = open_atomic(output_file, tmp_file);
         if (fout == NULL) {fprintf(stderr, "Unable to open file %s.\n",save_W_file); return 1;}
-        for (a = 0; a < 2 * (long long)vocab_size * (vector_size + 1); a++) fwrite(&W[a], sizeof(real), 1,fout);
-        fclose(fout);
+        write_bin_header(fout);
+        if (write_param_rows(w, fout) != 0) {fprintf(stderr, "Unable to write file %s.\n",output_file); fclose(fout); remove(tmp_file); return 1;}
+        if (close_atomic(fout, tmp_file, output_file) != 0) {fprintf(stderr, "Unable to write file %s.\n",output_file); return 1;}
         if (save_gradsq > 0) {
             if (nb_iter <= 0)
                 sprintf(output_file_gsq,"%s.bin",save_gradsq_file);
             else
                 sprintf(output_file_gsq,"%s.%03d.bin",save_gradsq_file,nb_iter);
 
-            fgs = fopen(output_file_gsq,"wb");
+            fgs = open_atomic(output_file_gsq, tmp_file_gsq);
             if (fgs == NULL) {fprintf(stderr, "Unable to open file %s.\n",save_gradsq_file); return 1;}
-            for (a = 0; a < 2 * (long long)vocab_size * (vector_size + 1); a++) fwrite(&gradsq[a], sizeof(real), 1,fgs);
-            fclose(fgs);
+            write_bin_header(fgs);
+            if (write_param_rows(g, fgs) != 0) {fprintf(stderr, "Unable to write file %s.\n",output_file_gsq); fclose(fgs); remove(tmp_file_gsq); return 1;}
+            if (close_atomic(fgs, tmp_file_gsq, output_file_gsq) != 0) {fprintf(stderr, "Unable to write file %s.\n",output_file_gsq); return 1;}
         }
     }
     if (use_binary != 1) { // Save parameters in text file
@@ -234,71 +1982,397 @@ int save_params(int nb_iter) {
             else
                 sprintf(output_file_gsq,"%s.%03d.txt",save_gradsq_file,nb_iter);
 
-            fgs = fopen(output_file_gsq,"wb");
+            fgs = open_atomic(output_file_gsq, tmp_file_gsq);
             if (fgs == NULL) {fprintf(stderr, "Unable to open file %s.\n",save_gradsq_file); return 1;}
         }
-        fout = fopen(output_file,"wb");
+        fout = open_atomic(output_file, tmp_file);
         if (fout == NULL) {fprintf(stderr, "Unable to open file %s.\n",save_W_file); return 1;}
-        fid = fopen(vocab_file, "r");
-        sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-        if (fid == NULL) {fprintf(stderr, "Unable to open file %s.\n",vocab_file); return 1;}
-	if (write_header) fprintf(fout, "%ld %d\n", vocab_size, vector_size);
-        for (a = 0; a < vocab_size; a++) {
-            if (fscanf(fid,format,word) == 0) return 1;
-            // input vocab cannot contain special <unk> keyword
-            if (strcmp(word, "<unk>") == 0) return 1;
-            fprintf(fout, "%s",word);
-            if (model == 0) { // Save all parameters (including bias)
-                for (b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", W[a * (vector_size + 1) + b]);
-                for (b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", W[(vocab_size + a) * (vector_size + 1) + b]);
-            }
-            if (model == 1) // Save only "word" vectors (without bias)
-                for (b = 0; b < vector_size; b++) fprintf(fout," %lf", W[a * (vector_size + 1) + b]);
-            if (model == 2) // Save "word + context word" vectors (without bias)
-                for (b = 0; b < vector_size; b++) fprintf(fout," %lf", W[a * (vector_size + 1) + b] + W[(vocab_size + a) * (vector_size + 1) + b]);
-            fprintf(fout,"\n");
-            if (save_gradsq > 0) { // Save gradsq
-                fprintf(fgs, "%s",word);
-                for (b = 0; b < (vector_size + 1); b++) fprintf(fgs," %lf", gradsq[a * (vector_size + 1) + b]);
-                for (b = 0; b < (vector_size + 1); b++) fprintf(fgs," %lf", gradsq[(vocab_size + a) * (vector_size + 1) + b]);
-                fprintf(fgs,"\n");
-            }
-            if (fscanf(fid,format,word) == 0) return 1; // Eat irrelevant frequency entry
+        if (load_vocab_words() != 0) {fclose(fout); remove(tmp_file); if (save_gradsq > 0) {fclose(fgs); remove(tmp_file_gsq);} return 1;}
+	if (write_header) fprintf(fout, "%lld %d\n", vocab_size, vector_size);
+        if (write_text_rows(w, g, fout, save_gradsq > 0 ? fgs : NULL) != 0) {
+            fprintf(stderr, "Unable to write file %s.\n", output_file);
+            fclose(fout); remove(tmp_file);
+            if (save_gradsq > 0) {fclose(fgs); remove(tmp_file_gsq);}
+            return 1;
         }
 
         if (use_unk_vec) {
             real* unk_vec = (real*)calloc((vector_size + 1), sizeof(real));
             real* unk_context = (real*)calloc((vector_size + 1), sizeof(real));
-            word = "<unk>";
+            char *line = malloc(text_row_bound());
 
             int num_rare_words = vocab_size < 100 ? vocab_size : 100;
 
             for (a = vocab_size - num_rare_words; a < vocab_size; a++) {
                 for (b = 0; b < (vector_size + 1); b++) {
-                    unk_vec[b] += W[a * (vector_size + 1) + b] / num_rare_words;
-                    unk_context[b] += W[(vocab_size + a) * (vector_size + 1) + b] / num_rare_words;
+                    unk_vec[b] += get_param(w, a * row_stride + b) / num_rare_words;
+                    unk_context[b] += get_param(w, (vocab_size + a) * row_stride + b) / num_rare_words;
                 }
             }
 
-            fprintf(fout, "%s",word);
-            if (model == 0) { // Save all parameters (including bias)
-                for (b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", unk_vec[b]);
-                for (b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", unk_context[b]);
-            }
-            if (model == 1) // Save only "word" vectors (without bias)
-                for (b = 0; b < vector_size; b++) fprintf(fout," %lf", unk_vec[b]);
-            if (model == 2) // Save "word + context word" vectors (without bias)
-                for (b = 0; b < vector_size; b++) fprintf(fout," %lf", unk_vec[b] + unk_context[b]);
-            fprintf(fout,"\n");
+            fwrite(line, 1, put_vector_row(line, "<unk>", unk_vec, unk_context) - line, fout);
 
+            free(line);
             free(unk_vec);
             free(unk_context);
         }
 
-        fclose(fid);
-        fclose(fout);
-        if (save_gradsq > 0) fclose(fgs);
+        if (close_atomic(fout, tmp_file, output_file) != 0) {fprintf(stderr, "Unable to write file %s.\n",output_file); return 1;}
+        if (save_gradsq > 0 && close_atomic(fgs, tmp_file_gsq, output_file_gsq) != 0) {fprintf(stderr, "Unable to write file %s.\n",output_file_gsq); return 1;}
+    }
+    return 0;
+}
+
+// 后台写检查点：主线程在屏障处把W和gradsq拷贝到快照里（只是一次memcpy），然后由另一个线程慢慢写文件，训练继续进行
+/* Background checkpoints: between epochs the main thread copies W and gradsq into snapshot buffers, which takes a
+ * memcpy, and a separate thread writes the files with save_params while training carries on. The snapshots are
+ * allocated on first use and reused, so this costs one extra copy of the parameters (two with -save-gradsq) */
+typedef struct checkpoint {
+    pthread_t thread;
+    int active, nb_iter, result;
+    void *w, *g;
+} CHECKPOINT;
+
+CHECKPOINT checkpoint;
+
+void *checkpoint_thread(void *arg) {
+    CHECKPOINT *c = (CHECKPOINT *)arg;
+    c->result = save_params(c->nb_iter, c->w, c->g);
+    return NULL;
+}
+
+/* Wait for the checkpoint being written, if any. Returns its save_params result */
+int wait_checkpoint() {
+    if (!checkpoint.active) return 0;
+    pthread_join(checkpoint.thread, NULL);
+    checkpoint.active = 0;
+    if (verbose > 1 && checkpoint.result == 0) fprintf(stderr, "    checkpoint for iter %03d written\n", checkpoint.nb_iter);
+    return checkpoint.result;
+}
+
+/* Snapshot W and gradsq and start writing them as the checkpoint for nb_iter; the previous checkpoint is waited for
+ * first. Returns nonzero if the previous checkpoint failed or no memory is left for the snapshot */
+int start_checkpoint(int nb_iter) {
+    size_t bytes = param_alloc_size;
+    int interleaved = param_layout == LAYOUT_INTERLEAVED, result = wait_checkpoint();
+    if (result != 0) return result;
+    if (checkpoint.w == NULL && posix_memalign(&checkpoint.w, 128, bytes) != 0) checkpoint.w = NULL;
+    if (interleaved && checkpoint.w != NULL) checkpoint.g = (char *)checkpoint.w + ((char *)gradsq - (char *)W); // copied along with W
+    else if (save_gradsq > 0 && checkpoint.g == NULL && posix_memalign(&checkpoint.g, 128, bytes) != 0) checkpoint.g = NULL;
+    if (checkpoint.w == NULL || (save_gradsq > 0 && checkpoint.g == NULL)) {
+        fprintf(stderr, "Unable to allocate checkpoint snapshot; writing checkpoints synchronously.\n");
+        checkpoint_async = 0;
+        return save_params(nb_iter, W, gradsq);
+    }
+    memcpy(checkpoint.w, W, bytes);
+    if (save_gradsq > 0 && !interleaved) memcpy(checkpoint.g, gradsq, bytes);
+    checkpoint.nb_iter = nb_iter;
+    checkpoint.result = 0;
+    if (pthread_create(&checkpoint.thread, NULL, checkpoint_thread, &checkpoint) != 0) return save_params(nb_iter, checkpoint.w, checkpoint.g);
+    checkpoint.active = 1;
+    return 0;
+}
+
+// 更新函数的微基准测试：在随机的词对上分别运行当前精度下所有可用的更新函数，输出每秒更新次数
+/* Microbenchmark: run every update kernel available for the current precision over random word pairs and report
+ * updates/sec. Pairs and weights are precomputed so only the kernel is timed. */
+int benchmark_kernels(long long num_updates) {
+    long long a, n_pairs = num_updates < 1048576 ? num_updates : 1048576;
+    long long *l1 = malloc(sizeof(long long) * n_pairs), *l2 = malloc(sizeof(long long) * n_pairs);
+    real *logval = malloc(sizeof(real) * n_pairs), *weight = malloc(sizeof(real) * n_pairs), val;
+    void *scratch = malloc(2 * vector_size * sizeof(real));
+    struct timespec t0, t1;
+    double seconds;
+    int k;
+    
+    if (vocab_size <= 0) vocab_size = 100000;
+    for (a = 0; a < n_pairs; a++) {
+        l1[a] = rand() % vocab_size; // row numbers; row_stride is known once the parameters are allocated
+        l2[a] = rand() % vocab_size + vocab_size;
+        val = 1.0 + rand() % 200;
+        logval[a] = log(val);
+        weight[a] = (val > x_max) ? 1.0 : pow(val / x_max, alpha);
+    }
+    printf("precision %s, vector size %d, vocab size %lld, %lld updates per kernel\n", precision_name(precision), vector_size, vocab_size, num_updates);
+    for (k = 0; k < NUM_KERNELS; k++) {
+        if (!kernel_usable(k)) continue;
+        srand(1);
+        initialize_parameters();
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (a = 0; a < num_updates; a++) {
+            long long p = a % n_pairs;
+            long long o1 = l1[p] * row_stride * param_size, o2 = l2[p] * row_stride * param_size;
+            kernels[k].fn((char *)W + o1, (char *)W + o2, (char *)gradsq + o1, (char *)gradsq + o2, logval[p], weight[p], scratch);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+        printf("kernel %-8s %-8s %10.2f M updates/sec\n", kernels[k].name, kernels[k].width ? "fixed" : "generic", num_updates / seconds * 1e-6);
+        metrics_emit("bench_kernel", seconds, "\"kernel\":\"%s\",\"width\":\"%s\",\"precision\":\"%s\",\"vector_size\":%d,\"updates\":%lld,\"updates_per_sec\":%.0f",
+                     kernels[k].name, kernels[k].width ? "fixed" : "generic", precision_name(precision), vector_size, num_updates, num_updates / seconds);
+        free_parameters();
+    }
+    free(l1); free(l2); free(logval); free(weight); free(scratch);
+    return 0;
+}
+
+// 多线程扩展性的基准测试：在按Zipf分布生成的记录上，分别用1/8/16/32/64个线程训练一遍，比较Hogwild和-hot-rows
+// 记录的总数固定，分给所有线程，输出每秒更新次数和一遍之后的误差（丢失的更新会让误差变大）
+/* Thread scaling benchmark: one pass over num_records synthetic records with Zipf distributed word ids, split over 1,
+ * 8, 16, 32 and 64 threads, with shared rows only and with -hot-rows (1024 rows unless given). Reports updates/sec and
+ * the mean cost of a second pass, which grows when updates are lost */
+typedef struct bench_job {
+    CREC *slice;
+    long long length;
+    void *scratch;
+    HOT_ROWS *hr;
+    real cost;
+} BENCH_JOB;
+
+void *bench_thread(void *arg) {
+    BENCH_JOB *job = (BENCH_JOB *)arg;
+    job->cost = train_slice(job->slice, job->length, NULL, job->scratch, NULL, 0, job->hr, 0, NULL);
+    if (job->hr != NULL) hot_rows_merge(job->hr);
+    return NULL;
+}
+
+/* Run one pass with nthreads threads; returns its wall time in seconds and sets the total cost */
+double bench_pass(CREC *records, long long n, int nthreads, int hot, real *cost_out) {
+    pthread_t *pt = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    BENCH_JOB *jobs = (BENCH_JOB *)calloc(nthreads, sizeof(BENCH_JOB));
+    double t0, seconds;
+    int t;
+    for (t = 0; t < nthreads; t++) {
+        jobs[t].slice = records + n * t / nthreads;
+        jobs[t].length = n * (t + 1) / nthreads - n * t / nthreads;
+        jobs[t].scratch = malloc(2 * vector_size * sizeof(real));
+        jobs[t].hr = hot ? hot_rows_create() : NULL;
+    }
+    t0 = wall_seconds();
+    for (t = 0; t < nthreads; t++) pthread_create(&pt[t], NULL, bench_thread, &jobs[t]);
+    for (t = 0; t < nthreads; t++) pthread_join(pt[t], NULL);
+    seconds = wall_seconds() - t0;
+    for (*cost_out = 0, t = 0; t < nthreads; t++) {
+        *cost_out += jobs[t].cost;
+        free(jobs[t].scratch);
+        hot_rows_free(jobs[t].hr);
+    }
+    free(jobs);
+    free(pt);
+    return seconds;
+}
+
+int benchmark_threads(long long num_records) {
+    static const int thread_counts[] = {1, 8, 16, 32, 64};
+    CREC *records = (CREC *)malloc(num_records * sizeof(CREC));
+    long long a, saved_hot = hot_rows;
+    double seconds;
+    real cost, check;
+    int c, hot;
+    
+    if (records == NULL) {fprintf(stderr, "Unable to allocate %lld benchmark records.\n", num_records); return 1;}
+    if (vocab_size <= 0) vocab_size = 100000;
+    if (saved_hot <= 0) saved_hot = 1024;
+    if (saved_hot > vocab_size) saved_hot = vocab_size;
+    for (a = 0; a < num_records; a++) { // rank ~ 1/r
+        records[a].word1 = (int)counter_zipf(seed, 0, a, vocab_size, 1.0);
+        records[a].word2 = (int)counter_zipf(seed, 1, a, vocab_size, 1.0);
+        records[a].val = 1.0 + counter_rand_below(seed, 2, a, 200);
+    }
+    printf("precision %s, vector size %d, vocab size %lld, %lld records, kernel %s, -hot-rows %lld, merged every %lld records\n",
+           precision_name(precision), vector_size, vocab_size, num_records, update_kernel_name, saved_hot, hot_merge_every);
+    for (c = 0; c < (int)(sizeof(thread_counts) / sizeof(int)); c++) {
+        for (hot = 0; hot <= 1; hot++) {
+            srand(1);
+            initialize_parameters();
+            hot_rows = hot ? saved_hot : 0;
+            seconds = bench_pass(records, num_records, thread_counts[c], hot, &cost);
+            bench_pass(records, num_records, 1, 0, &check); // cost of the trained model, measured serially
+            printf("threads %2d %-9s %10.2f M updates/sec, cost after pass %lf\n", thread_counts[c], hot ? "hot-rows" : "hogwild",
+                   num_records / seconds * 1e-6, check / num_records);
+            metrics_emit("bench_threads", seconds, "\"threads\":%d,\"mode\":\"%s\",\"records\":%lld,\"updates_per_sec\":%.0f,\"cost\":%lf",
+                         thread_counts[c], hot ? "hot-rows" : "hogwild", num_records, num_records / seconds, check / num_records);
+            free_parameters();
+        }
+    }
+    hot_rows = saved_hot;
+    free(records);
+    return 0;
+}
+
+// 每轮迭代结束后由主线程调用：汇总各线程的误差，输出日志，按需保存中间结果
+// 此时所有工作线程都停在屏障处，可以安全地读取W和gradsq
+/* Called by the main thread between epochs, while all workers wait at the barrier: reduce per-thread cost, report and
+ * checkpoint. Returns nonzero to stop training. */
+int end_of_epoch(int nb_iter) {
+    long long a, skipped = 0;
+    int save_params_return_code;
+    real total_cost = 0;
+    time_t rawtime;
+    struct tm *info;
+    char time_buffer[80];
+    double t, rate, min_rate = 0, max_rate = 0, max_seconds = 0, sum_seconds = 0, train_seconds = wall_seconds() - epoch_started;
+    
+    for (a = 0; a < num_threads; a++) {
+        total_cost += cost[a];
+        rate = thread_records[a] / (thread_seconds[a] + 1e-9);
+        if (a == 0 || rate < min_rate) min_rate = rate;
+        if (a == 0 || rate > max_rate) max_rate = rate;
+        if (thread_seconds[a] > max_seconds) max_seconds = thread_seconds[a];
+        sum_seconds += thread_seconds[a];
+        skipped += thread_skipped[a];
+    }
+    if (dist_size > 1) {
+        double t0 = wall_seconds();
+        total_cost = dist_sum(total_cost);
+        skipped = dist_sum_ll(skipped);
+        if (sync_rounds > 1 || nb_iter % sync_every == 0 || nb_iter == num_iter || (checkpoint_every > 0 && nb_iter % checkpoint_every == 0)) {
+            dist_sync_params();
+            syncs++;
+        }
+        sync_seconds += wall_seconds() - t0;
+    }
+    mean_record_cost = total_cost / global_lines;
+    if (dist_rank != 0) return dist_any(0);
+    time(&rawtime);
+    info = localtime(&rawtime);
+    strftime(time_buffer,80,"%x - %I:%M.%S%p", info);
+    // 跳过的记录不更新参数；cost仍是所有记录的平均误差（的无偏估计），可以和不跳过时比较
+    if (sampling) fprintf(stderr, "%s, iter: %03d, cost: %lf, processed: %lld, skipped: %lld\n", time_buffer, nb_iter, total_cost/global_lines,
+                          global_lines - skipped, skipped);
+    else fprintf(stderr, "%s, iter: %03d, cost: %lf\n", time_buffer,  nb_iter, total_cost/global_lines);
+    if (dist_size > 1 && verbose > 0) {
+        double seconds = wall_seconds() - epoch_started;
+        // 和单机训练的records/s比较就得到扩展效率
+        fprintf(stderr, "    %d ranks: %.0f records/s, %.0f per rank, %d syncs in %.2fs\n", dist_size, global_lines / seconds,
+                global_lines / seconds / dist_size, syncs, sync_seconds);
+    }
+    // 不均衡度 = 最慢的线程的用时 / 各线程的平均用时，1表示完全均衡；多机训练时是rank 0上各线程的数字
+    metrics_emit("epoch", train_seconds, "\"iter\":%d,\"cost\":%lf,\"records\":%lld,\"skipped\":%lld,\"records_per_sec\":%.0f,\"threads\":%d,\"ranks\":%d,\"syncs\":%d,\"sync_seconds\":%.3f,"
+                 "\"thread_updates_per_sec_min\":%.0f,\"thread_updates_per_sec_max\":%.0f,\"imbalance\":%.3f",
+                 nb_iter, total_cost/global_lines, global_lines, skipped, global_lines / (train_seconds + 1e-9), num_threads, dist_size, syncs, sync_seconds,
+                 min_rate, max_rate, sum_seconds > 0 ? max_seconds * num_threads / sum_seconds : 1.0);
+
+    if (checkpoint_every > 0 && nb_iter % checkpoint_every == 0) {
+        t = wall_seconds();
+        if (checkpoint_async > 0) {
+            if (verbose > 1) fprintf(stderr,"    saving itermediate parameters for iter %03d in the background\n", nb_iter);
+            save_params_return_code = start_checkpoint(nb_iter);
+            metrics_emit("checkpoint", wall_seconds() - t, "\"iter\":%d,\"background\":1", nb_iter); // time the training threads waited for the snapshot
+            return dist_any(save_params_return_code);
+        }
+        fprintf(stderr,"    saving itermediate parameters for iter %03d...", nb_iter);
+        saved_bytes = 0;
+        save_params_return_code = save_params(nb_iter, W, gradsq);
+        if (save_params_return_code != 0)
+            return dist_any(save_params_return_code);
+        metrics_emit("checkpoint", wall_seconds() - t, "\"iter\":%d,\"background\":0,\"bytes_written\":%lld", nb_iter, saved_bytes);
+        fprintf(stderr,"done.\n");
+    }
+    return dist_any(0);
+}
+
+// 紧凑格式的输入：扫一遍块头（跳过块的内容），记下每个块的位置和总记录数
+/* Index the blocks of a compact cooccurrence file, positioned just past its header; sets num_lines and num_blocks.
+ * When the ranks of a distributed run share the file, only this rank's range of blocks is kept */
+int index_blocks(FILE *fin, int shared) {
+    long long a, first, last, records, capacity = 1024, *block_records = (long long *)malloc(sizeof(long long) * capacity);
+    off_t offset = ftello(fin);
+    block_offset = (off_t *)malloc(sizeof(off_t) * capacity);
+    num_lines = num_blocks = 0;
+    while ((records = crec_read_block(fin, input_format, NULL, NULL, NULL)) > 0) {
+        if (num_blocks == capacity) {
+            capacity *= 2;
+            block_offset = (off_t *)realloc(block_offset, sizeof(off_t) * capacity);
+            block_records = (long long *)realloc(block_records, sizeof(long long) * capacity);
+        }
+        block_records[num_blocks] = records;
+        block_offset[num_blocks++] = offset;
+        num_lines += records;
+        offset = ftello(fin);
+    }
+    if (records < 0) {fprintf(stderr,"Corrupt cooccurrence file %s at block %lld.\n", input_file, num_blocks); free(block_records); return 1;}
+    records = 0;
+    if (shared && dist_size > 1) {
+        first = num_blocks * dist_rank / dist_size;
+        last = num_blocks * (dist_rank + 1) / dist_size;
+        for (a = first, num_lines = 0; a < last; a++) {
+            block_offset[a - first] = block_offset[a];
+            block_records[a - first] = block_records[a];
+            num_lines += block_records[a];
+        }
+        num_blocks = last - first;
+    }
+    for (a = 0, first = 0; a < num_blocks; a++) { // counts become first record indices
+        records = block_records[a];
+        block_records[a] = first;
+        first += records;
+    }
+    block_first = block_records;
+    if (use_mmap > 0) {
+        fprintf(stderr,"-mmap is not used with compact input; reading blocks through stdio.\n");
+        use_mmap = 0;
+    }
+    return 0;
+}
+
+// 断点续训（-start-iter）：没有给出-init-W时，用save_W_file第start_iter轮的检查点；-1表示找最新的检查点
+/* Resolve -start-iter: without -init-W, resume from the binary checkpoint of iteration start_iter (and its gradsq
+ * checkpoint when -save-gradsq is on). start_iter == -1 picks the latest checkpoint on disk, or starts from scratch
+ * if there is none. Returns 0 on success */
+int find_resume_files() {
+    char file[MAX_STRING_LENGTH];
+    int b;
+    
+    if (start_iter == 0 || init_W_file[0] != 0) {
+        if (start_iter < 0) {fprintf(stderr, "-start-iter -1 needs the checkpoints of save-file; give the iteration of -init-W instead.\n"); return 1;}
+        return 0;
+    }
+    if (use_binary == 0) {fprintf(stderr, "Resuming needs binary checkpoints (-binary 1 or 2).\n"); return 1;}
+    if (start_iter < 0) {
+        for (b = num_iter; b > 0; b--) {
+            sprintf(file, "%s.%03d.bin", save_W_file, b);
+            if (access(file, R_OK) == 0) break;
+        }
+        start_iter = b;
+        if (start_iter == 0) {
+            if (verbose > 0) fprintf(stderr, "no checkpoint of %s found; starting from scratch\n", save_W_file);
+            return 0;
+        }
+    }
+    sprintf(init_W_file, "%s.%03d.bin", save_W_file, start_iter);
+    if (access(init_W_file, R_OK) != 0) {fprintf(stderr, "Checkpoint %s not found.\n", init_W_file); return 1;}
+    if (save_gradsq > 0 && init_gradsq_file[0] == 0) {
+        sprintf(init_gradsq_file, "%s.%03d.bin", save_gradsq_file, start_iter);
+        if (access(init_gradsq_file, R_OK) != 0) {
+            fprintf(stderr, "Checkpoint %s not found; squared gradients restart from 1.\n", init_gradsq_file);
+            init_gradsq_file[0] = 0;
+        }
+    }
+    if (verbose > 0) fprintf(stderr, "resuming after iter %03d from %s\n", start_iter, init_W_file);
+    return 0;
+}
+
+/* Open input_file and find this rank's records in it; sets num_lines, global_lines and *file_size. Returns 0 on success */
+int open_input_file(int shared, long long *file_size) {
+    FILE *fin = fopen(input_file, "rb");
+    if (fin == NULL) {fprintf(stderr,"Unable to open cooccurrence file %s.\n",input_file); return 1;}
+    if ((input_format = crec_file_format(fin)) != CREC_FORMAT_RAW) {
+        if (index_blocks(fin, shared) != 0) {fclose(fin); return 1;}
+        *file_size = ftello(fin);
     }
+    else {
+        fseeko(fin, 0, SEEK_END);
+        *file_size = ftello(fin);
+        num_lines = *file_size/(sizeof(CREC)); // Assuming the file isn't corrupt and consists only of CREC's
+        if (shared && dist_size > 1) { // this rank's share of the records
+            shard_start = num_lines * dist_rank / dist_size;
+            num_lines = num_lines * (dist_rank + 1) / dist_size - shard_start;
+        }
+    }
+    fclose(fin);
+    if (dist_size > 1) fprintf(stderr,"Rank %d of %d: read %lld lines of %s.\n", dist_rank, dist_size, num_lines, input_file);
+    else fprintf(stderr,"Read %lld lines.\n", num_lines);
+    global_lines = dist_sum_ll(num_lines);
     return 0;
 }
 
@@ -306,62 +2380,155 @@ int save_params(int nb_iter) {
 /* Train model */
 int train_glove() {
     long long a, file_size;
-    int save_params_return_code;
-    int b;
-    FILE *fin;
-    real total_cost = 0;
+    int b, shared, result = 0;
+    double started = wall_seconds(), t;
 
     fprintf(stderr, "TRAINING MODEL\n");
     
-    fin = fopen(input_file, "rb");
-    if (fin == NULL) {fprintf(stderr,"Unable to open cooccurrence file %s.\n",input_file); return 1;}
-    fseeko(fin, 0, SEEK_END);
-    file_size = ftello(fin);
-    num_lines = file_size/(sizeof(CREC)); // Assuming the file isn't corrupt and consists only of CREC's
-    fclose(fin);
-    fprintf(stderr,"Read %lld lines.\n", num_lines);
+    shared = strchr(input_file, '%') == NULL;
+    if (adaptive > 0 && (shuffle_block > 0 || strcmp(input_file, "-") == 0)) {
+        fprintf(stderr, "-adaptive keeps a loss per record in input order; it cannot be used with -block-shuffle or -input-file -.\n");
+        return 1;
+    }
+    if (strcmp(input_file, "-") == 0) {
+        if (dist_size > 1) {fprintf(stderr, "Distributed training reads its shards from files; -input-file - is not supported under mpirun.\n"); return 1;}
+        if (open_pipe_input() != 0) return 1;
+        num_lines = file_size = 0;
+    }
+    else if (shard_file_name() != 0) return 1;
+    else if ((result = open_input_file(shared, &file_size)) != 0) return result;
+    if (use_mmap > 0 && !pipe_epoch && map_cooccur_file(file_size) != 0) return 1;
     if (verbose > 1) fprintf(stderr,"Initializing parameters...");
     initialize_parameters();
     if (verbose > 1) fprintf(stderr,"done.\n");
+    // 多机训练时只有rank 0读检查点和-init-W，然后广播给其他rank
+    if (dist_rank == 0) result = find_resume_files();
+    if (dist_rank == 0 && result == 0 && (init_W_file[0] != 0 || init_gradsq_file[0] != 0)) {
+        long long old_size, *init_map = load_init_map(&old_size);
+        if (init_vocab_file[0] != 0 && init_map == NULL) result = 1;
+        if (result == 0 && init_W_file[0] != 0 && load_init_params(W, init_W_file, init_map, old_size) != 0) result = 1;
+        if (result == 0 && init_gradsq_file[0] != 0 && load_init_params(gradsq, init_gradsq_file, init_map, old_size) != 0) result = 1;
+        free(init_map);
+    }
+    if ((result = dist_share_params(result)) != 0) return result;
+    metrics_emit("load", wall_seconds() - started, "\"records\":%lld,\"bytes\":%lld,\"mmap\":%d,\"vocab_size\":%lld,\"vector_size\":%d,\"precision\":\"%s\"",
+                 num_lines, file_size, cooccur_map != NULL, vocab_size, vector_size, precision_name(precision));
     if (verbose > 0) fprintf(stderr,"vector size: %d\n", vector_size);
     if (verbose > 0) fprintf(stderr,"vocab size: %lld\n", vocab_size);
     if (verbose > 0) fprintf(stderr,"x_max: %lf\n", x_max);
     if (verbose > 0) fprintf(stderr,"alpha: %lf\n", alpha);
+    if (verbose > 0) fprintf(stderr,"precision: %s\n", precision_name(precision));
+    if (verbose > 1) fprintf(stderr,"update kernel: %s%s\n", update_kernel_name, update_kernel_width ? " (fixed width)" : "");
     pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
     lines_per_thread = (long long *) malloc(num_threads * sizeof(long long));
+    long long *thread_ids = (long long*)malloc(sizeof(long long) * num_threads);
+    for (a = 0; a < num_threads - 1; a++) lines_per_thread[a] = num_lines / num_threads;
+    lines_per_thread[a] = num_lines / num_threads + num_lines % num_threads;
     
-    time_t rawtime;
-    struct tm *info;
-    char time_buffer[80];
+    if (input_format != CREC_FORMAT_RAW) {
+        // 线程t处理连续的第t段块；-block-shuffle时每轮再重新排列
+        block_order = (long long *)malloc(sizeof(long long) * (num_blocks + 1));
+        for (a = 0; a < num_blocks; a++) block_order[a] = a;
+        if (shuffle_block > 0) shuffle_block = CREC_BLOCK_RECORDS;
+        if (verbose > 0) fprintf(stderr,"%s input in %lld blocks%s\n", input_format == CREC_FORMAT_COMPACT32 ? "compact32" : "compact",
+                                 num_blocks, shuffle_block > 0 ? ", shuffled" : "");
+    }
+    else if (shuffle_block > 0 && !pipe_epoch) { // pipe input sets up its blocks once it has been read
+        num_blocks = (num_lines + shuffle_block - 1) / shuffle_block;
+        block_order = (long long *)malloc(sizeof(long long) * (num_blocks + 1));
+        if (verbose > 0) fprintf(stderr,"shuffling in %lld blocks of %lld records\n", num_blocks, shuffle_block);
+    }
+    if (hot_rows > vocab_size) hot_rows = vocab_size;
+    if (!pipe_epoch) alloc_weight_cache();
+    if (adaptive > 0) {
+        if ((record_loss = (float *)malloc(num_lines * sizeof(float))) == NULL) {
+            fprintf(stderr, "Unable to allocate %lld bytes for -adaptive; training on every record.\n", 4 * num_lines);
+            adaptive = 0;
+            sampling = min_weight > 0 || subsample > 0;
+        }
+        else for (a = 0; a < num_lines; a++) record_loss[a] = -1;
+    }
+    barrier_init(&epoch_start, num_threads + 1);
+    barrier_init(&epoch_end, num_threads + 1);
+    barrier_init(&sync_reached, num_threads + 1);
+    barrier_init(&sync_done, num_threads + 1);
+    // 段数按每个rank的平均记录数算，所有rank一样，这样各rank在同一个同步点调用allreduce
+    if (dist_size > 1 && sync_records > 0 && !pipe_epoch) {
+        sync_rounds = (global_lines / dist_size + sync_records - 1) / sync_records;
+        if (sync_rounds < 1) sync_rounds = 1;
+        if (verbose > 0 && dist_rank == 0) fprintf(stderr, "syncing %d times per iteration\n", sync_rounds);
+    }
+    for (a = 0; a < num_threads; a++) {
+        thread_ids[a] = a;
+        pthread_create(&pt[a], NULL, glove_thread, (void *)&thread_ids[a]);
+    }
     // Lock-free asynchronous SGD
-    for (b = 0; b < num_iter; b++) {
-        total_cost = 0;
-        for (a = 0; a < num_threads - 1; a++) lines_per_thread[a] = num_lines / num_threads;
-        lines_per_thread[a] = num_lines / num_threads + num_lines % num_threads;
-        long long *thread_ids = (long long*)malloc(sizeof(long long) * num_threads);
-        for (a = 0; a < num_threads; a++) thread_ids[a] = a;
-        for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, glove_thread, (void *)&thread_ids[a]);
-        for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
-        for (a = 0; a < num_threads; a++) total_cost += cost[a];
-        free(thread_ids);
-
-        time(&rawtime);
-        info = localtime(&rawtime);
-        strftime(time_buffer,80,"%x - %I:%M.%S%p", info);
-        fprintf(stderr, "%s, iter: %03d, cost: %lf\n", time_buffer,  b+1, total_cost/num_lines);
-
-        if (checkpoint_every > 0 && (b + 1) % checkpoint_every == 0) {
-            fprintf(stderr,"    saving itermediate parameters for iter %03d...", b+1);
-            save_params_return_code = save_params(b+1);
-            if (save_params_return_code != 0)
-                return save_params_return_code;
-            fprintf(stderr,"done.\n");
+    // 续训时从第start_iter轮开始，每轮的随机流（块的顺序）和不中断时一样
+    for (b = start_iter; b < num_iter; b++) {
+        current_epoch = b;
+        epoch_started = wall_seconds();
+        sync_seconds = 0;
+        syncs = 0;
+        if (shuffle_block > 0 && !pipe_epoch) shuffle_blocks(b);
+        barrier_wait(&epoch_start); // release workers into this epoch
+        if (pipe_epoch) result = read_pipe_input(); // they train on the blocks while the rest is being read
+        for (a = 1; a < sync_rounds; a++) { // sync the ranks each time all workers reach the end of a part
+            barrier_wait(&sync_reached);
+            t = wall_seconds();
+            dist_sync_params();
+            syncs++;
+            sync_seconds += wall_seconds() - t;
+            barrier_wait(&sync_done);
         }
-
+        barrier_wait(&epoch_end); // and wait until all of them are done
+        weight_cache_ready = weight_cache != NULL;
+        if (pipe_epoch && (result = finish_pipe_input(result, epoch_started)) != 0) break;
+        if ((result = end_of_epoch(b + 1)) != 0) break;
     }
+    stop_training = 1;
+    barrier_wait(&epoch_start);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    free(thread_ids);
     free(pt);
     free(lines_per_thread);
-    return save_params(0);
+    free(block_order);
+    free(block_offset);
+    free(block_first);
+    free(weight_cache);
+    free(record_loss);
+    if (cooccur_map != NULL) munmap(cooccur_map, cooccur_map_size);
+    if (pipe_in.fd >= 0) {
+        close(pipe_in.fd);
+        unlink(stream_file);
+    }
+    free(pipe_in.pending);
+    if (wait_checkpoint() != 0 && result == 0) result = 1;
+    free(checkpoint.w);
+    if (param_layout != LAYOUT_INTERLEAVED) free(checkpoint.g);
+    free(sync_W);
+    if (param_layout != LAYOUT_INTERLEAVED) free(sync_gradsq);
+    if (result != 0 || dist_rank != 0) return result;
+    started = wall_seconds();
+    saved_bytes = 0;
+    if ((result = save_params(0, W, gradsq)) == 0)
+        metrics_emit("dump", wall_seconds() - started, "\"bytes_written\":%lld,\"mb_per_sec\":%.1f", saved_bytes, saved_bytes / 1048576.0 / (wall_seconds() - started + 1e-9));
+    return result;
+}
+
+/* Number of lines of a file, or -1 if it cannot be read */
+long long count_lines(const char *path) {
+    char *buf = malloc(1 << 20);
+    const char *p, *end;
+    long long lines = 0;
+    size_t n;
+    FILE *fid = fopen(path, "rb");
+    if (fid == NULL || buf == NULL) {if (fid != NULL) fclose(fid); free(buf); return -1;}
+    while ((n = fread(buf, 1, 1 << 20, fid)) > 0) {
+        for (p = buf, end = buf + n; (p = memchr(p, '\n', end - p)) != NULL; p++) lines++;
+    }
+    fclose(fid);
+    free(buf);
+    return lines;
 }
 
 // 查看某个参数用户是否给出
@@ -381,14 +2548,20 @@ int find_arg(char *str, int argc, char **argv) {
 
 // 主函数，读取参数，调用核心逻辑
 int main(int argc, char **argv) {
-    int i;
-    FILE *fid;
+    int i, kernel, fixed_width_kernels = 1;
+    char kernel_name[MAX_STRING_LENGTH] = "auto";
     vocab_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
     input_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
     save_W_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
     save_gradsq_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    init_W_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    init_gradsq_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    init_vocab_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    stream_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    vocab_index_file = malloc(sizeof(char) * (MAX_STRING_LENGTH + sizeof(VOCAB_INDEX_SUFFIX)));
     int result = 0;
     
+    dist_init(&argc, &argv);
     if (argc == 1) {
         printf("GloVe: Global Vectors for Word Representation, v0.2\n");
         printf("Author: Jeffrey Pennington (jpennin@stanford.edu)\n\n");
@@ -418,16 +2591,101 @@ int main(int argc, char **argv) {
         printf("\t\t   2: output word vectors + context word vectors, excluding bias terms\n");
         printf("\t-input-file <file>\n");
         printf("\t\tBinary input file of shuffled cooccurrence data (produced by 'cooccur' and 'shuffle'); default cooccurrence.shuf.bin\n");
+        printf("\t\tRaw or compact (-format in cooccur and shuffle) files are both accepted; compact files are read block by block\n");
+        printf("\t\t- reads unshuffled cooccur output from stdin (cooccur ... | glove -input-file - ...): the first iteration trains on blocks\n");
+        printf("\t\tof -block-shuffle records (default %d) as they arrive, later iterations shuffle them as with -block-shuffle\n", CREC_BLOCK_RECORDS);
+        printf("\t-memory <float>\n");
+        printf("\t\tSoft limit for the cooccurrence data read from stdin, in gigabytes; default 4.0. Records past it go to -stream-file\n");
+        printf("\t-stream-file <file>\n");
+        printf("\t\tFile for the cooccurrence data read from stdin once it is over -memory, removed after training; default <save-file>.stream.bin\n");
         printf("\t-vocab-file <file>\n");
         printf("\t\tFile containing vocabulary (truncated unigram counts, produced by 'vocab_count'); default vocab.txt\n");
+        printf("\t-vocab-index <file>\n");
+        printf("\t\tBinary index of the vocabulary (vocab_count -vocab-index), mapped at startup instead of reading the vocab file when it is\n");
+        printf("\t\tup to date; default <vocab file>%s\n", VOCAB_INDEX_SUFFIX);
         printf("\t-save-file <file>\n");
         printf("\t\tFilename, excluding extension, for word vector output; default vectors\n");
         printf("\t-gradsq-file <file>\n");
         printf("\t\tFilename, excluding extension, for squared gradient output; default gradsq\n");
         printf("\t-save-gradsq <int>\n");
         printf("\t\tSave accumulated squared gradients; default 0 (off); ignored if gradsq-file is specified\n");
+        printf("\t-init-W <file>\n");
+        printf("\t\tStart from the binary word vectors of an earlier run (e.g. vectors.bin, any precision) instead of random values\n");
+        printf("\t-init-gradsq <file>\n");
+        printf("\t\tStart from the binary squared gradients of an earlier run (e.g. gradsq.bin) instead of 1\n");
+        printf("\t-init-vocab <file>\n");
+        printf("\t\tVocab file of the -init-W/-init-gradsq model when it differs from -vocab-file: rows are matched by word, new words\n");
+        printf("\t\tget the usual initial values. Default: same vocab\n");
+        printf("\t-start-iter <int>\n");
+        printf("\t\tNumber of iterations already done, to resume an interrupted run: without -init-W, start from the binary checkpoints\n");
+        printf("\t\t<save-file>.<int>.bin (and <gradsq-file>.<int>.bin with -save-gradsq); -1 picks the latest checkpoint. Default 0\n");
         printf("\t-checkpoint-every <int>\n");
-        printf("\t\tCheckpoint a  model every <int> iterations; default 0 (off)\n");
+        printf("\t\tCheckpoint a  model every <int> iterations; default 0 (off). Files are written under a .tmp name and renamed when complete\n");
+        printf("\t-checkpoint-async <int>\n");
+        printf("\t\tWrite checkpoints from a background thread, from a snapshot of the parameters; default 1, 0 to pause training instead\n");
+        printf("\t-mmap <int>\n");
+        printf("\t\tRead cooccurrence data through a memory mapping instead of stdio (0: off (default), 1: stream from the mapping, 2: lock the mapping in RAM so the file is read from disk only once)\n");
+        printf("\t-block-shuffle <int>\n");
+        printf("\t\tTrain directly on unshuffled cooccur output: split input-file into blocks of <int> records (e.g. 65536), visit the blocks\n");
+        printf("\t\tin a new random order each iteration and shuffle the records within each block; default 0 (off, input is read in order)\n");
+        printf("\t-weight-cache <int>\n");
+        printf("\t\tStore log(X) and f(X) of every record as floats during the first iteration and look them up afterwards instead of\n");
+        printf("\t\tcalling log and pow; uses 8 bytes of memory per record. Default 0 (off)\n");
+        printf("\t-min-weight <float>\n");
+        printf("\t\tSkip the records whose weight f(X) = min(1, (X/x-max)^alpha) is below <float>; default 0 (off)\n");
+        printf("\t-subsample <float>\n");
+        printf("\t\tTrain on a record with f(X) below <float> with probability f(X)/<float>, with weight <float> instead of f(X), so the\n");
+        printf("\t\texpected update is unchanged; e.g. 0.05. Default 0 (off)\n");
+        printf("\t-adaptive <float>\n");
+        printf("\t\tFrom the second iteration on, train on a record whose loss (when last trained on) is below <float> times the mean\n");
+        printf("\t\twith probability loss/(<float> * mean), at least %g, and weight it by the inverse; e.g. 1. Uses 4 bytes per record.\n", ADAPTIVE_MIN_KEEP);
+        printf("\t\tNot with -block-shuffle or -input-file -. Default 0 (off). With any of these three, each iteration logs the records\n");
+        printf("\t\tprocessed and skipped\n");
+        printf("\t-seed <int>\n");
+        printf("\t\tRandom seed for -block-shuffle, -subsample, -adaptive and the rounding of half squared gradients; default 1\n");
+        printf("\t-precision <string>\n");
+        printf("\t\tStorage precision of word vectors and squared gradients: double (default), float, or half (stored in 16 bits, updated in float;\n");
+        printf("\t\tsquared gradients are rounded stochastically, so increments below the half precision still accumulate).\n");
+        printf("\t\tBinary output of float and half models starts with a %d-byte text header giving precision, vocab size and vector size.\n", BIN_HEADER_SIZE);
+        printf("\t-layout <string>\n");
+        printf("\t\tIn-memory layout of word vectors and squared gradients: split (default; two arrays), padded (rows padded to %d bytes)\n", ROW_ALIGN);
+        printf("\t\tor interleaved (padded, and each vector row followed by its squared gradients). Output files are the same for all layouts\n");
+        printf("\t-huge-pages <int>\n");
+        printf("\t\tAllocate word vectors and squared gradients on huge pages: 0 (default, off), 1 (transparent huge pages) or 2 (reserved\n");
+        printf("\t\thuge pages via MAP_HUGETLB, falling back to 1)\n");
+#ifdef USE_MPI
+        printf("\t-sync-every <int>\n");
+        printf("\t\tDistributed training (run under mpirun): each rank trains on its shard of input-file, the file with %%d replaced by\n");
+        printf("\t\tthe rank if the name has a %%d, else an equal share of the one file. Every <int> iterations the ranks combine their\n");
+        printf("\t\tchanges: the mean of the changes to a word vector row over the ranks that changed it, the sum of the changes to\n");
+        printf("\t\tsquared gradients; default 1. Rank 0 logs throughput per rank and saves the model. Ranks do not see each other's\n");
+        printf("\t\tupdates between syncs, so the first iterations converge more slowly than on one node; the gap closes as training goes on\n");
+        printf("\t-sync-records <int>\n");
+        printf("\t\tAlso sync within each iteration, about every <int> records per rank (the threads meet at a barrier for it); default 0\n");
+        printf("\t\t(off). Overrides -sync-every: the ranks then sync after every iteration too. More syncs bring the cost per iteration\n");
+        printf("\t\tcloser to one node's, at the price of one barrier and one exchange of the changed rows each; compare the logged cost\n");
+        printf("\t\tper iteration with a one node run to choose <int>\n");
+#endif
+        printf("\t-numa <int>\n");
+        printf("\t\tNUMA placement: 0 (default, off), 1 (pin training threads to CPUs, round-robin over the NUMA nodes, so each thread's\n");
+        printf("\t\tbuffers and input pages are local), 2 (as 1, and interleave the pages of word vectors and squared gradients over the nodes)\n");
+        printf("\t-kernel <string>\n");
+        printf("\t\tUpdate kernel: auto (default; fastest supported by this CPU), scalar, avx2, avx512 or neon. SIMD kernels exist for double and float precision.\n");
+        printf("\t-fixed-width-kernels <int>\n");
+        printf("\t\tUse kernels compiled for a fixed vector size (50, 100, 200 or 300) when -vector-size matches; default 1, 0 to use the generic loop\n");
+        printf("\t-hot-rows <int>\n");
+        printf("\t\tThe <int> most frequent words get per-thread private copies of their word and context rows, merged into the shared\n");
+        printf("\t\trows every -hot-merge records; the other rows stay lock-free. Cuts cache line contention at high thread counts; default 0 (off)\n");
+        printf("\t-hot-merge <int>\n");
+        printf("\t\tRecords a thread trains between merges of its -hot-rows copies; default 1024\n");
+        printf("\t-metrics <file>\n");
+        printf("\t\tAppend one JSON line per phase to <file>, or to stderr for -: load, every epoch (cost, records/s, min and max per-thread\n");
+        printf("\t\tupdates/s and load imbalance, sync time), checkpoints and the final dump (bytes written), each with its time and peak RSS\n");
+        printf("\t-bench-threads <int>\n");
+        printf("\t\tBenchmark one pass over <int> synthetic Zipf distributed records with 1, 8, 16, 32 and 64 threads, with and without\n");
+        printf("\t\t-hot-rows (1024 unless given), then exit\n");
+        printf("\t-bench-kernels <int>\n");
+        printf("\t\tBenchmark every available kernel for the given precision and vector size with <int> random updates, then exit\n");
         printf("\nExample usage:\n");
         printf("./glove -input-file cooccurrence.shuf.bin -vocab-file vocab.txt -save-file vectors -gradsq-file gradsq -verbose 2 -vector-size 100 -threads 16 -alpha 0.75 -x-max 100.0 -eta 0.05 -binary 2 -model 2\n\n");
         result = 0;
@@ -438,6 +2696,9 @@ int main(int argc, char **argv) {
         if ((i = find_arg((char *)"-iter", argc, argv)) > 0) num_iter = atoi(argv[i + 1]);
         if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
         cost = malloc(sizeof(real) * num_threads);
+        thread_records = calloc(num_threads, sizeof(long long));
+        thread_skipped = calloc(num_threads, sizeof(long long));
+        thread_seconds = calloc(num_threads, sizeof(double));
         if ((i = find_arg((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
         if ((i = find_arg((char *)"-x-max", argc, argv)) > 0) x_max = atof(argv[i + 1]);
         if ((i = find_arg((char *)"-eta", argc, argv)) > 0) eta = atof(argv[i + 1]);
@@ -447,6 +2708,8 @@ int main(int argc, char **argv) {
         if ((i = find_arg((char *)"-save-gradsq", argc, argv)) > 0) save_gradsq = atoi(argv[i + 1]);
         if ((i = find_arg((char *)"-vocab-file", argc, argv)) > 0) strcpy(vocab_file, argv[i + 1]);
         else strcpy(vocab_file, (char *)"vocab.txt");
+        if ((i = find_arg((char *)"-vocab-index", argc, argv)) > 0) strcpy(vocab_index_file, argv[i + 1]);
+        else sprintf(vocab_index_file, "%s%s", vocab_file, VOCAB_INDEX_SUFFIX);
         if ((i = find_arg((char *)"-save-file", argc, argv)) > 0) strcpy(save_W_file, argv[i + 1]);
         else strcpy(save_W_file, (char *)"vectors");
         if ((i = find_arg((char *)"-gradsq-file", argc, argv)) > 0) {
@@ -457,19 +2720,100 @@ int main(int argc, char **argv) {
         if ((i = find_arg((char *)"-input-file", argc, argv)) > 0) strcpy(input_file, argv[i + 1]);
         else strcpy(input_file, (char *)"cooccurrence.shuf.bin");
         if ((i = find_arg((char *)"-checkpoint-every", argc, argv)) > 0) checkpoint_every = atoi(argv[i + 1]);
+        if ((i = find_arg((char *)"-checkpoint-async", argc, argv)) > 0) checkpoint_async = atoi(argv[i + 1]);
+        if ((i = find_arg((char *)"-start-iter", argc, argv)) > 0) start_iter = atoi(argv[i + 1]);
+        if ((i = find_arg((char *)"-init-W", argc, argv)) > 0) strcpy(init_W_file, argv[i + 1]);
+        else init_W_file[0] = 0;
+        if ((i = find_arg((char *)"-init-gradsq", argc, argv)) > 0) strcpy(init_gradsq_file, argv[i + 1]);
+        else init_gradsq_file[0] = 0;
+        if ((i = find_arg((char *)"-init-vocab", argc, argv)) > 0) strcpy(init_vocab_file, argv[i + 1]);
+        else init_vocab_file[0] = 0;
+        if ((i = find_arg((char *)"-mmap", argc, argv)) > 0) use_mmap = atoi(argv[i + 1]);
+        if ((i = find_arg((char *)"-block-shuffle", argc, argv)) > 0) shuffle_block = atoll(argv[i + 1]);
+        if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
+        if ((i = find_arg((char *)"-stream-file", argc, argv)) > 0) strcpy(stream_file, argv[i + 1]);
+        else sprintf(stream_file, "%s.stream.bin", save_W_file);
+        if ((i = find_arg((char *)"-weight-cache", argc, argv)) > 0) use_weight_cache = atoi(argv[i + 1]);
+        if ((i = find_arg((char *)"-min-weight", argc, argv)) > 0) min_weight = atof(argv[i + 1]);
+        if ((i = find_arg((char *)"-subsample", argc, argv)) > 0) subsample = atof(argv[i + 1]);
+        if ((i = find_arg((char *)"-adaptive", argc, argv)) > 0) adaptive = atof(argv[i + 1]);
+        sampling = min_weight > 0 || subsample > 0 || adaptive > 0;
+        if ((i = find_arg((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+        if ((i = find_arg((char *)"-layout", argc, argv)) > 0) {
+            if (strcmp(argv[i + 1], "split") == 0) param_layout = LAYOUT_SPLIT;
+            else if (strcmp(argv[i + 1], "padded") == 0) param_layout = LAYOUT_PADDED;
+            else if (strcmp(argv[i + 1], "interleaved") == 0) param_layout = LAYOUT_INTERLEAVED;
+            else {fprintf(stderr, "Unknown layout %s; expected split, padded or interleaved.\n", argv[i + 1]); return 1;}
+        }
+        if ((i = find_arg((char *)"-huge-pages", argc, argv)) > 0) use_huge_pages = atoi(argv[i + 1]);
+        if ((i = find_arg((char *)"-numa", argc, argv)) > 0) numa_mode = atoi(argv[i + 1]);
+        if ((i = find_arg((char *)"-hot-rows", argc, argv)) > 0) hot_rows = atoll(argv[i + 1]);
+        if ((i = find_arg((char *)"-hot-merge", argc, argv)) > 0) hot_merge_every = atoll(argv[i + 1]);
+        if (hot_merge_every < 1) hot_merge_every = 1;
+        if ((i = find_arg((char *)"-sync-every", argc, argv)) > 0) sync_every = atoi(argv[i + 1]);
+        if (sync_every < 1) sync_every = 1;
+        if ((i = find_arg((char *)"-sync-records", argc, argv)) > 0) sync_records = atoll(argv[i + 1]);
+        if (dist_rank != 0 && verbose > 0) verbose = 0; // rank 0 reports for everyone
+        if ((i = find_arg((char *)"-metrics", argc, argv)) > 0 && dist_rank == 0) metrics_path = argv[i + 1];
+        if (metrics_open("glove", metrics_path) != 0) {
+            fprintf(stderr, "Unable to open metrics file %s.\n", metrics_path);
+            return 1;
+        }
+        if (numa_mode > 0) numa_discover();
+        if ((i = find_arg((char *)"-precision", argc, argv)) > 0) {
+            if (strcmp(argv[i + 1], "double") == 0) precision = PRECISION_DOUBLE;
+            else if (strcmp(argv[i + 1], "float") == 0) precision = PRECISION_FLOAT;
+            else if (strcmp(argv[i + 1], "half") == 0) precision = PRECISION_HALF;
+            else {fprintf(stderr, "Unknown precision %s; expected double, float or half.\n", argv[i + 1]); return 1;}
+        }
+        if (precision == PRECISION_FLOAT) param_size = sizeof(float);
+        else if (precision == PRECISION_HALF) param_size = sizeof(half);
+        if ((i = find_arg((char *)"-kernel", argc, argv)) > 0) strcpy(kernel_name, argv[i + 1]);
+        if ((i = find_arg((char *)"-fixed-width-kernels", argc, argv)) > 0) fixed_width_kernels = atoi(argv[i + 1]);
+        if ((kernel = select_kernel(kernel_name, fixed_width_kernels)) < 0) {
+            fprintf(stderr, "Kernel %s is not available for %s precision on this CPU.\n", kernel_name, precision_name(precision));
+            return 1;
+        }
+        update_record = kernels[kernel].fn;
+        update_kernel_name = kernels[kernel].name;
+        update_kernel_width = kernels[kernel].width;
+        if ((i = find_arg((char *)"-bench-threads", argc, argv)) > 0) {
+            result = benchmark_threads(atoll(argv[i + 1]));
+            free(cost);
+            free(thread_records);
+            free(thread_skipped);
+            free(thread_seconds);
+            return result;
+        }
+        if ((i = find_arg((char *)"-bench-kernels", argc, argv)) > 0) {
+            result = benchmark_kernels(atoll(argv[i + 1]));
+            free(cost);
+            free(thread_records);
+            free(thread_skipped);
+            free(thread_seconds);
+            return result;
+        }
         
-        vocab_size = 0;
-        fid = fopen(vocab_file, "r");
-        if (fid == NULL) {fprintf(stderr, "Unable to open vocab file %s.\n",vocab_file); return 1;}
-        while ((i = getc(fid)) != EOF) if (i == '\n') vocab_size++; // Count number of entries in vocab_file
-        fclose(fid);
+        if (vocab_map_open(&vocab, vocab_index_file, vocab_file) == 0) vocab_size = vocab.size;
+        else if ((vocab_size = count_lines(vocab_file)) < 0) {fprintf(stderr, "Unable to open vocab file %s.\n",vocab_file); return 1;} // Count number of entries in vocab_file
 
         result = train_glove();
+        metrics_close();
+        free(vocab_words);
+        vocab_map_free(&vocab);
         free(cost);
     }
+    free(thread_records);
+    free(thread_skipped);
+    free(thread_seconds);
     free(vocab_file);
     free(input_file);
     free(save_W_file);
     free(save_gradsq_file);
+    free(init_W_file);
+    free(init_gradsq_file);
+    free(init_vocab_file);
+    free(stream_file);
+    free(vocab_index_file);
     return result;
 }
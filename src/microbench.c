@@ -0,0 +1,235 @@
+//  Microbenchmarks of the code shared by the GloVe tools
+//
+//  GloVe: Global Vectors for Word Representation
+//  Copyright (c) 2014 The Board of Trustees of
+//  The Leland Stanford Junior University. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+//  For more information, bug reports, fixes, contact:
+//    Jeffrey Pennington (jpennin@stanford.edu)
+//    GlobalVectors@googlegroups.com
+//    http://nlp.stanford.edu/projects/glove/
+
+/***
+ *  microbench.c 单独测量common.c中几个热点的速度，结果和各个工具的-metrics一样，每项一行JSON
+ *   $ build/microbench -corpus corpus.txt -records 10000000 -metrics report.jsonl
+ *
+ *  - tokenize：分词器next_token（原来的get_word）扫描语料的前max_tokens个词；语料是mmap的，多大的文件都不会全部读进内存
+ *  - hash_insert / hash_find：把这些词插入词表哈希表，再逐个查找（原来的hashinsert / hashsearch）
+ *    词先切好存在数组里，所以这两项只计哈希表本身的时间
+ *  - crec_sort / qsort：对Zipf分布的共现记录排序，radix排序和原来的qsort + compare_crec比较
+ *  - compact_write / compact_read：同样的记录按紧凑格式写到临时文件再读回来
+ *  记录都由seed生成，同样的参数在同一台机器上的结果可以直接比较
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+
+#define WORD_SEPARATORS " \t"
+
+int verbose = 2; // 0, 1, or 2
+char *corpus_file = NULL; // text for tokenize and the hash table; those are skipped without it
+long long max_tokens = 10000000; // tokens of the corpus read by tokenize, hash_insert and hash_find
+long long num_records = 10000000; // records for the sort and compact benchmarks
+long long vocab_size = 100000; // word ids of the records are Zipf distributed over [1, vocab_size]
+unsigned long long seed = 1;
+
+/* The original comparison used with qsort in cooccur */
+int compare_crec(const void *a, const void *b) {
+    int c;
+    if ( (c = ((CREC *) a)->word1 - ((CREC *) b)->word1) != 0) return c;
+    else return (((CREC *) a)->word2 - ((CREC *) b)->word2);
+}
+
+/* Map the corpus file read-only; returns it and sets *size, or NULL. Only the pages tokenize reaches are read */
+const char *map_corpus(long long *size) {
+    struct stat st;
+    void *text;
+    int fd = open(corpus_file, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {close(fd); return NULL;}
+    *size = st.st_size;
+    text = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) return NULL;
+    madvise(text, *size, MADV_SEQUENTIAL);
+    return (const char *)text;
+}
+
+int bench_text() {
+    long long size, n = 0, a, length, found = 0, bytes, *offset, *lengths;
+    const char *token, *text = map_corpus(&size);
+    int flag;
+    double t;
+    TOKEN_READER reader;
+    VOCAB_HASH *h;
+    HASH_ENTRY *e;
+
+    if (text == NULL) {fprintf(stderr, "Unable to read corpus %s.\n", corpus_file); return 1;}
+    offset = malloc(sizeof(long long) * max_tokens);
+    lengths = malloc(sizeof(long long) * max_tokens);
+    if (offset == NULL || lengths == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+
+    t = metrics_now();
+    reader_init_range(&reader, text, text + size, WORD_SEPARATORS, 1);
+    while (n < max_tokens && (flag = next_token(&reader, &token, &length)) != TOKEN_END) {
+        if (flag == TOKEN_NEWLINE) continue;
+        offset[n] = token - text;
+        lengths[n++] = length;
+        if (flag == TOKEN_WORD_AT_END) break;
+    }
+    t = metrics_now() - t;
+    bytes = reader.pos - text; // the prefix of the corpus that was tokenized
+    if (verbose > 0) printf("tokenize: %lld tokens, %.2f M tokens/sec\n", n, n / t * 1e-6);
+    metrics_emit("tokenize", t, "\"tokens\":%lld,\"bytes\":%lld,\"tokens_per_sec\":%.0f,\"mb_per_sec\":%.1f", n, bytes, n / t, bytes / 1048576.0 / t);
+
+    t = metrics_now();
+    if ((h = vocab_hash_create(1 << 20)) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    for (a = 0; a < n; a++) {
+        if ((e = vocab_hash_insert(h, text + offset[a], lengths[a])) == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        e->value++;
+    }
+    t = metrics_now() - t;
+    if (verbose > 0) printf("hash_insert: %lld words, %lld distinct, %.2f M inserts/sec\n", n, h->size, n / t * 1e-6);
+    metrics_emit("hash_insert", t, "\"ops\":%lld,\"words\":%lld,\"ops_per_sec\":%.0f", n, h->size, n / t);
+
+    t = metrics_now();
+    for (a = 0; a < n; a++) found += vocab_hash_find(h, text + offset[a], lengths[a]) != NULL;
+    t = metrics_now() - t;
+    if (verbose > 0) printf("hash_find: %lld lookups, %.2f M lookups/sec\n", n, n / t * 1e-6);
+    metrics_emit("hash_find", t, "\"ops\":%lld,\"found\":%lld,\"ops_per_sec\":%.0f", n, found, n / t);
+
+    vocab_hash_free(h);
+    free(offset);
+    free(lengths);
+    munmap((void *)text, size);
+    return 0;
+}
+
+int bench_records() {
+    long long a, got = 0, n;
+    CREC *cr = malloc(sizeof(CREC) * num_records), *copy = malloc(sizeof(CREC) * num_records);
+    double t;
+    FILE *tmp;
+    CREC_WRITER writer;
+    CREC_READER reader;
+
+    if (cr == NULL || copy == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    for (a = 0; a < num_records; a++) {
+        cr[a].word1 = (int)counter_zipf(seed, 0, a, vocab_size, 1.0);
+        cr[a].word2 = (int)counter_zipf(seed, 1, a, vocab_size, 1.0);
+        cr[a].val = 1.0 / (1 + counter_rand_below(seed, 2, a, 10));
+    }
+
+    memcpy(copy, cr, sizeof(CREC) * num_records);
+    t = metrics_now();
+    qsort(copy, num_records, sizeof(CREC), compare_crec);
+    t = metrics_now() - t;
+    if (verbose > 0) printf("qsort: %lld records, %.2f M records/sec\n", num_records, num_records / t * 1e-6);
+    metrics_emit("qsort", t, "\"records\":%lld,\"records_per_sec\":%.0f", num_records, num_records / t);
+
+    memcpy(copy, cr, sizeof(CREC) * num_records);
+    t = metrics_now();
+    crec_sort(copy, num_records);
+    t = metrics_now() - t;
+    if (verbose > 0) printf("crec_sort: %lld records, %.2f M records/sec\n", num_records, num_records / t * 1e-6);
+    metrics_emit("crec_sort", t, "\"records\":%lld,\"records_per_sec\":%.0f", num_records, num_records / t);
+
+    // 排好序的记录是cooccur输出的样子，紧凑格式的差值编码在这上面才有意义
+    if ((tmp = tmpfile()) == NULL) {fprintf(stderr, "Unable to open a temporary file.\n"); return 1;}
+    t = metrics_now();
+    if (crec_writer_open(&writer, tmp, CREC_FORMAT_COMPACT, 0) != 0 || crec_write_many(&writer, copy, num_records) != 0
+        || crec_writer_close(&writer) != 0 || fflush(tmp) != 0) {fprintf(stderr, "Unable to write a temporary file.\n"); return 1;}
+    t = metrics_now() - t;
+    if (verbose > 0) printf("compact_write: %lld records, %.2f M records/sec, %.2f bytes/record\n", num_records, num_records / t * 1e-6, writer.bytes / (double)num_records);
+    metrics_emit("compact_write", t, "\"records\":%lld,\"bytes_written\":%lld,\"records_per_sec\":%.0f", num_records, writer.bytes, num_records / t);
+
+    rewind(tmp);
+    t = metrics_now();
+    if (crec_reader_open(&reader, tmp) != 0) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    while ((n = crec_read(&reader, cr, num_records - got > CREC_BLOCK_RECORDS ? CREC_BLOCK_RECORDS : num_records - got)) > 0) got += n;
+    t = metrics_now() - t;
+    if (n < 0 || got != num_records) {fprintf(stderr, "Corrupt temporary file.\n"); return 1;}
+    if (verbose > 0) printf("compact_read: %lld records, %.2f M records/sec\n", got, got / t * 1e-6);
+    metrics_emit("compact_read", t, "\"records\":%lld,\"bytes_read\":%lld,\"records_per_sec\":%.0f", got, reader.bytes, got / t);
+    crec_reader_close(&reader);
+    fclose(tmp);
+    free(cr);
+    free(copy);
+    return 0;
+}
+
+int find_arg(char *str, int argc, char **argv) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(str, argv[i])) {
+            if (i == argc - 1) {
+                printf("No argument given for %s\n", str);
+                exit(1);
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int i, result = 0;
+    char *metrics_path = (char *)"-";
+    if (argc == 1) {
+        printf("Microbenchmarks of the tokenizer, vocab hash table, record sort and compact format shared by the GloVe tools\n\n");
+        printf("Usage options:\n");
+        printf("\t-verbose <int>\n");
+        printf("\t\tSet verbosity: 0, 1, or 2 (default)\n");
+        printf("\t-corpus <file>\n");
+        printf("\t\tText to tokenize and hash; without it only the record benchmarks run\n");
+        printf("\t-max-tokens <int>\n");
+        printf("\t\tNumber of tokens read from the start of the corpus for tokenize, hash_insert and hash_find; default 10000000\n");
+        printf("\t-records <int>\n");
+        printf("\t\tNumber of synthetic records for crec_sort, qsort and the compact format; default 10000000, 0 to skip\n");
+        printf("\t-vocab-size <int>\n");
+        printf("\t\tWord ids of the records are Zipf distributed over 1..<int>; default 100000\n");
+        printf("\t-seed <int>\n");
+        printf("\t\tRandom seed for the records; default 1\n");
+        printf("\t-metrics <file>\n");
+        printf("\t\tAppend one JSON line per benchmark to <file>; default - (stderr)\n");
+        printf("\nExample usage:\n");
+        printf("./microbench -corpus corpus.txt -records 10000000 -metrics report.jsonl\n");
+        return 0;
+    }
+
+    if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-corpus", argc, argv)) > 0) corpus_file = argv[i + 1];
+    if ((i = find_arg((char *)"-max-tokens", argc, argv)) > 0) max_tokens = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-records", argc, argv)) > 0) num_records = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-vocab-size", argc, argv)) > 0) vocab_size = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+    if ((i = find_arg((char *)"-metrics", argc, argv)) > 0) metrics_path = argv[i + 1];
+    if (metrics_open("microbench", metrics_path) != 0) {
+        fprintf(stderr, "Unable to open metrics file %s.\n", metrics_path);
+        return 1;
+    }
+    if (max_tokens < 0) max_tokens = 0;
+    if (corpus_file != NULL) result = bench_text();
+    if (result == 0 && num_records > 0) result = bench_records();
+    metrics_close();
+    return result;
+}
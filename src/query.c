@@ -0,0 +1,624 @@
+//  Tool to query trained word vectors: nearest neighbours, analogies and the analogy test suite
+//
+//  GloVe: Global Vectors for Word Representation
+//  Copyright (c) 2014 The Board of Trustees of
+//  The Leland Stanford Junior University. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+//  For more information, bug reports, fixes, contact:
+//    Jeffrey Pennington (jpennin@stanford.edu)
+//    GlobalVectors@googlegroups.com
+//    http://nlp.stanford.edu/projects/glove/
+
+/***
+ *  query.c 直接在glove保存的vectors.bin上查询，代替eval/python中先读入整个vectors.txt的脚本
+ *   $ build/query -vectors-file vectors.bin -vocab-file vocab.txt < words.txt
+ *   $ build/query -vectors-file vectors.bin -vocab-file vocab.txt -analogy-dir eval/question-data
+ *
+ *  - vectors.bin（glove -binary 1或2的输出，double/float/half都可以）用mmap读入，和文本输出的-model 2一样取词向量 + 上下文向量
+ *  - 每一行归一化后量化成int8，每行一个缩放系数：内存只要vocab_size * vector_size字节，扫描时点积用整数SIMD指令
+ *  - 查询按QUERY_BATCH个一批，每读入一行就和这一批的全部查询做点积，所以每行只从内存读一次
+ *  - int8打分选出前rerank个候选，再用文件里原来的精度精确打分、排序。int8的误差随vector_size变小而变大，
+ *    默认的候选数按top_k和vector_size来定；它只是让漏掉真正近邻的情况变少，不保证和精确打分完全相同，要完全相同用-quantize 0
+ *  - 查询分给各个线程，每个线程扫描所有的行
+ *  - -analogy-dir跑eval/question-data的类比测试，输出和evaluate.py一样；默认精确打分，这样准确率可以和evaluate.py直接比较
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define MAX_STRING_LENGTH 1000
+#define BIN_HEADER_SIZE 64      // text header of float and half vectors.bin files, see glove.c
+#define QUERY_BATCH 8           // queries scored together against each row while it is in cache
+#define ROW_ALIGN 32            // int8 rows are padded with zeros to a multiple of this many bytes
+#define MAX_QUERY_WORDS 64
+#define INPUT_BATCH 4096        // stdin queries answered together when stdin is not a terminal
+#define RERANK_MIN 100          // least candidates rescored by default after an int8 scan
+
+typedef uint16_t half;
+
+typedef struct query {
+    long long ids[MAX_QUERY_WORDS]; // rows of the query words, which are never answers
+    int n_ids, ok;                  // ok: all words are among the searched rows
+    float *vec;                     // unit query vector, vector_size floats
+    int8_t *qvec;                   // quantized query, row_pad bytes
+    float qscale;
+    long long *best;                // candidates: a min-heap on score while scanning, then sorted best first
+    float *score;
+    int n_best;
+} QUERY;
+
+int verbose = 2; // 0, 1, or 2
+int num_threads = 0; // 0: one per CPU core
+int model = 2; // 1: word vectors; 2: word + context vectors, as -model 2 of glove's text output
+int quantize = -1; // 1: scan int8 rows, then rerank; 0: scan float rows; -1: 1 for queries, 0 for -analogy-dir
+int analogy = 0; // queries on stdin: 0: nearest neighbours of the sum of the words; 1: "a b c" asks for b - a + c
+long long top_k = 10, rerank = 0, max_vocab = 0; // rerank 0: see rerank_depth
+char *vectors_file, *vocab_file, *vocab_index_file, *analogy_dir;
+
+long long vocab_size, num_rows; // rows searched: the num_rows most frequent words
+VOCAB_MAP vocab; // mapped from <vocab_file>.idx when that is up to date; the word of row r has rank r + 1
+// vectors.bin的映射：2 * vocab_size行（词向量，然后是上下文向量），每行vector_size + 1个元素（最后一个是bias）
+const char *file_data;
+size_t file_size;
+long long file_offset, row_pad;
+int vector_size, elem_size;
+float *row_norm; // length of each raw row, for exact rescoring
+int8_t *qrows; // quantized unit rows, row_pad bytes each
+float *qscale;
+float *frows; // unit rows, without -quantize
+
+static inline float half_to_float(half h) {
+    union { uint32_t u; float f; } o;
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+    if (exp == 0x1f) o.u = sign | 0x7f800000 | (mant << 13); // inf or NaN
+    else if (exp != 0) o.u = sign | ((exp + 112) << 23) | (mant << 13);
+    else if (mant == 0) o.u = sign;
+    else { // subnormal half, renormalize
+        exp = 113;
+        while (!(mant & 0x400)) {mant <<= 1; exp--;}
+        o.u = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    return o.f;
+}
+
+static inline float file_elem(long long row, int b) {
+    const char *p = file_data + file_offset + (row * (vector_size + 1) + b) * elem_size;
+    if (elem_size == sizeof(half)) return half_to_float(*(const half *)p);
+    if (elem_size == sizeof(float)) return *(const float *)p;
+    return *(const double *)p;
+}
+
+/* Vector of word row r (0-based) as stored in the file, before normalizing */
+void raw_row(long long r, float *out) {
+    int b;
+    for (b = 0; b < vector_size; b++) out[b] = file_elem(r, b) + (model == 2 ? file_elem(r + vocab_size, b) : 0);
+}
+
+static inline float dot_float(const float *a, const float *b, int n) {
+    float s = 0;
+    int i;
+    for (i = 0; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+// 一行和一批查询的int8点积：行的每一段只读入一次，和这一批的每个查询相乘
+// 量化后的值在[-127, 127]之间，maddubs（无符号 * 有符号）用|x|和带上x的符号的y来算，两两相加不会溢出16位
+#if defined(__AVX2__)
+/* Dot products of row with the n queries in q; len is a multiple of ROW_ALIGN */
+static inline void dot_int8_batch(const int8_t *row, int8_t *const *q, int n, long long len, int *out) {
+    __m256i acc[QUERY_BATCH], x, ax, y;
+    __m128i h;
+    long long i;
+    int j;
+    for (j = 0; j < n; j++) acc[j] = _mm256_setzero_si256();
+    for (i = 0; i < len; i += 32) {
+        x = _mm256_loadu_si256((const __m256i *)(row + i));
+        ax = _mm256_sign_epi8(x, x);
+        for (j = 0; j < n; j++) {
+            y = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)(q[j] + i)), x);
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+            acc[j] = _mm256_dpbusd_epi32(acc[j], ax, y);
+#else
+            acc[j] = _mm256_add_epi32(acc[j], _mm256_madd_epi16(_mm256_maddubs_epi16(ax, y), _mm256_set1_epi16(1)));
+#endif
+        }
+    }
+    for (j = 0; j < n; j++) {
+        h = _mm_add_epi32(_mm256_castsi256_si128(acc[j]), _mm256_extracti128_si256(acc[j], 1));
+        h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 0x4e));
+        h = _mm_add_epi32(h, _mm_shuffle_epi32(h, 0xb1));
+        out[j] = _mm_cvtsi128_si32(h);
+    }
+}
+#else
+static inline void dot_int8_batch(const int8_t *row, int8_t *const *q, int n, long long len, int *out) {
+    long long i;
+    int j, s;
+    for (j = 0; j < n; j++) {
+        for (i = 0, s = 0; i < len; i++) s += row[i] * q[j][i];
+        out[j] = s;
+    }
+}
+#endif
+
+/* Scale v to unit length and, with out != NULL, quantize it to out (row_pad bytes); returns the scale of out */
+float normalize_quantize(float *v, int8_t *out) {
+    float norm = sqrtf(dot_float(v, v, vector_size)), max = 0, scale;
+    int b;
+    if (norm > 0) for (b = 0; b < vector_size; b++) v[b] /= norm;
+    if (out == NULL) return 0;
+    for (b = 0; b < vector_size; b++) if (fabsf(v[b]) > max) max = fabsf(v[b]);
+    scale = max > 0 ? max / 127 : 1;
+    memset(out, 0, row_pad);
+    for (b = 0; b < vector_size; b++) out[b] = (int8_t)lrintf(v[b] / scale);
+    return scale;
+}
+
+/* Unit vector of row r at the file's precision, for rescoring */
+void exact_row(long long r, float *out) {
+    int b;
+    raw_row(r, out);
+    if (row_norm[r] > 0) for (b = 0; b < vector_size; b++) out[b] /= row_norm[r];
+}
+
+typedef struct range_arg {
+    long long start, end;
+    QUERY *q;
+} RANGE_ARG;
+
+/* Normalize (and quantize) rows [start, end) */
+void *prepare_rows(void *arg) {
+    RANGE_ARG *ra = (RANGE_ARG *)arg;
+    float *v = malloc(sizeof(float) * vector_size);
+    long long r;
+    for (r = ra->start; r < ra->end; r++) {
+        raw_row(r, v);
+        row_norm[r] = sqrtf(dot_float(v, v, vector_size));
+        if (quantize) qscale[r] = normalize_quantize(v, qrows + r * row_pad);
+        else {
+            normalize_quantize(v, NULL);
+            memcpy(frows + r * vector_size, v, sizeof(float) * vector_size);
+        }
+    }
+    free(v);
+    return NULL;
+}
+
+/* Run fn over num_threads ranges of [0, n), each with arg ranges of q if q is not NULL */
+void run_threads(void *(*fn)(void *), long long n, QUERY *q) {
+    pthread_t *pt = malloc(sizeof(pthread_t) * num_threads);
+    RANGE_ARG *ra = malloc(sizeof(RANGE_ARG) * num_threads);
+    int a;
+    for (a = 0; a < num_threads; a++) {
+        ra[a].start = n * a / num_threads;
+        ra[a].end = n * (a + 1) / num_threads;
+        ra[a].q = q;
+        pthread_create(&pt[a], NULL, fn, &ra[a]);
+    }
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    free(pt);
+    free(ra);
+}
+
+/* Offer candidate r with score s to the min-heap of q, which keeps the capacity best */
+static inline void heap_offer(QUERY *q, int capacity, long long r, float s) {
+    int i = q->n_best, c;
+    if (i == capacity) {
+        if (s <= q->score[0]) return;
+        // replace the root and sift it down
+        for (i = 0; (c = 2 * i + 1) < capacity; i = c) {
+            if (c + 1 < capacity && q->score[c + 1] < q->score[c]) c++;
+            if (q->score[c] >= s) break;
+            q->score[i] = q->score[c];
+            q->best[i] = q->best[c];
+        }
+    }
+    else {
+        q->n_best++;
+        for (; i > 0 && q->score[(i - 1) / 2] > s; i = (i - 1) / 2) {
+            q->score[i] = q->score[(i - 1) / 2];
+            q->best[i] = q->best[(i - 1) / 2];
+        }
+    }
+    q->score[i] = s;
+    q->best[i] = r;
+}
+
+static inline int excluded(const QUERY *q, long long r) {
+    int i;
+    for (i = 0; i < q->n_ids; i++) if (q->ids[i] == r) return 1;
+    return 0;
+}
+
+/* Sort the candidates of q best first, rescoring them exactly first after an int8 scan, and keep top_k */
+void finish_query(QUERY *q, float *v) {
+    int i, j;
+    long long r;
+    float s;
+    if (quantize) for (i = 0; i < q->n_best; i++) {
+        exact_row(q->best[i], v);
+        q->score[i] = dot_float(v, q->vec, vector_size);
+    }
+    for (i = 1; i < q->n_best; i++) { // insertion sort; there are only a few candidates
+        r = q->best[i];
+        s = q->score[i];
+        for (j = i; j > 0 && (q->score[j - 1] < s || (q->score[j - 1] == s && q->best[j - 1] > r)); j--) {
+            q->score[j] = q->score[j - 1];
+            q->best[j] = q->best[j - 1];
+        }
+        q->score[j] = s;
+        q->best[j] = r;
+    }
+    if (q->n_best > top_k) q->n_best = top_k;
+}
+
+/* Candidates kept by the scan: -rerank, or by default top_k times a factor that grows as the vectors get shorter
+ * (the error of an int8 score grows like 1/sqrt(vector_size), and more near-ties fall within it), at least RERANK_MIN */
+int rerank_depth() {
+    long long n = rerank;
+    if (!quantize) return top_k;
+    if (n <= 0) {
+        n = top_k * (vector_size < 100 ? 1000 / vector_size : 10);
+        if (n < RERANK_MIN) n = RERANK_MIN;
+    }
+    return n > top_k ? n : top_k;
+}
+
+/* Answer queries [start, end): scan every row once per batch of QUERY_BATCH queries */
+void *answer_queries(void *arg) {
+    RANGE_ARG *ra = (RANGE_ARG *)arg;
+    QUERY *batch[QUERY_BATCH];
+    int8_t *qv[QUERY_BATCH];
+    long long a, r;
+    int n, j, dots[QUERY_BATCH], capacity = rerank_depth();
+    float s, *v = malloc(sizeof(float) * vector_size);
+    for (a = ra->start; a < ra->end; ) {
+        for (n = 0; n < QUERY_BATCH && a < ra->end; a++) if (ra->q[a].ok) batch[n++] = &ra->q[a];
+        if (n == 0) break;
+        for (j = 0; j < n; j++) qv[j] = batch[j]->qvec;
+        for (r = 0; r < num_rows; r++) {
+            if (quantize) dot_int8_batch(qrows + r * row_pad, qv, n, row_pad, dots);
+            for (j = 0; j < n; j++) {
+                if (quantize) s = dots[j] * qscale[r] * batch[j]->qscale;
+                else s = dot_float(frows + r * vector_size, batch[j]->vec, vector_size);
+                if (batch[j]->n_best == capacity && s <= batch[j]->score[0]) continue;
+                if (!excluded(batch[j], r)) heap_offer(batch[j], capacity, r, s);
+            }
+        }
+        for (j = 0; j < n; j++) finish_query(batch[j], v);
+    }
+    free(v);
+    return NULL;
+}
+
+/* Look up word; returns its row, or -1 if it is not among the searched rows */
+long long find_row(const char *word) {
+    long long rank = vocab_map_find(&vocab, word, strlen(word));
+    if (rank == 0 || rank > num_rows) return -1;
+    return rank - 1;
+}
+
+void query_alloc(QUERY *q) {
+    int capacity = rerank_depth();
+    q->vec = malloc(sizeof(float) * vector_size);
+    q->qvec = quantize ? malloc(row_pad) : NULL;
+    q->best = malloc(sizeof(long long) * capacity);
+    q->score = malloc(sizeof(float) * capacity);
+}
+
+void query_free(QUERY *q) {
+    free(q->vec);
+    free(q->qvec);
+    free(q->best);
+    free(q->score);
+}
+
+/* Set up q from the rows of its words: their sum, or b - a + c for an analogy (ids a, b, c) */
+void query_set(QUERY *q, int is_analogy) {
+    float *v = malloc(sizeof(float) * vector_size);
+    int i, b;
+    q->n_best = 0;
+    if (!q->ok) {free(v); return;}
+    for (b = 0; b < vector_size; b++) q->vec[b] = 0;
+    for (i = 0; i < q->n_ids; i++) {
+        exact_row(q->ids[i], v);
+        for (b = 0; b < vector_size; b++) q->vec[b] += (is_analogy && i == 0) ? -v[b] : v[b];
+    }
+    q->qscale = normalize_quantize(q->vec, q->qvec);
+    free(v);
+}
+
+/* Split line into words and set up q; returns 0 if some word is unknown, naming it in *unknown */
+int parse_query(char *line, QUERY *q, char **unknown) {
+    char *w, *save = NULL;
+    q->n_ids = 0;
+    q->ok = 1;
+    *unknown = NULL;
+    for (w = strtok_r(line, " \t\r\n", &save); w != NULL && q->n_ids < MAX_QUERY_WORDS; w = strtok_r(NULL, " \t\r\n", &save)) {
+        if ((q->ids[q->n_ids++] = find_row(w)) < 0 && q->ok) {q->ok = 0; *unknown = w;}
+    }
+    if (q->n_ids == 0 || (analogy && q->n_ids != 3)) q->ok = 0;
+    query_set(q, analogy);
+    return q->ok;
+}
+
+/* Answer the queries on stdin, one per line: the query words, then a tab and "word score" for each answer */
+int query_stdin() {
+    char **lines = malloc(sizeof(char *) * INPUT_BATCH), *unknown, *copy;
+    QUERY *q = calloc(INPUT_BATCH, sizeof(QUERY));
+    int n, i, j, batch = isatty(fileno(stdin)) ? 1 : INPUT_BATCH;
+    size_t cap;
+    for (i = 0; i < INPUT_BATCH; i++) {query_alloc(&q[i]); lines[i] = NULL;}
+    while (1) {
+        for (n = 0; n < batch; n++) {
+            cap = 0;
+            if (getline(&lines[n], &cap, stdin) < 0) break;
+            lines[n][strcspn(lines[n], "\r\n")] = 0;
+        }
+        if (n == 0) break;
+        for (i = 0; i < n; i++) {
+            copy = strdup(lines[i]);
+            if (!parse_query(copy, &q[i], &unknown) && verbose > 0) {
+                if (unknown != NULL) fprintf(stderr, "%s: %s is not among the %lld words searched\n", lines[i], unknown, num_rows);
+                else if (analogy) fprintf(stderr, "%s: an analogy query needs three words\n", lines[i]);
+            }
+            free(copy);
+        }
+        run_threads(answer_queries, n, q);
+        for (i = 0; i < n; i++) {
+            fputs(lines[i], stdout);
+            for (j = 0; j < q[i].n_best; j++) printf("\t%s %f", vocab_map_word(&vocab, q[i].best[j] + 1), q[i].score[j]);
+            putchar('\n');
+            free(lines[i]);
+            lines[i] = NULL;
+        }
+        fflush(stdout);
+        if (n < batch) break;
+    }
+    for (i = 0; i < INPUT_BATCH; i++) query_free(&q[i]);
+    free(q);
+    free(lines);
+    return 0;
+}
+
+/* Run the analogy questions of eval/question-data and report as eval/python/evaluate.py does */
+int run_analogies() {
+    const char *filenames[] = {
+        "capital-common-countries.txt", "capital-world.txt", "currency.txt",
+        "city-in-state.txt", "family.txt", "gram1-adjective-to-adverb.txt",
+        "gram2-opposite.txt", "gram3-comparative.txt", "gram4-superlative.txt",
+        "gram5-present-participle.txt", "gram6-nationality-adjective.txt",
+        "gram7-past-tense.txt", "gram8-plural.txt", "gram9-plural-verbs.txt",
+    };
+    int i, k, n, capacity = 1024;
+    long long correct, correct_sem = 0, correct_syn = 0, count_sem = 0, count_syn = 0, full_count = 0, ids[4];
+    char path[MAX_STRING_LENGTH * 2], line[4 * MAX_STRING_LENGTH], *w, *save;
+    double start = metrics_now();
+    QUERY *q = malloc(sizeof(QUERY) * capacity);
+    long long *answers = malloc(sizeof(long long) * capacity);
+    FILE *fid;
+
+    top_k = 1;
+    for (i = 0; i < (int)(sizeof(filenames) / sizeof(filenames[0])); i++) {
+        snprintf(path, sizeof(path), "%s/%s", analogy_dir, filenames[i]);
+        if ((fid = fopen(path, "r")) == NULL) {fprintf(stderr, "Unable to open %s.\n", path); return 1;}
+        n = 0;
+        while (fgets(line, sizeof(line), fid) != NULL) {
+            full_count++;
+            for (k = 0, save = NULL, w = strtok_r(line, " \t\r\n", &save); w != NULL && k < 4; w = strtok_r(NULL, " \t\r\n", &save)) ids[k++] = find_row(w);
+            if (k != 4 || ids[0] < 0 || ids[1] < 0 || ids[2] < 0 || ids[3] < 0) continue; // questions with unknown words are not asked
+            if (n == capacity) {
+                capacity *= 2;
+                q = realloc(q, sizeof(QUERY) * capacity);
+                answers = realloc(answers, sizeof(long long) * capacity);
+            }
+            query_alloc(&q[n]);
+            memcpy(q[n].ids, ids, sizeof(long long) * 3);
+            q[n].n_ids = 3;
+            q[n].ok = 1;
+            query_set(&q[n], 1);
+            answers[n++] = ids[3];
+        }
+        fclose(fid);
+        run_threads(answer_queries, n, q);
+        for (k = 0, correct = 0; k < n; k++) {
+            correct += q[k].n_best > 0 && q[k].best[0] == answers[k];
+            query_free(&q[k]);
+        }
+        if (i < 5) {count_sem += n; correct_sem += correct;}
+        else {count_syn += n; correct_syn += correct;}
+        printf("%s:\n", filenames[i]);
+        printf("ACCURACY TOP1: %.2f%% (%lld/%d)\n", n > 0 ? 100.0 * correct / n : 0.0, correct, n);
+    }
+    printf("Questions seen/total: %.2f%% (%lld/%lld)\n", full_count > 0 ? 100.0 * (count_sem + count_syn) / full_count : 0.0, count_sem + count_syn, full_count);
+    printf("Semantic accuracy: %.2f%%  (%lld/%lld)\n", count_sem > 0 ? 100.0 * correct_sem / count_sem : 0.0, correct_sem, count_sem);
+    printf("Syntactic accuracy: %.2f%%  (%lld/%lld)\n", count_syn > 0 ? 100.0 * correct_syn / count_syn : 0.0, correct_syn, count_syn);
+    printf("Total accuracy: %.2f%%  (%lld/%lld)\n", count_sem + count_syn > 0 ? 100.0 * (correct_sem + correct_syn) / (count_sem + count_syn) : 0.0,
+           correct_sem + correct_syn, count_sem + count_syn);
+    if (verbose > 0) fprintf(stderr, "%lld questions in %.2f seconds\n", count_sem + count_syn, metrics_now() - start);
+    free(q);
+    free(answers);
+    return 0;
+}
+
+/* Read the vocab (words in the order of the rows) and map the vectors file */
+int load_model() {
+    char header[BIN_HEADER_SIZE + 1], name[16];
+    long long file_vocab;
+    double start = metrics_now();
+    struct stat st;
+    int fd;
+
+    if (vocab_map_load(&vocab, vocab_file, vocab_index_file) != 0) {fprintf(stderr, "Unable to open vocab file %s.\n", vocab_file); return 1;}
+    vocab_size = vocab.size;
+    if (vocab_size == 0) {fprintf(stderr, "Vocab file %s is empty.\n", vocab_file); return 1;}
+
+    if ((fd = open(vectors_file, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {fprintf(stderr, "Unable to open file %s.\n", vectors_file); return 1;}
+    file_size = st.st_size;
+    file_data = file_size > 0 ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (file_data == MAP_FAILED) {fprintf(stderr, "Unable to map file %s.\n", vectors_file); return 1;}
+    if (file_size >= BIN_HEADER_SIZE && strncmp(file_data, "GloVe ", 6) == 0) {
+        memcpy(header, file_data, BIN_HEADER_SIZE);
+        header[BIN_HEADER_SIZE] = 0;
+        if (sscanf(header, "GloVe %15s %lld %d", name, &file_vocab, &vector_size) != 3) {fprintf(stderr, "Bad header in %s.\n", vectors_file); return 1;}
+        elem_size = strcmp(name, "half") == 0 ? sizeof(half) : (strcmp(name, "float") == 0 ? sizeof(float) : sizeof(double));
+        file_offset = BIN_HEADER_SIZE;
+        if (file_vocab != vocab_size) {fprintf(stderr, "%s holds %lld words; %s has %lld.\n", vectors_file, file_vocab, vocab_file, vocab_size); return 1;}
+    }
+    else { // headerless double: the size follows from the vocab
+        elem_size = sizeof(double);
+        vector_size = file_size / (2 * vocab_size * sizeof(double)) - 1;
+        if (vector_size < 1 || file_size != 2 * vocab_size * (vector_size + 1) * sizeof(double)) {
+            fprintf(stderr, "%s does not hold %lld words of double vectors; is it the .bin output of glove for %s?\n", vectors_file, vocab_size, vocab_file);
+            return 1;
+        }
+    }
+    if (file_offset + 2 * vocab_size * (vector_size + 1) * elem_size > (long long)file_size) {fprintf(stderr, "%s is truncated.\n", vectors_file); return 1;}
+
+    num_rows = max_vocab > 0 && max_vocab < vocab_size ? max_vocab : vocab_size;
+    row_pad = (vector_size + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+    row_norm = malloc(sizeof(float) * vocab_size);
+    if (quantize) {
+        qrows = malloc(row_pad * num_rows);
+        qscale = malloc(sizeof(float) * num_rows);
+    }
+    else frows = malloc(sizeof(float) * vector_size * num_rows);
+    if (row_norm == NULL || (quantize ? qrows == NULL || qscale == NULL : frows == NULL)) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    run_threads(prepare_rows, num_rows, NULL);
+    // 不在搜索范围内的词也可以出现在查询里（按它们的向量查询最近的词），它们的长度按需算
+    {
+        long long r;
+        float *v = malloc(sizeof(float) * vector_size);
+        for (r = num_rows; r < vocab_size; r++) {
+            raw_row(r, v);
+            row_norm[r] = sqrtf(dot_float(v, v, vector_size));
+        }
+        free(v);
+    }
+    if (verbose > 1) fprintf(stderr, "%lld words of size %d (%s), searching %lld %s rows; prepared in %.2f seconds\n", vocab_size, vector_size,
+                             elem_size == sizeof(half) ? "half" : (elem_size == sizeof(float) ? "float" : "double"), num_rows, quantize ? "int8" : "float", metrics_now() - start);
+    return 0;
+}
+
+int find_arg(char *str, int argc, char **argv) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(str, argv[i])) {
+            if (i == argc - 1) {
+                printf("No argument given for %s\n", str);
+                exit(1);
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int i, result;
+    vectors_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    vocab_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    vocab_index_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    analogy_dir = malloc(sizeof(char) * MAX_STRING_LENGTH);
+
+    if (argc == 1) {
+        printf("Tool to query trained word vectors: nearest neighbours, analogies and the analogy test suite\n\n");
+        printf("Usage options:\n");
+        printf("\t-verbose <int>\n");
+        printf("\t\tSet verbosity: 0, 1, or 2 (default)\n");
+        printf("\t-vectors-file <file>\n");
+        printf("\t\tBinary vectors saved by glove with -binary 1 or 2, at any -precision; default vectors.bin\n");
+        printf("\t-vocab-file <file>\n");
+        printf("\t\tVocab file the vectors were trained with; default vocab.txt\n");
+        printf("\t-vocab-index <file>\n");
+        printf("\t\tBinary index of the vocab file (vocab_count -vocab-index), mapped instead of reading it when up to date; default <vocab file>%s\n", VOCAB_INDEX_SUFFIX);
+        printf("\t-model <int>\n");
+        printf("\t\tVectors to compare: 1 (word vectors) or 2 (default; word + context vectors, as in glove's default text output)\n");
+        printf("\t-k <int>\n");
+        printf("\t\tNumber of answers per query; default 10\n");
+        printf("\t-analogy <int>\n");
+        printf("\t\tQueries on stdin: 0 (default) for the nearest words to the sum of the words of each line, 1 for analogies: a line\n");
+        printf("\t\t'a b c' asks for the words closest to b - a + c\n");
+        printf("\t-analogy-dir <dir>\n");
+        printf("\t\tRun the analogy questions in <dir> (e.g. eval/question-data) instead of reading queries, reporting as evaluate.py.\n");
+        printf("\t\tScores exactly (as -quantize 0) unless -quantize 1 is given\n");
+        printf("\t-max-vocab <int>\n");
+        printf("\t\tOnly search (and only ask questions about) the <int> most frequent words; default 0 (all words)\n");
+        printf("\t-quantize <int>\n");
+        printf("\t\tScan rows stored as int8, one byte per element, and rescore the best -rerank of them exactly: 1 (default for queries),\n");
+        printf("\t\tor 0 to scan float rows (4 bytes per element; default for -analogy-dir). Only 0 guarantees the exact answers\n");
+        printf("\t-rerank <int>\n");
+        printf("\t\tCandidates from the int8 scan rescored at full precision; default 0: -k times 1000/vector-size (10 from vector size\n");
+        printf("\t\t100 on), at least %d\n", RERANK_MIN);
+        printf("\t-threads <int>\n");
+        printf("\t\tNumber of threads; default 0 (one per CPU core)\n");
+        printf("\nOutput: one line per query, the query, then a tab and 'word cosine' for each answer, best first.\n");
+        printf("\nExample usage:\n");
+        printf("./query -vectors-file vectors.bin -vocab-file vocab.txt -k 10 < words.txt\n");
+        printf("./query -vectors-file vectors.bin -vocab-file vocab.txt -analogy-dir eval/question-data\n");
+        return 0;
+    }
+
+    if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-vectors-file", argc, argv)) > 0) strcpy(vectors_file, argv[i + 1]);
+    else strcpy(vectors_file, (char *)"vectors.bin");
+    if ((i = find_arg((char *)"-vocab-file", argc, argv)) > 0) strcpy(vocab_file, argv[i + 1]);
+    else strcpy(vocab_file, (char *)"vocab.txt");
+    if ((i = find_arg((char *)"-vocab-index", argc, argv)) > 0) strcpy(vocab_index_file, argv[i + 1]);
+    else vocab_index_file[0] = 0;
+    if ((i = find_arg((char *)"-analogy-dir", argc, argv)) > 0) strcpy(analogy_dir, argv[i + 1]);
+    else analogy_dir[0] = 0;
+    if ((i = find_arg((char *)"-model", argc, argv)) > 0) model = atoi(argv[i + 1]);
+    if (model != 1) model = 2;
+    if ((i = find_arg((char *)"-k", argc, argv)) > 0) top_k = atoll(argv[i + 1]);
+    if (top_k < 1) top_k = 1;
+    if ((i = find_arg((char *)"-analogy", argc, argv)) > 0) analogy = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-max-vocab", argc, argv)) > 0) max_vocab = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-quantize", argc, argv)) > 0) quantize = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-rerank", argc, argv)) > 0) rerank = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+    if (num_threads < 1) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) num_threads = 1;
+
+    if (quantize < 0) quantize = analogy_dir[0] == 0;
+
+    if (load_model() != 0) return 1;
+    result = analogy_dir[0] != 0 ? run_analogies() : query_stdin();
+    munmap((void *)file_data, file_size);
+    vocab_map_free(&vocab);
+    free(row_norm);
+    free(qrows);
+    free(qscale);
+    free(frows);
+    free(vectors_file);
+    free(vocab_file);
+    free(vocab_index_file);
+    free(analogy_dir);
+    return result;
+}
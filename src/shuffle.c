@@ -40,19 +40,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "common.h"
 
 #define MAX_STRING_LENGTH 1000
+// 多线程打乱时把数组分成的桶数，固定不变，所以打乱的结果不依赖于线程数
+#define SHUFFLE_BUCKETS 256
 
 static const long LRAND_MAX = ((long) RAND_MAX + 2) * (long)RAND_MAX;
 typedef double real;
 
-// 共现记录，word1和word2是词在vocab_count词频统计的输出文件中的序号，序号越小词频越大
-typedef struct cooccur_rec {
-    int word1;
-    int word2;
-    // 加权后的共现次数
-    real val;
-} CREC;
+// 共现记录CREC定义在common.h中，word1和word2是词在vocab_count词频统计的输出文件中的序号，序号越小词频越大
 
 // 用来控制输出log
 int verbose = 2; // 0, 1, or 2
@@ -62,6 +61,16 @@ long long array_size = 2000000; // size of chunks to shuffle individually
 char *file_head; // temporary file string
 // 限制内存大小，这是一个粗略的限制，默认是2G
 real memory_limit = 2.0; // soft limit, in gigabytes
+int memory_auto = 0; // -memory auto: memory_limit from the free memory, array_size no larger than the input needs
+// 线程数，大于1时用基于计数器的随机数并行打乱，结果只由seed决定；等于1时保持原来基于rand()的结果
+int num_threads = 1; // pthreads; 1 keeps the original rand() based output
+// 多线程打乱用的随机数种子
+unsigned long long seed = 1; // seed for the counter-based generator used with more than 1 thread
+// 输出和临时文件的格式，见common.h；输入的格式自动识别
+int output_format = CREC_FORMAT_RAW, compress_level = 0;
+// 运行指标（-metrics）：当前阶段的开始时间、上一行进度的时间，以及阶段内花在打乱数组上的时间（其余是读写）
+char *metrics_path = NULL;
+double metrics_phase, metrics_last, shuffle_seconds;
 
 /* Efficient string comparison */
 // 比较两个词书佛欧相同，这个程序中好像没有用到
@@ -82,14 +91,6 @@ static long rand_long(long n) {
     return rnd % n;
 }
 
-/* Write contents of array to binary file */
-// 把整个数组中的记录，写到输出文件或标准输出
-int write_chunk(CREC *array, long size, FILE *fout) {
-    long i = 0;
-    for (i = 0; i < size; i++) fwrite(&array[i], sizeof(CREC), 1, fout);
-    return 0;
-}
-
 /* Fisher-Yates shuffle */
 // 打乱数组
 void shuffle(CREC *array, long n) {
@@ -104,30 +105,142 @@ void shuffle(CREC *array, long n) {
     }
 }
 
+/***
+ *  多线程打乱：把数组分成SHUFFLE_BUCKETS段，每个记录用计数器随机数选一个桶
+ *  1. 每段统计落到每个桶的记录数
+ *  2. 前缀和得到每段在每个桶中的写入位置
+ *  3. 每段把记录分散写到out中对应的桶里
+ *  4. 每个桶内部再做一次Fisher-Yates
+ *  每个记录均匀随机地落到某个桶，桶内再均匀打乱，所以结果是一个均匀的随机排列
+ */
+
+typedef struct shuffle_job {
+    CREC *array, *out;
+    long n;
+    unsigned long long stream;  // random stream of this chunk; the bucket shuffle uses stream + 1
+    long long (*counts)[SHUFFLE_BUCKETS]; // counts[part][bucket], turned into write offsets after the count pass
+    int phase;                  // 0: count, 1: scatter, 2: shuffle buckets
+} SHUFFLE_JOB;
+
+typedef struct shuffle_thread {
+    SHUFFLE_JOB *job;
+    int id;
+} STHREAD;
+
+void *shuffle_thread(void *arg) {
+    STHREAD *t = (STHREAD *)arg;
+    SHUFFLE_JOB *job = t->job;
+    long i, j, start, end, first, last;
+    int p, b;
+    CREC tmp;
+    // 段和桶都按线程号跨步分配，每个线程处理SHUFFLE_BUCKETS / num_threads个
+    for (p = t->id; p < SHUFFLE_BUCKETS; p += num_threads) {
+        start = job->n * p / SHUFFLE_BUCKETS;
+        end = job->n * (p + 1) / SHUFFLE_BUCKETS;
+        if (job->phase == 0) {
+            for (i = start; i < end; i++) job->counts[p][counter_rand_below(seed, job->stream, i, SHUFFLE_BUCKETS)]++;
+        }
+        else if (job->phase == 1) {
+            for (i = start; i < end; i++) job->out[job->counts[p][counter_rand_below(seed, job->stream, i, SHUFFLE_BUCKETS)]++] = job->array[i];
+        }
+        else {
+            b = p; // In this phase p is a bucket: after the scatter, bucket b spans [counts[SHUFFLE_BUCKETS - 1][b - 1], counts[SHUFFLE_BUCKETS - 1][b])
+            first = (b == 0) ? 0 : job->counts[SHUFFLE_BUCKETS - 1][b - 1];
+            last = job->counts[SHUFFLE_BUCKETS - 1][b];
+            for (i = last - 1; i > first; i--) {
+                j = first + counter_rand_below(seed, job->stream + 1, i, i - first + 1);
+                tmp = job->out[j];
+                job->out[j] = job->out[i];
+                job->out[i] = tmp;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Run one phase of the parallel shuffle on all threads */
+void run_shuffle_phase(SHUFFLE_JOB *job, int phase) {
+    int a;
+    pthread_t *pt = malloc(num_threads * sizeof(pthread_t));
+    STHREAD *threads = malloc(num_threads * sizeof(STHREAD));
+    job->phase = phase;
+    for (a = 0; a < num_threads; a++) {
+        threads[a].job = job;
+        threads[a].id = a;
+        pthread_create(&pt[a], NULL, shuffle_thread, (void *)&threads[a]);
+    }
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    free(pt);
+    free(threads);
+}
+
+/* Parallel shuffle of array[0..n) into out[0..n) with a bucketed scatter; the result depends only on seed and stream */
+// 多线程打乱array，结果写到out中
+void shuffle_parallel(CREC *array, CREC *out, long n, unsigned long long stream) {
+    static long long counts[SHUFFLE_BUCKETS][SHUFFLE_BUCKETS];
+    SHUFFLE_JOB job;
+    long long offset = 0, c;
+    int p, b;
+    memset(counts, 0, sizeof(counts));
+    job.array = array;
+    job.out = out;
+    job.n = n;
+    job.stream = stream;
+    job.counts = counts;
+    run_shuffle_phase(&job, 0);
+    // 前缀和：桶b中第p段的起始位置 = 前面所有桶的大小 + 桶b中前面各段的大小
+    for (b = 0; b < SHUFFLE_BUCKETS; b++) {
+        for (p = 0; p < SHUFFLE_BUCKETS; p++) {
+            c = counts[p][b];
+            counts[p][b] = offset;
+            offset += c;
+        }
+    }
+    run_shuffle_phase(&job, 1);
+    // 分散写完之后，counts[SHUFFLE_BUCKETS - 1][b]正好是桶b的结束位置
+    run_shuffle_phase(&job, 2);
+}
+
 /* Merge shuffled temporary files; doesn't necessarily produce a perfect shuffle, but good enough */
 int shuffle_merge(int num) {
     long i, j, k, l = 0;
     int fidcounter = 0;
-    CREC *array;
+    long long round = 0, bytes_read = 0;
+    double start;
+    CREC *array, *out = NULL;
     char filename[MAX_STRING_LENGTH];
-    FILE **fid, *fout = stdout;
+    FILE **fid;
+    CREC_READER *readers;
+    CREC_WRITER writer, *fout = &writer;
+    char *done;
     
     // 重新开辟一个数组，其实复用上一个也可以吧
     array = malloc(sizeof(CREC) * array_size);
+    // 多线程打乱需要第二个数组来存放打乱后的结果
+    if (num_threads > 1) out = malloc(sizeof(CREC) * array_size);
+    if (array == NULL || (num_threads > 1 && out == NULL)) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
     // 这个数组用来存各个文件的句柄
     fid = malloc(sizeof(FILE) * num);
+    readers = malloc(sizeof(CREC_READER) * num);
+    done = calloc(num, 1);
     // 一共有num个临时文件
     for (fidcounter = 0; fidcounter < num; fidcounter++) { //num = number of temporary files to merge
         sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
         // 打开文件
         fid[fidcounter] = fopen(filename, "rb");
         // 如果失败就退出
-        if (fid[fidcounter] == NULL) {
+        if (fid[fidcounter] == NULL || crec_reader_open(&readers[fidcounter], fid[fidcounter]) != 0) {
             fprintf(stderr, "Unable to open file %s.\n",filename);
             return 1;
         }
     }
+    if (crec_writer_open(fout, stdout, output_format, compress_level) != 0) {fprintf(stderr, "Unable to write output.\n"); return 1;}
     if (verbose > 0) fprintf(stderr, "Merging temp files: processed %ld lines.", l);
+    metrics_phase = metrics_last = metrics_now();
+    shuffle_seconds = 0;
     
     // 直到所有文件都读完
     while (1) { //Loop until EOF in all files
@@ -137,30 +250,40 @@ int shuffle_merge(int num) {
         // 从每个文件中读取array_size / num条记录到数组
         for (j = 0; j < num; j++) {
             // 如果当前文件空了，直接读下一个
-            if (feof(fid[j])) continue;
-            // 从当前文件中读取array_size / num条记录到数组
-            for (k = 0; k < array_size / num; k++){
-                // 读取一条记录
-                fread(&array[i], sizeof(CREC), 1, fid[j]);
-                // 如果EOF了，退出当前循环，读取下一个文件
-                if (feof(fid[j])) break;
-                // 记录读取记录的数目
-                i++;
-            }
+            if (done[j]) continue;
+            // 从当前文件中一次读取array_size / num条记录到数组，记录读取记录的数目；没读满说明这个文件读完了
+            if ((k = crec_read(&readers[j], &array[i], array_size / num)) < 0) {fprintf(stderr, "Corrupt temporary file.\n"); return 1;}
+            if (k < array_size / num) done[j] = 1;
+            i += k;
         }
         // 如果一条都没读到，说明所有文件都EOF了，退出
         if (i == 0) break;
         // 记录一共读取了多少条记录
         l += i;
-        // 打乱数组
-        shuffle(array, i-1); // Shuffles lines between temp files
-        // 把打乱后的数组写到标准输出
-        write_chunk(array,i,fout);
+        round++;
+        // 打乱数组，把打乱后的数组写到标准输出
+        start = metrics_now();
+        if (num_threads > 1) {
+            shuffle_parallel(array, out, i, 4 * (round - 1) + 2); // Streams 4k + 2 and 4k + 3; the chunk pass uses 4k and 4k + 1
+            shuffle_seconds += metrics_now() - start;
+            if (crec_write_many(fout,out,i) != 0) {fprintf(stderr, "Unable to write output.\n"); return 1;}
+        }
+        else {
+            shuffle(array, i-1); // Shuffles lines between temp files
+            shuffle_seconds += metrics_now() - start;
+            if (crec_write_many(fout,array,i) != 0) {fprintf(stderr, "Unable to write output.\n"); return 1;}
+        }
         if (verbose > 0) fprintf(stderr, "\033[31G%ld lines.", l);
+        if (metrics_due(&metrics_last)) metrics_emit("merge", metrics_last - metrics_phase, "\"progress\":1,\"records\":%ld,\"bytes_written\":%lld", l, fout->bytes);
     }
     fprintf(stderr, "\033[0GMerging temp files: processed %ld lines.", l);
     // 关闭所有临时文件，并删除文件
+    if (crec_writer_close(fout) != 0 || fflush(stdout) != 0) {fprintf(stderr, "Unable to write output.\n"); return 1;}
+    for (fidcounter = 0; fidcounter < num; fidcounter++) bytes_read += readers[fidcounter].bytes;
+    metrics_emit("merge", metrics_now() - metrics_phase, "\"files\":%d,\"records\":%ld,\"bytes_read\":%lld,\"bytes_written\":%lld,\"shuffle_seconds\":%.3f,\"records_per_sec\":%.0f",
+        num, l, bytes_read, fout->bytes, shuffle_seconds, l / (metrics_now() - metrics_phase + 1e-9));
     for (fidcounter = 0; fidcounter < num; fidcounter++) {
+        crec_reader_close(&readers[fidcounter]);
         fclose(fid[fidcounter]);
         sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
         remove(filename);
@@ -168,74 +291,116 @@ int shuffle_merge(int num) {
     fprintf(stderr, "\n\n");
     // 释放内存，程序结束
     free(array);
+    free(out);
+    free(readers);
+    free(done);
     return 0;
 }
 
 /* Shuffle large input stream by splitting into chunks */
 // 通过把文件切成一个个chunk的方式来打乱
+/* Upper bound on the records on stdin when it is a regular file, or -1; compact records take at least a value and
+ * two 1-byte ids */
+long long input_records_bound() {
+    struct stat st;
+    int format;
+    if (fstat(fileno(stdin), &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    format = crec_file_format(stdin);
+    fseeko(stdin, 0, SEEK_SET); // crec_reader_open reads the header again
+    if (format == CREC_FORMAT_RAW) return st.st_size / sizeof(CREC);
+    return st.st_size / ((format == CREC_FORMAT_COMPACT32 ? sizeof(float) : sizeof(double)) + 2);
+}
+
 int shuffle_by_chunks() {
     long i = 0, l = 0;
     int fidcounter = 0;
+    long long bytes_written = 0;
+    double start;
     char filename[MAX_STRING_LENGTH];
-    CREC *array;
-    FILE *fin = stdin, *fid;
+    CREC *array, *out = NULL, *chunk;
+    FILE *fid;
+    CREC_READER reader;
+    CREC_WRITER writer;
     array = malloc(sizeof(CREC) * array_size);
+    // 多线程打乱需要第二个数组来存放打乱后的结果
+    if (num_threads > 1) out = malloc(sizeof(CREC) * array_size);
+    if (array == NULL || (num_threads > 1 && out == NULL)) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
     
-    fprintf(stderr,"SHUFFLING COOCCURRENCES\n");
-    if (verbose > 0) fprintf(stderr,"array size: %lld\n", array_size);
-    // 打开第一个文件
-    sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
-    fid = fopen(filename,"w");
-    // 如果失败就退出
-    if (fid == NULL) {
-        fprintf(stderr, "Unable to open file %s.\n",filename);
+    if (crec_reader_open(&reader, stdin) != 0) {
+        fprintf(stderr, "Couldn't allocate memory!");
         return 1;
     }
+    
+    fprintf(stderr,"SHUFFLING COOCCURRENCES\n");
+    if (verbose > 0) fprintf(stderr,"array size: %lld\n", array_size);
     if (verbose > 1) fprintf(stderr, "Shuffling by chunks: processed 0 lines.");
+    metrics_phase = metrics_last = metrics_now();
+    shuffle_seconds = 0;
     
     // 循环直到读完所有文件中的记录
     while (1) { //Continue until EOF
-        // i用来记录目前数组中已经存的记录的个数
-        // 如果要超过数组大小了，就输出到文件
-        if (i >= array_size) {// If array is full, shuffle it and save to temporary file
-            // 打乱一下
-            shuffle(array, i-2);
-            // l记录了已经读取了多少条记录
-            l += i;
-            if (verbose > 1) fprintf(stderr, "\033[22Gprocessed %ld lines.", l);
-            // 把这个chuck，也就是一个数组，写入一个临时文件
-            write_chunk(array,i,fid);
-            // 关闭文件
-            fclose(fid);
-            // 用来存储一共写了多少个临时文件了
-            fidcounter++;
-            // 打开下一个临时文件
-            sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
-            fid = fopen(filename,"w");
-            // 如果打开失败 就退出
-            if (fid == NULL) {
-                fprintf(stderr, "Unable to open file %s.\n",filename);
-                return 1;
-            }
-            // 数组计数器归0
-            i = 0;
+        // 一次读入一整个chunk，i是读到的记录数，最后一个chunk可能不满
+        if ((i = crec_read(&reader, array, array_size)) < 0) {fprintf(stderr, "Corrupt input.\n"); return 1;}
+        // l记录了已经读取了多少条记录
+        l += i;
+        // 多线程时如果整个输入都能放进内存，打乱一次直接输出，不再写临时文件、也不再合并
+        if (num_threads > 1 && fidcounter == 0 && i < array_size) { // Whole input fits in memory: no temporary files
+            start = metrics_now();
+            shuffle_parallel(array, out, i, 0);
+            shuffle_seconds = metrics_now() - start;
+            if (verbose > 1) fprintf(stderr, "\033[22Gprocessed %ld lines.\n\n", l);
+            if (crec_writer_open(&writer, stdout, output_format, compress_level) != 0 || crec_write_many(&writer, out, i) != 0
+                || crec_writer_close(&writer) != 0 || fflush(stdout) != 0) {fprintf(stderr, "Unable to write output.\n"); return 1;}
+            metrics_emit("shuffle", metrics_now() - metrics_phase, "\"chunks\":1,\"records\":%ld,\"bytes_read\":%lld,\"bytes_written\":%lld,\"shuffle_seconds\":%.3f,\"records_per_sec\":%.0f",
+                l, reader.bytes, writer.bytes, shuffle_seconds, l / (metrics_now() - metrics_phase + 1e-9));
+            crec_reader_close(&reader);
+            free(array);
+            free(out);
+            return 0;
         }
-        // 读取下一条记录，存到数组的
-        fread(&array[i], sizeof(CREC), 1, fin);
-        if (feof(fin)) break;
-        i++;
+        // 打乱一下
+        start = metrics_now();
+        if (num_threads > 1) {
+            shuffle_parallel(array, out, i, 4 * (unsigned long long)fidcounter);
+            chunk = out;
+        }
+        else {
+            shuffle(array, i-2); //Last chunk may be smaller than array_size
+            chunk = array;
+        }
+        shuffle_seconds += metrics_now() - start;
+        // 把这个chuck，也就是一个数组，写入一个临时文件
+        sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
+        fid = fopen(filename,"w");
+        // 如果打开失败 就退出
+        if (fid == NULL) {
+            fprintf(stderr, "Unable to open file %s.\n",filename);
+            return 1;
+        }
+        if (crec_writer_open(&writer, fid, output_format, compress_level) != 0 || crec_write_many(&writer, chunk, i) != 0
+            || crec_writer_close(&writer) != 0) {fprintf(stderr, "Unable to write file %s.\n",filename); return 1;}
+        bytes_written += writer.bytes;
+        // 关闭文件
+        fclose(fid);
+        // 没有读满说明已经到了文件末尾
+        if (i < array_size) break;
+        if (verbose > 1) fprintf(stderr, "\033[22Gprocessed %ld lines.", l);
+        if (metrics_due(&metrics_last)) metrics_emit("shuffle", metrics_last - metrics_phase, "\"progress\":1,\"chunks\":%d,\"records\":%ld,\"bytes_read\":%lld,\"bytes_written\":%lld",
+            fidcounter + 1, l, reader.bytes, bytes_written);
+        // 用来存储一共写了多少个临时文件了
+        fidcounter++;
     }
-    // 打乱最后一个chuck
-    shuffle(array, i-2); //Last chunk may be smaller than array_size
-    // 写入最后一个chuck
-    write_chunk(array,i,fid);
-    // 记录一个写了多少个记录
-    l += i;
     if (verbose > 1) fprintf(stderr, "\033[22Gprocessed %ld lines.\n", l);
     if (verbose > 1) fprintf(stderr, "Wrote %d temporary file(s).\n", fidcounter + 1);
-    // 关闭文件 清理内存
-    fclose(fid);
+    metrics_emit("shuffle", metrics_now() - metrics_phase, "\"chunks\":%d,\"records\":%ld,\"bytes_read\":%lld,\"bytes_written\":%lld,\"shuffle_seconds\":%.3f,\"records_per_sec\":%.0f",
+        fidcounter + 1, l, reader.bytes, bytes_written, shuffle_seconds, l / (metrics_now() - metrics_phase + 1e-9));
+    // 清理内存
+    crec_reader_close(&reader);
     free(array);
+    free(out);
     // 还没完呢！把所有文件重新合并成一个文件，这个过程中也会打乱的
     return shuffle_merge(fidcounter + 1); // Merge and shuffle together temporary files
 }
@@ -267,11 +432,25 @@ int main(int argc, char **argv) {
         printf("\t-verbose <int>\n");
         printf("\t\tSet verbosity: 0, 1, or 2 (default)\n");
         printf("\t-memory <float>\n");
-        printf("\t\tSoft limit for memory consumption, in GB; default 4.0\n");
+        printf("\t\tSoft limit for memory consumption, in GB; default 4.0. auto: use %.0f%% of the memory available to this process\n", 100 * AUTO_MEMORY_FRACTION);
+        printf("\t\t(free RAM, within any cgroup limit), and no more than a regular input file on stdin needs\n");
         printf("\t-array-size <int>\n");
         printf("\t\tLimit to length <int> the buffer which stores chunks of data to shuffle before writing to disk. \n\t\tThis value overrides that which is automatically produced by '-memory'.\n");
         printf("\t-temp-file <file>\n");
         printf("\t\tFilename, excluding extension, for temporary files; default temp_shuffle\n");
+        printf("\t-format <string>\n");
+        printf("\t\tFormat of the output and temporary files: raw (default), compact or compact32 (see cooccur); input format is detected\n");
+        printf("\t-compress <int>\n");
+        printf("\t\tzstd level for compact blocks; default 0 (off)\n");
+        printf("\t-threads <int>\n");
+        printf("\t\tNumber of threads; default 1. With more than 1, chunks are shuffled in parallel with a counter-based generator, so the output\n");
+        printf("\t\tdepends only on -seed (not on <int>); two buffers are needed, so the default array size is halved. If the whole input fits\n");
+        printf("\t\tin one chunk it is shuffled in memory and written out directly, without temporary files.\n");
+        printf("\t-seed <int>\n");
+        printf("\t\tRandom seed for -threads > 1; default 1\n");
+        printf("\t-metrics <file>\n");
+        printf("\t\tAppend one JSON line per phase (shuffle, merge) to <file>, or to stderr for -: time, records/sec, bytes read and written,\n");
+        printf("\t\ttime spent shuffling and peak RSS. Long phases also report progress every %.0f seconds.\n", METRICS_INTERVAL);
         
         printf("\nExample usage: (assuming 'cooccurrence.bin' has been produced by 'coccur')\n");
         printf("./shuffle -verbose 2 -memory 8.0 < cooccurrence.bin > cooccurrence.shuf.bin\n");
@@ -283,13 +462,40 @@ int main(int argc, char **argv) {
     // 临时文件的文件头，默认是temp_shuffle，所以临时文件就是temp_shuffle_0000.bin的格式命名
     if ((i = find_arg((char *)"-temp-file", argc, argv)) > 0) strcpy(file_head, argv[i + 1]);
     else strcpy(file_head, (char *)"temp_shuffle");
-    // 限制内存大小，这是一个粗略的限制，默认是4G
-    if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
+    // 限制内存大小，这是一个粗略的限制，默认是4G；auto表示按可用内存确定
+    if ((i = find_arg((char *)"-memory", argc, argv)) > 0) {
+        if (strcmp(argv[i + 1], "auto") == 0) memory_auto = 1;
+        else memory_limit = atof(argv[i + 1]);
+    }
     // 通过内存大小，来计算要开辟的数组的长度
+    if ((i = find_arg((char *)"-format", argc, argv)) > 0 && (output_format = crec_parse_format(argv[i + 1])) < 0) {
+        fprintf(stderr, "Unknown format %s; expected raw, compact or compact32.\n", argv[i + 1]);
+        return 1;
+    }
+    if ((i = find_arg((char *)"-compress", argc, argv)) > 0) compress_level = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+    if (num_threads < 1) num_threads = 1;
+    if ((i = find_arg((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+    if (memory_auto) memory_limit = auto_memory_gb(memory_limit);
     array_size = (long long) (0.95 * (real)memory_limit * 1073741824/(sizeof(CREC)));
+    // 多线程时需要两个数组
+    if (num_threads > 1) array_size /= 2;
+    // 自动模式下输入比内存小时，数组只开到能放下整个输入，多线程时就不用写临时文件了
+    if (memory_auto) {
+        long long bound = input_records_bound();
+        if (bound >= 0 && bound < array_size) array_size = bound + 1;
+        if (verbose > 1) fprintf(stderr, "auto memory: %.2f GB\n", (double)memory_limit);
+    }
     // 如果用户指定了数组长度，那么直接赋值，上面的计算就是娱乐而已了
     if ((i = find_arg((char *)"-array-size", argc, argv)) > 0) array_size = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-metrics", argc, argv)) > 0) metrics_path = argv[i + 1];
+    if (metrics_open("shuffle", metrics_path) != 0) {
+        fprintf(stderr, "Unable to open metrics file %s.\n", metrics_path);
+        return 1;
+    }
     // 开始打乱
-    return shuffle_by_chunks();
+    i = shuffle_by_chunks();
+    metrics_close();
+    return i;
 }
 
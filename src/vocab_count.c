@@ -40,15 +40,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
 
 // 每个单词最长长度，如果超出会被截断成2个
 #define MAX_STRING_LENGTH 1000
-// 哈希表的大小 2^20
-#define TSIZE	1048576
-// 哈希函数中使用
-#define SEED	1159241
-// 哈希函数，实际本程序中只有这一个哈希函数
-#define HASHFN  bitwisehash
+// 分隔词的字符，与fscanf的%s相同
+#define WORD_SEPARATORS " \t\n\v\f\r"
+// 哈希表的初始大小，词数超过后会自动扩容
+#define INITIAL_VOCAB_HASH_SIZE 1048576
 
 // 最终词表的数组的节点
 typedef struct vocabulary {
@@ -58,22 +62,19 @@ typedef struct vocabulary {
     long long count;
 } VOCAB;
 
-// 每一条哈希记录的结构，同时也是单向链表节点
-typedef struct hashrec {
-    // 词
-    char *word;
-    // 统计词频
-    long long count;
-    // 链表，用来解决哈希碰撞
-    struct hashrec *next;
-} HASHREC;
-
 // 控制是否输出debug信息
 int verbose = 2; // 0, 1, or 2
 // 最小词频，低于这个阈值的词会被丢弃
 long long min_count = 1; // min occurrences for inclusion in vocab
 // 最大词数，总词数不超过这个阈值，如果超过了，会有比min_count高的词被丢弃
 long long max_vocab = 0; // max_vocab = 0 for no limit
+// 线程数，大于1时把语料切分成num_threads段并行统计，此时标准输入必须重定向自一个普通文件
+int num_threads = 1; // pthreads; more than 1 requires stdin to be redirected from a regular file
+// 运行指标：输出文件（-metrics），当前阶段的开始时间和上一行进度的时间
+char *metrics_path = NULL;
+double metrics_phase, metrics_last;
+// -vocab-index：同时写出词表的二进制索引（见common.h），cooccur、glove和query启动时直接mmap它
+char *index_file = NULL;
 
 
 /* Efficient string comparison */
@@ -93,166 +94,240 @@ int CompareVocabTie(const void *a, const void *b) {
     
 }
 
-/* Vocab frequency comparison; no tie-breaker */
-// tie-breaker : 平局决胜
-// 比较两个词的词频，a>b返回-1；a<b返回1；a=b返回0，不继续比较
-int CompareVocab(const void *a, const void *b) {
-    long long c;
-    if ( (c = ((VOCAB *) b)->count - ((VOCAB *) a)->count) != 0) return ( c > 0 ? 1 : -1 );
-    else return 0;
+/* Count every token from reader into vocab_hash. Returns 0 on success, 1 if <unk> is found, 2 if out of memory */
+// 把reader中的每一个词插入哈希表，词频加1；单线程和多线程共用
+// 单线程时show_progress打开，除了屏幕上的计数，还按METRICS_INTERVAL输出tokenize阶段的进度
+int count_tokens(TOKEN_READER *reader, VOCAB_HASH *vocab_hash, long long *tokens, int show_progress) {
+    long long length, off, n;
+    // 分词器返回的词，指向分词器的缓冲区内部
+    const char *token;
+    int flag;
+    HASH_ENTRY *htmp;
+    
+    while ((flag = next_token(reader, &token, &length)) != TOKEN_END) { // Insert all tokens into hashtable
+        // 和以前的fscanf("%1000s")一样，超过MAX_STRING_LENGTH的词被切成几段，每段算一个词
+        for (off = 0; off < length; off += n) { // Words longer than MAX_STRING_LENGTH are split into pieces, as fscanf did
+            n = (length - off < MAX_STRING_LENGTH) ? length - off : MAX_STRING_LENGTH;
+            // <unk> 是系统默认项，用户文件中不许出现
+            if (n == 5 && memcmp(token + off, "<unk>", 5) == 0) return 1;
+            // 插入哈希表，词频加1
+            if ((htmp = vocab_hash_insert(vocab_hash, token + off, n)) == NULL) return 2;
+            htmp->value++;
+            // 统计总token数，重复词重复计入
+            if (((++*tokens)%100000) == 0 && show_progress) {
+                if (verbose > 1) fprintf(stderr,"\033[11G%lld tokens.", *tokens);
+                if (metrics_due(&metrics_last)) metrics_emit("tokenize", metrics_last - metrics_phase, "\"progress\":1,\"tokens\":%lld,\"bytes_read\":%lld,\"tokens_per_sec\":%.0f",
+                    *tokens, reader->bytes, *tokens / (metrics_last - metrics_phase));
+            }
+        }
+        if (flag == TOKEN_WORD_AT_END) break;
+    }
+    return 0;
 }
 
-// 哈希函数、数据结构、哈希表的初始化、插入、查找，都是从这个网址的源代码中稍加修改而来
-// 修改的部分就是数据结构，和哈希表的默认长度
-// 很不错的源代码，可以仔细学习一些原理
-/* Move-to-front hashing and hash function from Hugh Williams, http://www.seg.rmit.edu.au/code/zwh-ipl/ */
+// 每个线程统计语料中[start, end)这一段，使用自己的哈希表，最后再合并
+typedef struct vocab_thread {
+    const char *start, *end; // Byte range of the corpus, starting and ending on a separator boundary
+    VOCAB_HASH *vocab_hash;
+    long long tokens;
+    int result;
+} VTHREAD;
 
-/* Simple bitwise hash function */
-// 哈希函数
-unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
-    char c;
-    unsigned int h;
-    h = seed;
-    for (; (c =* word) != '\0'; word++) h ^= ((h << 5) + c + (h >> 2));
-    return((unsigned int)((h&0x7fffffff) % tsize));
+void *count_thread(void *arg) {
+    VTHREAD *t = (VTHREAD *)arg;
+    TOKEN_READER reader;
+    reader_init_range(&reader, t->start, t->end, WORD_SEPARATORS, 0);
+    t->tokens = 0;
+    if ((t->vocab_hash = vocab_hash_create(INITIAL_VOCAB_HASH_SIZE)) == NULL) t->result = 2;
+    else t->result = count_tokens(&reader, t->vocab_hash, &t->tokens, 0);
+    return NULL;
 }
 
-/* Create hash table, initialise pointers to NULL */
-// 新建一个大小为TSIZE的哈希表，用链表解决哈希冲突
-HASHREC ** inithashtable() {
-    int	i;
-    HASHREC **ht;
-    ht = (HASHREC **) malloc( sizeof(HASHREC *) * TSIZE );
-    for (i = 0; i < TSIZE; i++) ht[i] = (HASHREC *) NULL;
-    return(ht);
+/* Multi-threaded counting: map the corpus on stdin, split it into num_threads ranges at separators, count each range
+ * in a thread-local table, then add all tables into the first one. Returns 0 on success, 1 for <unk>, 2 for errors */
+// 多线程统计：把标准输入的语料映射到内存，在分隔符处切成num_threads段，每个线程用自己的哈希表统计，最后合并到第一个表
+int get_counts_parallel(VOCAB_HASH **merged, long long *tokens, long long *bytes) {
+    struct stat st;
+    const char *corpus;
+    long long a, b;
+    int result = 0;
+    pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    VTHREAD *threads = (VTHREAD *)malloc(num_threads * sizeof(VTHREAD));
+    HASH_ENTRY *htmp;
+    
+    if (fstat(fileno(stdin), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "-threads > 1 needs the corpus on stdin to be a regular file (vocab_count ... < corpus.txt).\n");
+        return 2;
+    }
+    corpus = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(stdin), 0) : NULL;
+    if (corpus == MAP_FAILED) {fprintf(stderr, "Unable to map corpus.\n"); return 2;}
+    if (corpus != NULL) madvise((void *)corpus, st.st_size, MADV_SEQUENTIAL);
+    for (a = 0; a < num_threads; a++) {
+        // 每一段都从一个分隔符之后开始，这样不会把一个词切开
+        threads[a].start = corpus + range_start(corpus, st.st_size, a, num_threads, WORD_SEPARATORS); // Never split a word
+        if (a > 0) threads[a - 1].end = threads[a].start;
+    }
+    threads[num_threads - 1].end = corpus + st.st_size;
+    *bytes = st.st_size;
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, count_thread, (void *)&threads[a]);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    
+    for (a = 0; a < num_threads; a++) {
+        *tokens += threads[a].tokens;
+        if (threads[a].result > result) result = threads[a].result;
+    }
+    // 把其它线程的哈希表合并到第一个表中
+    for (a = 1; a < num_threads && result == 0; a++) {
+        for (b = 0; b < threads[a].vocab_hash->capacity; b++) {
+            if (threads[a].vocab_hash->slots[b].word == NULL) continue;
+            htmp = vocab_hash_insert(threads[0].vocab_hash, threads[a].vocab_hash->slots[b].word, strlen(threads[a].vocab_hash->slots[b].word));
+            if (htmp == NULL) {result = 2; break;}
+            htmp->value += threads[a].vocab_hash->slots[b].value;
+        }
+    }
+    for (a = 1; a < num_threads; a++) vocab_hash_free(threads[a].vocab_hash);
+    if (corpus != NULL) munmap((void *)corpus, st.st_size);
+    *merged = threads[0].vocab_hash;
+    free(pt);
+    free(threads);
+    return result;
 }
 
-/* Search hash table for given string, insert if not found */
-// 搜索一个词是否在哈希表中，没有的话就创建
-// 本代码中使用链表来解决哈希冲突
-void hashinsert(HASHREC **ht, char *w) {
-    // 指向一条哈希表记录的指针
-    HASHREC	*htmp, *hprv;
-    // 计算这个词的哈希值，默认调用bitwisehash函数
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    
-    // 通过哈希值寻找对应的哈希表记录，如果发现非空并且不是当前词，
-    // 说明遇到哈希冲突，则循环到链表的下一个节点，直到找到一个空记录
-    for (hprv = NULL, htmp = ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    // 如果当前词不存在，创建
-    if (htmp == NULL) {
-        // 创建一条新的哈希表记录
-        htmp = (HASHREC *) malloc( sizeof(HASHREC) );
-        // 把词赋值
-        htmp->word = (char *) malloc( strlen(w) + 1 );
-        strcpy(htmp->word, w);
-        // 词频初始化为1
-        htmp->count = 1;
-        htmp->next = NULL;
-        // 指针操作，如果有哈希冲突，要跟前面的节点连起来，否则直接赋值到哈希表
-        if ( hprv==NULL )
-            ht[hval] = htmp;
-        else
-            hprv->next = htmp;
+/* Partially sort vocab so that vocab[0..k) holds the k most frequent words, in no particular order */
+// 部分排序（选择top-k），使vocab的前k项是词频最高的k个词，用三路划分处理大量词频相同的词
+// 词频相同的词之间的顺序仍然是哈希表中的顺序，相当于乱序，所以截尾时仍然近似随机
+void select_top(VOCAB *vocab, long long n, long long k) {
+    long long lo = 0, hi = n, lt, gt, i, pivot, x, y, z;
+    VOCAB tmp;
+    while (hi - lo > 1) {
+        x = vocab[lo].count; y = vocab[lo + (hi - lo) / 2].count; z = vocab[hi - 1].count;
+        pivot = (x < y) ? ((y < z) ? y : ((x < z) ? z : x)) : ((x < z) ? x : ((y < z) ? z : y)); // Median of three
+        // [lo, lt)词频大于pivot，[lt, gt)等于pivot，[gt, hi)小于pivot
+        for (lt = lo, i = lo, gt = hi; i < gt; ) {
+            if (vocab[i].count > pivot) {tmp = vocab[lt]; vocab[lt++] = vocab[i]; vocab[i++] = tmp;}
+            else if (vocab[i].count < pivot) {tmp = vocab[--gt]; vocab[gt] = vocab[i]; vocab[i] = tmp;}
+            else i++;
+        }
+        if (k < lt) hi = lt;
+        else if (k > gt) lo = gt;
+        else return;
     }
-    else {
-        /* new records are not moved to front */
-        // 如果当前词已存在，把词频加1
-        htmp->count++;
-        // 如果当前词不是链表的头部，即有哈希冲突，则把当前词移到链表的头部
-        // 这是一个类似LRU的策略，十分有效，因为哈希之后链表里的词互相有关的概率很小
-        // 而在一段话中一个词反复出现的概率又很高，所以这样做能节约很多遍历链表的操作
-        if (hprv != NULL) {
-            /* move to front on access */
-            hprv->next = htmp->next;
-            htmp->next = ht[hval];
-            ht[hval] = htmp;
+}
+
+/* Write the binary index of the size words just printed to stdout, for the other tools to map. stdout must be a
+ * regular file: the index is stamped with it */
+int write_index(const VOCAB *vocab, long long size) {
+    char **words = malloc(sizeof(char *) * (size + 1));
+    long long a, *counts = malloc(sizeof(long long) * (size + 1));
+    VOCAB_MAP v;
+    char path[64];
+    int result = 1, fd;
+    if (words != NULL && counts != NULL) {
+        for (a = 0; a < size; a++) {
+            words[a] = vocab[a].word;
+            counts[a] = vocab[a].count;
+        }
+        if (vocab_map_build(&v, words, counts, size) == 0) {
+            // 标准输出一般是只写打开的，通过/proc重新以只读方式打开同一个文件来计算内容指纹
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(stdout));
+            if ((fd = open(path, O_RDONLY)) < 0) fd = dup(fileno(stdout));
+            if (fd < 0 || vocab_map_stamp(&v, fd) != 0) fprintf(stderr, "Standard output is not a readable regular file; the vocab index needs one.\n");
+            else result = vocab_map_save(&v, index_file);
+            if (fd >= 0) close(fd);
+            vocab_map_free(&v);
         }
     }
-    return;
+    if (result != 0) fprintf(stderr, "Unable to write vocab index %s.\n", index_file);
+    else if (verbose > 1) fprintf(stderr, "Saved vocab index to \"%s\".\n", index_file);
+    free(words);
+    free(counts);
+    return result;
 }
 
 // 统计词频，程序最主要的逻辑
 int get_counts() {
-    // i、j是循环变量，vocab_size
-    long long i = 0, j = 0, vocab_size = 12500;
-    // scanf用的format参数
-    char format[20];
-    // 用来存每次读入的词
-    char str[MAX_STRING_LENGTH + 1];
-    // 创建哈希表
-    HASHREC **vocab_hash = inithashtable();
+    // i、j是循环变量；m是词频不低于min_count的词数，limit是词表大小的上限
+    long long i = 0, j = 0, m = 0, limit, bytes_read = 0, bytes_written = 0;
+    int result;
+    double t;
+    TOKEN_READER reader;
+    // 哈希表，词存放在哈希表的arena里
+    VOCAB_HASH *vocab_hash = NULL;
     // 临时变量，一条哈希表记录的指针
-    HASHREC *htmp;
+    HASH_ENTRY *htmp;
     // 一个词
     VOCAB *vocab;
-    // 输入句柄，直接使用了标准输入
-    FILE *fid = stdin;
     
     fprintf(stderr, "BUILDING VOCABULARY\n");
     if (verbose > 1) fprintf(stderr, "Processed %lld tokens.", i);
-    // 创建format，每次读取限定最长长度不超过MAX_STRING_LENGTH的字符串，默认为1000
-    sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-    // 每次从标准输入中读取一个词，直到文件结束
-    while (fscanf(fid, format, str) != EOF) { // Insert all tokens into hashtable
-        // <unk> 是系统默认项，用户文件中不许出现，直接退出程序
-        if (strcmp(str, "<unk>") == 0) {
-            fprintf(stderr, "\nError, <unk> vector found in corpus.\nPlease remove <unk>s from your corpus (e.g. cat text8 | sed -e 's/<unk>/<raw_unk>/g' > text8.new)");
-            return 1;
+    metrics_phase = metrics_last = metrics_now();
+    if (num_threads > 1) result = get_counts_parallel(&vocab_hash, &i, &bytes_read);
+    else {
+        // 输入直接使用了标准输入
+        if ((vocab_hash = vocab_hash_create(INITIAL_VOCAB_HASH_SIZE)) == NULL || reader_init_file(&reader, stdin, WORD_SEPARATORS, 0) != 0) result = 2;
+        else {
+            result = count_tokens(&reader, vocab_hash, &i, 1);
+            bytes_read = reader.bytes;
+            reader_free(&reader);
         }
-        // 插入哈希表
-        hashinsert(vocab_hash, str);
-        // 统计总token数，重复词重复计入
-        if (((++i)%100000) == 0) if (verbose > 1) fprintf(stderr,"\033[11G%lld tokens.", i);
+    }
+    // <unk> 是系统默认项，用户文件中不许出现，直接退出程序
+    if (result == 1) {
+        fprintf(stderr, "\nError, <unk> vector found in corpus.\nPlease remove <unk>s from your corpus (e.g. cat text8 | sed -e 's/<unk>/<raw_unk>/g' > text8.new)");
+        return 1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "\nCouldn't allocate memory!");
+        return 1;
     }
     // 这个i是整个语料库中的token的总数，同一个词重复出现会重复计算，不是词表中词的数目
     if (verbose > 1) fprintf(stderr, "\033[0GProcessed %lld tokens.\n", i);
-    // 创建词表，vocab_size为默认值，如果超了会realloc，奇怪vocab_size怎么没有设成2的幂次
-    vocab = malloc(sizeof(VOCAB) * vocab_size);
-    // 遍历整个哈希表，TSIZE是哈希表的大小
-    for (i = 0; i < TSIZE; i++) { // Migrate vocab to array
-        htmp = vocab_hash[i];
-        // 将一条哈希表项，以及可能存在的整条链表，都存到词表中
-        while (htmp != NULL) {
-            vocab[j].word = htmp->word;
-            vocab[j].count = htmp->count;
-            j++;
-            // 如果超了词表的大小，realloc一下
-            if (j>=vocab_size) {
-                vocab_size += 2500;
-                vocab = (VOCAB *)realloc(vocab, sizeof(VOCAB) * vocab_size);
-            }
-            htmp = htmp->next;
-        }
+    t = metrics_now() - metrics_phase;
+    metrics_emit("tokenize", t, "\"tokens\":%lld,\"bytes_read\":%lld,\"unique_words\":%lld,\"threads\":%d,\"tokens_per_sec\":%.0f,\"mb_per_sec\":%.1f",
+        i, bytes_read, vocab_hash->size, num_threads, i / (t > 0 ? t : 1e-9), bytes_read / 1048576.0 / (t > 0 ? t : 1e-9));
+    metrics_phase = metrics_now();
+    // 创建词表，大小就是哈希表中的词数
+    vocab = malloc(sizeof(VOCAB) * (vocab_hash->size + 1));
+    if (vocab == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    // 遍历整个哈希表，把词频不低于min_count的表项存到词表中；词频分布是非常长尾的，提前过滤可以省掉大部分排序的工作
+    for (i = 0; i < vocab_hash->capacity; i++) { // Migrate vocab to array, dropping words below min_count
+        htmp = &vocab_hash->slots[i];
+        if (htmp->word == NULL) continue;
+        j++;
+        if (htmp->value < min_count) continue;
+        vocab[m].word = htmp->word;
+        vocab[m].count = htmp->value;
+        m++;
     }
     if (verbose > 1) fprintf(stderr, "Counted %lld unique words.\n", j);
-    // 不太喜欢这种压缩的if for while的结构，用一下大括号会死啊...
-    // 如果用户设定了max_vocab，并且总词数超过了大小max_vocab限制的大小
-    // 那么先不使用平局决胜地排一次序，这样尾部频率相同的词就是乱序的，截尾去掉其中一部分的时候，就近似随机
-    if (max_vocab > 0 && max_vocab < j)
-        // If the vocabulary exceeds limit, first sort full vocab by frequency without alphabetical tie-breaks.
-        // This results in pseudo-random ordering for words with same frequency, so that when truncated, the words span whole alphabet
-        qsort(vocab, j, sizeof(VOCAB), CompareVocab);
-    // 如果max_vocab没有设置（默认为0），或者比总词数j要大，则把max_vocab设成总词数
-    else max_vocab = j;
-    // 排序（或者是重新排序），按词频排序，词频相同时按字典序排序
-    // 实际上如果是重新排序，多写几行代码可以比较遍历整个数组，即从尾部找出所以相同频率的词。不过看起来作者并不在乎。
-    qsort(vocab, max_vocab, sizeof(VOCAB), CompareVocabTie); //After (possibly) truncating, sort (possibly again), breaking ties alphabetically
+    // 如果用户设定了max_vocab，并且总词数超过了大小max_vocab限制的大小，只选出词频最高的max_vocab个词再排序，而不是把全部词排一次序
+    limit = (max_vocab > 0 && max_vocab < j) ? max_vocab : j;
+    // If the vocabulary exceeds limit, select the most frequent words without alphabetical tie-breaks.
+    // Words with the same frequency stay in pseudo-random hash order, so that when truncated, the words span whole alphabet
+    if (limit < m) select_top(vocab, m, limit);
+    else limit = m;
+    // 排序，按词频排序，词频相同时按字典序排序
+    qsort(vocab, limit, sizeof(VOCAB), CompareVocabTie); //After (possibly) truncating, sort, breaking ties alphabetically
+    t = metrics_now();
+    metrics_emit("sort", t - metrics_phase, "\"words\":%lld,\"kept\":%lld", j, limit);
+    metrics_phase = t;
     
-    // 遍历整个词表并输出
-    for (i = 0; i < max_vocab; i++) {
-        // 其实这个完全可以在前面哈希表转词表数组的时候过滤，可以节约很多内存，因为词频分布是非常长尾的
-        if (vocab[i].count < min_count) { // If a minimum frequency cutoff exists, truncate vocabulary
-            if (verbose > 0) fprintf(stderr, "Truncating vocabulary at min count %lld.\n",min_count);
-            break;
-        }
-        // 直接输出结果到标准输出
-        printf("%s %lld\n",vocab[i].word,vocab[i].count);
-    }
+    // 遍历整个词表并输出，直接输出结果到标准输出
+    for (i = 0; i < limit; i++) bytes_written += printf("%s %lld\n",vocab[i].word,vocab[i].count);
+    fflush(stdout);
+    metrics_emit("dump", metrics_now() - metrics_phase, "\"bytes_written\":%lld", bytes_written);
+    // 在vocab.txt写完之后再写索引，索引里记下vocab.txt此时的大小、inode、修改时间和内容指纹，其他工具据此判断索引没有过期
+    if (index_file != NULL && write_index(vocab, limit) != 0) return 1;
     
     // 输出两个信息
-    if (i == max_vocab && max_vocab < j) if (verbose > 0) fprintf(stderr, "Truncating vocabulary at size %lld.\n", max_vocab);
-    fprintf(stderr, "Using vocabulary of size %lld.\n\n", i);
+    if (limit < ((max_vocab > 0 && max_vocab < j) ? max_vocab : j)) {
+        if (verbose > 0) fprintf(stderr, "Truncating vocabulary at min count %lld.\n",min_count);
+    }
+    else if (limit < j) if (verbose > 0) fprintf(stderr, "Truncating vocabulary at size %lld.\n", max_vocab);
+    fprintf(stderr, "Using vocabulary of size %lld.\n\n", limit);
     return 0;
 }
 
@@ -286,6 +361,15 @@ int main(int argc, char **argv) {
         printf("\t\tUpper bound on vocabulary size, i.e. keep the <int> most frequent words. The minimum frequency words are randomly sampled so as to obtain an even distribution over the alphabet.\n");
         printf("\t-min-count <int>\n");
         printf("\t\tLower limit such that words which occur fewer than <int> times are discarded.\n");
+        printf("\t-threads <int>\n");
+        printf("\t\tNumber of threads; default 1. With more than 1 the corpus on stdin must be a regular file; each thread counts one part of it.\n");
+        printf("\t-vocab-index <file>\n");
+        printf("\t\tAlso write a binary index of the vocabulary (words, counts and their hash table) to <file>, which cooccur, glove and\n");
+        printf("\t\tquery map instead of parsing the vocab file when it is named <vocab file>%s, e.g. vocab.txt%s.\n", VOCAB_INDEX_SUFFIX, VOCAB_INDEX_SUFFIX);
+        printf("\t\tStandard output must be a regular file: the index records its size, inode, modification time and a fingerprint of its\n");
+        printf("\t\tcontents, and is ignored once any of them changes (also after copying both files)\n");
+        printf("\t-metrics <file>\n");
+        printf("\t\tAppend one JSON line per phase (tokenize, sort, dump) to <file>, or to stderr for -: time, tokens/sec, bytes read and written, peak RSS. Long phases also report progress every %.0f seconds.\n", METRICS_INTERVAL);
         printf("\nExample usage:\n");
         printf("./vocab_count -verbose 2 -max-vocab 100000 -min-count 10 < corpus.txt > vocab.txt\n");
         return 0;
@@ -297,7 +381,17 @@ int main(int argc, char **argv) {
     if ((i = find_arg((char *)"-max-vocab", argc, argv)) > 0) max_vocab = atoll(argv[i + 1]);
     // 最小词频，低于这个阈值的词会被丢弃
     if ((i = find_arg((char *)"-min-count", argc, argv)) > 0) min_count = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+    if (num_threads < 1) num_threads = 1;
+    if ((i = find_arg((char *)"-vocab-index", argc, argv)) > 0) index_file = argv[i + 1];
+    if ((i = find_arg((char *)"-metrics", argc, argv)) > 0) metrics_path = argv[i + 1];
+    if (metrics_open("vocab_count", metrics_path) != 0) {
+        fprintf(stderr, "Unable to open metrics file %s.\n", metrics_path);
+        return 1;
+    }
     // 统计词频
-    return get_counts();
+    i = get_counts();
+    metrics_close();
+    return i;
 }
 
@@ -0,0 +1,136 @@
+//  Tool to generate a synthetic corpus with Zipf distributed words, for benchmarks
+//
+//  GloVe: Global Vectors for Word Representation
+//  Copyright (c) 2014 The Board of Trustees of
+//  The Leland Stanford Junior University. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//
+//  For more information, bug reports, fixes, contact:
+//    Jeffrey Pennington (jpennin@stanford.edu)
+//    GlobalVectors@googlegroups.com
+//    http://nlp.stanford.edu/projects/glove/
+
+/***
+ *  zipf_corpus.c 生成基准测试用的语料，不需要下载任何数据
+ *   $ build/zipf_corpus -tokens 10000000 -vocab-size 100000 -seed 1 > corpus.txt
+ *
+ *  第i个词的词频排名由counter_zipf(seed, 0, i)决定，排名为r的词出现的次数约与r^-exponent成正比
+ *  排名r对应的词是r的双射26进制写法（a, b, ..., z, aa, ab, ...），所以高频词短，和真实语料差不多
+ *  每line_length个词一行；同样的参数（包括seed）总是生成逐字节相同的文件，不同规模的数据集可以在不同的机器上重新生成
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE 4194304
+
+int verbose = 2; // 0, 1, or 2
+long long num_tokens = 10000000; // words to write
+long long vocab_size = 100000; // distinct words that can be drawn
+long long line_length = 1000; // words per line; cooccur windows do not cross lines
+double exponent = 1.0; // Zipf exponent s: rank r appears about r^-s times as often as rank 1
+unsigned long long seed = 1;
+
+/* Write the word for rank r (r >= 1) to p in bijective base 26 and return its length */
+int rank_word(long long r, char *p) {
+    char tmp[16];
+    int n = 0, i;
+    while (r > 0) {
+        r--;
+        tmp[n++] = 'a' + r % 26;
+        r /= 26;
+    }
+    for (i = 0; i < n; i++) p[i] = tmp[n - 1 - i];
+    return n;
+}
+
+int generate() {
+    long long i;
+    char *buf = malloc(OUTPUT_BUFFER_SIZE), *p;
+    if (buf == NULL) {
+        fprintf(stderr, "Couldn't allocate memory!");
+        return 1;
+    }
+    if (verbose > 0) fprintf(stderr, "GENERATING CORPUS\n%lld tokens, vocab size %lld, exponent %lf, seed %llu\n", num_tokens, vocab_size, exponent, seed);
+    p = buf;
+    for (i = 0; i < num_tokens; i++) {
+        p += rank_word(counter_zipf(seed, 0, i, vocab_size, exponent), p);
+        *p++ = ((i + 1) % line_length == 0 || i == num_tokens - 1) ? '\n' : ' ';
+        if (p - buf > OUTPUT_BUFFER_SIZE - 32) {
+            if (fwrite(buf, 1, p - buf, stdout) != (size_t)(p - buf)) {fprintf(stderr, "Unable to write output.\n"); return 1;}
+            p = buf;
+            if (verbose > 1) fprintf(stderr, "\033[0G%lld tokens.", i + 1);
+        }
+    }
+    if (fwrite(buf, 1, p - buf, stdout) != (size_t)(p - buf) || fflush(stdout) != 0) {fprintf(stderr, "Unable to write output.\n"); return 1;}
+    if (verbose > 1) fprintf(stderr, "\033[0G%lld tokens.\n", num_tokens);
+    free(buf);
+    return 0;
+}
+
+int find_arg(char *str, int argc, char **argv) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(str, argv[i])) {
+            if (i == argc - 1) {
+                printf("No argument given for %s\n", str);
+                exit(1);
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    int i;
+    if (argc == 1) {
+        printf("Tool to generate a synthetic corpus with Zipf distributed words, for benchmarks\n\n");
+        printf("Usage options:\n");
+        printf("\t-verbose <int>\n");
+        printf("\t\tSet verbosity: 0, 1, or 2 (default)\n");
+        printf("\t-tokens <int>\n");
+        printf("\t\tNumber of words to write; default 10000000. Suffixes k, M and G are accepted (e.g. 1G)\n");
+        printf("\t-vocab-size <int>\n");
+        printf("\t\tNumber of distinct words; default 100000\n");
+        printf("\t-exponent <float>\n");
+        printf("\t\tZipf exponent: the word of frequency rank r appears about r^-<float> times as often as the most frequent one; default 1.0\n");
+        printf("\t-line-length <int>\n");
+        printf("\t\tWords per line; default 1000\n");
+        printf("\t-seed <int>\n");
+        printf("\t\tRandom seed; the same options always give the same corpus. Default 1\n");
+        printf("\nExample usage:\n");
+        printf("./zipf_corpus -tokens 10M -vocab-size 100000 -seed 1 > corpus.txt\n");
+        return 0;
+    }
+
+    if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-tokens", argc, argv)) > 0) {
+        char *end;
+        num_tokens = strtoll(argv[i + 1], &end, 10);
+        if (*end == 'k') num_tokens *= 1000;
+        else if (*end == 'M') num_tokens *= 1000000;
+        else if (*end == 'G') num_tokens *= 1000000000;
+    }
+    if ((i = find_arg((char *)"-vocab-size", argc, argv)) > 0) vocab_size = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-exponent", argc, argv)) > 0) exponent = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-line-length", argc, argv)) > 0) line_length = atoll(argv[i + 1]);
+    if ((i = find_arg((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+    if (vocab_size < 1) vocab_size = 1;
+    if (line_length < 1) line_length = 1;
+    return generate();
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+set -e
+
+# Checks that need a training run rather than a microbenchmark. Run with 'make test'.
+# half: with -precision half the squared gradients must grow like the double ones. Each increment is far below the
+# half ulp at 1.0 (about 1e-3), so without stochastic rounding gradsq stays at 1 and AdaGrad degenerates into SGD.
+# threads: vocab_count and cooccur must give the same output with -threads 1 and -threads 4, also on an input shorter
+# than 4 bytes, where some ranges are empty. The cooccurrence sums are added in another order, so values may differ by rounding.
+
+BUILDDIR=${BUILDDIR:-build}
+DATA=$(mktemp -d)
+trap 'rm -rf $DATA' EXIT
+
+$BUILDDIR/zipf_corpus -tokens 1M -vocab-size 10000 -seed 1 -verbose 0 > $DATA/corpus.txt
+$BUILDDIR/vocab_count -min-count 5 -verbose 0 < $DATA/corpus.txt > $DATA/vocab.txt
+$BUILDDIR/cooccur -memory 0.5 -vocab-file $DATA/vocab.txt -window-size 10 -verbose 0 < $DATA/corpus.txt > $DATA/cooccurrence.bin
+$BUILDDIR/shuffle -memory 0.5 -verbose 0 < $DATA/cooccurrence.bin > $DATA/cooccurrence.shuf.bin
+for p in double half; do
+  $BUILDDIR/glove -input-file $DATA/cooccurrence.shuf.bin -vocab-file $DATA/vocab.txt -save-file $DATA/vectors_$p \
+      -gradsq-file $DATA/gradsq_$p -precision $p -vector-size 50 -iter 3 -threads 1 -binary 0 -verbose 0 > /dev/null
+done
+
+# Growth of gradsq above its initial 1, summed over all entries; half must get within 10% of double
+paste -d' ' $DATA/gradsq_double.txt $DATA/gradsq_half.txt | awk '
+  { n = NF / 2; for (i = 2; i <= n; i++) {d += $i - 1; h += $(n + i) - 1} }
+  END {
+    printf "half: gradsq growth %.2f, double %.2f (ratio %.3f)\n", h, d, h / d
+    if (d <= 0 || h / d < 0.9 || h / d > 1.1) {print "FAIL: half gradsq does not track double"; exit 1}
+    print "PASS"
+  }'
+
+# -threads: vocab counts must match exactly, cooccurrence keys exactly and values to 1e-9 relative
+$BUILDDIR/zipf_corpus -tokens 50000 -vocab-size 2000 -seed 2 -verbose 0 > $DATA/small.txt
+printf 'ab\n' > $DATA/tiny.txt
+for c in small tiny; do
+  for n in 1 4; do
+    $BUILDDIR/vocab_count -threads $n -verbose 0 < $DATA/$c.txt > $DATA/${c}_vocab_$n.txt
+    $BUILDDIR/cooccur -threads $n -vocab-file $DATA/${c}_vocab_1.txt -window-size 5 -verbose 0 < $DATA/$c.txt > $DATA/${c}_cooccur_$n.bin
+  done
+  cmp -s $DATA/${c}_vocab_1.txt $DATA/${c}_vocab_4.txt || { echo "FAIL: vocab_count -threads 4 differs on $c input"; exit 1; }
+  [ $(wc -c < $DATA/${c}_cooccur_1.bin) -eq $(wc -c < $DATA/${c}_cooccur_4.bin) ] || { echo "FAIL: cooccur -threads 4 gives a different number of records on $c input"; exit 1; }
+  # od prints each 16-byte record as a line of 4 ints (word1, word2 and the two halves of val) and a line of 2 doubles
+  paste -d' ' <(od -An -v -w16 -t d4 -t f8 $DATA/${c}_cooccur_1.bin) <(od -An -v -w16 -t d4 -t f8 $DATA/${c}_cooccur_4.bin) | awk -v c=$c '
+    NR % 2 == 1 {if ($1 != $5 || $2 != $6) bad++; next}
+    {if ($2 - $4 > 1e-9 * $2 || $4 - $2 > 1e-9 * $2) bad++}
+    END {
+      printf "threads: %s input, %d cooccurrence records\n", c, NR / 2
+      if (bad > 0) {printf "FAIL: cooccur -threads 4 differs in %d records\n", bad; exit 1}
+      print "PASS"
+    }'
+done